@@ -0,0 +1,211 @@
+// bench_contention.c
+// The multithreaded request path against the number of threads: 1, 2,
+// 4 and 8 threads, each with a peer that has every piece, claim blocks
+// the way a worker does (picker_claim_reserved() without the lock,
+// picker_pick_block() under it), record them in the peer's request
+// table, then take them back as delivered and count them in the picker
+// under the lock, as handle_block() does. No sockets: what is measured
+// is the picker and the lock. Prints blocks/s, the share of blocks
+// claimed without the lock, and how long the lock was held and waited
+// for.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "piece_picker.h"
+#include "store_pieces.h"
+#include "request_pipeline.h"
+#include "init_torrent_state.h"
+
+#define BENCH_PIECES 20000
+#define BENCH_BLOCKS 16         // blocks per piece
+#define BENCH_WINDOW 64         // requests in flight per peer
+
+static const int thread_counts[] = { 1, 2, 4, 8 };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static TorrentState ts;
+static int *blocks_got;         // per piece, under the lock
+
+typedef struct {
+    int id;
+    Peer peer;
+    long blocks;
+    long locks;
+    long waits;
+    double held;                // seconds
+    double waited;
+} Worker;
+
+static int setup(void) {
+    int n = BENCH_PIECES;
+
+    memset(&ts, 0, sizeof(ts));
+    ts.total_pieces = n;
+    ts.piece_length = BENCH_BLOCKS * BLOCK_SIZE;
+    ts.pieces_wanted = n;
+    ts.my_bitfield_len = (n + 7) / 8;
+    ts.my_bitfield = calloc(ts.my_bitfield_len, 1);
+
+    // the picker only needs the block counts and request flags
+    ts.pieces = calloc(n, sizeof(PieceBuffer));
+    ts.piece_states = calloc(n, sizeof(PieceState));
+    blocks_got = calloc(n, sizeof(int));
+    bool *requested = calloc((size_t)n * BENCH_BLOCKS, sizeof(bool));
+    unsigned char *state = calloc((size_t)n * BENCH_BLOCKS, 1);
+    if (!ts.my_bitfield || !ts.pieces || !ts.piece_states || !blocks_got ||
+        !requested || !state)
+        return -1;
+
+    for (int i = 0; i < n; i++) {
+        ts.pieces[i].length = ts.piece_length;
+        ts.pieces[i].num_blocks = BENCH_BLOCKS;
+        ts.pieces[i].block_requested = requested + (size_t)i * BENCH_BLOCKS;
+        ts.pieces[i].block_state = state + (size_t)i * BENCH_BLOCKS;
+    }
+    return picker_init(&ts);
+}
+
+static void teardown(void) {
+    picker_free(&ts);
+    free(ts.pieces[0].block_requested);
+    free(ts.pieces[0].block_state);
+    free(ts.pieces);
+    free(ts.piece_states);
+    free(ts.my_bitfield);
+    free(blocks_got);
+}
+
+static void lock_timed(Worker *w) {
+    double t0 = get_time_seconds();
+
+    if (pthread_mutex_trylock(&lock) != 0) {
+        w->waits++;
+        pthread_mutex_lock(&lock);
+        w->waited += get_time_seconds() - t0;
+    }
+    w->locks++;
+}
+
+static void unlock_timed(Worker *w, double since) {
+    w->held += get_time_seconds() - since;
+    pthread_mutex_unlock(&lock);
+}
+
+static void *worker_thread(void *arg) {
+    Worker *w = arg;
+    Peer *p = &w->peer;
+    bool exhausted = false;
+
+    picker_set_thread(w->id);
+
+    while (1) {
+        // fill the window: reserved pieces first, the picker for the rest
+        while (!exhausted && p->outstanding_requests < BENCH_WINDOW) {
+            int piece, block;
+            bool duplicate;
+
+            if (!picker_claim_reserved(&ts, p, &piece, &block)) {
+                lock_timed(w);
+                double t0 = get_time_seconds();
+                bool ok = picker_pick_block(&ts, p, &piece, &block, &duplicate);
+                unlock_timed(w, t0);
+                if (!ok) {
+                    exhausted = true;
+                    break;
+                }
+            }
+            pipeline_on_request(p, piece, block * BLOCK_SIZE, BLOCK_SIZE,
+                                get_time_seconds());
+        }
+
+        if (p->outstanding_requests == 0)
+            break;
+
+        // every request answered
+        while (p->outstanding_requests > 0) {
+            PeerRequest r = p->reqs[0];
+            int block = r.begin / BLOCK_SIZE;
+            pipeline_on_block(p, r.index, r.begin, r.length, get_time_seconds());
+
+            lock_timed(w);
+            double t0 = get_time_seconds();
+            picker_block_received(&ts, r.index, block);
+            if (++blocks_got[r.index] == BENCH_BLOCKS) {
+                picker_piece_done(&ts, r.index);
+                __atomic_fetch_add(&ts.pieces_complete, 1, __ATOMIC_RELEASE);
+            }
+            unlock_timed(w, t0);
+            w->blocks++;
+        }
+    }
+    return NULL;
+}
+
+static void run(int threads) {
+    Worker workers[8];
+    pthread_t tids[8];
+    unsigned char *bits = setup() < 0 ? NULL : malloc(ts.my_bitfield_len);
+
+    if (!bits) {
+        fprintf(stderr, "[BENCH] Out of memory\n");
+        exit(1);
+    }
+    memset(bits, 0xff, ts.my_bitfield_len);
+
+    for (int i = 0; i < threads; i++) {
+        memset(&workers[i], 0, sizeof(Worker));
+        workers[i].id = i;
+        pipeline_init(&workers[i].peer);
+        picker_peer_bitfield(&ts, &workers[i].peer, bits, ts.my_bitfield_len);
+    }
+    free(bits);
+
+    double t0 = get_time_seconds();
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, worker_thread, &workers[started]) != 0)
+            break;
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    double t = get_time_seconds() - t0;
+
+    long blocks = 0, locks = 0, waits = 0;
+    double held = 0, waited = 0;
+    for (int i = 0; i < started; i++) {
+        blocks += workers[i].blocks;
+        locks += workers[i].locks;
+        waits += workers[i].waits;
+        held += workers[i].held;
+        waited += workers[i].waited;
+    }
+
+    PiecePicker *pk = ts.picker;
+    printf("[BENCH] contention %d thread%s  %9.0f blocks/s  %4.1f%% claimed unlocked  "
+           "lock %5.2f/block held %4.0f ns  waited on %5.3f%% of them, %8.0f ns each\n",
+           started, started == 1 ? " " : "s", blocks / t,
+           pk->claims ? 100.0 * pk->claims_unlocked / pk->claims : 0.0,
+           blocks ? (double)locks / blocks : 0.0, locks ? held * 1e9 / locks : 0.0,
+           locks ? 100.0 * waits / locks : 0.0, waits ? waited * 1e9 / waits : 0.0);
+
+    if (blocks != (long)BENCH_PIECES * BENCH_BLOCKS || pk->duplicate_claims != 0) {
+        fprintf(stderr, "[BENCH] %ld of %d blocks, %ld duplicate claims\n",
+                blocks, BENCH_PIECES * BENCH_BLOCKS, pk->duplicate_claims);
+        exit(1);
+    }
+
+    for (int i = 0; i < started; i++) {
+        picker_peer_gone(&ts, &workers[i].peer);
+        free(workers[i].peer.reqs);
+    }
+    teardown();
+}
+
+int main(void) {
+    for (size_t k = 0; k < sizeof(thread_counts) / sizeof(thread_counts[0]); k++)
+        run(thread_counts[k]);
+    return 0;
+}
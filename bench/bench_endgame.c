@@ -0,0 +1,346 @@
+// bench_endgame.c
+// Tail latency with and without endgame. The single-threaded coordinator
+// downloads a torrent over loopback from three seeders in this process,
+// one of which serves each request only BENCH_SLOW_MS after the previous
+// one, like a peer on a slow link. Each download runs in a child process
+// (the coordinator keeps global state) and reports the time the last 1%
+// of pieces took (ts->tail_time) and the whole download, best of
+// BENCH_RUNS, with --no-endgame and with endgame.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "torrent_parser.h"
+#include "init_torrent_state.h"
+#include "download_coordinator.h"
+#include "sendRequest.h"
+#include "sha1.h"
+
+#define BENCH_PIECES 1024
+#define BENCH_PIECE_LEN (16 * 1024)
+#define BENCH_SEEDERS 3           // the last one is slow
+#define BENCH_SLOW_MS 50
+#define BENCH_RUNS 3
+#define BENCH_QUEUE 1024          // requests a seeder holds
+
+typedef struct {
+    int listen_fd;
+    int port;
+    int delay_ms;                 // per request, served one at a time
+    const unsigned char *data;
+} Seeder;
+
+typedef struct {
+    uint32_t index, begin, len;
+} Request;
+
+static double now_ms(void) {
+    return get_time_seconds() * 1000.0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t r = send(fd, p, len, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, uint8_t id, const void *payload, uint32_t len) {
+    unsigned char hdr[5];
+    uint32_t n = htonl(len + 1);
+
+    memcpy(hdr, &n, 4);
+    hdr[4] = id;
+    if (write_full(fd, hdr, 5) < 0)
+        return -1;
+    return len ? write_full(fd, payload, len) : 0;
+}
+
+static int send_block(int fd, const unsigned char *data, const Request *r) {
+    unsigned char hdr[13];
+    uint32_t n = htonl(9 + r->len), index = htonl(r->index), begin = htonl(r->begin);
+
+    memcpy(hdr, &n, 4);
+    hdr[4] = 7;
+    memcpy(hdr + 5, &index, 4);
+    memcpy(hdr + 9, &begin, 4);
+    if (write_full(fd, hdr, 13) < 0)
+        return -1;
+    return write_full(fd, data + (size_t)r->index * BENCH_PIECE_LEN + r->begin, r->len);
+}
+
+// One connection: handshake, everything in the BITFIELD, unchoked, then
+// requests served in order, each delay_ms after the last; a CANCEL drops
+// the request if it is still queued
+static void *seeder_thread(void *arg) {
+    Seeder *s = arg;
+    int fd = accept(s->listen_fd, NULL, NULL);
+    if (fd < 0)
+        return NULL;
+
+    unsigned char hs[68];
+    if (read_full(fd, hs, sizeof(hs)) < 0)
+        goto out;
+    memset(hs + 48, 'S', 20);              // our peer id, their info hash
+    if (write_full(fd, hs, sizeof(hs)) < 0)
+        goto out;
+
+    unsigned char bits[(BENCH_PIECES + 7) / 8];
+    memset(bits, 0xff, sizeof(bits));
+    if (BENCH_PIECES % 8)
+        bits[sizeof(bits) - 1] = (unsigned char)(0xff << (8 - BENCH_PIECES % 8));
+    if (send_frame(fd, 5, bits, sizeof(bits)) < 0 || send_frame(fd, 1, NULL, 0) < 0)
+        goto out;
+
+    Request queue[BENCH_QUEUE];
+    int head = 0, count = 0;
+    double next_send = 0;
+
+    while (1) {
+        int timeout = -1;
+        if (count > 0) {
+            double wait = next_send - now_ms();
+            timeout = wait > 0 ? (int)wait + 1 : 0;
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+            break;
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            uint32_t len;
+            unsigned char msg[32];
+            if (read_full(fd, &len, 4) < 0)
+                break;
+            len = ntohl(len);
+            if (len > sizeof(msg)) {
+                unsigned char skip[256];
+                while (len > 0) {
+                    uint32_t n = len < sizeof(skip) ? len : sizeof(skip);
+                    if (read_full(fd, skip, n) < 0)
+                        goto out;
+                    len -= n;
+                }
+                continue;
+            }
+            if (len == 0 || read_full(fd, msg, len) < 0)
+                continue;
+
+            Request r;
+            if ((msg[0] == 6 || msg[0] == 8) && len == 13) {
+                memcpy(&r.index, msg + 1, 4);
+                memcpy(&r.begin, msg + 5, 4);
+                memcpy(&r.len, msg + 9, 4);
+                r.index = ntohl(r.index);
+                r.begin = ntohl(r.begin);
+                r.len = ntohl(r.len);
+            }
+
+            if (msg[0] == 6 && len == 13 && count < BENCH_QUEUE) {
+                if (count == 0 && next_send < now_ms())
+                    next_send = now_ms() + s->delay_ms;
+                queue[(head + count++) % BENCH_QUEUE] = r;
+            } else if (msg[0] == 8 && len == 13) {
+                for (int k = 0; k < count; k++) {
+                    Request *q = &queue[(head + k) % BENCH_QUEUE];
+                    if (q->index == r.index && q->begin == r.begin)
+                        q->len = 0;    // served as nothing
+                }
+            }
+            continue;
+        }
+
+        // the request at the head is due
+        if (count > 0 && now_ms() >= next_send) {
+            Request *r = &queue[head];
+            head = (head + 1) % BENCH_QUEUE;
+            count--;
+            if (r->len > 0) {
+                if (send_block(fd, s->data, r) < 0)
+                    break;
+                next_send = now_ms() + s->delay_ms;
+            }
+        }
+    }
+
+out:
+    close(fd);
+    return NULL;
+}
+
+static int start_seeder(Seeder *s) {
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    s->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (s->listen_fd < 0 ||
+        bind(s->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(s->listen_fd, 1) < 0 ||
+        getsockname(s->listen_fd, (struct sockaddr *)&addr, &alen) < 0)
+        return -1;
+    s->port = ntohs(addr.sin_port);
+
+    pthread_t t;
+    if (pthread_create(&t, NULL, seeder_thread, s) != 0)
+        return -1;
+    pthread_detach(t);
+    return 0;
+}
+
+// A single-file torrent of the data, its piece hashes included
+static int write_torrent(const char *path, const unsigned char *data) {
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+
+    fprintf(f, "d8:announce22:http://127.0.0.1:1/ann4:infod6:lengthi%de"
+               "4:name9:bench.bin12:piece lengthi%de6:pieces%d:",
+            BENCH_PIECES * BENCH_PIECE_LEN, BENCH_PIECE_LEN, BENCH_PIECES * 20);
+    for (int i = 0; i < BENCH_PIECES; i++) {
+        uint8_t digest[SHA1_DIGEST_LEN];
+        sha1(data + (size_t)i * BENCH_PIECE_LEN, BENCH_PIECE_LEN, digest);
+        fwrite(digest, 1, sizeof(digest), f);
+    }
+    fputs("ee", f);
+    return fclose(f);
+}
+
+// The download, in the child: tail and total seconds go to out_fd
+static int download(int endgame, int out_fd) {
+    unsigned char *data = malloc((size_t)BENCH_PIECES * BENCH_PIECE_LEN);
+    unsigned int seed = 1;
+    Seeder seeders[BENCH_SEEDERS];
+
+    if (!data)
+        return 1;
+    for (size_t k = 0; k < (size_t)BENCH_PIECES * BENCH_PIECE_LEN; k++)
+        data[k] = rand_r(&seed);
+    if (write_torrent("bench.torrent", data) < 0)
+        return 1;
+
+    for (int i = 0; i < BENCH_SEEDERS; i++) {
+        seeders[i].delay_ms = i == BENCH_SEEDERS - 1 ? BENCH_SLOW_MS : 0;
+        seeders[i].data = data;
+        if (start_seeder(&seeders[i]) < 0)
+            return 1;
+    }
+
+    // the coordinator's report is not what we are after
+    if (!freopen("/dev/null", "w", stdout))
+        return 1;
+
+    TorrentInfo ti;
+    TorrentState ts;
+    if (torrentparser("bench.torrent", &ti) != 0 || init_torrent_state(&ts, &ti, 0) != 0)
+        return 1;
+
+    set_endgame(endgame);
+    ts.skip_tracker = true;
+    ts.download_start_time = get_time_seconds();
+    for (int i = 0; i < BENCH_SEEDERS; i++) {
+        if (try_connect_peer(&ts, "127.0.0.1", seeders[i].port) != 0)
+            return 1;
+    }
+
+    alarm(60);
+    if (download_torrent(&ts) != 0)
+        return 1;
+
+    double result[2] = { ts.tail_time, get_time_seconds() - ts.download_start_time };
+    if (write(out_fd, result, sizeof(result)) != sizeof(result))
+        return 1;
+    return 0;
+}
+
+// One run in a child process in a scratch directory
+static int run(int endgame, double *tail, double *total) {
+    char dir[] = "/tmp/bench_endgame.XXXXXX";
+    int fds[2];
+
+    if (!mkdtemp(dir) || pipe(fds) < 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (chdir(dir) < 0)
+            _exit(1);
+        _exit(download(endgame, fds[1]));
+    }
+    close(fds[1]);
+
+    double result[2];
+    ssize_t n = read(fds[0], result, sizeof(result));
+    int status = 0;
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    char rm[64];
+    snprintf(rm, sizeof(rm), "rm -rf %s", dir);
+    if (system(rm) != 0)
+        fprintf(stderr, "[BENCH] Could not remove %s\n", dir);
+
+    if (n != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    *tail = result[0];
+    *total = result[1];
+    return 0;
+}
+
+int main(void) {
+    printf("[BENCH] endgame: %d x %d KiB pieces, %d seeders, the last %d ms per block\n",
+           BENCH_PIECES, BENCH_PIECE_LEN / 1024, BENCH_SEEDERS, BENCH_SLOW_MS);
+    fflush(stdout);
+
+    for (int endgame = 0; endgame <= 1; endgame++) {
+        double best_tail = 0, best_total = 0;
+
+        for (int k = 0; k < BENCH_RUNS; k++) {
+            double tail, total;
+            if (run(endgame, &tail, &total) < 0) {
+                fprintf(stderr, "[BENCH] Download failed\n");
+                return 1;
+            }
+            if (k == 0 || tail < best_tail)
+                best_tail = tail;
+            if (k == 0 || total < best_total)
+                best_total = total;
+        }
+
+        printf("[BENCH] endgame %-3s  last 1%% of pieces %8.2f ms  download %8.1f ms\n",
+               endgame ? "on" : "off", best_tail * 1000, best_total * 1000);
+        fflush(stdout);        // before the next fork copies the buffer
+    }
+    return 0;
+}
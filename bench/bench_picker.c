@@ -0,0 +1,154 @@
+// bench_picker.c
+// Cost of a pick as the torrent grows: the same three peers against
+// torrents of 1k, 100k and 1M pieces.
+//   seeder - the peer has every piece
+//   few    - the peer has 16 pieces
+//   tail   - the rarest 95% of the pieces are fully requested
+// Background peers that each have half the pieces spread the pieces over
+// the availability buckets. Prints ns and candidates examined per pick.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "piece_picker.h"
+#include "store_pieces.h"
+#include "init_torrent_state.h"
+
+#define BENCH_BLOCKS 4          // blocks per piece
+#define BENCH_BACKGROUND 8      // peers with half the pieces
+#define BENCH_PICKS 1000
+#define BENCH_FEW 16            // pieces of the "few" peer
+
+static const int sizes[] = { 1000, 100000, 1000000 };
+
+static unsigned int seed = 12345;
+
+static int setup(TorrentState *ts, int n) {
+    memset(ts, 0, sizeof(*ts));
+    ts->total_pieces = n;
+    ts->piece_length = BENCH_BLOCKS * BLOCK_SIZE;
+    ts->pieces_wanted = n;
+    ts->pieces_complete = PICKER_RANDOM_FIRST;    // past the random warmup
+    ts->my_bitfield_len = (n + 7) / 8;
+
+    // the picker only needs the block counts and request flags
+    ts->pieces = calloc(n, sizeof(PieceBuffer));
+    ts->piece_states = calloc(n, sizeof(PieceState));
+    bool *requested = calloc((size_t)n * BENCH_BLOCKS, sizeof(bool));
+    unsigned char *state = calloc((size_t)n * BENCH_BLOCKS, 1);
+    if (!ts->pieces || !ts->piece_states || !requested || !state)
+        return -1;
+
+    for (int i = 0; i < n; i++) {
+        ts->pieces[i].length = ts->piece_length;
+        ts->pieces[i].num_blocks = BENCH_BLOCKS;
+        ts->pieces[i].block_requested = requested + (size_t)i * BENCH_BLOCKS;
+        ts->pieces[i].block_state = state + (size_t)i * BENCH_BLOCKS;
+    }
+    return picker_init(ts);
+}
+
+static void teardown(TorrentState *ts) {
+    picker_free(ts);
+    free(ts->pieces[0].block_requested);
+    free(ts->pieces[0].block_state);
+    free(ts->pieces);
+    free(ts->piece_states);
+}
+
+// A peer with each piece with probability 1/every, or the given count
+static Peer *make_peer(TorrentState *ts, int every, int count) {
+    Peer *p = calloc(1, sizeof(Peer));
+    unsigned char *bits = calloc(ts->my_bitfield_len, 1);
+    int n = ts->total_pieces;
+
+    for (int i = 0; i < n && every; i++) {
+        if (rand_r(&seed) % every == 0)
+            bits[i / 8] |= 0x80 >> (i % 8);
+    }
+    for (int k = 0; k < count; k++) {
+        int i = rand_r(&seed) % n;
+        bits[i / 8] |= 0x80 >> (i % 8);
+    }
+
+    picker_peer_bitfield(ts, p, bits, ts->my_bitfield_len);
+    free(bits);
+    return p;
+}
+
+static void free_peer(TorrentState *ts, Peer *p) {
+    picker_peer_gone(ts, p);
+    free(p);
+}
+
+// The rarest share of the pieces has every block taken
+static void take_rarest(TorrentState *ts, double share) {
+    const int *wanted;
+    int count = picker_wanted_pieces(ts, &wanted);
+    int take = (int)(count * share);
+    int *pieces = malloc(take * sizeof(int));
+
+    memcpy(pieces, wanted, take * sizeof(int));
+    for (int k = 0; k < take; k++) {
+        for (int b = 0; b < BENCH_BLOCKS; b++)
+            picker_block_received(ts, pieces[k], b);
+    }
+    free(pieces);
+}
+
+static void run(int n, const char *name) {
+    TorrentState ts;
+    Peer *background[BENCH_BACKGROUND];
+
+    if (setup(&ts, n) < 0) {
+        fprintf(stderr, "[BENCH] Out of memory for %d pieces\n", n);
+        exit(1);
+    }
+    for (int k = 0; k < BENCH_BACKGROUND; k++)
+        background[k] = make_peer(&ts, 2, 0);
+
+    Peer *p;
+    if (strcmp(name, "seeder") == 0) {
+        p = make_peer(&ts, 1, 0);
+    } else if (strcmp(name, "few") == 0) {
+        p = make_peer(&ts, 0, BENCH_FEW);
+    } else {
+        p = make_peer(&ts, 1, 0);
+        take_rarest(&ts, 0.95);
+    }
+
+    PiecePicker *pk = ts.picker;
+    long examined = pk->examined;
+    int picks = 0;
+    double t0 = get_time_seconds();
+
+    for (int k = 0; k < BENCH_PICKS; k++) {
+        int piece, block;
+        bool duplicate;
+
+        if (!picker_pick_block(&ts, p, &piece, &block, &duplicate))
+            break;
+        picks++;
+    }
+
+    double t = get_time_seconds() - t0;
+    printf("[BENCH] picker %8d pieces  %-6s  %5d picks  %10.0f ns/pick  %9.1f examined/pick\n",
+           n, name, picks, picks ? t * 1e9 / picks : 0.0,
+           picks ? (double)(pk->examined - examined) / picks : 0.0);
+
+    free_peer(&ts, p);
+    for (int k = 0; k < BENCH_BACKGROUND; k++)
+        free_peer(&ts, background[k]);
+    teardown(&ts);
+}
+
+int main(void) {
+    static const char *peers[] = { "seeder", "few", "tail" };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t k = 0; k < sizeof(peers) / sizeof(peers[0]); k++)
+            run(sizes[s], peers[k]);
+    }
+    return 0;
+}
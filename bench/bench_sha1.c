@@ -0,0 +1,98 @@
+// bench_sha1.c
+// SHA1 throughput on one core for each backend the CPU supports, hashing
+// the same pieces one at a time with sha1() and in batches of
+// sha1_lanes() with sha1_many(), as the hash pool does. Every digest is
+// checked against the openssl backend.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sha1.h"
+#include "init_torrent_state.h"
+
+#define BENCH_PIECES 64
+#define BENCH_PIECE_LEN (256 * 1024)
+#define BENCH_ROUNDS 4
+
+static const char *backends[] = { "openssl", "sha-ni", "sse2", "avx2" };
+
+static uint8_t expected[BENCH_PIECES][SHA1_DIGEST_LEN];
+static uint8_t digests[BENCH_PIECES][SHA1_DIGEST_LEN];
+
+// GB/s of hashing all the pieces BENCH_ROUNDS times, batch at a time
+static double rate(const uint8_t *const *data, const size_t *len, int batch) {
+    double t0 = get_time_seconds();
+
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int i = 0; i < BENCH_PIECES; i += batch) {
+            int n = BENCH_PIECES - i < batch ? BENCH_PIECES - i : batch;
+            if (batch == 1)
+                sha1(data[i], len[i], digests[i]);
+            else
+                sha1_many(data + i, len + i, n, digests + i);
+        }
+    }
+
+    double t = get_time_seconds() - t0;
+    return (double)BENCH_PIECES * BENCH_PIECE_LEN * BENCH_ROUNDS / t / 1e9;
+}
+
+static int check(const char *name, const char *how) {
+    if (memcmp(digests, expected, sizeof(expected)) == 0)
+        return 0;
+    fprintf(stderr, "[BENCH] sha1 %s %s: wrong digest\n", name, how);
+    return -1;
+}
+
+int main(void) {
+    const uint8_t *data[BENCH_PIECES];
+    size_t len[BENCH_PIECES];
+    unsigned int seed = 1;
+
+    for (int i = 0; i < BENCH_PIECES; i++) {
+        uint8_t *p = malloc(BENCH_PIECE_LEN);
+        if (!p) {
+            fprintf(stderr, "[BENCH] Out of memory\n");
+            return 1;
+        }
+        for (int k = 0; k < BENCH_PIECE_LEN; k++)
+            p[k] = rand_r(&seed);
+        data[i] = p;
+        len[i] = BENCH_PIECE_LEN;
+    }
+
+    if (sha1_set_backend("openssl") < 0)
+        return 1;
+    for (int i = 0; i < BENCH_PIECES; i++)
+        sha1(data[i], len[i], expected[i]);
+
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        const char *name = backends[b];
+        if (sha1_set_backend(name) < 0) {
+            printf("[BENCH] sha1 %-8s not supported\n", name);
+            continue;
+        }
+
+        // warm the caches and the clock
+        rate(data, len, 1);
+
+        memset(digests, 0, sizeof(digests));
+        double single = rate(data, len, 1);
+        if (check(name, "single") < 0)
+            return 1;
+
+        memset(digests, 0, sizeof(digests));
+        int lanes = sha1_lanes();
+        double batched = rate(data, len, lanes);
+        if (check(name, "batched") < 0)
+            return 1;
+
+        printf("[BENCH] sha1 %-8s  single %5.2f GB/s  batches of %d %5.2f GB/s\n",
+               name, single, lanes, batched);
+    }
+
+    for (int i = 0; i < BENCH_PIECES; i++)
+        free((void *)data[i]);
+    return 0;
+}
@@ -0,0 +1,267 @@
+// bench_upload.c
+// Seeding throughput of the three upload paths: the same verified
+// pieces served over a loopback TCP connection with send_piece(), the
+// payload copied into the output queue, sent with sendfile() from the
+// file, or sent with MSG_ZEROCOPY from the piece buffer. A thread on
+// the other end reads and discards. Each path runs in a child process
+// (the upload mode and the piece buffers are global state) and reports
+// GB/s and the sending thread's CPU time per GB. On loopback the kernel
+// copies MSG_ZEROCOPY sends anyway; the copied count shows it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "torrent_parser.h"
+#include "init_torrent_state.h"
+#include "store_pieces.h"
+#include "outgoingMessages.h"
+#include "peer_output.h"
+#include "sha1.h"
+
+#define BENCH_PIECES 256
+#define BENCH_PIECE_LEN (256 * 1024)
+#define BENCH_BLOCK 16384
+#define BENCH_ROUNDS 4             // times every block is sent
+
+static const struct {
+    const char *name;
+    UploadMode mode;
+} paths[] = {
+    { "copy", UPLOAD_COPY },
+    { "sendfile", UPLOAD_SENDFILE },
+    { "zerocopy", UPLOAD_ZEROCOPY },
+};
+
+typedef struct {
+    double seconds;
+    double cpu;                    // sending thread
+    long copied, sendfile, zerocopy, zerocopy_copied;
+} Result;
+
+typedef struct {
+    int fd;
+    long expected;
+} Reader;
+
+static double thread_cpu_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void *reader_thread(void *arg) {
+    Reader *r = arg;
+    static unsigned char buf[1 << 18];
+    long got = 0;
+
+    while (got < r->expected) {
+        ssize_t n = read(r->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += n;
+    }
+    r->expected = got;
+    return NULL;
+}
+
+// A single-file torrent of the data, its piece hashes included
+static int write_torrent(const char *path, const unsigned char *data) {
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return -1;
+
+    fprintf(f, "d8:announce22:http://127.0.0.1:1/ann4:infod6:lengthi%de"
+               "4:name9:bench.bin12:piece lengthi%de6:pieces%d:",
+            BENCH_PIECES * BENCH_PIECE_LEN, BENCH_PIECE_LEN, BENCH_PIECES * 20);
+    for (int i = 0; i < BENCH_PIECES; i++) {
+        uint8_t digest[SHA1_DIGEST_LEN];
+        sha1(data + (size_t)i * BENCH_PIECE_LEN, BENCH_PIECE_LEN, digest);
+        fwrite(digest, 1, sizeof(digest), f);
+    }
+    fputs("ee", f);
+    return fclose(f);
+}
+
+// Both ends of a loopback connection; the sending end non-blocking, as
+// the coordinators keep their sockets
+static int connect_pair(int *tx, int *rx) {
+    struct sockaddr_in addr;
+    socklen_t alen = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 ||
+        bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1) < 0 ||
+        getsockname(lfd, (struct sockaddr *)&addr, &alen) < 0)
+        return -1;
+
+    *tx = socket(AF_INET, SOCK_STREAM, 0);
+    if (*tx < 0 || connect(*tx, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        return -1;
+    *rx = accept(lfd, NULL, NULL);
+    close(lfd);
+    if (*rx < 0)
+        return -1;
+
+    return fcntl(*tx, F_SETFL, fcntl(*tx, F_GETFL) | O_NONBLOCK);
+}
+
+// Queue a block, first waiting for the socket while the queue is full
+static int serve_block(Peer *p, TorrentState *ts, int index, int begin) {
+    while (p->tx_queued + 13 + BENCH_BLOCK > PEER_TX_MAX_QUEUED) {
+        struct pollfd pfd = { .fd = p->socket_fd, .events = POLLOUT };
+        if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+            return -1;
+        if (peer_flush(p) < 0)
+            return -1;
+    }
+    return send_piece(p, ts, index, begin, BENCH_BLOCK);
+}
+
+// The seeding, in the child: the Result goes to out_fd
+static int seed(UploadMode mode, int out_fd) {
+    unsigned char *data = malloc((size_t)BENCH_PIECES * BENCH_PIECE_LEN);
+    unsigned int seed = 1;
+
+    if (!data)
+        return 1;
+    for (size_t k = 0; k < (size_t)BENCH_PIECES * BENCH_PIECE_LEN; k++)
+        data[k] = rand_r(&seed);
+    if (write_torrent("bench.torrent", data) < 0)
+        return 1;
+
+    // storage setup and piece writes report on stdout
+    if (!freopen("/dev/null", "w", stdout))
+        return 1;
+
+    set_upload_mode(mode);
+
+    TorrentInfo ti;
+    TorrentState ts;
+    if (torrentparser("bench.torrent", &ti) != 0 || init_torrent_state(&ts, &ti, 0) != 0)
+        return 1;
+
+    // every piece verified and on disk, as after a download
+    for (int i = 0; i < BENCH_PIECES; i++) {
+        PieceBuffer *pb = &ts.pieces[i];
+        memcpy(pb->data, data + (size_t)i * BENCH_PIECE_LEN, BENCH_PIECE_LEN);
+        pb->verified = true;
+        write_verified_piece(&ts, i);
+        mark_piece_complete(&ts, i);
+    }
+    free(data);
+
+    Peer peer;
+    int rx;
+    memset(&peer, 0, sizeof(peer));
+    strcpy(peer.ip, "127.0.0.1");
+    if (connect_pair(&peer.socket_fd, &rx) < 0)
+        return 1;
+
+    Reader reader = { rx, (long)BENCH_ROUNDS * BENCH_PIECES * BENCH_PIECE_LEN / BENCH_BLOCK *
+                          (13 + BENCH_BLOCK) };
+    long expected = reader.expected;
+    pthread_t t;
+    if (pthread_create(&t, NULL, reader_thread, &reader) != 0)
+        return 1;
+
+    double t0 = get_time_seconds(), c0 = thread_cpu_seconds();
+
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int i = 0; i < BENCH_PIECES; i++) {
+            for (int b = 0; b < BENCH_PIECE_LEN; b += BENCH_BLOCK) {
+                if (serve_block(&peer, &ts, i, b) < 0)
+                    return 1;
+            }
+        }
+    }
+    while (peer.tx_queued > 0) {
+        struct pollfd pfd = { .fd = peer.socket_fd, .events = POLLOUT };
+        if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+            return 1;
+        if (peer_flush(&peer) < 0)
+            return 1;
+    }
+
+    double cpu = thread_cpu_seconds() - c0;
+    pthread_join(t, NULL);
+    if (reader.expected != expected)
+        return 1;
+
+    Result res = { get_time_seconds() - t0, cpu, 0, 0, 0, 0 };
+    peer_output_copy_stats(&res.copied, &res.sendfile, &res.zerocopy, &res.zerocopy_copied);
+    if (write(out_fd, &res, sizeof(res)) != sizeof(res))
+        return 1;
+    return 0;
+}
+
+// One path in a child process in a scratch directory
+static int run(UploadMode mode, Result *res) {
+    char dir[] = "/tmp/bench_upload.XXXXXX";
+    int fds[2];
+
+    if (!mkdtemp(dir) || pipe(fds) < 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (chdir(dir) < 0)
+            _exit(1);
+        _exit(seed(mode, fds[1]));
+    }
+    close(fds[1]);
+
+    ssize_t n = read(fds[0], res, sizeof(*res));
+    int status = 0;
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+
+    char rm[64];
+    snprintf(rm, sizeof(rm), "rm -rf %s", dir);
+    if (system(rm) != 0)
+        fprintf(stderr, "[BENCH] Could not remove %s\n", dir);
+
+    if (n != sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return 0;
+}
+
+int main(void) {
+    double gb = (double)BENCH_ROUNDS * BENCH_PIECES * BENCH_PIECE_LEN / 1e9;
+
+    printf("[BENCH] upload: %d MiB served %d times in %d KiB blocks over loopback\n",
+           BENCH_PIECES * (BENCH_PIECE_LEN / 1024) / 1024, BENCH_ROUNDS, BENCH_BLOCK / 1024);
+    fflush(stdout);
+
+    for (size_t k = 0; k < sizeof(paths) / sizeof(paths[0]); k++) {
+        Result res;
+        if (run(paths[k].mode, &res) < 0) {
+            fprintf(stderr, "[BENCH] Upload with %s failed\n", paths[k].name);
+            return 1;
+        }
+
+        printf("[BENCH] upload %-8s  %5.2f GB/s  sender CPU %6.1f ms/GB  "
+               "(MiB copied %ld, sendfile %ld, zerocopy %ld; zerocopy sends copied %ld)\n",
+               paths[k].name, gb / res.seconds, res.cpu * 1000 / gb,
+               res.copied >> 20, res.sendfile >> 20, res.zerocopy >> 20,
+               res.zerocopy_copied);
+        fflush(stdout);            // before the next fork copies the buffer
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef BITFIELD_H
+#define BITFIELD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Kernels over packed bitfields (the wire layout: piece 0 in the top bit
+// of byte 0). The widest implementation the CPU supports is chosen on
+// first use: AVX2, SSE2, or plain 64-bit words elsewhere.
+//
+
+/**
+ * @return bits set in a[0 .. len-1]
+ */
+size_t bitfield_count(const uint8_t *a, size_t len);
+
+/**
+ * @return bits set in a and clear in b (popcount of a AND NOT b)
+ */
+size_t bitfield_andnot_count(const uint8_t *a, const uint8_t *b, size_t len);
+
+/**
+ * @return name of the implementation in use ("avx2", "sse2", "scalar")
+ */
+const char *bitfield_kernel_name(void);
+
+#endif
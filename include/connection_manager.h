@@ -0,0 +1,125 @@
+#ifndef CONNECTION_MANAGER_H
+#define CONNECTION_MANAGER_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "contact_tracker.h"
+
+#define CONN_HALF_OPEN_DEFAULT 16     // parallel TCP connects in flight
+#define CONN_CONNECT_TIMEOUT 5.0      // seconds for the TCP connect
+#define CONN_HANDSHAKE_TIMEOUT 10.0   // seconds from connect to handshake
+#define CONN_MAX_CANDIDATES 1000      // addresses remembered per torrent
+#define CONN_MAX_FAILURES 3           // failed attempts before giving up
+#define CONN_RETRY_BACKOFF 30.0       // seconds, times the failure count
+
+// Connection phase of a Peer (p->conn_phase)
+#define CONN_PHASE_NONE       0       // no deadline (active, or not dialled)
+#define CONN_PHASE_CONNECTING 1       // TCP connect in flight (half-open)
+#define CONN_PHASE_HANDSHAKE  2       // waiting for the peer's handshake
+
+//
+// Connection establishment. Tracker peers go into a candidate pool and are
+// dialled in parallel, at most half_open_limit TCP connects at a time. A
+// connect or handshake that misses its deadline is dropped by the peer's
+// conn_timer (armed by peer_watch()), and every failure frees its slot
+// for the next candidate. Failed addresses are retried with a growing
+// backoff and dropped after CONN_MAX_FAILURES attempts.
+//
+// The pool is shared: the thread that owns a peer reports its progress
+// (connected, handshake done, closed) while the coordinator dials.
+//
+typedef enum {
+    CAND_IDLE = 0,              // can be dialled once retry_at passes
+    CAND_DIALING,               // connect or handshake in progress
+    CAND_CONNECTED,             // handshake done, peer is live
+    CAND_DEAD                   // failed too often
+} CandState;
+
+typedef struct {
+    char ip[16];
+    int port;
+    CandState state;
+    int failures;
+    double retry_at;
+} ConnCandidate;
+
+typedef struct ConnManager {
+    pthread_mutex_t lock;
+
+    ConnCandidate *cands;
+    int cand_count;
+    int cand_capacity;
+    int next_cand;              // round-robin scan position
+
+    int half_open;              // dialled peers still in TCP connect
+    int handshaking;            // connected, handshake not done yet
+    int notify_fd;              // eventfd, signalled when a slot frees up
+
+    double start_time;
+
+    // Statistics
+    long attempts;
+    long connects;
+    long handshakes;
+    long connect_failures;
+    long connect_timeouts;
+    long handshake_failures;
+    long handshake_timeouts;
+    double connect_latency_sum;
+    double connect_latency_max;
+    double handshake_latency_sum;
+    long first_block_usec;      // since start_time, 0 = none yet
+} ConnManager;
+
+/**
+ * Set the half-open limit used by managers created afterwards.
+ */
+void set_half_open_limit(int limit);
+int get_half_open_limit(void);
+
+int conn_manager_init(ConnManager *cm);
+void conn_manager_destroy(ConnManager *cm);
+
+/**
+ * Add an address to the pool (duplicates are ignored).
+ * @return 1 if added, 0 if already known or the pool is full
+ */
+int conn_manager_add_candidate(ConnManager *cm, const char *ip, int port);
+
+/**
+ * Start connects until the half-open limit is reached, open_peers plus
+ * the new dials reach max_peers, or no candidate is due. New peers are
+ * stored in out (up to max_out) for the caller to attach to a loop.
+ * @return number of peers dialled
+ */
+int conn_manager_fill(ConnManager *cm, int open_peers, int max_peers,
+                      Peer **out, int max_out);
+
+/**
+ * Start a non-blocking connect outside the pool (e.g. --peer). The peer
+ * still gets connect and handshake deadlines.
+ */
+Peer *peer_dial(const char *ip, int port);
+
+/**
+ * Expect the peer's handshake by the handshake deadline (inbound peers).
+ */
+void peer_expect_handshake(Peer *p);
+
+/**
+ * Progress reports from the thread that owns the peer.
+ * conn_manager_release() may be called for any peer, more than once;
+ * it counts a failure if the peer never finished its handshake.
+ */
+void conn_manager_connected(ConnManager *cm, Peer *p);
+void conn_manager_handshake_done(ConnManager *cm, Peer *p);
+void conn_manager_release(ConnManager *cm, Peer *p);
+
+/**
+ * Record the arrival of the first block (time to first byte).
+ */
+void conn_manager_first_block(ConnManager *cm);
+
+void conn_manager_print_stats(ConnManager *cm);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include "event_loop.h"
 
 typedef enum {
     PEER_DISCONNECTED = 0,      // Peer not connected
@@ -14,6 +15,8 @@ typedef enum {
     PEER_ESTABLISHED
 } PeerState;
 
+struct OutChunk;
+
 // Peer entry
 typedef struct Peer {
     char ip[16];          
@@ -30,6 +33,7 @@ typedef struct Peer {
     bool am_interested;   // we are interested in peer
     bool is_choked;       // peer is choking us
     bool is_interested;   // peer is interested in us
+    int wanted_pieces;    // pieces it has that we still want (interest.c)
 
     // Download state
     int current_piece;     // -1 = none selected
@@ -37,8 +41,71 @@ typedef struct Peer {
 
     // Peer ID from handshake
     unsigned char peer_id[20];
-    int outstanding_requests;
-    int max_pipeline;
+    int outstanding_requests;  // entries in reqs
+    int max_pipeline;          // request window, see request_pipeline.h
+
+    // Requests in flight and the window estimator
+    struct PeerRequest *reqs;  // unordered table
+    bool snubbed;              // nothing delivered for a while
+    double snubbed_at;
+    double last_delivery;      // time of the last block (or first request)
+    double srtt;               // smoothed block round trip, seconds
+    double min_rtt;
+    double dlv_rate;           // block bytes/sec delivered
+    long dlv_bytes;
+    long dlv_mark;             // dlv_bytes at the last rate sample
+    double dlv_mark_time;
+
+    // Incremental receive state (partial handshake / frame)
+    unsigned char hs_buf[68];
+    int hs_got;
+    unsigned char *rx_buf;     // receive buffer, frames are decoded in place
+    uint32_t rx_start;         // first undecoded byte
+    uint32_t rx_end;           // end of received data
+    bool rx_in_blocks;         // last frame was a block received in place
+    unsigned char *rx_msg;     // frame too big for rx_buf: prefix + id + payload
+    unsigned char *rx_done;    // big frame handed out last time, freed on next read
+    uint32_t rx_len;           // bytes after the length prefix
+    uint32_t rx_got;
+
+    // PIECE payload received straight into the piece buffer
+    unsigned char *rx_dst;     // block destination while receiving
+    unsigned char *rx_claim;   // BlockState held LANDING for that block
+    uint32_t rx_block_index;   // last block delivered with WIRE_BLOCK
+    uint32_t rx_block_begin;
+    uint32_t rx_block_len;
+    unsigned char *rx_block;
+
+    // Connection setup (see connection_manager.h)
+    int conn_cand;             // candidate pool index, -1 = not from the pool
+    int conn_phase;            // CONN_PHASE_*
+    double conn_start;         // when the current phase began
+    double conn_deadline;
+
+    // Event loop registration (NULL loop = not registered)
+    EventLoop *loop;
+    EventHandler ev;
+
+    // Timers on that loop, armed by peer_watch()
+    Timer keepalive_timer;
+    Timer idle_timer;
+    Timer conn_timer;          // connect / handshake deadline
+    long idle_mark;            // bytes_received at the last idle check
+
+    // Traffic counters, updated by whichever thread owns the peer
+    long bytes_received;       // wire bytes of complete frames
+    long msgs_received;
+    long rate_mark;            // bytes_received at last rate sample
+    double rate_mark_time;
+    double download_rate;      // bytes/sec, smoothed
+
+    // Outbound queue (see peer_output.h)
+    struct OutChunk *tx_head;
+    struct OutChunk *tx_tail;
+    size_t tx_queued;          // bytes not yet written
+    int tx_cork;               // >0: queue only, flush on uncork
+    int tx_zc_state;           // 0 = untried, 1 = SO_ZEROCOPY on, -1 = unsupported
+    long tx_zc_inflight;       // MSG_ZEROCOPY sends not yet acknowledged
 } Peer;
 
 
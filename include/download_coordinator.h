@@ -13,4 +13,12 @@
  */
 int download_torrent(TorrentState *ts);
 
+/**
+ * Start a non-blocking connect to a peer and add it to the peer list.
+ * The connection completes inside the download loop.
+ *
+ * @return 0 if the connect was started, -1 on error
+ */
+int try_connect_peer(TorrentState *ts, const char *ip, int port);
+
 #endif // DOWNLOAD_COORDINATOR_H
\ No newline at end of file
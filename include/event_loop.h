@@ -0,0 +1,88 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include "timer_wheel.h"
+
+#define EVENT_LOOP_MAX_EVENTS 256
+
+struct EventLoop;
+typedef struct EventLoop EventLoop;
+
+typedef void (*event_handler_fn)(EventLoop *loop, void *ctx, uint32_t events);
+
+//
+// Registration record for one fd. epoll hands this pointer back to us,
+// so it must stay valid for as long as the fd is registered.
+//
+typedef struct EventHandler {
+    event_handler_fn fn;
+    void *ctx;
+    int fd;
+} EventHandler;
+
+//
+// Edge-triggered epoll reactor. Each fd is registered once and its
+// handler is called only when that fd becomes ready, so a wakeup costs
+// O(ready fds) instead of O(all peers).
+//
+// Time-based work (keep-alives, deadlines, periodic rounds) is armed on
+// the loop's timer wheel; event_loop_poll() sleeps until the next timer
+// is due and runs it after dispatching I/O.
+//
+struct EventLoop {
+    int epoll_fd;
+    void *user;                 // owner state (TorrentState for coordinators)
+    TimerWheel timers;
+
+    // counters
+    long wakeups;               // epoll_wait() calls that returned events
+    long events_dispatched;     // handler invocations
+    double dispatch_time;       // seconds spent inside handlers
+};
+
+/**
+ * Create an event loop.
+ * @param user Pointer stored in loop->user for handlers to use
+ * @return loop on success, NULL on error
+ */
+EventLoop *event_loop_create(void *user);
+
+/**
+ * Close the epoll instance and free the loop. Registered fds are not
+ * closed; timers still armed are disarmed.
+ */
+void event_loop_destroy(EventLoop *loop);
+
+/**
+ * Register fd with the loop. EPOLLET is added automatically.
+ * @return 0 on success, -1 on error
+ */
+int event_loop_add(EventLoop *loop, EventHandler *h, int fd, uint32_t events);
+
+/**
+ * Change the events watched for an already registered handler.
+ * @return 0 on success, -1 on error
+ */
+int event_loop_mod(EventLoop *loop, EventHandler *h, uint32_t events);
+
+/**
+ * Remove fd from the loop. Safe to call before close().
+ */
+void event_loop_del(EventLoop *loop, int fd);
+
+/**
+ * Arm t on the loop's timer wheel, delay seconds from now.
+ */
+void event_loop_arm(EventLoop *loop, Timer *t, double delay);
+
+/**
+ * Wait for readiness, at most until the next timer is due and never
+ * longer than timeout_ms (-1: no limit), dispatch to handlers, then run
+ * expired timers.
+ * @return number of events dispatched, 0 on timeout, -1 on error
+ */
+int event_loop_poll(EventLoop *loop, int timeout_ms);
+
+#endif // EVENT_LOOP_H
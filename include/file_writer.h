@@ -1,8 +1,102 @@
 #ifndef FILE_WRITER_H
 #define FILE_WRITER_H
 
+#include <pthread.h>
+#include <sys/types.h>
 #include "torrent_parser.h"
 
+#define STORAGE_MAX_OPEN_FILES 64   // descriptors kept open at once
+
+// File priorities; a piece gets the highest of the files it touches
+#define FILE_PRIO_SKIP 0     // not downloaded, not created
+#define FILE_PRIO_LOW 1
+#define FILE_PRIO_NORMAL 2
+#define FILE_PRIO_HIGH 3
+
+//
+// Storage: each piece's parts in each file (spans), and an LRU cache of
+// at most STORAGE_MAX_OPEN_FILES descriptors, pinned while in use.
+// Skipped files are never opened or written.
+//
+typedef struct FileSpan {
+    int file;                  // index in meta->files
+    int length;                // bytes of the piece in this file
+    long file_offset;
+} FileSpan;
+
+typedef struct OpenFile {
+    int file;                  // -1 = slot unused
+    int fd;
+    int pins;
+    unsigned long last_use;
+} OpenFile;
+
+typedef struct FileWriter {
+    const TorrentFile *files;
+    int num_files;
+
+    FileSpan *spans;
+    int *first_span;           // total_pieces + 1 entries
+
+    pthread_mutex_t lock;      // guards the cache below
+    OpenFile open[STORAGE_MAX_OPEN_FILES];
+    int *slot_of;              // file -> slot in open[], -1 if closed
+    bool *sized;               // file created at its full length
+    uint8_t *priority;         // FILE_PRIO_* per file
+    unsigned long clock;
+
+    long opens;
+    long evictions;
+    long piece_writes;
+    long span_writes;
+} FileWriter;
+
+/**
+ * Choose the files to download, applied when the next torrent is opened.
+ * Both are comma-separated lists of file indexes or ranges ("0,3-5").
+ * only: download these files, skip the rest. priorities: entries
+ * RANGE=LEVEL, LEVEL one of skip, low, normal, high. NULL keeps the
+ * current setting.
+ */
+void set_file_priorities(const char *only, const char *priorities);
+
+/**
+ * Build the span map for ts->meta, apply the file priorities (setting
+ * ts->piece_priority and ts->pieces_wanted) and prepare the descriptor
+ * cache.
+ * @return 0, or -1 on failure
+ */
+int file_writer_open(TorrentState *ts);
+
+/**
+ * Close every cached descriptor and free the storage state.
+ */
+void file_writer_close(TorrentState *ts);
+
+/**
+ * Write a verified piece: one write per file the piece touches,
+ * submitted to the I/O backend as one batch.
+ * @return 0, or -1 on error
+ */
 int file_writer_write_piece(TorrentState *ts, int index, unsigned char *data, int length);
 
+/**
+ * Read len bytes of piece index starting at begin, across files.
+ * @return 0, or -1 on error
+ */
+int file_writer_read(TorrentState *ts, int index, int begin, unsigned char *out, int len);
+
+/**
+ * Descriptor the block can be sent from with sendfile(). Only given when
+ * the block lies in one file and the cache holds every file, so the
+ * descriptor stays open for as long as the storage does.
+ * @return the descriptor and its offset in *offset, or -1
+ */
+int file_writer_block_fd(TorrentState *ts, int index, int begin, int len, off_t *offset);
+
+/**
+ * Print the storage counters ([FILE] line).
+ */
+void file_writer_print_stats(TorrentState *ts);
+
 #endif
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include "contact_tracker.h"
 #include "torrent_parser.h"
+#include "receive_message.h"
 #define PSTR_LEN        19
 #define HANDSHAKE_LEN   68
 #define PROTOCOL_STRING "BitTorrent protocol"
@@ -37,4 +38,21 @@ int connect_and_handshake(Peer *peer, const unsigned char *info_hash, const unsi
 int safe_recv(int sock_fd,unsigned char *buffer, size_t n_bytes);
 int recv_handshake(int fd, TorrentState *ts);
 
+/**
+ * Non-blocking handshake reader. Partial bytes are kept in the Peer, so
+ * a handshake split across several segments is handled.
+ *
+ * @return WIRE_DONE when a valid handshake was read (peer_id is filled in),
+ *         WIRE_AGAIN if more bytes are needed,
+ *         WIRE_ERROR on close, socket error or handshake mismatch.
+ */
+int peer_read_handshake(Peer *peer, const unsigned char *info_hash);
+
+/**
+ * Send our 68-byte handshake on the peer's socket.
+ * @return 0 on success, -1 on failure
+ */
+int peer_send_handshake(Peer *peer, const unsigned char *info_hash,
+                        const unsigned char *client_id);
+
 #endif  // CONTACT_PEER_H
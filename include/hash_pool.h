@@ -0,0 +1,91 @@
+#ifndef HASH_POOL_H
+#define HASH_POOL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "torrent_parser.h"
+
+#define HASH_THREADS_DEFAULT 2    // hashing threads per download
+#define HASH_THREADS_MAX 16
+
+//
+// Piece verification on hashing threads. Verdicts come back through a
+// result ring that the coordinator collects when notify_fd is readable.
+//
+typedef struct {
+    int piece;
+    bool ok;                    // verified and written; false = reset it
+} HashResult;
+
+typedef struct HashPool {
+    TorrentState *ts;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      // a piece was queued, or stopping
+    pthread_t threads[HASH_THREADS_MAX];
+    int thread_count;
+    bool stopping;
+
+    int capacity;               // total_pieces
+    int *jobs;                  // pieces waiting for a hashing thread
+    double *queued_at;          // when each job was queued
+    int job_head;
+    int job_count;
+    HashResult *results;        // verdicts waiting for the collector
+    int result_head;
+    int result_count;
+    int notify_fd;              // eventfd, signalled when a result is posted
+
+    // Statistics
+    int busy;                   // threads hashing right now
+    int depth_max;              // most pieces queued or being hashed
+    long hashed;
+    long batches;               // sha1_many() calls
+    long failed;
+    long bytes;
+    double hash_time;           // seconds in SHA1, over all threads
+    double write_time;          // seconds writing verified pieces
+    double wait_time;           // seconds pieces spent queued
+} HashPool;
+
+/**
+ * Set the number of hashing threads of pools started afterwards (0 =
+ * hash on the thread that completes the piece).
+ */
+void set_hash_threads(int n);
+int get_hash_threads(void);
+
+/**
+ * Start the hashing threads.
+ * @return 0, or -1 if the queues or the eventfd could not be set up
+ */
+int hash_pool_init(HashPool *hp, TorrentState *ts);
+
+/**
+ * Stop and join the threads; pieces still queued are not hashed.
+ */
+void hash_pool_destroy(HashPool *hp);
+
+/**
+ * Queue a piece whose last block was just stored (store_block()
+ * returned 1). Safe from any thread.
+ */
+void hash_pool_submit(HashPool *hp, int piece);
+
+/**
+ * Take up to max verdicts, oldest first, and clear notify_fd. Call from
+ * the loop that watches notify_fd.
+ * @return number stored in out
+ */
+int hash_pool_collect(HashPool *hp, HashResult *out, int max);
+
+/**
+ * @return pieces queued or being hashed
+ */
+int hash_pool_depth(HashPool *hp);
+
+/**
+ * Print the [HASH] counters: pieces, failures, throughput, queue depth.
+ */
+void hash_pool_print_stats(HashPool *hp);
+
+#endif
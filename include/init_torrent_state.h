@@ -27,7 +27,12 @@ int init_torrent_state(TorrentState *ts, TorrentInfo *ti, int port);
 void cleanup_torrent_state(TorrentState *ts);
 
 /**
- * Check if all pieces have been downloaded and verified.
+ * @return false for a piece that only covers skipped files
+ */
+bool piece_wanted(TorrentState *ts, int index);
+
+/**
+ * Check if all wanted pieces have been downloaded and verified.
  * 
  * @param ts Pointer to TorrentState
  * @return true if download is complete, false otherwise
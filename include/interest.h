@@ -0,0 +1,65 @@
+#ifndef INTEREST_H
+#define INTEREST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "torrent_parser.h"
+
+//
+// Interest in a peer follows Peer.wanted_pieces, the number of pieces it
+// has that we still want. The count is taken once with a bitfield kernel
+// when the peer's BITFIELD arrives and then kept up to date one piece at
+// a time: a HAVE for a piece we want adds one, each of our completions
+// of a piece the peer has takes one away. INTERESTED goes out when the
+// count leaves zero and NOT_INTERESTED when it gets back to zero, so a
+// peer with nothing left for us is not kept interested.
+//
+// The count is against a done map: the pieces we do not want (complete
+// or skipped) in the layout of the wire bitfield. A thread that owns
+// peers keeps its own map and marks completions in the order it learns
+// of them, so the counts of its peers only ever see one consistent
+// sequence of completions.
+//
+
+/**
+ * Done map for the current state of the torrent (spare bits after the
+ * last piece are set).
+ * @return the map (free() it), or NULL on allocation failure
+ */
+uint8_t *interest_map_new(TorrentState *ts);
+
+/**
+ * Mark a piece done in the map.
+ * @return true if it was not marked yet; then call interest_piece_done()
+ * for every peer counted against the map
+ */
+bool interest_map_set(uint8_t *done, uint32_t index);
+
+/**
+ * Count the peer's wanted pieces from scratch: after its BITFIELD, or
+ * when it moves to a thread with a different map.
+ */
+void interest_recount(TorrentState *ts, Peer *p, const uint8_t *done);
+
+/**
+ * The peer announced a piece it did not have before.
+ */
+void interest_have(Peer *p, uint32_t index, const uint8_t *done);
+
+/**
+ * We completed the piece (just marked in the peer's map).
+ */
+void interest_piece_done(Peer *p, uint32_t index);
+
+/**
+ * Count a HAVE message from a peer; safe from any thread. HAVEs are
+ * counted, not logged, so a flood of them costs no writes.
+ */
+void interest_have_received(void);
+
+/**
+ * Print the [INTEREST] counters.
+ */
+void interest_print_stats(void);
+
+#endif
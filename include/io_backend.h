@@ -0,0 +1,69 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef enum {
+    IO_BACKEND_POSIX = 0,       // one syscall per operation
+    IO_BACKEND_URING            // batched through io_uring
+} IoBackendKind;
+
+typedef enum {
+    IO_OP_WRITE = 0,            // pwrite() at offset (disk)
+    IO_OP_SEND                  // stream write on a socket
+} IoOpKind;
+
+//
+// One I/O operation in a batch. The buffer must stay valid until
+// io_backend_submit() returns.
+//
+typedef struct {
+    IoOpKind kind;
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;               // file offset for IO_OP_WRITE
+    ssize_t result;             // bytes transferred, or -errno
+} IoOp;
+
+/**
+ * Select the I/O backend. Asking for io_uring probes the kernel and falls
+ * back to the POSIX path when it is unavailable.
+ *
+ * @param want Backend requested by the user
+ * @return Backend actually in use
+ */
+IoBackendKind io_backend_init(IoBackendKind want);
+
+/**
+ * Release the calling thread's ring (if any). Worker threads call this
+ * before exiting; the main thread calls it at shutdown.
+ */
+void io_backend_thread_exit(void);
+
+IoBackendKind io_backend_kind(void);
+const char *io_backend_name(void);
+
+/**
+ * Execute a batch of operations. With io_uring the whole batch costs one
+ * io_uring_enter() per round; with POSIX each op is its own syscall.
+ * Ops on the same fd complete in array order. Ops are retried until
+ * complete.
+ *
+ * @return number of ops that succeeded, -1 on backend failure
+ */
+int io_backend_submit(IoOp *ops, int n);
+
+/**
+ * Convenience wrapper: write len bytes at offset as a single-op batch.
+ * @return 0 on success, -1 on error
+ */
+int io_backend_pwrite(int fd, const void *buf, size_t len, off_t offset);
+
+/**
+ * Counters since startup (all threads).
+ */
+void io_backend_stats(long *syscalls, long *bytes);
+
+#endif // IO_BACKEND_H
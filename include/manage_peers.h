@@ -5,11 +5,29 @@
 
 
 
+Peer *peer_create(const char *ip, int port);
+void attach_peer(TorrentState *ts, Peer *p);
 Peer *add_peer(TorrentState *ts, const char *ip, int port);
 void remove_peer(TorrentState *ts, int index);
 void cleanup_dead_peers(TorrentState *ts);
 void start_peer_listener();
 
+/**
+ * Register p's socket with loop and arm its keep-alive, idle and
+ * connection deadline timers there.
+ */
+int peer_watch(EventLoop *loop, Peer *p, event_handler_fn fn);
+void peer_unwatch(Peer *p);
+void peer_disconnect(Peer *p);
+void peer_free(Peer *p);
+
+/**
+ * Update p->download_rate from bytes received since the previous call.
+ * Only the thread that owns the peer may call this.
+ * @return smoothed rate in bytes/sec
+ */
+double peer_sample_rate(Peer *p, double now);
+
 Peer *find_peer_by_fd(TorrentState *ts, int fd);
 
 #endif
@@ -10,14 +10,16 @@
  * Multithreaded download function
  * 
  * Uses a pool of worker threads to handle peer connections concurrently.
- * Each worker thread manages a subset of peers, processing messages and
- * requesting blocks in parallel.
+ * Each worker owns its peers outright and runs its own epoll loop; the
+ * main thread only contacts the tracker, accepts inbound connections and
+ * hands new peers to the least loaded worker through a small inbox.
  * 
  * Features:
  * - 4 worker threads by default
- * - Thread-safe state management with mutexes
- * - 2-4x faster than single-threaded download
- * - Automatic load balancing across threads
+ * - Shared state limited to the piece picker (state_mutex) and block
+ *   storage (disk_mutex); HAVEs are queued to each worker's inbox
+ * - Upload slots shared through an atomic counter
+ * - Surviving peers are returned to ts->peers for the seeding phase
  * 
  * @param ts Pointer to initialized TorrentState
  * @return 0 on success, -1 on error
@@ -12,7 +12,7 @@
  * KEEP-ALIVE
  * length = 0 (no ID)
  */
-int send_keepalive(Peer *peer);
+int send_keep_alive(Peer *peer);
 
 /**
  * CHOKE message
@@ -52,10 +52,31 @@ int send_have(Peer *peer, uint32_t piece_index);
  */
 int send_bitfield(Peer *peer, TorrentState *ts);
 
+/**
+ * CANCEL message
+ * length = 13, id = 8
+ * payload: index, begin, length of a REQUEST sent earlier
+ */
+int send_cancel(Peer *peer, uint32_t index, uint32_t begin, uint32_t length);
+
 // --------------------------------------------------
 // Uploading messages (PIECE) - called by send_piece()
 // --------------------------------------------------
 
+typedef enum {
+    UPLOAD_COPY = 0,    // copy the block into the peer's output queue
+    UPLOAD_SENDFILE,    // sendfile() from the output file; piece RAM is
+                        // released once the piece is on disk
+    UPLOAD_ZEROCOPY     // MSG_ZEROCOPY straight from the piece buffer
+} UploadMode;
+
+/**
+ * Select how PIECE payloads are sent. Set once at startup.
+ */
+void set_upload_mode(UploadMode mode);
+UploadMode get_upload_mode(void);
+const char *upload_mode_name(void);
+
 /**
  * PIECE message
  * length = 9 + block_length
@@ -73,4 +94,7 @@ int send_piece(Peer *peer, TorrentState *ts,
 // --------------------------------------------------
 int broadcast_have(TorrentState *ts, int piece_index);
 
+// Same, for an explicit peer array (e.g. the peers one worker owns)
+int broadcast_have_to(Peer **peers, int count, int piece_index);
+
 #endif
\ No newline at end of file
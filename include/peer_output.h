@@ -0,0 +1,113 @@
+#ifndef PEER_OUTPUT_H
+#define PEER_OUTPUT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "contact_tracker.h"
+
+#define PEER_TX_CHUNK_SIZE (16 * 1024)      // chunk size for small frames
+#define PEER_TX_MAX_QUEUED (4 * 1024 * 1024) // refuse new PIECEs beyond this
+#define PEER_TX_MAX_IOV 64
+
+//
+// Per-peer outbound queue, flushed with writev(). While a peer is corked
+// frames are only queued; a chunk may also reference a file range or a
+// caller-owned buffer that must not change until sent.
+//
+typedef enum {
+    OUT_DATA = 0,               // bytes copied into the chunk
+    OUT_FILE,                   // range of a file, sent with sendfile()
+    OUT_REF                     // external buffer, sent with MSG_ZEROCOPY
+} OutChunkKind;
+
+typedef struct OutChunk {
+    struct OutChunk *next;
+    OutChunkKind kind;
+    size_t len;                 // bytes filled / referenced
+    size_t off;                 // bytes already written
+    size_t cap;
+
+    int file_fd;                // OUT_FILE
+    off_t file_off;
+    const unsigned char *ref;   // OUT_REF
+
+    unsigned char data[];
+} OutChunk;
+
+/**
+ * Append a complete frame to the queue (flushes unless corked).
+ * @return 0 on success, -1 on allocation or write error
+ */
+int peer_queue(Peer *p, const void *frame, size_t len);
+
+/**
+ * Append a frame without flushing, whatever the cork state. The caller
+ * flushes later (e.g. peer_flush_many() after a HAVE broadcast).
+ * @return 0 on success, -1 on allocation error
+ */
+int peer_queue_deferred(Peer *p, const void *frame, size_t len);
+
+/**
+ * Reserve len contiguous bytes at the end of the queue for the caller to
+ * fill in place (avoids building the frame in a temporary buffer).
+ * The caller must finish with peer_queue_commit().
+ * @return pointer to the reserved space, NULL on error
+ */
+unsigned char *peer_queue_reserve(Peer *p, size_t len);
+int peer_queue_commit(Peer *p);
+
+/**
+ * Queue len bytes of file fd starting at offset; they are sent with
+ * sendfile() (flushes unless corked).
+ * @return 0 on success, -1 on allocation or write error
+ */
+int peer_queue_file(Peer *p, int fd, off_t offset, size_t len);
+
+/**
+ * Queue a caller-owned buffer to be sent with MSG_ZEROCOPY. Falls back
+ * to a copy if the socket does not support zero-copy sends.
+ * @return 0 on success, -1 on allocation or write error
+ */
+int peer_queue_ref(Peer *p, const unsigned char *buf, size_t len);
+
+/**
+ * Write as much of the queue as the socket accepts.
+ * @return 0 when the queue is empty, 1 if data is still pending,
+ *         -1 on a socket error (the queue is dropped)
+ */
+int peer_flush(Peer *p);
+
+/**
+ * Flush several peers. With the io_uring backend the pending data of all
+ * peers is written in one batch.
+ */
+void peer_flush_many(Peer **peers, int count);
+
+void peer_cork(Peer *p);
+int peer_uncork(Peer *p);
+
+static inline bool peer_output_pending(const Peer *p) {
+    return p->tx_queued > 0;
+}
+
+/**
+ * Drop everything still queued (used on disconnect).
+ */
+void peer_output_reset(Peer *p);
+
+/**
+ * Counters since startup (all threads): frames queued, write syscalls,
+ * bytes written.
+ */
+void peer_output_stats(long *frames, long *writes, long *bytes);
+
+/**
+ * Bytes by path since startup: copied into the queue, sent with
+ * sendfile(), sent with MSG_ZEROCOPY, plus the number of zero-copy sends
+ * the kernel ended up copying anyway (e.g. on loopback).
+ */
+void peer_output_copy_stats(long *copied, long *sendfile, long *zerocopy,
+                            long *zerocopy_copied);
+
+#endif // PEER_OUTPUT_H
@@ -0,0 +1,180 @@
+#ifndef PIECE_PICKER_H
+#define PIECE_PICKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "contact_tracker.h"
+#include "torrent_parser.h"
+#include "file_writer.h"
+
+#define PICKER_RANDOM_FIRST 4   // pieces picked at random before rarest-first
+#define PICKER_LEVELS 64        // availability buckets; the last holds the rest
+#define PICKER_TIERS FILE_PRIO_HIGH   // one set of buckets per priority
+#define PICKER_BUCKETS (PICKER_TIERS * PICKER_LEVELS)
+#define PICKER_RESERVED 8       // started pieces a thread keeps claiming from
+#define PICKER_SCAN_MIN 64      // bucket entries a pick may try before the bitmap
+
+#define STREAM_WINDOW_DEFAULT 16  // pieces ahead of the read cursor
+#define STREAM_PIECE_TIME 1.0     // seconds the reader is given per piece
+#define STREAM_FIRST_MIB 4        // reported: time until this much is readable
+
+//
+// Piece selection: started pieces first, then the rarest wanted piece
+// the peer has, by file priority and, when streaming, by deadline.
+//
+// Locking: picker_claim_reserved() and picker_return_claim() take no
+// lock, a block is claimed by a CAS on its free bit. Everything else is
+// called with the picker's lock held (the state lock in the
+// multithreaded coordinator).
+//
+typedef struct PiecePicker {
+    int words;                 // 64-bit words in a per-piece bitmap
+    uint64_t *fresh;           // wanted, no block requested or received
+
+    // wanted pieces by priority, then availability: with t tiers below
+    // the piece's, order[bucket[l] .. bucket[l+1]-1] for l = t *
+    // PICKER_LEVELS + a are the pieces that a peers have (the last
+    // bucket of a tier: a or more)
+    int *order;
+    int *pos;                  // piece -> index in order, -1 if not wanted
+    int bucket[PICKER_BUCKETS + 1];  // bucket[PICKER_BUCKETS] = pieces wanted
+    int fresh_end[PICKER_BUCKETS];   // bucket l's fresh pieces end here
+
+    // started pieces that still have unrequested blocks
+    int *partial;
+    int *partial_pos;          // piece -> index in partial, -1 if absent
+    int partial_count;
+
+    // unrequested blocks, block_words words per piece; bits are only
+    // cleared with a CAS, the counts follow atomically
+    uint64_t *free_blocks;
+    int block_words;
+    int *free_count;
+    long free_total;
+    signed char *owner;        // piece -> thread that started it, -1 = none
+
+    // streaming
+    bool streaming;
+    int cursor;                // first piece not yet complete
+    int window_end;            // pieces below this have a deadline
+    double first_time;         // first STREAM_FIRST_MIB readable, 0 = not yet
+    long deadlines_met;
+    long deadlines_missed;
+    long raced_blocks;         // duplicate requests near the cursor
+
+    long picks;
+    long examined;             // candidates looked at over all picks
+
+    // atomic, claims can happen on any thread without the lock
+    long claims;               // blocks handed out
+    long claims_unlocked;      // of those by picker_claim_reserved()
+    long claim_retries;        // CAS lost to another thread, tried again
+    long duplicate_claims;     // block was requested already (must stay 0)
+} PiecePicker;
+
+/**
+ * Download in streaming mode from now on: deadlines for the window
+ * pieces after the read cursor, piece_time seconds apart. window 0
+ * turns streaming off, window < 0 keeps the current one (the default
+ * if streaming was off), piece_time <= 0 keeps the current spacing.
+ */
+void set_stream_mode(int window, double piece_time);
+
+/**
+ * Tag picks made by the calling thread with id, for piece affinity
+ * (threads that never call this are thread 0).
+ */
+void picker_set_thread(int id);
+
+/**
+ * Build the picker index (called by init_torrent_state() once piece
+ * storage exists).
+ * @return 0, or -1 on allocation failure
+ */
+int picker_init(TorrentState *ts);
+void picker_free(TorrentState *ts);
+
+/**
+ * Replace the peer's bitfield with the one it sent.
+ * @return 0, or -1 on allocation failure
+ */
+int picker_peer_bitfield(TorrentState *ts, Peer *p,
+                         const unsigned char *bits, uint32_t len);
+
+/**
+ * The peer announced a piece (HAVE).
+ * @return true if it is a piece the peer did not have before
+ */
+bool picker_peer_have(TorrentState *ts, Peer *p, uint32_t index);
+
+/**
+ * The peer is gone: drop its pieces from the counts and free its
+ * bitfield. Safe to call more than once.
+ */
+void picker_peer_gone(TorrentState *ts, Peer *p);
+
+/**
+ * Choose and claim the next block to request from the peer: one that is
+ * neither received nor requested, in a piece the peer has. In streaming
+ * mode it can also be a block of a piece whose deadline is near that is
+ * in flight at another peer; *duplicate is then set and nothing is
+ * claimed.
+ * @return true and the block in *piece / *block, false if none
+ */
+bool picker_pick_block(TorrentState *ts, Peer *p, int *piece, int *block,
+                       bool *duplicate);
+
+/**
+ * Claim a block of one of the calling thread's reserved pieces that the
+ * peer has. Needs no lock; not used while streaming, where deadlines
+ * decide the order.
+ * @return true and the block in *piece / *block, false if none
+ */
+bool picker_claim_reserved(TorrentState *ts, Peer *p, int *piece, int *block);
+
+/**
+ * Give back a block claimed by picker_claim_reserved() that could not be
+ * requested after all. Needs no lock.
+ */
+void picker_return_claim(TorrentState *ts, int piece, int block);
+
+/**
+ * Return a requested block to the pool unless it has been received.
+ */
+void picker_unmark(TorrentState *ts, int piece, int block);
+
+/**
+ * The first copy of a block arrived.
+ */
+void picker_block_received(TorrentState *ts, int piece, int block);
+
+/**
+ * Every block of the piece has arrived; it is not picked again unless
+ * picker_piece_failed() says otherwise.
+ */
+void picker_piece_done(TorrentState *ts, int piece);
+
+/**
+ * The piece failed its hash check and its buffer was reset
+ * (reset_piece()): forget its blocks and pick it like a piece not yet
+ * started.
+ */
+void picker_piece_failed(TorrentState *ts, int piece);
+
+/**
+ * Pieces still wanted, in no particular order.
+ * @return their number; *pieces points into the picker
+ */
+int picker_wanted_pieces(TorrentState *ts, const int **pieces);
+
+/**
+ * @return blocks of wanted pieces that are neither requested nor received
+ */
+long picker_free_blocks(TorrentState *ts);
+
+/**
+ * Print the picker counters ([PICKER] and [STREAM] lines).
+ */
+void picker_print_stats(TorrentState *ts);
+
+#endif
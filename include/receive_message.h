@@ -10,4 +10,48 @@ int safe_recv(int sock_fd, unsigned char *buffer, size_t n_bytes);
 // receive a full BitTorrent message frame
 unsigned char* receive_message(int sock_fd);
 
+// Return codes for the non-blocking readers
+#define WIRE_DONE   1    // a complete handshake/frame is available
+#define WIRE_AGAIN  0    // socket drained, need more bytes
+#define WIRE_ERROR -1    // peer closed, socket error or bad data
+#define WIRE_BLOCK  2    // a PIECE payload landed in the piece buffer
+
+// Per-connection receive buffer. One read fills it and every complete
+// frame in it is decoded before the socket is read again.
+#define PEER_RX_BUF_SIZE (32 * 1024)
+
+struct Peer;
+struct TorrentState;
+
+/*
+ * Non-blocking frame reader. Reads whatever the socket has into the peer's
+ * receive buffer and returns one frame per call, reading again only once
+ * the buffered frames are used up. On WIRE_DONE *out points to a frame in
+ * the same layout receive_message() returns; it is owned by the reader and
+ * stays valid until the next call for this peer (do not free it).
+ */
+int peer_read_message(struct Peer *peer, unsigned char **out);
+
+/*
+ * Same, but a PIECE whose block can be claimed in ts's piece buffer is
+ * received straight into place instead of into a frame. That case returns
+ * WIRE_BLOCK with peer->rx_block_index/begin/len/rx_block describing the
+ * block; the caller must pass it to store_block() (which sees the data is
+ * already in place and ends the claim) before reading the next frame. Everything else comes
+ * back as a normal WIRE_DONE frame.
+ */
+int peer_read_message_direct(struct Peer *peer, struct TorrentState *ts,
+                             unsigned char **out);
+
+// drop any partially received frame and the receive buffer
+void peer_rx_reset(struct Peer *peer);
+
+/**
+ * Reader totals since startup: socket reads that returned data, frames
+ * and blocks decoded, and PIECE payload bytes that arrived in the same
+ * read as earlier frames and were copied from the receive buffer into
+ * the piece buffer.
+ */
+void peer_rx_stats(long *reads, long *frames, long *copied_bytes);
+
 #endif
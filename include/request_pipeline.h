@@ -0,0 +1,106 @@
+#ifndef REQUEST_PIPELINE_H
+#define REQUEST_PIPELINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "contact_tracker.h"
+#include "torrent_parser.h"
+
+#define PIPELINE_INITIAL_DEPTH 16     // requests in flight before any sample
+#define PIPELINE_MIN_DEPTH 2          // default lower bound
+#define PIPELINE_MAX_DEPTH 256        // hard upper bound (size of the table)
+#define PIPELINE_GAIN 2.0             // window = gain * bandwidth-delay product
+#define PIPELINE_RTT_FLOOR 0.005      // seconds, least delay used for the BDP
+#define PIPELINE_RATE_INTERVAL 0.05   // min seconds per delivery rate sample
+
+#define REQUEST_TIMEOUT 20.0          // seconds before a request is reissued
+#define REQUEST_TIMEOUT_RTTS 4        // ... or this many smoothed RTTs
+#define PEER_SNUB_TIMEOUT 10.0        // seconds without a block = snubbed
+#define PEER_SNUB_PENALTY 30.0        // seconds a snubbed peer gets no requests
+
+//
+// Requests in flight per peer and the window sized from rate * min RTT.
+// The table is only touched by the peer's thread; functions that return
+// blocks to the pool need the picker's lock (the state lock in the
+// multithreaded coordinator).
+//
+typedef struct PeerRequest {
+    uint32_t index;
+    uint32_t begin;
+    uint32_t length;
+    double sent;
+} PeerRequest;
+
+/**
+ * Set the window bounds (in blocks) used from now on. max is capped at
+ * PIPELINE_MAX_DEPTH; values < 1 leave a bound unchanged.
+ */
+void set_pipeline_bounds(int min_depth, int max_depth);
+void get_pipeline_bounds(int *min_depth, int *max_depth);
+
+/**
+ * Reset the estimator of a new peer (called by peer_create()).
+ */
+void pipeline_init(Peer *p);
+
+/**
+ * Record a REQUEST queued to the peer (counts in outstanding_requests).
+ * @return 0, or -1 if the table is full or cannot be allocated
+ */
+int pipeline_on_request(Peer *p, uint32_t index, uint32_t begin,
+                        uint32_t len, double now);
+
+/**
+ * A block arrived from the peer: drop its request, take an RTT sample
+ * and resize the window.
+ * @return true if the block was in the table
+ */
+bool pipeline_on_block(Peer *p, uint32_t index, uint32_t begin,
+                       uint32_t len, double now);
+
+/**
+ * @return true if the block is in the peer's request table
+ */
+bool pipeline_has_request(const Peer *p, uint32_t index, uint32_t begin);
+
+/**
+ * Drop the block from the peer's table and send CANCEL for it (endgame,
+ * another peer delivered it first). The picker lock is not needed.
+ * @return true if the block was in the table
+ */
+bool pipeline_cancel(Peer *p, uint32_t index, uint32_t begin);
+
+/**
+ * Return every request in flight to the pool (choke, disconnect).
+ * @return number of blocks returned
+ */
+int pipeline_release(Peer *p, TorrentState *ts);
+
+/**
+ * Return requests past their deadline to the pool, snub the peer
+ * (releasing all its requests) if it has sent nothing for
+ * PEER_SNUB_TIMEOUT, and lift a snub whose penalty is over.
+ * @return number of blocks returned
+ */
+int pipeline_expire(Peer *p, TorrentState *ts, double now);
+
+/**
+ * Print a [PIPE] line if pipeline_expire() snubbed the peer or lifted
+ * its snub. Call without the picker's lock.
+ * @param was_snubbed p->snubbed before pipeline_expire()
+ * @param released   what pipeline_expire() returned
+ */
+void pipeline_print_snub(const Peer *p, bool was_snubbed, int released, double now);
+
+/**
+ * Print the global counters ([PIPE] lines): RTT samples, window changes,
+ * requests timed out and released, snubs.
+ */
+void pipeline_print_stats(void);
+
+/**
+ * Print the estimator state of one peer ([PIPE] line).
+ */
+void pipeline_print_peer(const Peer *p);
+
+#endif
@@ -7,7 +7,7 @@
 #include "torrent_parser.h"
 
 static inline bool we_have_piece(TorrentState *ts, int index) {
-    return ts->piece_complete[index];
+    return is_piece_complete(ts, index);
 }
 
 
@@ -37,4 +37,28 @@ int request_next_block(Peer *peer, TorrentState *ts);
  */
 int request_pipeline_blocks(Peer *peer, TorrentState *ts);
 
+/**
+ * Fill the pipeline from the pieces the calling thread has reserved
+ * (picker_claim_reserved()), without the piece picker's lock.
+ * Returns number of blocks requested.
+ */
+int request_reserved_blocks(Peer *peer, TorrentState *ts);
+
+/**
+ * Turn endgame on (the default) or off, for comparing tail times.
+ */
+void set_endgame(bool on);
+
+/**
+ * Time the last 1% of pieces (the tail) from pieces_complete. Call after
+ * mark_piece_complete(), with the piece picker's lock held.
+ */
+void endgame_piece_done(TorrentState *ts, double now);
+
+/**
+ * Print the endgame counters ([ENDGAME] lines): when it started,
+ * duplicate requests, CANCELs sent, wasted bytes and the tail time.
+ */
+void endgame_print_stats(TorrentState *ts);
+
 #endif // SEND_REQUEST_H
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_LEN 20
+#define SHA1_MAX_LANES 8      // most buffers one backend hashes at once
+
+//
+// SHA1 for piece verification. The fastest backend the CPU has (sha-ni,
+// avx2 and sse2 lanes, or openssl) is picked on first use; the lane
+// backends only pay off through sha1_many() with equal-length buffers.
+//
+
+/**
+ * digest = SHA1(data[0 .. len-1])
+ */
+void sha1(const uint8_t *data, size_t len, uint8_t *digest);
+
+/**
+ * digest[i] = SHA1(data[i][0 .. len[i]-1]) for i < n.
+ */
+void sha1_many(const uint8_t *const *data, const size_t *len, int n,
+               uint8_t (*digest)[SHA1_DIGEST_LEN]);
+
+/**
+ * @return buffers the backend hashes at once (1 for sha-ni and openssl):
+ *         the batch size that keeps it busy
+ */
+int sha1_lanes(void);
+
+/**
+ * Use the named backend instead of the best one (for comparing them).
+ * @return 0, or -1 if the name is unknown or the CPU lacks it
+ */
+int sha1_set_backend(const char *name);
+
+/**
+ * @return name of the backend in use
+ */
+const char *sha1_backend_name(void);
+
+/**
+ * Print the [SHA1] line: the backend in use and the GB/s per core each
+ * backend reached when they were compared.
+ */
+void sha1_print_stats(void);
+
+#endif
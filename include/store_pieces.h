@@ -2,6 +2,19 @@
 #define STORE_PIECES_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+//
+// State of each block of a piece buffer. A block goes FREE -> LANDING
+// while someone writes into it (recv() in place or the copy of a frame),
+// then LANDING -> STORED, or back to FREE if the transfer is abandoned.
+// Every change is a CAS, so exactly one writer owns a block at a time.
+//
+typedef enum {
+    BLOCK_FREE = 0,
+    BLOCK_LANDING,
+    BLOCK_STORED
+} BlockState;
 
 //
 // Buffer for each piece being downloaded
@@ -10,19 +23,84 @@ typedef struct PieceBuffer {
     unsigned char *data;
     int length;
     int num_blocks;
-    bool *block_received;
+    unsigned char *block_state;    // BlockState of each block
     bool *block_requested;
     int blocks_done;
     bool verified;
+    bool written;          // piece is on disk (can be served from the file)
 } PieceBuffer;
 
+static inline bool block_stored(const PieceBuffer *pb, int block) {
+    return __atomic_load_n(&pb->block_state[block], __ATOMIC_ACQUIRE) == BLOCK_STORED;
+}
+
 struct TorrentState;
 typedef struct TorrentState TorrentState;
 
 int init_piece_storage(TorrentState *ts);
 void free_piece_storage(TorrentState *ts);
 int store_received_block(TorrentState *ts, int index, int begin, unsigned char *data, int len);
+
+/**
+ * The two halves of store_received_block(), for callers on several
+ * threads: store_block() copies the block into the piece buffer, owning
+ * it through its BlockState, and is safe from any thread. Once a piece is
+ * full it takes no more blocks, so finish_piece() (hash check, disk
+ * write, HAVE) needs no lock either.
+ * @return store_block(): 1 if this block filled the piece (call
+ *         finish_piece() or hash_pool_submit()), 0 if it was stored,
+ *         -1 if it was not (a duplicate, a full piece, a block that is
+ *         not exactly one we request);
+ *         finish_piece(): 0 if verified, -1 if the piece was reset
+ */
+int store_block(TorrentState *ts, int index, int begin, unsigned char *data, int len);
+int finish_piece(TorrentState *ts, int index);
+
+/**
+ * The two outcomes of finish_piece(), for callers that verify on another
+ * thread (hash_pool.h): write_verified_piece() puts a piece that passed
+ * verify_piece() on disk, dropping the RAM copy when uploads come from
+ * the file; reset_piece() empties a piece that failed so it takes blocks
+ * again. Neither marks the piece or sends HAVE.
+ */
+void write_verified_piece(TorrentState *ts, int index);
+void reset_piece(TorrentState *ts, int index);
+
+/**
+ * Print a [PROGRESS] line each time another 10% of the wanted pieces is
+ * complete. Safe from any thread.
+ */
+void print_progress_if_needed(TorrentState *ts);
+
+/**
+ * Reserve a block for a reader that recv()s its payload straight into the
+ * piece buffer: the block goes FREE -> LANDING. *claim receives its state;
+ * store_block() on the data in place ends the claim either way, and
+ * release_block_claim() ends it if the transfer is abandoned.
+ * @return destination inside the piece buffer, or NULL (use a frame buffer)
+ */
+unsigned char *claim_block_buffer(TorrentState *ts, uint32_t index, uint32_t begin,
+                                  uint32_t len, unsigned char **claim);
+void release_block_claim(unsigned char *claim);
+
 int get_piece_block(TorrentState *ts, int index, int begin, int length, unsigned char *out);
+
+/**
+ * Lock-free test of our bitfield, safe from any thread.
+ * @return true once the piece has been verified
+ */
 bool is_piece_complete(TorrentState *ts, int index);
 
+/**
+ * Set the piece's bit in our bitfield and count it in pieces_complete and
+ * bytes_complete. Call once the piece has been verified.
+ * @return false if it was already set
+ */
+bool mark_piece_complete(TorrentState *ts, int index);
+
+/**
+ * Blocks stored since startup: received in place vs copied from a frame.
+ */
+void store_block_stats(long *in_place, long *copied);
+
 #endif
@@ -0,0 +1,88 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_TICK_MS 10              // wheel resolution
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4          // 64^4 ticks, about 46 hours
+
+typedef void (*timer_fn)(void *ctx);
+
+//
+// One-shot timer, embedded in the object it belongs to (e.g. the Peer).
+// A callback that wants a periodic timer re-arms it.
+//
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer *prev;
+    struct TimerWheel *wheel;   // NULL = not armed
+    uint64_t expires;           // tick
+    int level;
+    int slot;
+
+    timer_fn fn;
+    void *ctx;
+} Timer;
+
+//
+// Hierarchical timing wheel. Level 0 has one slot per tick; each higher
+// level has one slot per whole turn of the level below, and its timers
+// are moved down a level when the lower wheel comes round to them.
+// Arming and cancelling are O(1) list operations, an idle timer costs
+// nothing, and a bitmap of non-empty slots per level tells the owner
+// how long it may sleep.
+//
+// Not thread safe: a wheel belongs to the thread that runs its loop.
+//
+typedef struct TimerWheel {
+    double base_time;           // time of tick 0
+    uint64_t now_tick;          // last tick processed
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+    long armed;                 // timers currently in the wheel
+    long fired;
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *tw, double now);
+
+/**
+ * Disarm every timer still in the wheel (before the wheel goes away).
+ */
+void timer_wheel_clear(TimerWheel *tw);
+
+void timer_init(Timer *t, timer_fn fn, void *ctx);
+
+/**
+ * Arm t to fire delay seconds from now (re-arming moves it). Delays
+ * are rounded up to the next tick.
+ */
+void timer_arm(TimerWheel *tw, Timer *t, double delay);
+
+/**
+ * Disarm t. Safe on a timer that is not armed.
+ */
+void timer_cancel(Timer *t);
+
+static inline bool timer_pending(const Timer *t) {
+    return t->wheel != NULL;
+}
+
+/**
+ * Fire every timer that expired by now. Callbacks may arm and cancel
+ * timers, including the one being run.
+ * @return number of timers fired
+ */
+int timer_wheel_run(TimerWheel *tw, double now);
+
+/**
+ * Milliseconds until the wheel next needs timer_wheel_run(), capped at
+ * max_ms (max_ms < 0: no cap).
+ * @return timeout for epoll_wait(), -1 if nothing is armed and no cap
+ */
+int timer_wheel_timeout_ms(const TimerWheel *tw, double now, int max_ms);
+
+#endif // TIMER_WHEEL_H
@@ -14,6 +14,8 @@ typedef struct {
     int received_blocks;
     uint8_t *have_block;       // 1 = already downloaded
     uint8_t *requested_block;  // 1 = requested but not received yet
+    double deadline;           // streaming: wanted by then, 0 = none
+    bool raced;                // some block requested from two peers
 } PieceState;
 // Forward declare PieceBuffer
 struct PieceBuffer;
@@ -22,6 +24,15 @@ typedef struct PieceBuffer PieceBuffer;
 // Include peer definition (from contact_tracker.h)
 #include "contact_tracker.h"
 
+//
+// One file of the torrent, in the order of the info dictionary
+//
+typedef struct TorrentFile {
+    char *path;                // relative to the working directory
+    long length;
+    long offset;               // where the file starts in the torrent's data
+} TorrentFile;
+
 //
 // Torrent metadata parsed from .torrent file
 //
@@ -34,7 +45,12 @@ typedef struct TorrentInfo {
     int num_pieces;
 
     char *name;
-    long file_length;
+    long file_length;          // total over all files
+
+    // a single-file torrent has one entry named after the torrent; the
+    // files of a multi-file torrent live in a directory of that name
+    TorrentFile *files;
+    int num_files;
 
     unsigned char info_hash[20];
 } TorrentInfo;
@@ -54,10 +70,14 @@ typedef struct TorrentState {
     int peer_count;
     int peer_capacity;
 
+    // Verified pieces, in the wire layout so it goes out as our BITFIELD
+    // as is. Bits are only ever set, with atomic ORs (store_pieces.c),
+    // so any thread may test one without a lock.
     uint8_t *my_bitfield;
     int my_bitfield_len;
+    int pieces_complete;          // wanted pieces in my_bitfield (atomic)
+    long bytes_complete;          // and their bytes (atomic)
 
-    bool *piece_complete;      
     int *piece_bytes_have;
 
     unsigned char **piece_data;
@@ -65,12 +85,16 @@ typedef struct TorrentState {
     int total_pieces;
     int piece_length;
     PieceState *piece_states;
+    int *availability;         // peers that have each piece (piece_picker.c)
+    struct PiecePicker *picker;
 
     const unsigned char *client_id;
 
     PieceBuffer *pieces;
 
-    FILE *output_file; 
+    struct FileWriter *writer;   // the torrent's files (file_writer.c)
+    uint8_t *piece_priority;     // highest of its files' FILE_PRIO_*
+    int pieces_wanted;           // pieces not skipped
 
     double download_start_time;   // timestamp when download began
     long bytes_downloaded;        // total bytes downloaded so far
@@ -80,9 +104,23 @@ typedef struct TorrentState {
     bool is_seeding;             
     bool download_announced;     
 
+    // Endgame: every missing block is in flight, so blocks are requested
+    // from more than one peer (see request_multiple_blocks())
+    bool endgame;
+    double endgame_start;
+    int endgame_blocks;           // blocks missing when it started
+    long endgame_requests;        // duplicate requests sent
+    long cancels_sent;
+    long wasted_bytes;            // payload of blocks we already had
+    double tail_start;            // when the last 1% of pieces began
+    double tail_time;             // seconds the last 1% took
+
     int listen_fd;
     int listen_port;
-    
+
+    EventLoop *loop;             // reactor used by download/seed loops
+    EventHandler listen_ev;
+
 } TorrentState;
 
 int torrentparser(const char *path, TorrentInfo *ti);
@@ -6,4 +6,12 @@
 
 bool verify_piece(TorrentState *ts, int index, unsigned char *data, int length);
 
+/**
+ * Verify several full pieces in one go, which lets a multi-buffer SHA1
+ * backend (sha1.h) hash them side by side. ok[i] is the verdict for
+ * index[i].
+ * @return pieces that passed
+ */
+int verify_pieces(TorrentState *ts, const int *index, int n, bool *ok);
+
 #endif
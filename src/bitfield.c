@@ -0,0 +1,125 @@
+#include <string.h>
+
+#include "bitfield.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITFIELD_X86 1
+#endif
+
+typedef size_t (*andnot_count_fn)(const uint8_t *a, const uint8_t *b, size_t len);
+
+// b == NULL counts a alone, so one kernel serves both calls
+
+static size_t andnot_count_scalar(const uint8_t *a, const uint8_t *b, size_t len) {
+    size_t n = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t x, y = 0;
+        memcpy(&x, a + i, 8);
+        if (b)
+            memcpy(&y, b + i, 8);
+        n += __builtin_popcountll(x & ~y);
+    }
+    for (; i < len; i++)
+        n += __builtin_popcount(a[i] & (b ? ~b[i] : 0xff) & 0xff);
+    return n;
+}
+
+#ifdef BITFIELD_X86
+
+// SSE2 has no popcount: fold bit pairs, nibbles and bytes in the
+// register, then sum the bytes with psadbw
+__attribute__((target("sse2")))
+static size_t andnot_count_sse2(const uint8_t *a, const uint8_t *b, size_t len) {
+    const __m128i m1 = _mm_set1_epi8(0x55);
+    const __m128i m2 = _mm_set1_epi8(0x33);
+    const __m128i m4 = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        if (b)
+            x = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(b + i)), x);
+
+        x = _mm_sub_epi8(x, _mm_and_si128(_mm_srli_epi64(x, 1), m1));
+        x = _mm_add_epi8(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi64(x, 2), m2));
+        x = _mm_and_si128(_mm_add_epi8(x, _mm_srli_epi64(x, 4)), m4);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(x, zero));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return lanes[0] + lanes[1] + andnot_count_scalar(a + i, b ? b + i : NULL, len - i);
+}
+
+// Nibble lookup with vpshufb, byte sums with vpsadbw
+__attribute__((target("avx2")))
+static size_t andnot_count_avx2(const uint8_t *a, const uint8_t *b, size_t len) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        if (b)
+            x = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(b + i)), x);
+
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, low));
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           andnot_count_scalar(a + i, b ? b + i : NULL, len - i);
+}
+
+#endif
+
+static andnot_count_fn kernel;
+static const char *kernel_name;
+
+// Racing first callers pick the same kernel, so no lock is needed
+static andnot_count_fn pick_kernel(void) {
+    andnot_count_fn k = __atomic_load_n(&kernel, __ATOMIC_ACQUIRE);
+    if (k)
+        return k;
+
+    const char *name = "scalar";
+    k = andnot_count_scalar;
+#ifdef BITFIELD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        k = andnot_count_avx2;
+        name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        k = andnot_count_sse2;
+        name = "sse2";
+    }
+#endif
+
+    __atomic_store_n(&kernel_name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&kernel, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+size_t bitfield_count(const uint8_t *a, size_t len) {
+    return pick_kernel()(a, NULL, len);
+}
+
+size_t bitfield_andnot_count(const uint8_t *a, const uint8_t *b, size_t len) {
+    return pick_kernel()(a, b, len);
+}
+
+const char *bitfield_kernel_name(void) {
+    pick_kernel();
+    return __atomic_load_n(&kernel_name, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "connection_manager.h"
+#include "manage_peers.h"
+#include "init_torrent_state.h"
+
+static int half_open_limit = CONN_HALF_OPEN_DEFAULT;
+
+void set_half_open_limit(int limit) {
+    if (limit > 0)
+        half_open_limit = limit;
+}
+
+int get_half_open_limit(void) {
+    return half_open_limit;
+}
+
+int conn_manager_init(ConnManager *cm) {
+    memset(cm, 0, sizeof(*cm));
+
+    cm->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cm->notify_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    pthread_mutex_init(&cm->lock, NULL);
+    cm->start_time = get_time_seconds();
+    return 0;
+}
+
+void conn_manager_destroy(ConnManager *cm) {
+    if (cm->notify_fd >= 0)
+        close(cm->notify_fd);
+    cm->notify_fd = -1;
+
+    free(cm->cands);
+    cm->cands = NULL;
+    cm->cand_count = 0;
+    cm->cand_capacity = 0;
+    pthread_mutex_destroy(&cm->lock);
+}
+
+static void notify_slot_free(ConnManager *cm) {
+    uint64_t one = 1;
+    if (write(cm->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+int conn_manager_add_candidate(ConnManager *cm, const char *ip, int port) {
+    int added = 0;
+
+    pthread_mutex_lock(&cm->lock);
+
+    for (int i = 0; i < cm->cand_count; i++) {
+        if (cm->cands[i].port == port && strcmp(cm->cands[i].ip, ip) == 0)
+            goto out;
+    }
+
+    if (cm->cand_count == CONN_MAX_CANDIDATES)
+        goto out;
+
+    if (cm->cand_count == cm->cand_capacity) {
+        int cap = cm->cand_capacity ? cm->cand_capacity * 2 : 64;
+        ConnCandidate *c = realloc(cm->cands, cap * sizeof(ConnCandidate));
+        if (!c)
+            goto out;
+        cm->cands = c;
+        cm->cand_capacity = cap;
+    }
+
+    ConnCandidate *c = &cm->cands[cm->cand_count++];
+    memset(c, 0, sizeof(*c));
+    snprintf(c->ip, sizeof(c->ip), "%s", ip);
+    c->port = port;
+    c->state = CAND_IDLE;
+    added = 1;
+
+out:
+    pthread_mutex_unlock(&cm->lock);
+    return added;
+}
+
+// Next candidate that is due, round robin; caller holds the lock
+static int next_due_candidate(ConnManager *cm, double now) {
+    for (int n = 0; n < cm->cand_count; n++) {
+        int i = (cm->next_cand + n) % cm->cand_count;
+        ConnCandidate *c = &cm->cands[i];
+
+        if (c->state == CAND_IDLE && c->retry_at <= now) {
+            cm->next_cand = i + 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// caller holds the lock
+static void candidate_failed(ConnManager *cm, int idx, double now) {
+    ConnCandidate *c = &cm->cands[idx];
+
+    c->failures++;
+    c->state = c->failures >= CONN_MAX_FAILURES ? CAND_DEAD : CAND_IDLE;
+    c->retry_at = now + CONN_RETRY_BACKOFF * c->failures;
+}
+
+Peer *peer_dial(const char *ip, int port) {
+    Peer *peer = peer_create(ip, port);
+    if (!peer) return NULL;
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        perror("socket");
+        peer_free(peer);
+        return NULL;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+        close(sock);
+        peer_free(peer);
+        return NULL;
+    }
+
+    // Start connection — will return immediately
+    int r = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    if (r < 0 && errno != EINPROGRESS) {
+        printf("[CONNECT] %s:%d: %s\n", ip, port, strerror(errno));
+        close(sock);
+        peer_free(peer);
+        return NULL;
+    }
+
+    peer->socket_fd = sock;
+    peer->state = PEER_CONNECTING;
+    peer->conn_phase = CONN_PHASE_CONNECTING;
+    peer->conn_start = get_time_seconds();
+    peer->conn_deadline = peer->conn_start + CONN_CONNECT_TIMEOUT;
+    return peer;
+}
+
+void peer_expect_handshake(Peer *p) {
+    p->conn_phase = CONN_PHASE_HANDSHAKE;
+    p->conn_start = get_time_seconds();
+    p->conn_deadline = p->conn_start + CONN_HANDSHAKE_TIMEOUT;
+}
+
+int conn_manager_fill(ConnManager *cm, int open_peers, int max_peers,
+                      Peer **out, int max_out) {
+    double now = get_time_seconds();
+    int n = 0;
+
+    pthread_mutex_lock(&cm->lock);
+
+    while (n < max_out && cm->half_open < half_open_limit &&
+           open_peers + n < max_peers) {
+        int idx = next_due_candidate(cm, now);
+        if (idx < 0)
+            break;
+
+        ConnCandidate *c = &cm->cands[idx];
+        cm->attempts++;
+
+        Peer *p = peer_dial(c->ip, c->port);
+        if (!p) {
+            cm->connect_failures++;
+            candidate_failed(cm, idx, now);
+            continue;
+        }
+
+        p->conn_cand = idx;
+        c->state = CAND_DIALING;
+        cm->half_open++;
+        out[n++] = p;
+    }
+
+    pthread_mutex_unlock(&cm->lock);
+    return n;
+}
+
+void conn_manager_connected(ConnManager *cm, Peer *p) {
+    if (p->conn_phase != CONN_PHASE_CONNECTING)
+        return;
+
+    double now = get_time_seconds();
+    double latency = now - p->conn_start;
+
+    p->conn_phase = CONN_PHASE_HANDSHAKE;
+    p->conn_start = now;
+    p->conn_deadline = now + CONN_HANDSHAKE_TIMEOUT;
+    if (p->loop)
+        event_loop_arm(p->loop, &p->conn_timer, CONN_HANDSHAKE_TIMEOUT);
+
+    if (p->conn_cand < 0)
+        return;
+
+    pthread_mutex_lock(&cm->lock);
+    cm->half_open--;
+    cm->handshaking++;
+    cm->connects++;
+    cm->connect_latency_sum += latency;
+    if (latency > cm->connect_latency_max)
+        cm->connect_latency_max = latency;
+    pthread_mutex_unlock(&cm->lock);
+
+    // a half-open slot is free for the next candidate
+    notify_slot_free(cm);
+}
+
+void conn_manager_handshake_done(ConnManager *cm, Peer *p) {
+    if (p->conn_phase != CONN_PHASE_HANDSHAKE)
+        return;
+
+    double latency = get_time_seconds() - p->conn_start;
+
+    p->conn_phase = CONN_PHASE_NONE;
+    p->conn_deadline = 0;
+    timer_cancel(&p->conn_timer);
+
+    if (p->conn_cand < 0)
+        return;
+
+    pthread_mutex_lock(&cm->lock);
+    cm->handshaking--;
+    cm->handshakes++;
+    cm->handshake_latency_sum += latency;
+    cm->cands[p->conn_cand].state = CAND_CONNECTED;
+    cm->cands[p->conn_cand].failures = 0;
+    pthread_mutex_unlock(&cm->lock);
+}
+
+void conn_manager_release(ConnManager *cm, Peer *p) {
+    int idx = p->conn_cand;
+    int phase = p->conn_phase;
+    double now = get_time_seconds();
+    bool timed_out = phase != CONN_PHASE_NONE && now >= p->conn_deadline;
+
+    p->conn_cand = -1;
+    p->conn_phase = CONN_PHASE_NONE;
+    p->conn_deadline = 0;
+    timer_cancel(&p->conn_timer);
+
+    if (idx < 0)
+        return;
+
+    pthread_mutex_lock(&cm->lock);
+
+    if (phase == CONN_PHASE_CONNECTING) {
+        cm->half_open--;
+        cm->connect_failures++;
+        if (timed_out) cm->connect_timeouts++;
+        candidate_failed(cm, idx, now);
+    } else if (phase == CONN_PHASE_HANDSHAKE) {
+        cm->handshaking--;
+        cm->handshake_failures++;
+        if (timed_out) cm->handshake_timeouts++;
+        candidate_failed(cm, idx, now);
+    } else {
+        // a live peer went away; it may come back later
+        cm->cands[idx].state = CAND_IDLE;
+        cm->cands[idx].retry_at = now + CONN_RETRY_BACKOFF;
+    }
+
+    pthread_mutex_unlock(&cm->lock);
+    notify_slot_free(cm);
+}
+
+void conn_manager_first_block(ConnManager *cm) {
+    if (__atomic_load_n(&cm->first_block_usec, __ATOMIC_RELAXED) != 0)
+        return;
+
+    long usec = (long)((get_time_seconds() - cm->start_time) * 1e6);
+    if (usec < 1)
+        usec = 1;
+
+    long expected = 0;
+    __atomic_compare_exchange_n(&cm->first_block_usec, &expected, usec, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void conn_manager_print_stats(ConnManager *cm) {
+    pthread_mutex_lock(&cm->lock);
+
+    int dead = 0;
+    for (int i = 0; i < cm->cand_count; i++) {
+        if (cm->cands[i].state == CAND_DEAD)
+            dead++;
+    }
+
+    printf("[CONN] %ld dials (half-open limit %d): %ld connected "
+           "(avg %.0f ms, max %.0f ms), %ld failed, %ld timed out\n",
+           cm->attempts, half_open_limit, cm->connects,
+           cm->connects ? cm->connect_latency_sum / cm->connects * 1000.0 : 0.0,
+           cm->connect_latency_max * 1000.0,
+           cm->connect_failures, cm->connect_timeouts);
+    printf("[CONN] %ld handshakes (avg %.0f ms), %ld failed, %ld timed out; "
+           "%d candidates, %d given up\n",
+           cm->handshakes,
+           cm->handshakes ? cm->handshake_latency_sum / cm->handshakes * 1000.0 : 0.0,
+           cm->handshake_failures, cm->handshake_timeouts,
+           cm->cand_count, dead);
+
+    long first = __atomic_load_n(&cm->first_block_usec, __ATOMIC_RELAXED);
+    if (first > 0)
+        printf("[CONN] First block %.0f ms after start\n", first / 1000.0);
+
+    pthread_mutex_unlock(&cm->lock);
+}
@@ -1,8 +1,10 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <time.h>
 #include <errno.h>
 #include <sys/socket.h>
@@ -20,26 +22,32 @@
 #include "outgoingMessages.h"
 #include "init_torrent_state.h"
 #include "requestPayload.h"
+#include "event_loop.h"
+#include "peer_output.h"
+#include "io_backend.h"
+#include "connection_manager.h"
+#include "request_pipeline.h"
+#include "piece_picker.h"
+#include "file_writer.h"
+#include "interest.h"
+#include "bitfield.h"
+#include "hash_pool.h"
 
 #define MAX_PEER_CONNECTIONS 50
 #define TRACKER_RECONTACT_INTERVAL 1800  // 30 minutes
+#define SWEEP_INTERVAL 0.1               // seconds between full peer sweeps
+#define DIAL_BATCH 16                    // connects started per loop iteration
+#define HASH_RESULT_BATCH 64             // verdicts taken per wakeup
 
 static unsigned char CLIENT_ID[20] = "-TC0001-123456789012";
 
-// Update our bitfield when we complete a piece
-static void update_my_bitfield(TorrentState *ts, int piece_index) {
-    if (!ts->my_bitfield || piece_index < 0 || piece_index >= ts->total_pieces) {
-        return;
-    }
-    
-    int byte = piece_index / 8;
-    int bit = 7 - (piece_index % 8);
-    
-    if (byte < ts->my_bitfield_len) {
-        ts->my_bitfield[byte] |= (1 << bit);
-        printf("[BITFIELD] Updated: we now have piece %d\n", piece_index);
-    }
-}
+static ConnManager conn_mgr;
+static HashPool hash_pool;
+static EventHandler hash_ev;
+
+// pieces we no longer want, for the peers' interest counts; kept for the
+// seeding phase, which runs on the same handlers
+static uint8_t *interest_done;
 
 // Manage upload slots - allow some peers to download from us
 static void manage_upload_slots(TorrentState *ts) {
@@ -96,15 +104,14 @@ static int setup_listen_socket(int port) {
         return -1;
     }
 
+    // edge-triggered accept loop drains until EAGAIN
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
     return fd;
 }
 
 bool all_pieces_downloaded(TorrentState *ts) {
-    for (int i = 0; i < ts->total_pieces; i++) {
-        if (!ts->piece_complete[i])
-            return false;
-    }
-    return true;
+    return is_download_complete(ts);
 }
 
 static bool peer_can_request_more(Peer *peer, TorrentState *ts) {
@@ -123,97 +130,152 @@ static bool peer_can_request_more(Peer *peer, TorrentState *ts) {
         return false;
     }
 
-    if (!peer->bitfield || !ts->piece_complete) {
-        return false;
-    }
-
     // Check if the peer has at least one piece we still need
-    for (int i = 0; i < ts->total_pieces; i++) {
-        if (ts->piece_complete[i])
-            continue;
-
-        int byte = i / 8;
-        int bit  = 7 - (i % 8);
-
-        if (byte < peer->bitfield_len &&
-            (peer->bitfield[byte] & (1 << bit))) {
-            return true;
-        }
-    }
-
-    return false;
+    return peer->wanted_pieces > 0;
 }
 
+// Top the peer's window up (request_next_block() fills it)
 static void maybe_request_more(Peer *peer, TorrentState *ts) {
     if (!peer_can_request_more(peer, ts)) {
         return;
     }
 
-    for (int i = 0; i < 4; i++) {
-        if (peer_can_request_more(peer, ts)) {
-            request_next_block(peer, ts);
-        }
-    }
+    request_next_block(peer, ts);
 }
 
+static void on_peer_event(EventLoop *loop, void *ctx, uint32_t events);
+
 // Try to connect to a peer and perform handshake
- int try_connect_peer(TorrentState *ts, const char *ip, int port) {
+int try_connect_peer(TorrentState *ts, const char *ip, int port) {
     printf("[CONNECT] Launching async connect to %s:%d\n", ip, port);
 
-    Peer *peer = add_peer(ts, ip, port);
+    Peer *peer = peer_dial(ip, port);
     if (!peer) {
-        fprintf(stderr, "Failed to allocate peer\n");
+        fprintf(stderr, "Failed to connect to %s:%d\n", ip, port);
         return -1;
     }
+    attach_peer(ts, peer);
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("socket");
-        return -1;
-    }
+    // peers added before the loop exists are registered by download_torrent()
+    if (ts->loop)
+        peer_watch(ts->loop, peer, on_peer_event);
 
-    // set non-blocking
-    fcntl(sock, F_SETFL, O_NONBLOCK);
+    printf("[CONNECT] Started async connect to %s:%d (fd=%d)\n",
+           ip, port, peer->socket_fd);
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    inet_pton(AF_INET, ip, &addr.sin_addr);
+    return 0;
+}
 
-    // Start connection — will return immediately
-    int r = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-    peer->state = PEER_CONNECTING;
+// Dial pool candidates while there are free half-open slots
+static void dial_candidates(TorrentState *ts) {
+    Peer *batch[DIAL_BATCH];
+    int n = conn_manager_fill(&conn_mgr, ts->peer_count, MAX_PEER_CONNECTIONS,
+                              batch, DIAL_BATCH);
 
-    if (r < 0 && errno != EINPROGRESS) {
-        perror("connect");
-        close(sock);
-        peer->state = PEER_DISCONNECTED;
-        return -1;
+    for (int i = 0; i < n; i++) {
+        attach_peer(ts, batch[i]);
+        peer_watch(ts->loop, batch[i], on_peer_event);
     }
+}
 
-    peer->socket_fd = sock;
-    peer->state = PEER_CONNECTING;
-
-    printf("[CONNECT] Started async connect to %s:%d (fd=%d)\n", ip, port, sock);
+// Free closed peers; their pool slots go back to the connection manager
+static void reap_peers(TorrentState *ts) {
+    for (int i = 0; i < ts->peer_count; i++) {
+        if (ts->peers[i]->socket_fd < 0) {
+            conn_manager_release(&conn_mgr, ts->peers[i]);
+            pipeline_release(ts->peers[i], ts);
+            picker_peer_gone(ts, ts->peers[i]);
+        }
+    }
 
-    return 0;
+    cleanup_dead_peers(ts);
 }
 
-// Handle incoming message from a peer during DOWNLOAD
-static void handle_peer_message(TorrentState *ts, Peer *peer) {
-    unsigned char *raw_buf = receive_message(peer->socket_fd);
-    if (!raw_buf) {
-        printf("[PEER %s:%d] Connection closed\n", peer->ip, peer->port);
-        peer->socket_fd = -1;
+// A block arrived, either in a frame or already placed in the piece buffer
+static void handle_block(TorrentState *ts, Peer *peer, uint32_t index,
+                         uint32_t begin, unsigned char *data, uint32_t len) {
+    if (index >= (uint32_t)ts->total_pieces)
         return;
-    }
+
+    conn_manager_first_block(&conn_mgr);
+    bool stored = store_block(ts, index, begin, data, len) >= 0;
+    pipeline_on_block(peer, index, begin, len, get_time_seconds());
     
+    PieceState *ps = &ts->piece_states[index];
+    int b = begin / BLOCK_SIZE;
+
+    // the counts only take blocks the piece buffer took, so they stay
+    // in step with it across a failed hash check
+    if (!stored) {
+        // endgame duplicate that beat our CANCEL
+        ts->wasted_bytes += len;
+    } else {
+        ps->have_block[b] = 1;
+        ps->requested_block[b] = 0;
+        ps->received_blocks++;
+        picker_block_received(ts, index, b);
+
+        // Endgame or a raced streaming piece: the other peers asked
+        // for this block can drop it
+        if (ts->endgame || ps->raced) {
+            for (int i = 0; i < ts->peer_count; i++) {
+                Peer *other = ts->peers[i];
+                if (other != peer && pipeline_cancel(other, index, begin))
+                    ts->cancels_sent++;
+            }
+        }
+
+        // nothing left to request; the hashing threads decide whether
+        // it is done, on_hash_results() hears back
+        if (ps->received_blocks == ps->total_blocks) {
+            picker_piece_done(ts, index);
+            hash_pool_submit(&hash_pool, index);
+        }
+    }
+
+    maybe_request_more(peer, ts);
+}
+
+// Verdicts from the hashing threads: announce the piece, or download it
+// again
+static void on_hash_results(EventLoop *loop, void *ctx, uint32_t events) {
+    TorrentState *ts = ctx;
+    HashResult res[HASH_RESULT_BATCH];
+    (void)loop;
+    (void)events;
+
+    int n = hash_pool_collect(&hash_pool, res, HASH_RESULT_BATCH);
+    for (int k = 0; k < n; k++) {
+        int index = res[k].piece;
+
+        if (!res[k].ok) {
+            printf("[STORE] Piece %d FAILED verification. Resetting.\n", index);
+            reset_piece(ts, index);
+            picker_piece_failed(ts, index);
+            continue;
+        }
+
+        mark_piece_complete(ts, index);
+        broadcast_have(ts, index);
+        print_progress_if_needed(ts);
+        endgame_piece_done(ts, get_time_seconds());
+
+        // peers that had nothing else for us get NOT_INTERESTED
+        if (interest_map_set(interest_done, index)) {
+            for (int i = 0; i < ts->peer_count; i++)
+                interest_piece_done(ts->peers[i], index);
+        }
+
+        printf("[PIECE] Completed piece %d\n", index);
+    }
+}
+
+// Handle one complete message frame from a peer during DOWNLOAD
+static void handle_peer_message(TorrentState *ts, Peer *peer, unsigned char *raw_buf) {
     ParsedMessage msg;
     if (parse_message(raw_buf, &msg) < 0) {
         fprintf(stderr, "[PEER %s:%d] Failed to parse message\n", peer->ip, peer->port);
-        free(raw_buf);
-        peer->socket_fd = -1;
+        peer_disconnect(peer);
         return;
     }
     
@@ -221,13 +283,13 @@ static void handle_peer_message(TorrentState *ts, Peer *peer) {
     switch (msg.id) {
         case MSG_CHOKE:
             peer->is_choked = true;
-            peer->outstanding_requests = 0;
+            // a choking peer drops our requests; others can have them
+            pipeline_release(peer, ts);
             printf("[PEER %s:%d] CHOKE received\n", peer->ip, peer->port);
             break;
             
         case MSG_UNCHOKE:
             peer->is_choked = false;
-            peer->outstanding_requests = 0;
             printf("[PEER %s:%d] UNCHOKE received\n", peer->ip, peer->port);
             maybe_request_more(peer, ts);
             break;
@@ -246,91 +308,33 @@ static void handle_peer_message(TorrentState *ts, Peer *peer) {
         case MSG_HAVE: {
             if (msg.payload_len == 4) {
                 uint32_t idx = ntohl(*(uint32_t*)msg.payload);
-                printf("[PEER %s:%d] HAVE piece %u\n", peer->ip, peer->port, idx);
-                if (peer->bitfield && idx < peer->bitfield_len * 8) {
-                    peer->bitfield[idx/8] |= (1 << (7 - (idx % 8)));
-                }
+                interest_have_received();
+                if (picker_peer_have(ts, peer, idx))
+                    interest_have(peer, idx, interest_done);
             }
             break;
         }
         
         case MSG_BITFIELD: {
-            printf("[PEER %s:%d] BITFIELD (%u bytes)\n",
-                peer->ip, peer->port, msg.payload_len);
+            printf("[PEER %s:%d] BITFIELD (%u bytes, %zu pieces)\n",
+                peer->ip, peer->port, msg.payload_len,
+                bitfield_count(msg.payload, msg.payload_len));
 
-            if (peer->bitfield) free(peer->bitfield);
-
-            peer->bitfield_len = msg.payload_len;
-            peer->bitfield = malloc(msg.payload_len);
-
-            if (!peer->bitfield) {
+            if (picker_peer_bitfield(ts, peer, msg.payload, msg.payload_len) < 0) {
                 printf("[ERROR] Failed to allocate bitfield for peer\n");
                 break;
             }
 
-            memcpy(peer->bitfield, msg.payload, msg.payload_len);
-
-            // Determine if we're interested
-            bool interesting = false;
-            for (int i = 0; i < ts->total_pieces; i++) {
-                if (ts->piece_complete[i])
-                    continue;
-
-                if (peer_has_piece(peer, i)) {
-                    interesting = true;
-                    break;
-                }
-            }
-
-            if (interesting) {
-                send_interested(peer);
-                peer->am_interested = true;
-                printf("[PEER %s:%d] Sent INTERESTED\n", peer->ip, peer->port);
-            } else {
-                send_not_interested(peer);
-                peer->am_interested = false;
-                printf("[PEER %s:%d] Sent NOT_INTERESTED\n", peer->ip, peer->port);
-            }
-
+            // sends INTERESTED if it has anything for us
+            interest_recount(ts, peer, interest_done);
             break;
         }
             
         case MSG_PIECE: {
             PiecePayload piece;
             if (parse_piece_payload(&msg, &piece) == 0) {
-                store_received_block(ts, piece.index, piece.begin, piece.data, piece.data_len);
-                peer->outstanding_requests--;
-                if (peer->outstanding_requests < 0)
-                    peer->outstanding_requests = 0;
-                
-                PieceState *ps = &ts->piece_states[piece.index];
-                int b = piece.begin / BLOCK_SIZE;
-
-                if (b < ps->total_blocks) {
-                    ps->have_block[b] = 1;
-                    ps->requested_block[b] = 0;
-                    ps->received_blocks++;
-
-                    // If piece fully received
-                    if (ps->received_blocks == ps->total_blocks) {
-                        ts->piece_complete[piece.index] = true;
-                        
-                        // Update our bitfield
-                        update_my_bitfield(ts, piece.index);
-                        
-                        // Announce to all peers that we have this piece
-                        for (int i = 0; i < ts->peer_count; i++) {
-                            Peer *p = ts->peers[i];
-                            if (p->state == PEER_ACTIVE && p->socket_fd >= 0) {
-                                send_have(p, piece.index);
-                            }
-                        }
-                        
-                        printf("[PIECE] Completed piece %u\n", piece.index);
-                    }
-                }
-
-                maybe_request_more(peer, ts);
+                handle_block(ts, peer, piece.index, piece.begin,
+                             piece.data, piece.data_len);
             }
             break;
         }
@@ -348,7 +352,7 @@ static void handle_peer_message(TorrentState *ts, Peer *peer) {
                 }
                 
                 // Check if we have the piece
-                if (req.index >= ts->total_pieces || !ts->piece_complete[req.index]) {
+                if (!is_piece_complete(ts, req.index)) {
                     printf("[DOWNLOAD] Don't have piece %u\n", req.index);
                     break;
                 }
@@ -376,308 +380,362 @@ static void handle_peer_message(TorrentState *ts, Peer *peer) {
             printf("[PEER %s:%d] Unknown message ID=%d\n", peer->ip, peer->port, msg.id);
             break;
     }
-    
-    free(raw_buf);
 }
 
-// Main download loop (DOWNLOAD ONLY - no seeding)
-int download_torrent(TorrentState *ts) {
-    time_t last_tracker_contact = 0;
-    int last_progress = -1;
+// Outgoing connect finished: check result and send our handshake
+static void complete_outgoing_connect(TorrentState *ts, Peer *p) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(p->socket_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+    if (err != 0) {
+        printf("[CONNECT] Failed %s:%d (%s)\n",
+            p->ip, p->port, strerror(err));
+        conn_manager_release(&conn_mgr, p);
+        peer_disconnect(p);
+        return;
+    }
 
-    ts->listen_fd = setup_listen_socket(ts->listen_port);
-    if (ts->listen_fd >= 0) {
-        printf("[LISTEN] Accepting peers on port %d (fd=%d)\n",
-               ts->listen_port, ts->listen_fd);
-    } else {
-        printf("[LISTEN] Failed to open listen socket, continuing without inbound peers\n");
+    printf("[CONNECT] Connected: %s:%d (%.0f ms)\n", p->ip, p->port,
+           (get_time_seconds() - p->conn_start) * 1000.0);
+    conn_manager_connected(&conn_mgr, p);
+
+    if (peer_send_handshake(p, ts->meta->info_hash, CLIENT_ID) < 0) {
+        printf("[CONNECT] Handshake send failed %s:%d\n", p->ip, p->port);
+        peer_disconnect(p);
+        return;
     }
 
-    printf("\n*****************************************\n");
-    printf("*     STARTING DOWNLOAD PHASE            *\n");
-    printf("*******************************************\n");
-    printf("\n");
-    printf("Total pieces: %d\n", ts->total_pieces);
-    printf("Piece length: %d bytes\n", ts->piece_length);
-    printf("File length: %ld bytes\n\n", ts->meta->file_length);
+    p->state = PEER_WAIT_HANDSHAKE_IN;
+}
 
-    // MAIN DOWNLOAD LOOP
-    while (1) {
-        time_t now = time(NULL);
+// Full handshake received from a peer (either direction)
+static void on_handshake_done(TorrentState *ts, Peer *p) {
+    conn_manager_handshake_done(&conn_mgr, p);
 
-        // 1. Check if download is complete
-        if (all_pieces_downloaded(ts)) {
-            double elapsed = get_time_seconds() - ts->download_start_time;
-            printf("\n");
-            printf("******************************************\n");
-            printf("*     DOWNLOAD COMPLETE!                 *\n");
-            printf("*     Time: %.2f seconds                 *\n", elapsed);
-            printf("******************************************\n");
-            printf("\n");
-            
-            // Return success - main.c will ask about seeding
-            return 0;
-        }
+    if (p->state == PEER_WAIT_HANDSHAKE_IN) {
+        printf("[HANDSHAKE] OK from %s:%d\n", p->ip, p->port);
+        p->state = PEER_ACTIVE;
+        p->am_choking = true;  // Start by choking
 
-        // 2. Re-contact tracker for more peers
-        if (now - last_tracker_contact > TRACKER_RECONTACT_INTERVAL ||
-            last_tracker_contact == 0) {
-
-            if (ts->skip_tracker) {
-                printf("\n[PEER MODE] Skipping tracker (peer mode active)\n");
-                last_tracker_contact = now;  // Update time 
-            } else {
-                printf("\n[TRACKER] Contacting tracker...\n");
-                TrackerResponse tr;
-
-                if (contact_tracker(ts->meta, &tr) == 0) {
-                    printf("[TRACKER] Received %d peers\n", tr.num_peers);
-
-                    int new_connections = 0;
-                    for (int i = 0; i < tr.num_peers && ts->peer_count < MAX_PEER_CONNECTIONS; i++) {
-                        if (new_connections >= 4) break;
-                        if (try_connect_peer(ts, tr.peers[i].ip, tr.peers[i].port) == 0)
-                            new_connections++;
-                    }
-                    tracker_response_free(&tr);
-                }
-                last_tracker_contact = now;
-            }
+        // Send  bitfield
+        if (ts->my_bitfield_len > 0) {
+            send_bitfield(p, ts);
+            printf("[BITFIELD] Sent to %s:%d\n", p->ip, p->port);
         }
 
-        // 3. No peers so wait
-        if (ts->peer_count == 0) {
-            sleep(1);
-            continue;
-        }
+        // INTERESTED follows once its BITFIELD shows what it has
+        return;
+    }
 
-        // 4. SELECT loop setup
-        fd_set read_fds;
-        fd_set write_fds;
-        FD_ZERO(&read_fds);
-        FD_ZERO(&write_fds);
+    // inbound: reply with our handshake first
+    printf("[INBOUND-HS] OK from peer\n");
 
-        int max_fd = -1;
+    if (peer_send_handshake(p, ts->meta->info_hash, CLIENT_ID) < 0) {
+        peer_disconnect(p);
+        return;
+    }
 
-        if (ts->listen_fd >= 0) {
-            FD_SET(ts->listen_fd, &read_fds);
-            max_fd = ts->listen_fd;
-        }
+    p->state = PEER_ACTIVE;
+    p->am_choking = true;  // Start by choking
 
-        for (int i = 0; i < ts->peer_count; i++) {
-            Peer *p = ts->peers[i];
-            if (p->socket_fd < 0) continue;
+    // Send bitfield
+    if (ts->my_bitfield_len > 0) {
+        send_bitfield(p, ts);
+    }
+}
 
-            if (p->state == PEER_CONNECTING) {
-                FD_SET(p->socket_fd, &write_fds);
-            } else if (p->state == PEER_WAIT_HANDSHAKE_IN ||
-                       p->state == PEER_WAIT_HANDSHAKE_OUT ||
-                       p->state == PEER_ACTIVE) {
-                FD_SET(p->socket_fd, &read_fds);
-            }
+// Per-peer readiness handler. Never blocks: each reader consumes what the
+// socket has and keeps partial state in the Peer until the next event.
+static void on_peer_event(EventLoop *loop, void *ctx, uint32_t events) {
+    TorrentState *ts = loop->user;
+    Peer *p = ctx;
 
-            if (p->socket_fd > max_fd)
-                max_fd = p->socket_fd;
-        }
+    if (p->socket_fd < 0) return;
 
-        if (max_fd < 0) {
-            cleanup_dead_peers(ts);
-            continue;
+    if (p->state == PEER_CONNECTING &&
+        !(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        return;
+
+    // everything this event produces leaves in one write on uncork;
+    // an EPOLLOUT edge also lands here and flushes leftover output
+    peer_cork(p);
+
+    if (p->state == PEER_CONNECTING)
+        complete_outgoing_connect(ts, p);
+
+    while (p->socket_fd >= 0) {
+        int r;
+
+        if (p->state == PEER_WAIT_HANDSHAKE_IN ||
+            p->state == PEER_WAIT_HANDSHAKE_OUT) {
+
+            r = peer_read_handshake(p, ts->meta->info_hash);
+            if (r == WIRE_AGAIN) break;
+            if (r == WIRE_ERROR) {
+                printf("[HANDSHAKE] Invalid from %s:%d\n", p->ip, p->port);
+                peer_disconnect(p);
+                break;
+            }
+            on_handshake_done(ts, p);
+
+        } else if (p->state == PEER_ACTIVE) {
+            unsigned char *raw_buf;
+            r = peer_read_message_direct(p, ts, &raw_buf);
+            if (r == WIRE_AGAIN) break;
+            if (r == WIRE_ERROR) {
+                printf("[PEER %s:%d] Connection closed\n", p->ip, p->port);
+                peer_disconnect(p);
+                break;
+            }
+            if (r == WIRE_BLOCK) {
+                handle_block(ts, p, p->rx_block_index, p->rx_block_begin,
+                             p->rx_block, p->rx_block_len);
+                continue;
+            }
+            handle_peer_message(ts, p, raw_buf);
+
+        } else {
+            break;
         }
+    }
 
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 20000;
+    peer_uncork(p);
+}
 
-        int activity = select(max_fd + 1, &read_fds, &write_fds, NULL, &tv);
+// Listen socket readiness: accept everything queued
+static void on_listen_event(EventLoop *loop, void *ctx, uint32_t events) {
+    TorrentState *ts = loop->user;
+    (void)ctx;
+    (void)events;
 
-        if (activity < 0) {
-            if (errno == EINTR) continue;
-            perror("select");
-            continue;
+    while (1) {
+        int new_fd = accept4(ts->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (new_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
         }
 
-        // 5. idle
-        if (activity == 0) {
-            int prog = (int)get_download_progress(ts);
-            if (prog != last_progress) {
-                printf("[PROGRESS] %d%% complete (%d/%d pieces)\n",
-                       prog,
-                       (prog * ts->total_pieces) / 100,
-                       ts->total_pieces);
+        printf("[LISTEN] Accepted inbound peer (fd=%d)\n", new_fd);
 
-                last_progress = prog;
-            }
+        Peer *p = add_peer(ts, "inbound", 0);
+        if (!p) {
+            printf("[LISTEN] Failed to add peer\n");
+            close(new_fd);
             continue;
         }
 
-        // 6. Handle incoming peer connections
-        if (ts->listen_fd >= 0 && FD_ISSET(ts->listen_fd, &read_fds)) {
-            int new_fd = accept(ts->listen_fd, NULL, NULL);
-            if (new_fd >= 0) {
-                printf("[LISTEN] Accepted inbound peer (fd=%d)\n", new_fd);
-
-                Peer *p = add_peer(ts, "inbound", 0);
-                if (!p) {
-                    printf("[LISTEN] Failed to add peer\n");
-                    close(new_fd);
-                } else {
-                    p->socket_fd = new_fd;
-                    p->state = PEER_WAIT_HANDSHAKE_OUT;
-                    p->am_choking = true;
-
-                    int flags = fcntl(new_fd, F_GETFL, 0);
-                    if (flags != -1)
-                        fcntl(new_fd, F_SETFL, flags & ~O_NONBLOCK);
-                }
-            }
-        }
+        p->socket_fd = new_fd;
+        p->state = PEER_WAIT_HANDSHAKE_OUT;
+        p->am_choking = true;
+        peer_expect_handshake(p);
 
-        // 7. Handle outgoing connection completion
-        for (int i = 0; i < ts->peer_count; i++) {
-            Peer *p = ts->peers[i];
-            if (p->state != PEER_CONNECTING) continue;
-            if (!FD_ISSET(p->socket_fd, &write_fds)) continue;
-
-            int err;
-            socklen_t len = sizeof(err);
-            getsockopt(p->socket_fd, SOL_SOCKET, SO_ERROR, &err, &len);
-
-            if (err != 0) {
-                printf("[CONNECT] Failed %s:%d (%s)\n",
-                    p->ip, p->port, strerror(err));
-                close(p->socket_fd);
-                p->socket_fd = -1;
-                p->state = PEER_DISCONNECTED;
-                continue;
-            }
+        peer_watch(loop, p, on_peer_event);
+    }
+}
 
-            printf("[CONNECT] Connected: %s:%d\n", p->ip, p->port);
+static Timer sweep_timer;
+static Timer tracker_timer;
+static int last_progress;
 
-            unsigned char hs[68] = {0};
-            hs[0] = 19;
-            memcpy(hs+1, "BitTorrent protocol", 19);
-            memcpy(hs+28, ts->meta->info_hash, 20);
-            memcpy(hs+48, CLIENT_ID, 20);
+// Announce and queue the returned peers for dialling; re-arms itself
+static void on_tracker_timer(void *ctx) {
+    TorrentState *ts = ctx;
 
-            send(p->socket_fd, hs, 68, 0);
+    printf("\n[TRACKER] Contacting tracker...\n");
+    TrackerResponse tr;
 
-            int flags = fcntl(p->socket_fd, F_GETFL, 0);
-            if (flags != -1) {
-                fcntl(p->socket_fd, F_SETFL, flags & ~O_NONBLOCK);
-            }
+    if (contact_tracker(ts->meta, &tr) == 0) {
+        printf("[TRACKER] Received %d peers\n", tr.num_peers);
 
-            p->state = PEER_WAIT_HANDSHAKE_IN;
-        }
+        for (int i = 0; i < tr.num_peers; i++)
+            conn_manager_add_candidate(&conn_mgr, tr.peers[i].ip,
+                                       tr.peers[i].port);
+        tracker_response_free(&tr);
+    }
 
-        // 8. Handle outgoing handshake responses
-        for (int i = 0; i < ts->peer_count; i++) {
-            Peer *p = ts->peers[i];
-            if (p->state != PEER_WAIT_HANDSHAKE_IN ||
-                !FD_ISSET(p->socket_fd, &read_fds))
-                continue;
+    event_loop_arm(ts->loop, &tracker_timer, TRACKER_RECONTACT_INTERVAL);
+}
 
-            unsigned char hs[68];
-            int got = recv(p->socket_fd, hs, 68, 0);
+// Periodic sweep over all peers, on a timer so that a busy loop does not
+// pay O(peers) per wakeup
+static void on_sweep_timer(void *ctx) {
+    TorrentState *ts = ctx;
 
-            if (got == 68 &&
-                hs[0] == 19 &&
-                memcmp(hs+1, "BitTorrent protocol", 19) == 0 &&
-                memcmp(hs+28, ts->meta->info_hash, 20) == 0) {
+    int prog = (int)get_download_progress(ts);
+    if (prog != last_progress) {
+        printf("[PROGRESS] %d%% complete (%d/%d pieces)\n",
+               prog,
+               (prog * ts->pieces_wanted) / 100,
+               ts->pieces_wanted);
 
-                printf("[HANDSHAKE] OK from %s:%d\n", p->ip, p->port);
-                p->state = PEER_ACTIVE;
-                p->am_choking = true;  // Start by choking
+        last_progress = prog;
+    }
 
-                // Send  bitfield
-                if (ts->my_bitfield_len > 0) {
-                    send_bitfield(p, ts);
-                    printf("[BITFIELD] Sent to %s:%d\n", p->ip, p->port);
-                }
+    // Take back requests from snubbing peers and missed deadlines first,
+    // so the loop below hands them to peers that are delivering
+    double now = get_time_seconds();
+    for (int i = 0; i < ts->peer_count; i++) {
+        Peer *p = ts->peers[i];
+        bool was_snubbed = p->snubbed;
+        int released = pipeline_expire(p, ts, now);
+        pipeline_print_snub(p, was_snubbed, released, now);
+    }
 
-                // Send INTERESTED
-                send_interested(p);
-                p->am_interested = true;
-                printf("[INTEREST] Sent INTERESTED to %s:%d\n", p->ip, p->port);
+    // Request more pieces
+    for (int i = 0; i < ts->peer_count; i++) {
+        Peer *peer = ts->peers[i];
+        if (peer->state == PEER_ACTIVE &&
+            peer->socket_fd >= 0 &&
+            !peer->is_choked) {
 
-            } else {
-                printf("[HANDSHAKE] Invalid from %s:%d\n", p->ip, p->port);
-                close(p->socket_fd);
-                p->socket_fd = -1;
-                p->state = PEER_DISCONNECTED;
-            }
+            maybe_request_more(peer, ts);
         }
+    }
 
-        // 9. Handle inbound handshakes
-        for (int i = 0; i < ts->peer_count; i++) {
-            Peer *p = ts->peers[i];
+    // Manage upload slots
+    manage_upload_slots(ts);
 
-            if (p->state != PEER_WAIT_HANDSHAKE_OUT ||
-                !FD_ISSET(p->socket_fd, &read_fds))
-                continue;
+    // Clean up closed peers
+    reap_peers(ts);
 
-            unsigned char hs[68];
-            int got = recv(p->socket_fd, hs, 68, 0);
+    event_loop_arm(ts->loop, &sweep_timer, SWEEP_INTERVAL);
+}
 
-            if (got == 68 &&
-                hs[0] == 19 &&
-                memcmp(hs+1, "BitTorrent protocol", 19) == 0 &&
-                memcmp(hs+28, ts->meta->info_hash, 20) == 0) {
+// Main download loop (DOWNLOAD ONLY - no seeding)
+int download_torrent(TorrentState *ts) {
 
-                printf("[INBOUND-HS] OK from peer\n");
+    if (!ts->loop) {
+        ts->loop = event_loop_create(ts);
+        if (!ts->loop) {
+            fprintf(stderr, "[LOOP] Failed to create event loop\n");
+            return -1;
+        }
+    }
 
-                unsigned char reply[68] = {0};
-                reply[0] = 19;
-                memcpy(reply+1, "BitTorrent protocol", 19);
-                memcpy(reply+28, ts->meta->info_hash, 20);
-                memcpy(reply+48, CLIENT_ID, 20);
+    free(interest_done);
+    interest_done = interest_map_new(ts);
+    if (!interest_done)
+        return -1;
 
-                send(p->socket_fd, reply, 68, 0);
+    if (conn_manager_init(&conn_mgr) < 0)
+        return -1;
 
-                p->state = PEER_ACTIVE;
-                p->am_choking = true;  // Start by choking
+    if (hash_pool_init(&hash_pool, ts) < 0) {
+        conn_manager_destroy(&conn_mgr);
+        return -1;
+    }
+    hash_ev.fn = on_hash_results;
+    hash_ev.ctx = ts;
+    event_loop_add(ts->loop, &hash_ev, hash_pool.notify_fd, EPOLLIN);
 
-                // Send bitfield
-                if (ts->my_bitfield_len > 0) {
-                    send_bitfield(p, ts);
-                }
-            } else {
-                printf("[INBOUND-HS] Invalid handshake\n");
-                close(p->socket_fd);
-                p->socket_fd = -1;
-                p->state = PEER_DISCONNECTED;
-            }
-        }
+    ts->listen_fd = setup_listen_socket(ts->listen_port);
+    if (ts->listen_fd >= 0) {
+        printf("[LISTEN] Accepting peers on port %d (fd=%d)\n",
+               ts->listen_port, ts->listen_fd);
+        ts->listen_ev.fn = on_listen_event;
+        ts->listen_ev.ctx = NULL;
+        event_loop_add(ts->loop, &ts->listen_ev, ts->listen_fd, EPOLLIN);
+    } else {
+        printf("[LISTEN] Failed to open listen socket, continuing without inbound peers\n");
+    }
+
+    // peers connected before the loop existed (e.g. --peer mode)
+    for (int i = 0; i < ts->peer_count; i++) {
+        Peer *p = ts->peers[i];
+        if (p->socket_fd >= 0 && !p->loop)
+            peer_watch(ts->loop, p, on_peer_event);
+    }
+
+    printf("\n*****************************************\n");
+    printf("*     STARTING DOWNLOAD PHASE            *\n");
+    printf("*******************************************\n");
+    printf("\n");
+    printf("Total pieces: %d\n", ts->total_pieces);
+    printf("Piece length: %d bytes\n", ts->piece_length);
+    printf("File length: %ld bytes\n\n", ts->meta->file_length);
 
-        // 10. Handle peer messages
-        for (int i = 0; i < ts->peer_count; i++) {
-            Peer *peer = ts->peers[i];
+    last_progress = -1;
+    timer_init(&sweep_timer, on_sweep_timer, ts);
+    event_loop_arm(ts->loop, &sweep_timer, SWEEP_INTERVAL);
 
-            if (peer->state == PEER_ACTIVE &&
-                FD_ISSET(peer->socket_fd, &read_fds)) {
+    timer_init(&tracker_timer, on_tracker_timer, ts);
+    if (ts->skip_tracker)
+        printf("\n[PEER MODE] Skipping tracker (peer mode active)\n");
+    else
+        on_tracker_timer(ts);
 
-                handle_peer_message(ts, peer);
-            }
-        }
+    // MAIN DOWNLOAD LOOP
+    while (1) {
+        // 1. Check if download is complete
+        if (all_pieces_downloaded(ts)) {
+            double elapsed = get_time_seconds() - ts->download_start_time;
+            printf("\n");
+            printf("******************************************\n");
+            printf("*     DOWNLOAD COMPLETE!                 *\n");
+            printf("*     Time: %.2f seconds                 *\n", elapsed);
+            printf("******************************************\n");
+            printf("[LOOP] %ld wakeups, %ld events dispatched, %ld timers fired\n",
+                   ts->loop->wakeups, ts->loop->events_dispatched,
+                   ts->loop->timers.fired);
+
+            long io_calls, io_bytes;
+            io_backend_stats(&io_calls, &io_bytes);
+            printf("[IO] %s backend: %ld syscalls for %.2f MiB\n",
+                   io_backend_name(), io_calls, io_bytes / (1024.0 * 1024.0));
+
+            long tx_frames, tx_writes, tx_bytes;
+            peer_output_stats(&tx_frames, &tx_writes, &tx_bytes);
+            printf("[TX] %ld frames in %ld writes (%.2f MiB)\n",
+                   tx_frames, tx_writes, tx_bytes / (1024.0 * 1024.0));
+
+            long rx_in_place, rx_copied;
+            store_block_stats(&rx_in_place, &rx_copied);
+            printf("[RX] %ld blocks received in place, %ld copied\n",
+                   rx_in_place, rx_copied);
+
+            long rx_reads, rx_frames, rx_buffered;
+            peer_rx_stats(&rx_reads, &rx_frames, &rx_buffered);
+            printf("[RX] %ld frames in %ld reads, %.2f MiB of blocks via receive buffer\n",
+                   rx_frames, rx_reads, rx_buffered / (1024.0 * 1024.0));
+
+            conn_manager_print_stats(&conn_mgr);
+
+            pipeline_print_stats();
+            for (int i = 0; i < ts->peer_count; i++)
+                pipeline_print_peer(ts->peers[i]);
+            picker_print_stats(ts);
+            endgame_print_stats(ts);
+            interest_print_stats();
+            hash_pool_print_stats(&hash_pool);
+            file_writer_print_stats(ts);
+            printf("\n");
 
-        // 11. Request more pieces
-        for (int i = 0; i < ts->peer_count; i++) {
-            Peer *peer = ts->peers[i];
-            if (peer->state == PEER_ACTIVE &&
-                peer->socket_fd >= 0 &&
-                !peer->is_choked) {
+            // the seeding phase keeps the peers but not their pool slots
+            for (int i = 0; i < ts->peer_count; i++)
+                ts->peers[i]->conn_cand = -1;
+            conn_manager_destroy(&conn_mgr);
 
-                maybe_request_more(peer, ts);
-            }
-        }
+            // every piece is in, nothing is left to hash
+            event_loop_del(ts->loop, hash_pool.notify_fd);
+            hash_pool_destroy(&hash_pool);
+
+            // the loop carries on into seeding; these timers do not
+            timer_cancel(&sweep_timer);
+            timer_cancel(&tracker_timer);
 
-        // 12. Manage upload slots 
-        if (activity > 0) {
-            manage_upload_slots(ts);
+            // Return success - main.c will ask about seeding
+            return 0;
         }
 
-        // 13. Clean up closed peers
-        cleanup_dead_peers(ts);
+        // 2. Replace closed and failed connections from the pool
+        dial_candidates(ts);
+
+        // 3. Sleep until I/O or the next timer (sweep, re-announce, peer
+        //    deadlines); handlers run connects, handshakes and peer
+        //    messages for the fds that are actually ready
+        event_loop_poll(ts->loop, -1);
     }
 
     return 0;
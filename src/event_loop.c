@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "event_loop.h"
+#include "init_torrent_state.h"
+
+EventLoop *event_loop_create(void *user) {
+    EventLoop *loop = calloc(1, sizeof(EventLoop));
+    if (!loop) return NULL;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        free(loop);
+        return NULL;
+    }
+
+    loop->user = user;
+    timer_wheel_init(&loop->timers, get_time_seconds());
+    return loop;
+}
+
+void event_loop_destroy(EventLoop *loop) {
+    if (!loop) return;
+    timer_wheel_clear(&loop->timers);
+    if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+    free(loop);
+}
+
+int event_loop_add(EventLoop *loop, EventHandler *h, int fd, uint32_t events) {
+    if (!loop || !h || fd < 0) return -1;
+
+    h->fd = fd;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLET;
+    ev.data.ptr = h;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        // already registered (e.g. handed over between phases) -> update
+        if (errno == EEXIST)
+            return event_loop_mod(loop, h, events);
+        perror("epoll_ctl(ADD)");
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_mod(EventLoop *loop, EventHandler *h, uint32_t events) {
+    if (!loop || !h || h->fd < 0) return -1;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLET;
+    ev.data.ptr = h;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, h->fd, &ev) < 0) {
+        perror("epoll_ctl(MOD)");
+        return -1;
+    }
+    return 0;
+}
+
+void event_loop_del(EventLoop *loop, int fd) {
+    if (!loop || fd < 0) return;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void event_loop_arm(EventLoop *loop, Timer *t, double delay) {
+    timer_arm(&loop->timers, t, delay);
+}
+
+int event_loop_poll(EventLoop *loop, int timeout_ms) {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    timeout_ms = timer_wheel_timeout_ms(&loop->timers, get_time_seconds(), timeout_ms);
+
+    int n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+
+    double start = get_time_seconds();
+
+    if (n > 0) {
+        loop->wakeups++;
+
+        for (int i = 0; i < n; i++) {
+            EventHandler *h = events[i].data.ptr;
+            if (!h || !h->fn) continue;
+            h->fn(loop, h->ctx, events[i].events);
+        }
+
+        loop->events_dispatched += n;
+    }
+
+    timer_wheel_run(&loop->timers, get_time_seconds());
+    loop->dispatch_time += get_time_seconds() - start;
+    return n;
+}
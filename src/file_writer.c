@@ -1,8 +1,388 @@
 #include "file_writer.h"
+#include "io_backend.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-// Writes one complete piece into the final output file.
+#define SPANS_ON_STACK 8
+
+static const char *only_files;
+static const char *file_priorities;
+
+void set_file_priorities(const char *only, const char *priorities) {
+    if (only)
+        only_files = only;
+    if (priorities)
+        file_priorities = priorities;
+}
+
+static int parse_level(const char *s, size_t len) {
+    static const char *names[] = { "skip", "low", "normal", "high" };
+
+    for (int i = 0; i <= FILE_PRIO_HIGH; i++) {
+        if (strlen(names[i]) == len && strncmp(s, names[i], len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// "I" or "I-J" at *s, advancing past it
+static int parse_range(const char **s, int num_files, int *lo, int *hi) {
+    char *end;
+    long a = strtol(*s, &end, 10);
+    if (end == *s)
+        return -1;
+
+    long b = a;
+    if (*end == '-') {
+        const char *t = end + 1;
+        b = strtol(t, &end, 10);
+        if (end == t)
+            return -1;
+    }
+
+    if (a < 0 || b < a || b >= num_files)
+        return -1;
+
+    *lo = (int)a;
+    *hi = (int)b;
+    *s = end;
+    return 0;
+}
+
+// File priorities from the --only and --file-priority lists
+static int apply_priorities(FileWriter *w) {
+    const char *s;
+    int lo, hi;
+
+    for (int i = 0; i < w->num_files; i++)
+        w->priority[i] = only_files ? FILE_PRIO_SKIP : FILE_PRIO_NORMAL;
+
+    if ((s = only_files)) {
+        for (;;) {
+            if (parse_range(&s, w->num_files, &lo, &hi) != 0)
+                goto bad;
+            for (int i = lo; i <= hi; i++)
+                w->priority[i] = FILE_PRIO_NORMAL;
+            if (*s == '\0')
+                break;
+            if (*s++ != ',')
+                goto bad;
+        }
+    }
+
+    if ((s = file_priorities)) {
+        for (;;) {
+            if (parse_range(&s, w->num_files, &lo, &hi) != 0 || *s++ != '=')
+                goto bad;
+
+            size_t len = strcspn(s, ",");
+            int level = parse_level(s, len);
+            if (level < 0)
+                goto bad;
+            s += len;
+
+            for (int i = lo; i <= hi; i++)
+                w->priority[i] = level;
+            if (*s == '\0')
+                break;
+            s++;
+        }
+    }
+
+    return 0;
+
+bad:
+    fprintf(stderr, "[FILE] Bad file list near \"%s\" (files are 0..%d)\n",
+            s, w->num_files - 1);
+    return -1;
+}
+
+// A piece is worth what its most important file is; count the pieces
+// that are downloaded at all
+static int piece_priorities(FileWriter *w, TorrentState *ts) {
+    ts->piece_priority = calloc(ts->total_pieces > 0 ? ts->total_pieces : 1, 1);
+    if (!ts->piece_priority)
+        return -1;
+
+    ts->pieces_wanted = 0;
+    for (int i = 0; i < ts->total_pieces; i++) {
+        uint8_t prio = FILE_PRIO_SKIP;
+        for (int k = w->first_span[i]; k < w->first_span[i + 1]; k++) {
+            if (w->priority[w->spans[k].file] > prio)
+                prio = w->priority[w->spans[k].file];
+        }
+
+        ts->piece_priority[i] = prio;
+        if (prio != FILE_PRIO_SKIP)
+            ts->pieces_wanted++;
+    }
+
+    int files = 0;
+    for (int i = 0; i < w->num_files; i++) {
+        if (w->priority[i] != FILE_PRIO_SKIP)
+            files++;
+    }
+    if (files < w->num_files)
+        printf("[FILE] Downloading %d of %d files: %d of %d pieces\n",
+               files, w->num_files, ts->pieces_wanted, ts->total_pieces);
+    return 0;
+}
+
+// mkdir -p for the directories in front of the last '/'
+static int make_parents(const char *path) {
+    char *dir = strdup(path);
+    if (!dir)
+        return -1;
+
+    for (char *s = strchr(dir, '/'); s; s = strchr(s + 1, '/')) {
+        *s = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "[FILE] mkdir %s: %s\n", dir, strerror(errno));
+            free(dir);
+            return -1;
+        }
+        *s = '/';
+    }
+
+    free(dir);
+    return 0;
+}
+
+// The first open in a run creates the file at its full length, like the
+// single output file used to be preallocated; later ones just reopen it
+static int open_file(FileWriter *w, int file) {
+    const TorrentFile *tf = &w->files[file];
+    int flags = O_RDWR | O_CREAT | (w->sized[file] ? 0 : O_TRUNC);
+
+    if (!w->sized[file] && make_parents(tf->path) != 0)
+        return -1;
+
+    int fd = open(tf->path, flags, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[FILE] open %s: %s\n", tf->path, strerror(errno));
+        return -1;
+    }
+
+    if (!w->sized[file]) {
+        if (ftruncate(fd, tf->length) != 0) {
+            fprintf(stderr, "[FILE] ftruncate %s: %s\n", tf->path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        w->sized[file] = true;
+    }
+
+    __atomic_fetch_add(&w->opens, 1, __ATOMIC_RELAXED);
+    return fd;
+}
+
+// Pinned descriptor for the file; *slot is -1 if it is not cached and
+// must be closed by release_fd()
+static int acquire_fd(FileWriter *w, int file, int *slot) {
+    pthread_mutex_lock(&w->lock);
+
+    int s = w->slot_of[file];
+    if (s >= 0) {
+        w->open[s].pins++;
+        w->open[s].last_use = ++w->clock;
+        *slot = s;
+        pthread_mutex_unlock(&w->lock);
+        return w->open[s].fd;
+    }
+
+    // Creating a file must not race another thread's O_TRUNC, so that
+    // happens under the lock, once per file. Reopening one does not.
+    int fd;
+    if (w->sized[file]) {
+        pthread_mutex_unlock(&w->lock);
+        fd = open_file(w, file);
+        pthread_mutex_lock(&w->lock);
+
+        // cached by another thread in the meantime: use that one
+        s = w->slot_of[file];
+        if (s >= 0) {
+            w->open[s].pins++;
+            w->open[s].last_use = ++w->clock;
+            *slot = s;
+            pthread_mutex_unlock(&w->lock);
+            if (fd >= 0)
+                close(fd);
+            return w->open[s].fd;
+        }
+    } else {
+        fd = open_file(w, file);
+    }
+
+    if (fd < 0) {
+        pthread_mutex_unlock(&w->lock);
+        return -1;
+    }
+
+    // a free slot, else the least recently used one nobody is using
+    s = -1;
+    for (int i = 0; i < STORAGE_MAX_OPEN_FILES; i++) {
+        if (w->open[i].file < 0) {
+            s = i;
+            break;
+        }
+        if (w->open[i].pins == 0 &&
+            (s < 0 || w->open[i].last_use < w->open[s].last_use))
+            s = i;
+    }
+
+    int evicted = -1;
+    if (s >= 0 && w->open[s].file >= 0) {
+        evicted = w->open[s].fd;
+        w->slot_of[w->open[s].file] = -1;
+        w->evictions++;
+    }
+
+    if (s >= 0) {
+        w->open[s].file = file;
+        w->open[s].fd = fd;
+        w->open[s].pins = 1;
+        w->open[s].last_use = ++w->clock;
+        w->slot_of[file] = s;
+    }
+
+    *slot = s;
+    pthread_mutex_unlock(&w->lock);
+
+    // unpinned, so nobody else is using it
+    if (evicted >= 0)
+        close(evicted);
+    return fd;
+}
+
+static void release_fd(FileWriter *w, int slot, int fd) {
+    if (slot < 0) {
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->open[slot].pins--;
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Walk pieces and files side by side; every span ends where a piece or
+// a file does, so there are at most pieces + files of them
+static int build_spans(FileWriter *w, TorrentState *ts) {
+    long total = ts->meta->file_length;
+    int max_spans = ts->total_pieces + w->num_files;
+
+    w->spans = malloc(sizeof(FileSpan) * (max_spans > 0 ? max_spans : 1));
+    w->first_span = malloc(sizeof(int) * (ts->total_pieces + 1));
+    if (!w->spans || !w->first_span)
+        return -1;
+
+    int n = 0;
+    int f = 0;
+    for (int i = 0; i < ts->total_pieces; i++) {
+        long pos = (long)i * ts->piece_length;
+        long end = pos + ts->piece_length;
+        if (end > total)
+            end = total;
+
+        w->first_span[i] = n;
+        while (pos < end) {
+            while (f < w->num_files &&
+                   w->files[f].offset + w->files[f].length <= pos)
+                f++;
+            if (f == w->num_files || n == max_spans)
+                return -1;
+
+            long file_end = w->files[f].offset + w->files[f].length;
+            long stop = end < file_end ? end : file_end;
+
+            w->spans[n].file = f;
+            w->spans[n].length = (int)(stop - pos);
+            w->spans[n].file_offset = pos - w->files[f].offset;
+            n++;
+            pos = stop;
+        }
+    }
+    w->first_span[ts->total_pieces] = n;
+    return 0;
+}
+
+int file_writer_open(TorrentState *ts) {
+    TorrentInfo *ti = ts->meta;
+
+    FileWriter *w = calloc(1, sizeof(FileWriter));
+    if (!w)
+        return -1;
+    ts->writer = w;
+
+    w->files = ti->files;
+    w->num_files = ti->num_files;
+    pthread_mutex_init(&w->lock, NULL);
+    for (int i = 0; i < STORAGE_MAX_OPEN_FILES; i++)
+        w->open[i].file = -1;
+
+    w->slot_of = malloc(sizeof(int) * (w->num_files > 0 ? w->num_files : 1));
+    w->sized = calloc(w->num_files > 0 ? w->num_files : 1, sizeof(bool));
+    w->priority = calloc(w->num_files > 0 ? w->num_files : 1, 1);
+    if (!w->slot_of || !w->sized || !w->priority)
+        goto error;
+    for (int i = 0; i < w->num_files; i++)
+        w->slot_of[i] = -1;
+
+    if (build_spans(w, ts) != 0) {
+        fprintf(stderr, "[FILE] Files do not cover the torrent's pieces\n");
+        goto error;
+    }
+
+    if (apply_priorities(w) != 0 || piece_priorities(w, ts) != 0)
+        goto error;
+
+    // no piece ever touches an empty file
+    for (int i = 0; i < w->num_files; i++) {
+        if (w->files[i].length > 0 || w->priority[i] == FILE_PRIO_SKIP)
+            continue;
+
+        int fd = open_file(w, i);
+        if (fd < 0)
+            goto error;
+        close(fd);
+    }
+
+    return 0;
+
+error:
+    file_writer_close(ts);
+    return -1;
+}
+
+void file_writer_close(TorrentState *ts) {
+    FileWriter *w = ts->writer;
+    if (!w)
+        return;
+
+    for (int i = 0; i < STORAGE_MAX_OPEN_FILES; i++) {
+        if (w->open[i].file >= 0)
+            close(w->open[i].fd);
+    }
+
+    pthread_mutex_destroy(&w->lock);
+    free(w->spans);
+    free(w->first_span);
+    free(w->slot_of);
+    free(w->sized);
+    free(w->priority);
+    free(w);
+    ts->writer = NULL;
+
+    free(ts->piece_priority);
+    ts->piece_priority = NULL;
+}
+
+// Writes one complete piece into the files it covers.
 int file_writer_write_piece(TorrentState *ts,
                             int piece_index,
                             unsigned char *data,
@@ -13,29 +393,177 @@ int file_writer_write_piece(TorrentState *ts,
         return -1;
     }
 
-    if (!ts->output_file) {
-        fprintf(stderr, "[FILE] Output file not open.\n");
+    FileWriter *w = ts->writer;
+    if (!w) {
+        fprintf(stderr, "[FILE] Output files not open.\n");
         return -1;
     }
 
-    long offset = (long) piece_index * ts->piece_length;
+    int first = w->first_span[piece_index];
+    int n = w->first_span[piece_index + 1] - first;
 
-    if (fseek(ts->output_file, offset, SEEK_SET) != 0) {
-        perror("[FILE] fseek failed");
-        return -1;
+    IoOp stack_ops[SPANS_ON_STACK];
+    int stack_slots[SPANS_ON_STACK];
+    IoOp *ops = stack_ops;
+    int *slots = stack_slots;
+    if (n > SPANS_ON_STACK) {
+        ops = malloc(sizeof(IoOp) * n);
+        slots = malloc(sizeof(int) * n);
+        if (!ops || !slots) {
+            free(ops);
+            free(slots);
+            return -1;
+        }
     }
 
-    size_t written = fwrite(data, 1, length, ts->output_file);
+    // one write per file; the piece is contiguous, so each is a single
+    // positioned write of the span's part of the buffer
+    int rc = 0;
+    int opened = 0;
+    int pos = 0;
+    for (int i = 0; i < n; i++) {
+        const FileSpan *sp = &w->spans[first + i];
+        int at = pos;
+        pos += sp->length;
 
-    if (written != (size_t)length) {
-        fprintf(stderr, "[FILE] fwrite wrote %zu/%d bytes\n", written, length);
-        return -1;
+        // the part of a boundary piece that belongs to a skipped file
+        if (w->priority[sp->file] == FILE_PRIO_SKIP)
+            continue;
+
+        int fd = acquire_fd(w, sp->file, &slots[opened]);
+        if (fd < 0) {
+            rc = -1;
+            break;
+        }
+
+        IoOp *op = &ops[opened++];
+        op->kind = IO_OP_WRITE;
+        op->fd = fd;
+        op->buf = data + at;
+        op->len = sp->length;
+        op->offset = sp->file_offset;
+        op->result = 0;
+    }
+
+    if (rc == 0 && pos != length) {
+        fprintf(stderr, "[FILE] piece %d is %d bytes, its files hold %d\n",
+                piece_index, length, pos);
+        rc = -1;
+    }
+
+    if (rc == 0 && io_backend_submit(ops, opened) != opened) {
+        fprintf(stderr, "[FILE] write of piece %d failed\n", piece_index);
+        rc = -1;
     }
 
-    fflush(ts->output_file);
+    for (int i = 0; i < opened; i++)
+        release_fd(w, slots[i], ops[i].fd);
 
-    printf("[FILE] Wrote piece %d (%d bytes) at offset %ld\n",
-           piece_index, length, offset);
+    if (ops != stack_ops) {
+        free(ops);
+        free(slots);
+    }
+
+    if (rc != 0)
+        return -1;
+
+    __atomic_fetch_add(&w->piece_writes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->span_writes, opened, __ATOMIC_RELAXED);
+
+    printf("[FILE] Wrote piece %d (%d bytes) to %d file%s\n",
+           piece_index, length, opened, opened == 1 ? "" : "s");
 
     return 0;
 }
+
+int file_writer_read(TorrentState *ts, int index, int begin, unsigned char *out, int len) {
+    FileWriter *w = ts->writer;
+    if (!w || index < 0 || index >= ts->total_pieces)
+        return -1;
+
+    int pos = 0;
+    for (int i = w->first_span[index]; i < w->first_span[index + 1] && len > 0; i++) {
+        const FileSpan *sp = &w->spans[i];
+        int span_end = pos + sp->length;
+
+        if (begin < span_end) {
+            int skip = begin - pos;
+            int take = sp->length - skip;
+            if (take > len)
+                take = len;
+            if (w->priority[sp->file] == FILE_PRIO_SKIP)
+                return -1;
+
+            int slot;
+            int fd = acquire_fd(w, sp->file, &slot);
+            if (fd < 0)
+                return -1;
+
+            int done = 0;
+            while (done < take) {
+                ssize_t r = pread(fd, out + done, take - done,
+                                  sp->file_offset + skip + done);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    break;
+                done += r;
+            }
+            release_fd(w, slot, fd);
+
+            if (done < take)
+                return -1;
+
+            out += take;
+            begin += take;
+            len -= take;
+        }
+        pos = span_end;
+    }
+
+    return len == 0 ? 0 : -1;
+}
+
+int file_writer_block_fd(TorrentState *ts, int index, int begin, int len, off_t *offset) {
+    FileWriter *w = ts->writer;
+    if (!w || w->num_files > STORAGE_MAX_OPEN_FILES ||
+        index < 0 || index >= ts->total_pieces)
+        return -1;
+
+    int pos = 0;
+    for (int i = w->first_span[index]; i < w->first_span[index + 1]; i++) {
+        const FileSpan *sp = &w->spans[i];
+        if (begin < pos + sp->length) {
+            if (begin + len > pos + sp->length ||
+                w->priority[sp->file] == FILE_PRIO_SKIP)
+                return -1;
+
+            // with a slot for every file nothing is ever evicted
+            int slot;
+            int fd = acquire_fd(w, sp->file, &slot);
+            if (fd < 0)
+                return -1;
+            release_fd(w, slot, fd);
+
+            *offset = sp->file_offset + (begin - pos);
+            return fd;
+        }
+        pos += sp->length;
+    }
+    return -1;
+}
+
+void file_writer_print_stats(TorrentState *ts) {
+    FileWriter *w = ts->writer;
+    if (!w)
+        return;
+
+    pthread_mutex_lock(&w->lock);
+    printf("[FILE] %d file%s, %ld piece writes in %ld file writes, "
+           "%ld opens, %ld closed to make room (cache %d)\n",
+           w->num_files, w->num_files == 1 ? "" : "s",
+           __atomic_load_n(&w->piece_writes, __ATOMIC_RELAXED),
+           __atomic_load_n(&w->span_writes, __ATOMIC_RELAXED),
+           w->opens, w->evictions, STORAGE_MAX_OPEN_FILES);
+    pthread_mutex_unlock(&w->lock);
+}
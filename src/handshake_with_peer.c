@@ -12,6 +12,8 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include "torrent_parser.h"
+#include "receive_message.h"
+#include "peer_output.h"
 
 
 #define PSTR_LEN 19 
@@ -226,3 +228,39 @@ int recv_handshake(int fd, TorrentState *ts) {
     return 0; // success
 }
 
+
+int peer_read_handshake(Peer *peer, const unsigned char *info_hash) {
+    while (peer->hs_got < HANDSHAKE_LEN) {
+        ssize_t n = recv(peer->socket_fd, peer->hs_buf + peer->hs_got,
+                         HANDSHAKE_LEN - peer->hs_got, 0);
+        if (n == 0) return WIRE_ERROR;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return WIRE_AGAIN;
+            return WIRE_ERROR;
+        }
+        peer->hs_got += n;
+    }
+
+    const unsigned char *hs = peer->hs_buf;
+    if (hs[0] != PSTR_LEN ||
+        memcmp(hs + 1, PROTOCOL_STRING, PSTR_LEN) != 0 ||
+        memcmp(hs + 28, info_hash, 20) != 0) {
+        return WIRE_ERROR;
+    }
+
+    memcpy(peer->peer_id, hs + 48, 20);
+    return WIRE_DONE;
+}
+
+int peer_send_handshake(Peer *peer, const unsigned char *info_hash,
+                        const unsigned char *client_id) {
+    unsigned char hs[HANDSHAKE_LEN] = {0};
+    hs[0] = PSTR_LEN;
+    memcpy(hs + 1, PROTOCOL_STRING, PSTR_LEN);
+    memcpy(hs + 28, info_hash, 20);
+    memcpy(hs + 48, client_id, 20);
+
+    // queued like any frame, so a short write is not fatal
+    return peer_queue(peer, hs, HANDSHAKE_LEN);
+}
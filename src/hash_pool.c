@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include "hash_pool.h"
+#include "store_pieces.h"
+#include "verify_pieces.h"
+#include "init_torrent_state.h"
+#include "sha1.h"
+
+static int hash_threads = HASH_THREADS_DEFAULT;
+
+void set_hash_threads(int n) {
+    if (n < 0)
+        return;
+    hash_threads = n < HASH_THREADS_MAX ? n : HASH_THREADS_MAX;
+}
+
+int get_hash_threads(void) {
+    return hash_threads;
+}
+
+// Hash the pieces together and write the good ones, timing both
+static void check_pieces(HashPool *hp, const int *pieces, int n, bool *ok,
+                         double *hash_s, double *write_s) {
+    TorrentState *ts = hp->ts;
+
+    double t0 = get_time_seconds();
+    verify_pieces(ts, pieces, n, ok);
+    double t1 = get_time_seconds();
+
+    for (int i = 0; i < n; i++) {
+        if (ok[i])
+            write_verified_piece(ts, pieces[i]);
+    }
+
+    *hash_s = t1 - t0;
+    *write_s = get_time_seconds() - t1;
+}
+
+// Called with the lock held
+static void post_result(HashPool *hp, int piece, bool ok) {
+    int slot = (hp->result_head + hp->result_count) % hp->capacity;
+
+    hp->results[slot].piece = piece;
+    hp->results[slot].ok = ok;
+    hp->result_count++;
+}
+
+// Called with the lock held, after the pieces were checked: count them
+// and hand over the verdicts
+static void finish_batch(HashPool *hp, const int *pieces, int n, const bool *ok,
+                         double hash_s, double write_s) {
+    hp->batches++;
+    hp->hash_time += hash_s;
+    hp->write_time += write_s;
+
+    for (int i = 0; i < n; i++) {
+        hp->hashed++;
+        if (!ok[i])
+            hp->failed++;
+        hp->bytes += hp->ts->pieces[pieces[i]].length;
+        post_result(hp, pieces[i], ok[i]);
+    }
+
+    uint64_t one = 1;
+    if (write(hp->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+// Each thread takes as many queued pieces as the SHA1 backend hashes at
+// once
+static void *hash_thread_func(void *arg) {
+    HashPool *hp = arg;
+    int batch = sha1_lanes();
+
+    pthread_mutex_lock(&hp->lock);
+    while (1) {
+        while (hp->job_count == 0 && !hp->stopping)
+            pthread_cond_wait(&hp->queued, &hp->lock);
+        if (hp->stopping)
+            break;
+
+        int pieces[SHA1_MAX_LANES];
+        bool ok[SHA1_MAX_LANES];
+        int n = 0;
+        double now = get_time_seconds();
+
+        while (n < batch && hp->job_count > 0) {
+            pieces[n++] = hp->jobs[hp->job_head];
+            hp->wait_time += now - hp->queued_at[hp->job_head];
+            hp->job_head = (hp->job_head + 1) % hp->capacity;
+            hp->job_count--;
+        }
+        hp->busy += n;
+        pthread_mutex_unlock(&hp->lock);
+
+        double hash_s, write_s;
+        check_pieces(hp, pieces, n, ok, &hash_s, &write_s);
+
+        pthread_mutex_lock(&hp->lock);
+        hp->busy -= n;
+        finish_batch(hp, pieces, n, ok, hash_s, write_s);
+    }
+    pthread_mutex_unlock(&hp->lock);
+    return NULL;
+}
+
+int hash_pool_init(HashPool *hp, TorrentState *ts) {
+    memset(hp, 0, sizeof(*hp));
+    hp->ts = ts;
+    hp->capacity = ts->total_pieces > 0 ? ts->total_pieces : 1;
+
+    hp->jobs = malloc(hp->capacity * sizeof(int));
+    hp->queued_at = malloc(hp->capacity * sizeof(double));
+    hp->results = malloc(hp->capacity * sizeof(HashResult));
+    if (!hp->jobs || !hp->queued_at || !hp->results) {
+        free(hp->jobs);
+        free(hp->queued_at);
+        free(hp->results);
+        return -1;
+    }
+
+    hp->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hp->notify_fd < 0) {
+        perror("eventfd");
+        free(hp->jobs);
+        free(hp->queued_at);
+        free(hp->results);
+        return -1;
+    }
+
+    pthread_mutex_init(&hp->lock, NULL);
+    pthread_cond_init(&hp->queued, NULL);
+
+    for (int i = 0; i < hash_threads; i++) {
+        if (pthread_create(&hp->threads[i], NULL, hash_thread_func, hp) != 0) {
+            fprintf(stderr, "[HASH] Could only start %d hashing threads\n", i);
+            break;
+        }
+        hp->thread_count++;
+    }
+
+    sha1_print_stats();
+    printf("[HASH] Verifying pieces on %d thread%s, up to %d at a time\n",
+           hp->thread_count, hp->thread_count == 1 ? "" : "s",
+           hp->thread_count ? sha1_lanes() : 1);
+    return 0;
+}
+
+void hash_pool_destroy(HashPool *hp) {
+    pthread_mutex_lock(&hp->lock);
+    hp->stopping = true;
+    pthread_cond_broadcast(&hp->queued);
+    pthread_mutex_unlock(&hp->lock);
+
+    for (int i = 0; i < hp->thread_count; i++)
+        pthread_join(hp->threads[i], NULL);
+    hp->thread_count = 0;
+
+    if (hp->notify_fd >= 0)
+        close(hp->notify_fd);
+    hp->notify_fd = -1;
+
+    free(hp->jobs);
+    free(hp->queued_at);
+    free(hp->results);
+    hp->jobs = NULL;
+    hp->queued_at = NULL;
+    hp->results = NULL;
+    pthread_cond_destroy(&hp->queued);
+    pthread_mutex_destroy(&hp->lock);
+}
+
+void hash_pool_submit(HashPool *hp, int piece) {
+    // no threads: hash right here, only the verdict is deferred
+    if (hp->thread_count == 0) {
+        double hash_s, write_s;
+        bool ok;
+        check_pieces(hp, &piece, 1, &ok, &hash_s, &write_s);
+
+        pthread_mutex_lock(&hp->lock);
+        finish_batch(hp, &piece, 1, &ok, hash_s, write_s);
+        pthread_mutex_unlock(&hp->lock);
+        return;
+    }
+
+    // the hashing thread sees the whole piece: the lock orders the
+    // stores of its last blocks before the hash
+    pthread_mutex_lock(&hp->lock);
+    int slot = (hp->job_head + hp->job_count) % hp->capacity;
+    hp->jobs[slot] = piece;
+    hp->queued_at[slot] = get_time_seconds();
+    hp->job_count++;
+    if (hp->job_count + hp->busy > hp->depth_max)
+        hp->depth_max = hp->job_count + hp->busy;
+    pthread_cond_signal(&hp->queued);
+    pthread_mutex_unlock(&hp->lock);
+}
+
+int hash_pool_collect(HashPool *hp, HashResult *out, int max) {
+    uint64_t count;
+    while (read(hp->notify_fd, &count, sizeof(count)) > 0)
+        ;
+
+    pthread_mutex_lock(&hp->lock);
+    int n = hp->result_count < max ? hp->result_count : max;
+    for (int i = 0; i < n; i++) {
+        out[i] = hp->results[hp->result_head];
+        hp->result_head = (hp->result_head + 1) % hp->capacity;
+    }
+    hp->result_count -= n;
+    bool more = hp->result_count > 0;
+    pthread_mutex_unlock(&hp->lock);
+
+    // more than max waiting: come back for the rest
+    if (more) {
+        uint64_t one = 1;
+        if (write(hp->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("eventfd write");
+    }
+    return n;
+}
+
+int hash_pool_depth(HashPool *hp) {
+    pthread_mutex_lock(&hp->lock);
+    int n = hp->job_count + hp->busy;
+    pthread_mutex_unlock(&hp->lock);
+    return n;
+}
+
+void hash_pool_print_stats(HashPool *hp) {
+    pthread_mutex_lock(&hp->lock);
+    double mib = hp->bytes / 1048576.0;
+
+    printf("[HASH] %ld pieces on %d thread%s (%ld failed), %.1f MiB at %.1f MiB/s "
+           "per thread, writes %.1f ms/piece\n",
+           hp->hashed, hp->thread_count, hp->thread_count == 1 ? "" : "s",
+           hp->failed, mib, hp->hash_time > 0 ? mib / hp->hash_time : 0.0,
+           hp->hashed ? hp->write_time * 1000 / hp->hashed : 0.0);
+    printf("[HASH] %ld batches of %.1f pieces on average (%s)\n", hp->batches,
+           hp->batches ? (double)hp->hashed / hp->batches : 0.0, sha1_backend_name());
+    printf("[HASH] Queue: %d now, %d at most, %.2f ms average wait\n",
+           hp->job_count + hp->busy, hp->depth_max,
+           hp->hashed && hp->thread_count ? hp->wait_time * 1000 / hp->hashed : 0.0);
+    pthread_mutex_unlock(&hp->lock);
+}
@@ -1,5 +1,9 @@
 #include "init_torrent_state.h"
 #include "store_pieces.h"
+#include "event_loop.h"
+#include "manage_peers.h"
+#include "piece_picker.h"
+#include "file_writer.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -41,27 +45,34 @@ int init_torrent_state(TorrentState *ts, TorrentInfo *ti, int port) {
         ps->requested_block = calloc(blocks, 1);
     }
 
-    // Allocate piece tracking arrays
-    ts->piece_complete = calloc(ts->total_pieces, sizeof(bool));
+    // Allocate piece tracking arrays; my_bitfield is also the record of
+    // which pieces are complete
+    ts->my_bitfield_len = (ts->total_pieces + 7) / 8;
+    ts->my_bitfield = calloc(ts->my_bitfield_len > 0 ? ts->my_bitfield_len : 1, 1);
     ts->piece_bytes_have = calloc(ts->total_pieces, sizeof(int));
     
-    if (!ts->piece_complete || !ts->piece_bytes_have) {
+    if (!ts->my_bitfield || !ts->piece_bytes_have) {
         fprintf(stderr, "[INIT] Failed to allocate piece tracking arrays\n");
         goto error;
     }
     
+    // Output files are opened (and sized) when first written; read
+    // access too, uploads can sendfile() from them. This also decides
+    // which pieces are wanted at all.
+    if (file_writer_open(ts) != 0) {
+        fprintf(stderr, "[INIT] Failed to set up output files for %s\n", ti->name);
+        goto error;
+    }
+
     // Initialize piece storage using store_pieces.c functions
     if (init_piece_storage(ts) != 0) {
         fprintf(stderr, "[INIT] Failed to initialize piece storage\n");
         goto error;
     }
-    
-    // Initialize bitfield
-    ts->my_bitfield_len = (ts->total_pieces + 7) / 8;
-    ts->my_bitfield = calloc(ts->my_bitfield_len, 1);  
-    if (!ts->my_bitfield) {
-        fprintf(stderr, "Failed to allocate my_bitfield\n");
-        return -1;
+
+    if (picker_init(ts) != 0) {
+        fprintf(stderr, "[INIT] Failed to build the piece picker index\n");
+        goto error;
     }
     
     // Initialize peer management
@@ -73,25 +84,14 @@ int init_torrent_state(TorrentState *ts, TorrentInfo *ti, int port) {
         goto error;
     }
     
-    // Open output file
-    ts->output_file = fopen(ti->name, "wb");
-    if (!ts->output_file) {
-        fprintf(stderr, "[INIT] Failed to open output file: %s\n", ti->name);
-        perror("fopen");
-        goto error;
-    }
-    
-    // Pre-allocate file space
-    if (fseek(ts->output_file, ti->file_length - 1, SEEK_SET) == 0) {
-        fputc(0, ts->output_file);
-        fseek(ts->output_file, 0, SEEK_SET);
-    }
-    
     printf("[INIT] TorrentState initialized:\n");
     printf("  - Total pieces: %d\n", ts->total_pieces);
     printf("  - Piece length: %d bytes\n", ts->piece_length);
     printf("  - File length: %ld bytes\n", ti->file_length);
-    printf("  - Output file: %s\n", ti->name);
+    if (ti->num_files == 1)
+        printf("  - Output file: %s\n", ti->files[0].path);
+    else
+        printf("  - Output files: %d under %s/\n", ti->num_files, ti->name);
     
     return 0;
 
@@ -103,79 +103,65 @@ error:
 void cleanup_torrent_state(TorrentState *ts) {
     if (!ts) return;
     
+    // Free peers first: a peer may still hold a claim on a piece buffer
+    if (ts->peers) {
+        for (int i = 0; i < ts->peer_count; i++) {
+            peer_free(ts->peers[i]);
+        }
+        free(ts->peers);
+        ts->peers = NULL;
+        ts->peer_count = 0;
+    }
+
     // Free piece storage
     free_piece_storage(ts);
     
     // Free piece tracking arrays
-    if (ts->piece_complete) {
-        free(ts->piece_complete);
-        ts->piece_complete = NULL;
-    }
-
-    
     if (ts->piece_bytes_have) {
         free(ts->piece_bytes_have);
         ts->piece_bytes_have = NULL;
     }
+
+    picker_free(ts);
     
     if (ts->my_bitfield) {
         free(ts->my_bitfield);
         ts->my_bitfield = NULL;
     }
     
-    // Free peers
-    if (ts->peers) {
-        for (int i = 0; i < ts->peer_count; i++) {
-            if (ts->peers[i]) {
-                if (ts->peers[i]->socket_fd >= 0) {
-                    close(ts->peers[i]->socket_fd);
-                }
-                if (ts->peers[i]->bitfield) {
-                    free(ts->peers[i]->bitfield);
-                }
-                free(ts->peers[i]);
-            }
-        }
-        free(ts->peers);
-        ts->peers = NULL;
-    }
     if (ts->listen_fd >= 0) {
         close(ts->listen_fd);
         ts->listen_fd = -1;
     }
 
-    // Close output file
-    if (ts->output_file) {
-        fclose(ts->output_file);
-        ts->output_file = NULL;
+    if (ts->loop) {
+        event_loop_destroy(ts->loop);
+        ts->loop = NULL;
     }
+
+    // Close output files
+    file_writer_close(ts);
     
     memset(ts, 0, sizeof(TorrentState));
 }
 
+bool piece_wanted(TorrentState *ts, int index) {
+    return !ts->piece_priority || ts->piece_priority[index] != FILE_PRIO_SKIP;
+}
+
 bool is_download_complete(TorrentState *ts) {
-    if (!ts || !ts->piece_complete) {
+    if (!ts || !ts->my_bitfield) {
         return false;
     }
-    
-    for (int i = 0; i < ts->total_pieces; i++) {
-        if (!ts->piece_complete[i]) {
-            return false;
-        }
-    }
-    return true;
+
+    return __atomic_load_n(&ts->pieces_complete, __ATOMIC_ACQUIRE) == ts->pieces_wanted;
 }
 
 float get_download_progress(TorrentState *ts) {
-    if (!ts || !ts->piece_complete || ts->total_pieces == 0) {
+    if (!ts || !ts->my_bitfield || ts->pieces_wanted == 0) {
         return 0.0f;
     }
-    
-    int complete_count = 0;
-    for (int i = 0; i < ts->total_pieces; i++) {
-        if (ts->piece_complete[i]) {
-            complete_count++;
-        }
-    }
-    return (float)complete_count / ts->total_pieces * 100.0f;
-}
\ No newline at end of file
+
+    int complete_count = __atomic_load_n(&ts->pieces_complete, __ATOMIC_RELAXED);
+    return (float)complete_count / ts->pieces_wanted * 100.0f;
+}
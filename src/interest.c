@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "interest.h"
+#include "bitfield.h"
+#include "outgoingMessages.h"
+#include "init_torrent_state.h"
+#include "sendRequest.h"
+
+static long recounts;
+static long interested_sent;
+static long not_interested_sent;
+static long haves_received;
+
+static bool map_has(const uint8_t *done, uint32_t index) {
+    return done[index / 8] & (1 << (7 - (index % 8)));
+}
+
+uint8_t *interest_map_new(TorrentState *ts) {
+    int len = ts->my_bitfield_len;
+    uint8_t *done = calloc(len > 0 ? len : 1, 1);
+    if (!done)
+        return NULL;
+
+    for (int i = 0; i < ts->total_pieces; i++) {
+        if (is_piece_complete(ts, i) || !piece_wanted(ts, i))
+            done[i / 8] |= 1 << (7 - (i % 8));
+    }
+
+    // bits a peer may set past the last piece are nothing we want
+    for (int i = ts->total_pieces; i < len * 8; i++)
+        done[i / 8] |= 1 << (7 - (i % 8));
+
+    return done;
+}
+
+bool interest_map_set(uint8_t *done, uint32_t index) {
+    if (map_has(done, index))
+        return false;
+
+    done[index / 8] |= 1 << (7 - (index % 8));
+    return true;
+}
+
+// Say so when the count crosses zero
+static void update(Peer *p) {
+    bool want = p->wanted_pieces > 0;
+
+    if (want == p->am_interested || p->state != PEER_ACTIVE || p->socket_fd < 0)
+        return;
+
+    if (want) {
+        send_interested(p);
+        __atomic_fetch_add(&interested_sent, 1, __ATOMIC_RELAXED);
+    } else {
+        send_not_interested(p);
+        __atomic_fetch_add(&not_interested_sent, 1, __ATOMIC_RELAXED);
+    }
+    p->am_interested = want;
+
+    printf("[INTEREST] %s %s:%d (%d pieces to get)\n",
+           want ? "INTERESTED in" : "NOT_INTERESTED in", p->ip, p->port,
+           p->wanted_pieces);
+}
+
+void interest_recount(TorrentState *ts, Peer *p, const uint8_t *done) {
+    int len = p->bitfield_len < ts->my_bitfield_len ? p->bitfield_len : ts->my_bitfield_len;
+
+    p->wanted_pieces = p->bitfield ? (int)bitfield_andnot_count(p->bitfield, done, len) : 0;
+    __atomic_fetch_add(&recounts, 1, __ATOMIC_RELAXED);
+    update(p);
+}
+
+void interest_have(Peer *p, uint32_t index, const uint8_t *done) {
+    if (map_has(done, index))
+        return;
+
+    p->wanted_pieces++;
+    update(p);
+}
+
+void interest_piece_done(Peer *p, uint32_t index) {
+    if (!peer_has_piece(p, index))
+        return;
+
+    p->wanted_pieces--;
+    update(p);
+}
+
+void interest_have_received(void) {
+    __atomic_fetch_add(&haves_received, 1, __ATOMIC_RELAXED);
+}
+
+void interest_print_stats(void) {
+    printf("[INTEREST] %ld HAVEs received, %ld full recounts (%s kernel), "
+           "%ld INTERESTED and %ld NOT_INTERESTED sent\n",
+           __atomic_load_n(&haves_received, __ATOMIC_RELAXED),
+           __atomic_load_n(&recounts, __ATOMIC_RELAXED), bitfield_kernel_name(),
+           __atomic_load_n(&interested_sent, __ATOMIC_RELAXED),
+           __atomic_load_n(&not_interested_sent, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,428 @@
+// io_backend.c
+// Batched disk/socket I/O. io_uring is driven through the raw syscalls
+// (no liburing dependency); the POSIX path is the fallback.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "io_backend.h"
+
+#define URING_ENTRIES 64
+#define URING_ARENA_SIZE (256 * 1024)   // registered staging buffer for sends
+
+typedef struct {
+    int fd;
+    unsigned entries;
+
+    // submission ring
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // completion ring
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+
+    // small sends are copied here and issued as WRITE_FIXED
+    unsigned char *arena;
+    bool arena_registered;
+
+    bool broken;                // ops may still be in flight, do not reuse
+} Uring;
+
+static IoBackendKind backend = IO_BACKEND_POSIX;
+static __thread Uring *thread_ring = NULL;
+
+static long stat_syscalls = 0;
+static long stat_bytes = 0;
+
+static void count_io(long syscalls, long bytes) {
+    __atomic_fetch_add(&stat_syscalls, syscalls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stat_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// ============================================================================
+// io_uring plumbing
+// ============================================================================
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                           unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_uring_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static void uring_free(Uring *r) {
+    if (!r) return;
+
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr) munmap(r->sq_ptr, r->sq_size);
+    if (r->fd >= 0) close(r->fd);
+
+    free(r->arena);
+    free(r);
+}
+
+static void *map_ring(int fd, size_t size, off_t offset) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static Uring *uring_create(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    Uring *r = calloc(1, sizeof(Uring));
+    if (!r) return NULL;
+
+    r->fd = sys_uring_setup(URING_ENTRIES, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->entries = p.sq_entries;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = map_ring(r->fd, r->sq_size, IORING_OFF_SQ_RING);
+    if (!r->sq_ptr) goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = map_ring(r->fd, r->cq_size, IORING_OFF_CQ_RING);
+        if (!r->cq_ptr) goto fail;
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = map_ring(r->fd, r->sqes_size, IORING_OFF_SQES);
+    if (!r->sqes) goto fail;
+
+    unsigned char *sq = r->sq_ptr;
+    r->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    unsigned char *cq = r->cq_ptr;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes    = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // registered buffers are optional: without them sends use IORING_OP_SEND
+    r->arena = aligned_alloc(4096, URING_ARENA_SIZE);
+    if (r->arena) {
+        struct iovec iov = { r->arena, URING_ARENA_SIZE };
+        if (sys_uring_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0)
+            r->arena_registered = true;
+    }
+
+    return r;
+
+fail:
+    uring_free(r);
+    return NULL;
+}
+
+// prev[i] = the op before i on the same fd, or -1. Ops on an fd finish
+// in order, so i may go once prev[i] has finished.
+static int link_same_fd(IoOp *ops, int n, int *prev) {
+    unsigned size = 16;
+    while (size < 2u * (unsigned)n)
+        size *= 2;
+
+    int *last = malloc(size * sizeof(int));    // open addressing on fd
+    if (!last) return -1;
+    for (unsigned k = 0; k < size; k++)
+        last[k] = -1;
+
+    for (int i = 0; i < n; i++) {
+        unsigned k = (unsigned)ops[i].fd * 2654435761u & (size - 1);
+        while (last[k] >= 0 && ops[last[k]].fd != ops[i].fd)
+            k = (k + 1) & (size - 1);
+        prev[i] = last[k];
+        last[k] = i;
+    }
+
+    free(last);
+    return 0;
+}
+
+static int uring_submit(Uring *r, IoOp *ops, int n) {
+    size_t *done = calloc(n, sizeof(size_t));
+    char *state = calloc(n, 1);     // 0 = pending, 1 = in flight, 2 = finished
+    int *prev = malloc(n * sizeof(int));
+    if (!done || !state || !prev || link_same_fd(ops, n, prev) < 0) {
+        free(done);
+        free(state);
+        free(prev);
+        return -1;
+    }
+
+    int finished = 0;
+    int rc = 0;
+
+    while (finished < n && rc == 0) {
+        unsigned tail = *r->sq_tail;
+        unsigned queued = 0;
+        size_t arena_used = 0;
+
+        // one op per fd per round keeps per-socket ordering intact
+        for (int i = 0; i < n && queued < r->entries; i++) {
+            if (state[i] != 0 || (prev[i] >= 0 && state[prev[i]] != 2))
+                continue;
+
+            unsigned idx = tail & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+
+            unsigned char *buf = (unsigned char *)ops[i].buf + done[i];
+            size_t len = ops[i].len - done[i];
+
+            switch (ops[i].kind) {
+                case IO_OP_WRITE:
+                    sqe->opcode = IORING_OP_WRITE;
+                    sqe->off = ops[i].offset + done[i];
+                    break;
+
+                case IO_OP_SEND:
+                    if (r->arena_registered &&
+                        len <= URING_ARENA_SIZE - arena_used) {
+                        memcpy(r->arena + arena_used, buf, len);
+                        buf = r->arena + arena_used;
+                        arena_used += len;
+                        sqe->opcode = IORING_OP_WRITE_FIXED;
+                        sqe->buf_index = 0;
+                        sqe->off = (__u64)-1;
+                    } else {
+                        sqe->opcode = IORING_OP_SEND;
+                        sqe->msg_flags = MSG_NOSIGNAL;
+                    }
+                    break;
+            }
+
+            sqe->fd = ops[i].fd;
+            sqe->addr = (unsigned long)buf;
+            sqe->len = (unsigned)len;
+            sqe->user_data = (__u64)i;
+
+            r->sq_array[idx] = idx;
+            tail++;
+            queued++;
+            state[i] = 1;
+        }
+
+        if (queued == 0)
+            break;
+
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+        int ret;
+        do {
+            ret = sys_uring_enter(r->fd, queued, queued, IORING_ENTER_GETEVENTS);
+        } while (ret < 0 && errno == EINTR);
+        count_io(1, 0);
+
+        // SQEs the kernel did not take point at the caller's buffers:
+        // take them back rather than leave them for the next batch, and
+        // only wait for the ones that went in
+        if (ret < 0 || (unsigned)ret < queued) {
+            if (ret < 0)
+                perror("io_uring_enter");
+            __atomic_store_n(r->sq_tail, __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE),
+                             __ATOMIC_RELEASE);
+            queued = ret < 0 ? 0 : (unsigned)ret;
+            rc = -1;
+        }
+
+        unsigned reaped = 0;
+        while (reaped < queued) {
+            unsigned head = *r->cq_head;
+            unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+            if (head == ctail) {
+                ret = sys_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS);
+                count_io(1, 0);
+                if (ret < 0 && errno != EINTR) {
+                    // completions still owed would be reaped against the
+                    // next batch: the ring is dropped instead
+                    perror("io_uring_enter");
+                    r->broken = true;
+                    rc = -1;
+                    break;
+                }
+                continue;
+            }
+
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            int i = (int)cqe->user_data;
+            int res = cqe->res;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            reaped++;
+
+            if (res < 0) {
+                // bytes already moved count even if the retry failed
+                ops[i].result = done[i] > 0 ? (ssize_t)done[i] : res;
+                state[i] = 2;
+                finished++;
+                continue;
+            }
+
+            done[i] += res;
+            count_io(0, res);
+
+            if (res == 0 || done[i] == ops[i].len) {
+                ops[i].result = (ssize_t)done[i];
+                state[i] = 2;
+                finished++;
+            } else {
+                state[i] = 0;   // short write: queue the remainder
+            }
+        }
+    }
+
+    free(done);
+    free(state);
+    free(prev);
+    return rc;
+}
+
+// ============================================================================
+// POSIX fallback
+// ============================================================================
+
+static void posix_submit(IoOp *ops, int n) {
+    for (int i = 0; i < n; i++) {
+        IoOp *op = &ops[i];
+        unsigned char *buf = op->buf;
+        size_t done = 0;
+        ssize_t r = 0;
+
+        while (done < op->len) {
+            if (op->kind == IO_OP_WRITE)
+                r = pwrite(op->fd, buf + done, op->len - done, op->offset + done);
+            else
+                r = send(op->fd, buf + done, op->len - done, MSG_NOSIGNAL);
+            count_io(1, r > 0 ? r : 0);
+
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) break;
+            done += r;
+        }
+
+        op->result = (r < 0 && done == 0) ? -errno : (ssize_t)done;
+    }
+}
+
+// ============================================================================
+// Public API
+// ============================================================================
+
+IoBackendKind io_backend_init(IoBackendKind want) {
+    if (want == IO_BACKEND_URING) {
+        if (!thread_ring)
+            thread_ring = uring_create();
+
+        if (thread_ring) {
+            backend = IO_BACKEND_URING;
+            printf("[IO] Using io_uring backend (%u entries%s)\n",
+                   thread_ring->entries,
+                   thread_ring->arena_registered ? ", registered buffers" : "");
+            return backend;
+        }
+
+        printf("[IO] io_uring unavailable (%s), using POSIX I/O\n", strerror(errno));
+    }
+
+    backend = IO_BACKEND_POSIX;
+    return backend;
+}
+
+void io_backend_thread_exit(void) {
+    uring_free(thread_ring);
+    thread_ring = NULL;
+}
+
+IoBackendKind io_backend_kind(void) {
+    return backend;
+}
+
+const char *io_backend_name(void) {
+    return backend == IO_BACKEND_URING ? "io_uring" : "posix";
+}
+
+int io_backend_submit(IoOp *ops, int n) {
+    if (!ops || n <= 0) return 0;
+
+    for (int i = 0; i < n; i++)
+        ops[i].result = 0;
+
+    bool used_uring = false;
+    if (backend == IO_BACKEND_URING) {
+        if (!thread_ring)
+            thread_ring = uring_create();
+        if (thread_ring) {
+            if (uring_submit(thread_ring, ops, n) < 0) {
+                if (thread_ring->broken)
+                    io_backend_thread_exit();   // a fresh ring next time
+                return -1;
+            }
+            used_uring = true;
+        }
+    }
+
+    if (!used_uring)
+        posix_submit(ops, n);
+
+    int ok = 0;
+    for (int i = 0; i < n; i++) {
+        if (ops[i].result == (ssize_t)ops[i].len)
+            ok++;
+    }
+    return ok;
+}
+
+int io_backend_pwrite(int fd, const void *buf, size_t len, off_t offset) {
+    IoOp op = {
+        .kind = IO_OP_WRITE,
+        .fd = fd,
+        .buf = (void *)buf,
+        .len = len,
+        .offset = offset,
+    };
+    return io_backend_submit(&op, 1) == 1 ? 0 : -1;
+}
+
+void io_backend_stats(long *syscalls, long *bytes) {
+    if (syscalls) *syscalls = __atomic_load_n(&stat_syscalls, __ATOMIC_RELAXED);
+    if (bytes) *bytes = __atomic_load_n(&stat_bytes, __ATOMIC_RELAXED);
+}
@@ -13,6 +13,15 @@
 #include "global_state.h"
 #include "upload_manager.h"
 #include "multithreaded_download_coordinator.h"
+#include "io_backend.h"
+#include "outgoingMessages.h"
+#include "connection_manager.h"
+#include "request_pipeline.h"
+#include "piece_picker.h"
+#include "file_writer.h"
+#include "hash_pool.h"
+#include "sha1.h"
+#include "sendRequest.h"
 
 
 TorrentState *g_torrent_state = NULL;
@@ -38,6 +47,13 @@ void print_torrent_info(TorrentInfo *ti) {
            ti->piece_length / 1024.0);
     printf("Number of pieces: %d\n", ti->num_pieces);
 
+    // the indexes --only and --file-priority refer to
+    if (ti->num_files > 1) {
+        printf("Files:\n");
+        for (int i = 0; i < ti->num_files; i++)
+            printf("  [%d] %s (%ld bytes)\n", i, ti->files[i].path, ti->files[i].length);
+    }
+
     printf("\nInfo hash: ");
     for (int i = 0; i < 20; i++) printf("%02x", ti->info_hash[i]);
     printf("\n\n");
@@ -212,12 +228,39 @@ void run_peer_mode(const char *torrent_file, int local_port, const char *peer_ip
 int main(int argc, char **argv) {
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    // sendfile() has no MSG_NOSIGNAL; a dead peer must not kill us
+    signal(SIGPIPE, SIG_IGN);
 
     // Parse command line arguments
     if (argc < 2) {
         printf("Usage:\n");
         printf("  Normal mode:  %s <port>\n", argv[0]);
         printf("  Peer mode:    %s <port> --peer <peer_ip> <peer_port>\n", argv[0]);
+        printf("\nOptions:\n");
+        printf("  --io-uring    Batch socket and disk I/O through io_uring\n");
+        printf("  --sendfile    Serve uploads from disk with sendfile(), free piece RAM\n");
+        printf("  --zerocopy    Serve uploads from RAM with MSG_ZEROCOPY\n");
+        printf("  --half-open N Dial at most N peers in parallel (default %d)\n",
+               CONN_HALF_OPEN_DEFAULT);
+        printf("  --pipeline-min N, --pipeline-max N\n");
+        printf("                Bounds of the per-peer request window in blocks\n");
+        printf("                (default %d..%d)\n", PIPELINE_MIN_DEPTH, PIPELINE_MAX_DEPTH);
+        printf("  --stream      Download in order for reading while it runs\n");
+        printf("  --stream-window N, --stream-deadline SEC\n");
+        printf("                Pieces with deadlines ahead of the read position and\n");
+        printf("                seconds between their deadlines (default %d, %.1f)\n",
+               STREAM_WINDOW_DEFAULT, STREAM_PIECE_TIME);
+        printf("  --no-endgame  Never request a block from more than one peer\n");
+        printf("  --hash-threads N\n");
+        printf("                Threads verifying pieces, 0 = on the network thread\n");
+        printf("                (default %d)\n", HASH_THREADS_DEFAULT);
+        printf("  --hash-backend NAME\n");
+        printf("                SHA1 backend: sha-ni, avx2, sse2 or openssl\n");
+        printf("                (default: the fastest on this CPU)\n");
+        printf("  --only LIST   Download only these files, e.g. 0,3-5\n");
+        printf("  --file-priority LIST\n");
+        printf("                Per-file priority, e.g. 0-2=high,7=skip\n");
+        printf("                (levels skip, low, normal, high)\n");
         printf("\nExamples:\n");
         printf("  %s 6881\n", argv[0]);
         printf("  %s 6882 --peer 127.0.0.1 6881\n", argv[0]);
@@ -229,6 +272,36 @@ int main(int argc, char **argv) {
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--multithread") == 0) {
             use_multithread = true;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            io_backend_init(IO_BACKEND_URING);
+        } else if (strcmp(argv[i], "--sendfile") == 0) {
+            set_upload_mode(UPLOAD_SENDFILE);
+        } else if (strcmp(argv[i], "--zerocopy") == 0) {
+            set_upload_mode(UPLOAD_ZEROCOPY);
+        } else if (strcmp(argv[i], "--half-open") == 0 && i + 1 < argc) {
+            set_half_open_limit(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--pipeline-min") == 0 && i + 1 < argc) {
+            set_pipeline_bounds(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--pipeline-max") == 0 && i + 1 < argc) {
+            set_pipeline_bounds(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            set_stream_mode(-1, 0);
+        } else if (strcmp(argv[i], "--stream-window") == 0 && i + 1 < argc) {
+            set_stream_mode(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--stream-deadline") == 0 && i + 1 < argc) {
+            set_stream_mode(-1, atof(argv[++i]));
+        } else if (strcmp(argv[i], "--no-endgame") == 0) {
+            set_endgame(false);
+        } else if (strcmp(argv[i], "--hash-threads") == 0 && i + 1 < argc) {
+            set_hash_threads(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--hash-backend") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            if (sha1_set_backend(name) < 0)
+                fprintf(stderr, "[SHA1] Backend %s not available, choosing one\n", name);
+        } else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) {
+            set_file_priorities(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--file-priority") == 0 && i + 1 < argc) {
+            set_file_priorities(NULL, argv[++i]);
         }
     }
     // Check for --peer mode
@@ -284,5 +357,6 @@ int main(int argc, char **argv) {
     }
 
     printf("\n Shutting down client.\n");
+    io_backend_thread_exit();
     return 0;
 }
\ No newline at end of file
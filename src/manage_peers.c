@@ -13,10 +13,22 @@
 #include "manage_peers.h"
 #include "outgoingMessages.h"
 #include "global_state.h"
+#include "receive_message.h"
+#include "peer_output.h"
+#include "connection_manager.h"
+#include "init_torrent_state.h"
+#include "request_pipeline.h"
 
 
 
 
+#define PEER_KEEPALIVE_INTERVAL 120.0   // seconds between our keep-alives
+#define PEER_IDLE_TIMEOUT 240.0         // drop a peer silent for this long
+
+static void on_keepalive_timer(void *ctx);
+static void on_idle_timer(void *ctx);
+static void on_conn_deadline(void *ctx);
+
 // Expand peer list if needed
 static void ensure_capacity(TorrentState *ts) {
     if (ts->peer_count < ts->peer_capacity)
@@ -26,24 +38,62 @@ static void ensure_capacity(TorrentState *ts) {
     ts->peers = realloc(ts->peers, ts->peer_capacity * sizeof(Peer *));
 }
 
-// Add a peer to the state
-Peer *add_peer(TorrentState *ts, const char *ip, int port) {
-    ensure_capacity(ts);
-
+// Allocate a peer with default state; it is not in any peer list yet
+Peer *peer_create(const char *ip, int port) {
     Peer *p = malloc(sizeof(Peer));
+    if (!p)
+        return NULL;
     memset(p, 0, sizeof(Peer));
 
-    strcpy(p->ip, ip);
+    snprintf(p->ip, sizeof(p->ip), "%s", ip);
     p->port = port;
     p->am_choking = true;      // We start by choking
     p->socket_fd = -1;
     p->is_choked = true;   
     p->am_interested    = false;
-    p->outstanding_requests = 0;
-    p->max_pipeline = 50;     
+    pipeline_init(p);
     p->state = PEER_DISCONNECTED;
+    p->conn_cand = -1;
+
+    timer_init(&p->keepalive_timer, on_keepalive_timer, p);
+    timer_init(&p->idle_timer, on_idle_timer, p);
+    timer_init(&p->conn_timer, on_conn_deadline, p);
+
+    return p;
+}
+
+// Fold traffic since the last sample into the smoothed download rate
+double peer_sample_rate(Peer *p, double now) {
+    if (p->rate_mark_time <= 0) {
+        p->rate_mark = p->bytes_received;
+        p->rate_mark_time = now;
+        return p->download_rate;
+    }
+
+    double dt = now - p->rate_mark_time;
+    if (dt < 0.05)
+        return p->download_rate;
+
+    double inst = (p->bytes_received - p->rate_mark) / dt;
+    p->download_rate = 0.7 * p->download_rate + 0.3 * inst;
+    p->rate_mark = p->bytes_received;
+    p->rate_mark_time = now;
+    return p->download_rate;
+}
 
+// Append an existing peer to the state's peer list
+void attach_peer(TorrentState *ts, Peer *p) {
+    ensure_capacity(ts);
     ts->peers[ts->peer_count++] = p;
+}
+
+// Add a peer to the state
+Peer *add_peer(TorrentState *ts, const char *ip, int port) {
+    Peer *p = peer_create(ip, port);
+    if (!p)
+        return NULL;
+
+    attach_peer(ts, p);
 
     printf(" Added peer %s:%d (total=%d)\n",
            ip, port, ts->peer_count);
@@ -60,11 +110,7 @@ void remove_peer(TorrentState *ts, int index) {
 
     printf(" Removing peer %s:%d\n", p->ip, p->port);
 
-    if (p->socket_fd >= 0)
-        close(p->socket_fd);
-
-    free(p->bitfield);
-    free(p);
+    peer_free(p);
 
     // shift peers left
     for (int i = index; i < ts->peer_count - 1; i++) {
@@ -74,6 +120,104 @@ void remove_peer(TorrentState *ts, int index) {
     ts->peer_count--;
 }
 
+// Send a keep-alive every PEER_KEEPALIVE_INTERVAL. Each peer's timer runs
+// from its own registration, so keep-alives are spread out over time.
+static void on_keepalive_timer(void *ctx) {
+    Peer *p = ctx;
+
+    if (p->state == PEER_ACTIVE)
+        send_keep_alive(p);
+
+    if (p->loop)
+        event_loop_arm(p->loop, &p->keepalive_timer, PEER_KEEPALIVE_INTERVAL);
+}
+
+// Nothing received since the last check: the peer is gone or stuck
+static void on_idle_timer(void *ctx) {
+    Peer *p = ctx;
+
+    if (p->bytes_received == p->idle_mark) {
+        printf("[PEER %s:%d] Nothing received for %.0f s, disconnecting\n",
+               p->ip, p->port, PEER_IDLE_TIMEOUT);
+        peer_disconnect(p);
+        return;
+    }
+
+    p->idle_mark = p->bytes_received;
+    event_loop_arm(p->loop, &p->idle_timer, PEER_IDLE_TIMEOUT);
+}
+
+// Connect or handshake deadline passed; the coordinator's reaper hands
+// the pool slot back to the connection manager
+static void on_conn_deadline(void *ctx) {
+    Peer *p = ctx;
+
+    printf("[CONNECT] %s %s:%d timed out\n",
+           p->conn_phase == CONN_PHASE_CONNECTING ? "Connect" : "Handshake",
+           p->ip, p->port);
+    peer_disconnect(p);
+}
+
+// Register a peer's socket with an event loop. The handler gets the Peer as ctx.
+int peer_watch(EventLoop *loop, Peer *p, event_handler_fn fn) {
+    if (!loop || !p || p->socket_fd < 0)
+        return -1;
+
+    p->ev.fn = fn;
+    p->ev.ctx = p;
+
+    if (event_loop_add(loop, &p->ev, p->socket_fd,
+                       EPOLLIN | EPOLLOUT | EPOLLRDHUP) < 0)
+        return -1;
+
+    p->loop = loop;
+
+    p->idle_mark = p->bytes_received;
+    event_loop_arm(loop, &p->keepalive_timer, PEER_KEEPALIVE_INTERVAL);
+    event_loop_arm(loop, &p->idle_timer, PEER_IDLE_TIMEOUT);
+    if (p->conn_phase != CONN_PHASE_NONE)
+        event_loop_arm(loop, &p->conn_timer, p->conn_deadline - get_time_seconds());
+    return 0;
+}
+
+// Take a peer off its event loop (e.g. to hand it to another thread);
+// the socket stays open
+void peer_unwatch(Peer *p) {
+    if (p->loop && p->socket_fd >= 0)
+        event_loop_del(p->loop, p->socket_fd);
+
+    timer_cancel(&p->keepalive_timer);
+    timer_cancel(&p->idle_timer);
+    timer_cancel(&p->conn_timer);
+    p->loop = NULL;
+}
+
+// Close a peer's socket and drop it from its event loop.
+// The Peer itself is freed later by cleanup_dead_peers().
+void peer_disconnect(Peer *p) {
+    if (!p || p->socket_fd < 0)
+        return;
+
+    peer_unwatch(p);
+
+    close(p->socket_fd);
+    p->socket_fd = -1;
+    p->state = PEER_DISCONNECTED;
+    peer_output_reset(p);
+}
+
+// Close and release a peer that is no longer in the peer list
+void peer_free(Peer *p) {
+    if (!p)
+        return;
+
+    peer_disconnect(p);
+    peer_rx_reset(p);
+    free(p->reqs);
+    free(p->bitfield);
+    free(p);
+}
+
 // Find a peer by its socket FD
 Peer *find_peer_by_fd(TorrentState *ts, int fd) {
     for (int i = 0; i < ts->peer_count; i++) {
@@ -1,12 +1,15 @@
 // multithreaded_download_coordinator.c
 // Thread-safe BitTorrent downloader with worker threads
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <time.h>
 #include <errno.h>
 #include <sys/socket.h>
@@ -24,91 +27,257 @@
 #include "outgoingMessages.h"
 #include "init_torrent_state.h"
 #include "requestPayload.h"
+#include "upload_manager.h"
+#include "io_backend.h"
+#include "connection_manager.h"
+#include "request_pipeline.h"
+#include "piece_picker.h"
+#include "file_writer.h"
+#include "interest.h"
+#include "event_loop.h"
+#include "peer_output.h"
+#include "hash_pool.h"
 
 #define MAX_PEER_CONNECTIONS 50
 #define TRACKER_RECONTACT_INTERVAL 1800
 #define NUM_WORKER_THREADS 4  // Number of download threads
+#define MAX_UNCHOKED 4        // upload slots shared by all workers
+#define SWEEP_INTERVAL 0.1    // seconds between per-worker peer sweeps
+#define REBALANCE_INTERVAL 1.0 // seconds between scheduler passes
+#define STATS_INTERVAL 5.0     // seconds between utilisation reports
+#define REBALANCE_RATIO 2.0    // busiest/idlest rate that triggers a move
+#define REBALANCE_MIN_RATE (64 * 1024)  // ignore gaps below this (bytes/sec)
+#define STEAL_INTERVAL 1.0     // seconds between steal attempts
+#define DIAL_BATCH 16          // connects started per main loop pass
+#define HASH_RESULT_BATCH 64   // verdicts taken per main loop wakeup
 
-// Thread-safe wrapper for critical sections
+// Shared torrent state is only touched under state_mutex (piece picker
+// and PieceState bookkeeping, in memory). Blocks go into piece buffers
+// without it: each block is owned through its BlockState (store_pieces.h),
+// for a recv() in place and a copy alike. Nothing that can block is done
+// under the lock: a full piece is hashed
+// and written by the hash pool and its verdict handled on the main
+// thread, and REQUESTs made under state_mutex stay corked until it is
+// released. Completion is an atomic bitset (store_pieces.c), and
+// everything about a Peer belongs to the worker that owns it.
 static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+static long state_waits;         // atomic: state_mutex was held by another thread
 static bool shutdown_flag = false;
+static int unchoked_slots = 0;   // atomic: peers we currently unchoke
 
 // Worker thread data
 typedef struct {
     int thread_id;
     TorrentState *ts;
     pthread_t pthread;
+
+    // reactor and the peers this worker exclusively owns
+    EventLoop *loop;
+    Peer **peers;
+    int peer_count;
+    int peer_capacity;
+
+    // handoff queue filled by other threads, drained by the owner
+    pthread_mutex_t inbox_lock;
+    Peer **inbox_peers;
+    int inbox_peer_count;
+    int inbox_peer_capacity;
+    int *inbox_haves;            // pieces to announce to our peers
+    int inbox_have_count;
+    int inbox_have_capacity;
+    uint32_t *inbox_cancels;     // (index, begin) pairs to cancel (endgame)
+    int inbox_cancel_count;      // pairs
+    int inbox_cancel_capacity;   // uint32_t slots
+
+    uint8_t *interest_done;      // completions as announced to our peers
+
+    int wake_fd;                 // eventfd, wakes the worker's loop
+    EventHandler wake_ev;
+
+    Timer sweep_timer;           // request top-up and reaping
+    Timer steal_timer;
+
+    // load counters, written by the owner and read by the scheduler
+    long bytes_in;
+    long msgs_in;
+    long busy_usec;              // time spent in handlers
+    long migrated_in;
+    long migrated_out;
+    long steals;                 // peers this worker stole while idle
+
+    // published by the scheduler each pass
+    long rate_bps;
+    long msg_rate;
+    int util_pct;
+
+    // worker id that should receive one of our peers, -1 = none
+    int migrate_to;
+
+    // scheduler bookkeeping (main thread only)
+    long last_bytes;
+    long last_msgs;
+    long last_busy_usec;
+    int cooldown;                // passes to wait after a move
 } WorkerThread;
 
+static WorkerThread workers[NUM_WORKER_THREADS];
+
+// dialled from the main thread, progress reported by the owning worker
+static ConnManager conn_mgr;
+
+// full pieces are verified here; the verdicts wake the main thread,
+// which checks for completion without polling
+static HashPool hash_pool;
+
 static unsigned char CLIENT_ID[20] = "-TC0001-123456789012";
 
 // ============================================================================
-// Thread-safe helper functions
+// Handoff queue
 // ============================================================================
 
-static void update_my_bitfield_safe(TorrentState *ts, int piece_index) {
-    if (!ts->my_bitfield || piece_index < 0 || piece_index >= ts->total_pieces) {
-        return;
+static void worker_wake(WorkerThread *w) {
+    uint64_t one = 1;
+    if (write(w->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+static int grow_array(void **arr, int *capacity, int needed, size_t elem) {
+    if (needed <= *capacity) return 0;
+
+    int cap = *capacity ? *capacity * 2 : 16;
+    while (cap < needed) cap *= 2;
+
+    void *tmp = realloc(*arr, cap * elem);
+    if (!tmp) return -1;
+
+    *arr = tmp;
+    *capacity = cap;
+    return 0;
+}
+
+// Give a peer to a worker. Ownership moves with it.
+static int worker_handoff_peer(WorkerThread *w, Peer *p) {
+    pthread_mutex_lock(&w->inbox_lock);
+    int rc = grow_array((void **)&w->inbox_peers, &w->inbox_peer_capacity,
+                        w->inbox_peer_count + 1, sizeof(Peer *));
+    if (rc == 0)
+        w->inbox_peers[w->inbox_peer_count++] = p;
+    pthread_mutex_unlock(&w->inbox_lock);
+
+    if (rc == 0)
+        worker_wake(w);
+    return rc;
+}
+
+// Ask every worker to announce a completed piece to the peers it owns
+static void broadcast_have_safe(int piece_index) {
+    for (int i = 0; i < NUM_WORKER_THREADS; i++) {
+        WorkerThread *w = &workers[i];
+
+        pthread_mutex_lock(&w->inbox_lock);
+        if (grow_array((void **)&w->inbox_haves, &w->inbox_have_capacity,
+                       w->inbox_have_count + 1, sizeof(int)) == 0)
+            w->inbox_haves[w->inbox_have_count++] = piece_index;
+        pthread_mutex_unlock(&w->inbox_lock);
+
+        worker_wake(w);
     }
-    
-    pthread_mutex_lock(&state_mutex);
-    
-    int byte = piece_index / 8;
-    int bit = 7 - (piece_index % 8);
-    
-    if (byte < ts->my_bitfield_len) {
-        ts->my_bitfield[byte] |= (1 << bit);
-        //printf("[THREAD-%d] [BITFIELD] Updated: we now have piece %d\n", 
-        //       pthread_self() % 100, piece_index);
-    }
-    
-    pthread_mutex_unlock(&state_mutex);
 }
 
-static void broadcast_have_safe(TorrentState *ts, int piece_index) {
-    pthread_mutex_lock(&state_mutex);
-    
-    for (int i = 0; i < ts->peer_count; i++) {
-        Peer *p = ts->peers[i];
-        if (p->state == PEER_ACTIVE && p->socket_fd >= 0) {
-            send_have(p, piece_index);
+// Endgame: ask every worker to CANCEL a delivered block at its peers
+static void broadcast_cancel_safe(uint32_t index, uint32_t begin) {
+    for (int i = 0; i < NUM_WORKER_THREADS; i++) {
+        WorkerThread *w = &workers[i];
+
+        pthread_mutex_lock(&w->inbox_lock);
+        if (grow_array((void **)&w->inbox_cancels, &w->inbox_cancel_capacity,
+                       2 * (w->inbox_cancel_count + 1), sizeof(uint32_t)) == 0) {
+            w->inbox_cancels[2 * w->inbox_cancel_count] = index;
+            w->inbox_cancels[2 * w->inbox_cancel_count + 1] = begin;
+            w->inbox_cancel_count++;
         }
+        pthread_mutex_unlock(&w->inbox_lock);
+
+        worker_wake(w);
     }
-    
-    pthread_mutex_unlock(&state_mutex);
 }
 
-static void manage_upload_slots_safe(TorrentState *ts) {
-    pthread_mutex_lock(&state_mutex);
-    
-    int unchoked_count = 0;
-    for (int i = 0; i < ts->peer_count && unchoked_count < 4; i++) {
-        Peer *p = ts->peers[i];
-        
-        if (p->state != PEER_ACTIVE || p->socket_fd < 0) {
-            continue;
+// Least loaded worker, by owned + pending peers
+static WorkerThread *pick_worker(void) {
+    WorkerThread *best = &workers[0];
+    int best_load = -1;
+
+    for (int i = 0; i < NUM_WORKER_THREADS; i++) {
+        WorkerThread *w = &workers[i];
+        pthread_mutex_lock(&w->inbox_lock);
+        int load = __atomic_load_n(&w->peer_count, __ATOMIC_RELAXED) +
+                   w->inbox_peer_count;
+        pthread_mutex_unlock(&w->inbox_lock);
+
+        if (best_load < 0 || load < best_load) {
+            best = w;
+            best_load = load;
         }
-        
-        if (p->is_interested && p->am_choking) {
+    }
+    return best;
+}
+
+static int total_peer_count(void) {
+    int n = 0;
+    for (int i = 0; i < NUM_WORKER_THREADS; i++)
+        n += __atomic_load_n(&workers[i].peer_count, __ATOMIC_RELAXED);
+    return n;
+}
+
+// ============================================================================
+// Thread-safe helper functions
+// ============================================================================
+
+// Lock, counting the times we had to wait
+static void lock_counted(pthread_mutex_t *m, long *waits) {
+    if (pthread_mutex_trylock(m) == 0)
+        return;
+
+    __atomic_fetch_add(waits, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(m);
+}
+
+static void state_lock(void) {
+    lock_counted(&state_mutex, &state_waits);
+}
+
+static void state_unlock(void) {
+    pthread_mutex_unlock(&state_mutex);
+}
+
+// Unchoke an interested peer if one of the shared upload slots is free
+static void try_unchoke(Peer *p) {
+    if (!p->is_interested || !p->am_choking) return;
+
+    int slots = __atomic_load_n(&unchoked_slots, __ATOMIC_RELAXED);
+    while (slots < MAX_UNCHOKED) {
+        if (__atomic_compare_exchange_n(&unchoked_slots, &slots, slots + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
             send_unchoke(p);
             p->am_choking = false;
-            unchoked_count++;
-        } else if (!p->am_choking) {
-            unchoked_count++;
+            return;
         }
     }
-    
-    pthread_mutex_unlock(&state_mutex);
+}
+
+static void release_upload_slot(Peer *p) {
+    if (!p->am_choking) {
+        p->am_choking = true;
+        __atomic_fetch_sub(&unchoked_slots, 1, __ATOMIC_ACQ_REL);
+    }
 }
 
 // ============================================================================
-// Core download functions (same as before, but with locking)
+// Core download functions
 // ============================================================================
 
 static int setup_listen_socket(int port) {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (fd < 0) {
         perror("socket(listen)");
         return -1;
@@ -138,403 +307,944 @@ static int setup_listen_socket(int port) {
     return fd;
 }
 
+// a counter read, no lock: pieces are counted as they are marked
 bool all_pieces_downloaded1(TorrentState *ts) {
-    pthread_mutex_lock(&state_mutex);
-    bool complete = true;
-    for (int i = 0; i < ts->total_pieces; i++) {
-        if (!ts->piece_complete[i]) {
-            complete = false;
-            break;
-        }
-    }
-    pthread_mutex_unlock(&state_mutex);
-    return complete;
+    return is_download_complete(ts);
 }
 
+// the interest count trails other workers' completions until their
+// HAVEs reach us, which at worst makes us ask the picker once more
 static bool peer_can_request_more(Peer *peer, TorrentState *ts) {
     if (!peer || !ts) return false;
     if (peer->socket_fd < 0) return false;
     if (peer->is_choked) return false;
     if (!peer->am_interested) return false;
     if (peer->outstanding_requests >= peer->max_pipeline) return false;
-    if (!peer->bitfield || !ts->piece_complete) return false;
 
-    for (int i = 0; i < ts->total_pieces; i++) {
-        if (ts->piece_complete[i]) continue;
+    return peer->wanted_pieces > 0;
+}
 
-        int byte = i / 8;
-        int bit  = 7 - (i % 8);
+static void maybe_request_more(Peer *peer, TorrentState *ts) {
+    if (!peer_can_request_more(peer, ts)) return;
 
-        if (byte < peer->bitfield_len &&
-            (peer->bitfield[byte] & (1 << bit))) {
-            return true;
-        }
+    // blocks of pieces this worker started are claimed without the lock;
+    // the picker is only asked for the rest. The REQUESTs are written
+    // once the lock is released.
+    peer_cork(peer);
+    request_reserved_blocks(peer, ts);
+    if (peer_can_request_more(peer, ts)) {
+        state_lock();
+        request_next_block(peer, ts);
+        state_unlock();
     }
-
-    return false;
+    peer_uncork(peer);
 }
 
-static void maybe_request_more(Peer *peer, TorrentState *ts, int thread_id) {
-    if (!peer_can_request_more(peer, ts)) return;
+// Dial pool candidates while there are free half-open slots; the new
+// connections complete on the workers they are handed to
+static void dial_candidates(void) {
+    Peer *batch[DIAL_BATCH];
+    int n = conn_manager_fill(&conn_mgr, total_peer_count(), MAX_PEER_CONNECTIONS,
+                              batch, DIAL_BATCH);
 
-    for (int i = 0; i < 4; i++) {
-        if (peer_can_request_more(peer, ts)) {
-            request_next_block(peer, ts);
+    for (int i = 0; i < n; i++) {
+        if (worker_handoff_peer(pick_worker(), batch[i]) < 0) {
+            conn_manager_release(&conn_mgr, batch[i]);
+            peer_free(batch[i]);
         }
     }
 }
 
-static int try_connect_peer(TorrentState *ts, const char *ip, int port) {
-    Peer *peer = add_peer(ts, ip, port);
-    if (!peer) return -1;
+static void on_dial_slot_free(EventLoop *loop, void *ctx, uint32_t events) {
+    uint64_t count;
+    (void)loop;
+    (void)ctx;
+    (void)events;
 
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return -1;
+    // the main loop dials right after this wakeup
+    while (read(conn_mgr.notify_fd, &count, sizeof(count)) > 0)
+        ;
+}
 
-    fcntl(sock, F_SETFL, O_NONBLOCK);
+// ============================================================================
+// Handle peer message (runs on the owning worker)
+// ============================================================================
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    inet_pton(AF_INET, ip, &addr.sin_addr);
+// A block arrived, either in a frame or already placed in the piece buffer
+static void handle_block(TorrentState *ts, Peer *peer, uint32_t index,
+                         uint32_t begin, unsigned char *data, uint32_t len) {
+    if (index >= (uint32_t)ts->total_pieces)
+        return;
 
-    int r = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
-    peer->state = PEER_CONNECTING;
+    conn_manager_first_block(&conn_mgr);
 
-    if (r < 0 && errno != EINPROGRESS) {
-        close(sock);
-        peer->state = PEER_DISCONNECTED;
-        return -1;
+    // the block's BlockState decides between this store, a duplicate
+    // and a reader receiving it in place
+    bool stored = store_block(ts, index, begin, data, len) >= 0;
+
+    pipeline_on_block(peer, index, begin, len, get_time_seconds());
+
+    state_lock();
+    PieceState *ps = &ts->piece_states[index];
+    int b = begin / BLOCK_SIZE;
+    bool cancel = false;
+    bool full = false;
+
+    // the counts only take blocks the piece buffer took, so they stay
+    // in step with it across a failed hash check
+    if (!stored) {
+        // endgame duplicate that beat our CANCEL
+        ts->wasted_bytes += len;
+    } else {
+        ps->have_block[b] = 1;
+        ps->requested_block[b] = 0;
+        ps->received_blocks++;
+        picker_block_received(ts, index, b);
+        cancel = ts->endgame || ps->raced;
+
+        // nothing left to request; whether it is done is up to the hash
+        if (ps->received_blocks == ps->total_blocks) {
+            picker_piece_done(ts, index);
+            full = true;
+        }
     }
+    state_unlock();
 
-    peer->socket_fd = sock;
-    peer->state = PEER_CONNECTING;
-    return 0;
+    // the hash pool verifies and writes it, on_hash_results() announces
+    // it; a full piece takes no more blocks, so no lock is needed
+    if (full)
+        hash_pool_submit(&hash_pool, index);
+
+    if (cancel)
+        broadcast_cancel_safe(index, begin);
+
+    maybe_request_more(peer, ts);
 }
 
-// ============================================================================
-// Handle peer message (with thread safety)
-// ============================================================================
-static void handle_peer_message(TorrentState *ts, Peer *peer, int thread_id) {
-    unsigned char *raw_buf = receive_message(peer->socket_fd);
-    if (!raw_buf) {
-        printf(" [PEER %s:%d] Connection closed\n", 
-                peer->ip, peer->port);
-        peer->socket_fd = -1;
-        return;
-    }
-    
+static void handle_peer_message(WorkerThread *w, Peer *peer, unsigned char *raw_buf) {
+    TorrentState *ts = w->ts;
+
     ParsedMessage msg;
     if (parse_message(raw_buf, &msg) < 0) {
-        free(raw_buf);
-        peer->socket_fd = -1;
+        peer_disconnect(peer);
         return;
     }
-    
+
     switch (msg.id) {
         case MSG_CHOKE:
             peer->is_choked = true;
-            peer->outstanding_requests = 0;
+            // a choking peer drops our requests; others can have them
+            state_lock();
+            pipeline_release(peer, ts);
+            state_unlock();
             printf(" [PEER %s:%d] CHOKE\n",  peer->ip, peer->port);
             break;
-            
+
         case MSG_UNCHOKE:
             peer->is_choked = false;
-            peer->outstanding_requests = 0;
             printf(" [PEER %s:%d] UNCHOKE\n",  peer->ip, peer->port);
-            maybe_request_more(peer, ts, thread_id);
+            maybe_request_more(peer, ts);
             break;
-            
+
         case MSG_INTERESTED:
             peer->is_interested = true;
             printf(" [PEER %s:%d] INTERESTED\n",  peer->ip, peer->port);
-            manage_upload_slots_safe(ts);
+            try_unchoke(peer);
             break;
-            
+
         case MSG_NOT_INTERESTED:
             peer->is_interested = false;
+            release_upload_slot(peer);
             break;
-            
+
         case MSG_HAVE: {
             if (msg.payload_len == 4) {
                 uint32_t idx = ntohl(*(uint32_t*)msg.payload);
-                pthread_mutex_lock(&state_mutex);
-                if (peer->bitfield && idx < peer->bitfield_len * 8) {
-                    peer->bitfield[idx/8] |= (1 << (7 - (idx % 8)));
-                }
-                pthread_mutex_unlock(&state_mutex);
+                interest_have_received();
+                state_lock();
+                bool fresh = picker_peer_have(ts, peer, idx);
+                state_unlock();
+
+                if (fresh)
+                    interest_have(peer, idx, w->interest_done);
             }
             break;
         }
-        
+
         case MSG_BITFIELD: {
-            pthread_mutex_lock(&state_mutex);
-            
-            if (peer->bitfield) free(peer->bitfield);
-            peer->bitfield_len = msg.payload_len;
-            peer->bitfield = malloc(msg.payload_len);
-            
-            if (peer->bitfield) {
-                memcpy(peer->bitfield, msg.payload, msg.payload_len);
-                
-                bool interesting = false;
-                for (int i = 0; i < ts->total_pieces; i++) {
-                    if (ts->piece_complete[i]) continue;
-                    if (peer_has_piece(peer, i)) {
-                        interesting = true;
-                        break;
-                    }
-                }
-                
-                pthread_mutex_unlock(&state_mutex);
-                
-                if (interesting) {
-                    send_interested(peer);
-                    peer->am_interested = true;
-                } else {
-                    send_not_interested(peer);
-                    peer->am_interested = false;
-                }
-            } else {
-                pthread_mutex_unlock(&state_mutex);
-            }
+            state_lock();
+            int rc = picker_peer_bitfield(ts, peer, msg.payload, msg.payload_len);
+            state_unlock();
+
+            // sends INTERESTED if it has anything for us
+            if (rc == 0)
+                interest_recount(ts, peer, w->interest_done);
             break;
         }
-            
+
         case MSG_PIECE: {
             PiecePayload piece;
             if (parse_piece_payload(&msg, &piece) == 0) {
-                // Lock for disk write
-                pthread_mutex_lock(&disk_mutex);
-                store_received_block(ts, piece.index, piece.begin, piece.data, piece.data_len);
-                pthread_mutex_unlock(&disk_mutex);
-                
-                pthread_mutex_lock(&state_mutex);
-                peer->outstanding_requests--;
-                if (peer->outstanding_requests < 0)
-                    peer->outstanding_requests = 0;
-                
-                PieceState *ps = &ts->piece_states[piece.index];
-                int b = piece.begin / BLOCK_SIZE;
-
-                if (b < ps->total_blocks) {
-                    ps->have_block[b] = 1;
-                    ps->requested_block[b] = 0;
-                    ps->received_blocks++;
-
-                    if (ps->received_blocks == ps->total_blocks) {
-                        ts->piece_complete[piece.index] = true;
-                        pthread_mutex_unlock(&state_mutex);
-                        
-                        update_my_bitfield_safe(ts, piece.index);
-                        broadcast_have_safe(ts, piece.index);
-                        
-                        printf(" [PIECE] Completed piece %u\n", 
-                               piece.index);
-                    } else {
-                        pthread_mutex_unlock(&state_mutex);
-                    }
-                } else {
-                    pthread_mutex_unlock(&state_mutex);
-                }
-
-                maybe_request_more(peer, ts, thread_id);
+                handle_block(ts, peer, piece.index, piece.begin,
+                             piece.data, piece.data_len);
             }
             break;
         }
-        
+
         case MSG_REQUEST: {
-            RequestPayload req;
-            if (parse_request_payload(&msg, &req) == 0) {
-                if (!peer->am_choking && 
-                    req.index < ts->total_pieces && 
-                    ts->piece_complete[req.index] &&
+            piece_request req;
+            if (msg.payload_len == 12 &&
+                parse_request_payload(msg.payload, &req) == 0) {
+                // completed pieces are immutable and their bits are
+                // read atomically, so no lock is needed
+                if (!peer->am_choking &&
+                    req.index < (uint32_t)ts->total_pieces &&
+                    is_piece_complete(ts, req.index) &&
                     req.length <= 16384) {
-                    
-                    pthread_mutex_lock(&disk_mutex);
+
                     send_piece(peer, ts, req.index, req.begin, req.length);
-                    pthread_mutex_unlock(&disk_mutex);
-                    
-                    pthread_mutex_lock(&state_mutex);
-                    ts->bytes_uploaded += req.length;
-                    pthread_mutex_unlock(&state_mutex);
+                    __atomic_fetch_add(&ts->bytes_uploaded, (long)req.length,
+                                       __ATOMIC_RELAXED);
                 }
             }
             break;
         }
-        
+
         default:
             break;
     }
-    
-    free(raw_buf);
 }
 
 // ============================================================================
-// Worker thread function
+// Per-worker reactor
 // ============================================================================
-void* worker_thread_func(void* arg) {
-    WorkerThread *worker = (WorkerThread*)arg;
-    TorrentState *ts = worker->ts;
-    int thread_id = worker->thread_id;
-    
-    
-    while (!shutdown_flag) {
-        pthread_mutex_lock(&state_mutex);
-        
-        // Find peers for this thread to handle
-        fd_set read_fds, write_fds;
-        FD_ZERO(&read_fds);
-        FD_ZERO(&write_fds);
-        int max_fd = -1;
-        
-        // Each thread handles a subset of peers
-        for (int i = thread_id; i < ts->peer_count; i += NUM_WORKER_THREADS) {
-            Peer *p = ts->peers[i];
-            if (p->socket_fd < 0) continue;
-            
-            if (p->state == PEER_CONNECTING) {
-                FD_SET(p->socket_fd, &write_fds);
-            } else if (p->state == PEER_WAIT_HANDSHAKE_IN || p->state == PEER_ACTIVE) {
-                FD_SET(p->socket_fd, &read_fds);
+
+// Outgoing connect finished: check result and send our handshake
+static void complete_outgoing_connect(TorrentState *ts, Peer *p) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(p->socket_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+    if (err != 0) {
+        conn_manager_release(&conn_mgr, p);
+        peer_disconnect(p);
+        return;
+    }
+
+    conn_manager_connected(&conn_mgr, p);
+
+    if (peer_send_handshake(p, ts->meta->info_hash, CLIENT_ID) < 0) {
+        peer_disconnect(p);
+        return;
+    }
+
+    p->state = PEER_WAIT_HANDSHAKE_IN;
+}
+
+static void on_handshake_done(TorrentState *ts, Peer *p) {
+    bool inbound = (p->state == PEER_WAIT_HANDSHAKE_OUT);
+
+    conn_manager_handshake_done(&conn_mgr, p);
+
+    if (inbound && peer_send_handshake(p, ts->meta->info_hash, CLIENT_ID) < 0) {
+        peer_disconnect(p);
+        return;
+    }
+
+    p->state = PEER_ACTIVE;
+    p->am_choking = true;
+
+    if (ts->my_bitfield_len > 0) {
+        send_bitfield(p, ts);
+    }
+
+    // INTERESTED follows once its BITFIELD shows what it has
+}
+
+// Readiness handler for a peer owned by this worker; never blocks
+static void on_worker_peer_event(EventLoop *loop, void *ctx, uint32_t events) {
+    WorkerThread *w = loop->user;
+    TorrentState *ts = w->ts;
+    Peer *p = ctx;
+    long bytes_before = p->bytes_received;
+    long msgs_before = p->msgs_received;
+
+    if (p->socket_fd < 0) return;
+
+    if (p->state == PEER_CONNECTING &&
+        !(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        return;
+
+    // everything this event produces leaves in one write on uncork;
+    // an EPOLLOUT edge also lands here and flushes leftover output
+    peer_cork(p);
+
+    if (p->state == PEER_CONNECTING)
+        complete_outgoing_connect(ts, p);
+
+    while (p->socket_fd >= 0) {
+        int r;
+
+        if (p->state == PEER_WAIT_HANDSHAKE_IN ||
+            p->state == PEER_WAIT_HANDSHAKE_OUT) {
+
+            r = peer_read_handshake(p, ts->meta->info_hash);
+            if (r == WIRE_AGAIN) break;
+            if (r == WIRE_ERROR) {
+                peer_disconnect(p);
+                break;
+            }
+            on_handshake_done(ts, p);
+
+        } else if (p->state == PEER_ACTIVE) {
+            unsigned char *raw_buf;
+            r = peer_read_message_direct(p, ts, &raw_buf);
+            if (r == WIRE_AGAIN) break;
+            if (r == WIRE_ERROR) {
+                printf(" [PEER %s:%d] Connection closed\n", p->ip, p->port);
+                peer_disconnect(p);
+                break;
             }
-            
-            if (p->socket_fd > max_fd) max_fd = p->socket_fd;
+            if (r == WIRE_BLOCK) {
+                handle_block(ts, p, p->rx_block_index, p->rx_block_begin,
+                             p->rx_block, p->rx_block_len);
+                continue;
+            }
+            handle_peer_message(w, p, raw_buf);
+
+        } else {
+            break;
         }
-        
-        pthread_mutex_unlock(&state_mutex);
-        
-        if (max_fd < 0) {
-            usleep(100000); // 100ms
+    }
+
+    peer_uncork(p);
+
+    __atomic_fetch_add(&w->bytes_in, p->bytes_received - bytes_before,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->msgs_in, p->msgs_received - msgs_before,
+                       __ATOMIC_RELAXED);
+}
+
+// Free a peer we are giving up on, returning its pool slot, upload slot
+// and requested blocks, and dropping its pieces from the availability
+static void drop_peer(TorrentState *ts, Peer *p) {
+    conn_manager_release(&conn_mgr, p);
+    release_upload_slot(p);
+
+    state_lock();
+    pipeline_release(p, ts);
+    picker_peer_gone(ts, p);
+    state_unlock();
+
+    peer_free(p);
+}
+
+// Adopt handed-off peers, send queued HAVE announcements and CANCELs
+static void worker_drain_inbox(WorkerThread *w) {
+    pthread_mutex_lock(&w->inbox_lock);
+    Peer **new_peers = w->inbox_peers;
+    int new_count = w->inbox_peer_count;
+    int *haves = w->inbox_haves;
+    int have_count = w->inbox_have_count;
+    uint32_t *cancels = w->inbox_cancels;
+    int cancel_count = w->inbox_cancel_count;
+
+    w->inbox_peers = NULL;
+    w->inbox_peer_count = 0;
+    w->inbox_peer_capacity = 0;
+    w->inbox_haves = NULL;
+    w->inbox_have_count = 0;
+    w->inbox_have_capacity = 0;
+    w->inbox_cancels = NULL;
+    w->inbox_cancel_count = 0;
+    w->inbox_cancel_capacity = 0;
+    pthread_mutex_unlock(&w->inbox_lock);
+
+    for (int i = 0; i < new_count; i++) {
+        Peer *p = new_peers[i];
+
+        if (grow_array((void **)&w->peers, &w->peer_capacity,
+                       w->peer_count + 1, sizeof(Peer *)) < 0) {
+            drop_peer(w->ts, p);
             continue;
         }
-        
-        struct timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = 50000; // 50ms timeout
-        
-        int activity = select(max_fd + 1, &read_fds, &write_fds, NULL, &tv);
-        
-        if (activity <= 0) continue;
-        
-        pthread_mutex_lock(&state_mutex);
-        
-        // Handle peer activity
-        for (int i = thread_id; i < ts->peer_count; i += NUM_WORKER_THREADS) {
-            Peer *p = ts->peers[i];
-            if (p->socket_fd < 0) continue;
-            
-            // Handle connection completion
-            if (p->state == PEER_CONNECTING && FD_ISSET(p->socket_fd, &write_fds)) {
-                int err;
-                socklen_t len = sizeof(err);
-                getsockopt(p->socket_fd, SOL_SOCKET, SO_ERROR, &err, &len);
-                
-                if (err == 0) {
-                    unsigned char hs[68] = {0};
-                    hs[0] = 19;
-                    memcpy(hs+1, "BitTorrent protocol", 19);
-                    memcpy(hs+28, ts->meta->info_hash, 20);
-                    memcpy(hs+48, CLIENT_ID, 20);
-                    
-                    pthread_mutex_unlock(&state_mutex);
-                    send(p->socket_fd, hs, 68, 0);
-                    pthread_mutex_lock(&state_mutex);
-                    
-                    int flags = fcntl(p->socket_fd, F_GETFL, 0);
-                    if (flags != -1) fcntl(p->socket_fd, F_SETFL, flags & ~O_NONBLOCK);
-                    
-                    p->state = PEER_WAIT_HANDSHAKE_IN;
-                } else {
-                    close(p->socket_fd);
-                    p->socket_fd = -1;
-                    p->state = PEER_DISCONNECTED;
-                }
-            }
-            
-            // Handle handshake response
-            else if (p->state == PEER_WAIT_HANDSHAKE_IN && FD_ISSET(p->socket_fd, &read_fds)) {
-                unsigned char hs[68];
-                pthread_mutex_unlock(&state_mutex);
-                int got = recv(p->socket_fd, hs, 68, 0);
-                pthread_mutex_lock(&state_mutex);
-                
-                if (got == 68 && hs[0] == 19 &&
-                    memcmp(hs+1, "BitTorrent protocol", 19) == 0 &&
-                    memcmp(hs+28, ts->meta->info_hash, 20) == 0) {
-                    
-                    p->state = PEER_ACTIVE;
-                    p->am_choking = true;
-                    
-                    pthread_mutex_unlock(&state_mutex);
-                    
-                    if (ts->my_bitfield_len > 0) {
-                        send_bitfield(p, ts);
-                    }
-                    send_interested(p);
-                    p->am_interested = true;
-                    
-                    pthread_mutex_lock(&state_mutex);
-                } else {
-                    close(p->socket_fd);
-                    p->socket_fd = -1;
-                    p->state = PEER_DISCONNECTED;
-                }
-            }
-            
-            // Handle normal messages
-            else if (p->state == PEER_ACTIVE && FD_ISSET(p->socket_fd, &read_fds)) {
-                pthread_mutex_unlock(&state_mutex);
-                handle_peer_message(ts, p, thread_id);
-                pthread_mutex_lock(&state_mutex);
-            }
+
+        w->peers[w->peer_count] = p;
+        __atomic_store_n(&w->peer_count, w->peer_count + 1, __ATOMIC_RELAXED);
+
+        // registration reports current readiness, so an already
+        // completed connect is not missed
+        if (peer_watch(w->loop, p, on_worker_peer_event) < 0)
+            peer_disconnect(p);
+
+        // a migrated peer was counted against its old worker's map
+        interest_recount(w->ts, p, w->interest_done);
+    }
+
+    for (int i = 0; i < have_count; i++) {
+        broadcast_have_to(w->peers, w->peer_count, haves[i]);
+
+        if (interest_map_set(w->interest_done, haves[i])) {
+            for (int j = 0; j < w->peer_count; j++)
+                interest_piece_done(w->peers[j], haves[i]);
         }
-        
-        pthread_mutex_unlock(&state_mutex);
-        
-        // Request more blocks
-        pthread_mutex_lock(&state_mutex);
-        for (int i = thread_id; i < ts->peer_count; i += NUM_WORKER_THREADS) {
-            Peer *p = ts->peers[i];
-            if (p->state == PEER_ACTIVE && p->socket_fd >= 0 && !p->is_choked) {
-                pthread_mutex_unlock(&state_mutex);
-                maybe_request_more(p, ts, thread_id);
-                pthread_mutex_lock(&state_mutex);
-            }
+    }
+
+    for (int i = 0; i < cancel_count; i++) {
+        for (int j = 0; j < w->peer_count; j++) {
+            if (pipeline_cancel(w->peers[j], cancels[2 * i], cancels[2 * i + 1]))
+                __atomic_fetch_add(&w->ts->cancels_sent, 1, __ATOMIC_RELAXED);
         }
-        pthread_mutex_unlock(&state_mutex);
     }
-    
+
+    free(new_peers);
+    free(haves);
+    free(cancels);
+}
+
+static void on_worker_wake(EventLoop *loop, void *ctx, uint32_t events) {
+    WorkerThread *w = loop->user;
+    uint64_t count;
+    (void)ctx;
+    (void)events;
+
+    while (read(w->wake_fd, &count, sizeof(count)) > 0)
+        ;
+    worker_drain_inbox(w);
+}
+
+// Drop dead peers from this worker (order does not matter)
+static void worker_reap_peers(WorkerThread *w) {
+    for (int i = w->peer_count - 1; i >= 0; i--) {
+        Peer *p = w->peers[i];
+        if (p->socket_fd >= 0) continue;
+
+        drop_peer(w->ts, p);
+        w->peers[i] = w->peers[w->peer_count - 1];
+        __atomic_store_n(&w->peer_count, w->peer_count - 1, __ATOMIC_RELAXED);
+    }
+}
+
+// ============================================================================
+// Load balancing
+// ============================================================================
+
+// Give one peer to the worker named in migrate_to. The peer whose rate is
+// closest to half the gap between the two workers is moved, so the move
+// evens out the load instead of just relocating the hot spot.
+static void worker_migrate_peer(WorkerThread *w, double now) {
+    int target = __atomic_exchange_n(&w->migrate_to, -1, __ATOMIC_ACQ_REL);
+    if (target < 0 || target == w->thread_id || w->peer_count < 2)
+        return;
+
+    WorkerThread *dst = &workers[target];
+    double gap = (__atomic_load_n(&w->rate_bps, __ATOMIC_RELAXED) -
+                  __atomic_load_n(&dst->rate_bps, __ATOMIC_RELAXED)) / 2.0;
+
+    int best = -1;
+    double best_diff = 0;
+    for (int i = 0; i < w->peer_count; i++) {
+        Peer *p = w->peers[i];
+        if (p->socket_fd < 0) continue;
+
+        double rate = peer_sample_rate(p, now);
+        double diff = rate > gap ? rate - gap : gap - rate;
+        if (best < 0 || diff < best_diff) {
+            best = i;
+            best_diff = diff;
+        }
+    }
+    if (best < 0) return;
+
+    Peer *p = w->peers[best];
+    peer_unwatch(p);
+    w->peers[best] = w->peers[w->peer_count - 1];
+    __atomic_store_n(&w->peer_count, w->peer_count - 1, __ATOMIC_RELAXED);
+
+    printf("[BALANCE] Worker %d -> %d: %s:%d (%.1f KiB/s)\n",
+           w->thread_id, target, p->ip, p->port, p->download_rate / 1024.0);
+
+    // partial frames and pipeline state travel with the peer
+    if (worker_handoff_peer(dst, p) < 0) {
+        drop_peer(w->ts, p);
+        return;
+    }
+
+    __atomic_fetch_add(&w->migrated_out, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->migrated_in, 1, __ATOMIC_RELAXED);
+}
+
+// Ask worker victim to hand one peer to worker to. Fails if another
+// move is already pending on victim.
+static bool request_migration(WorkerThread *victim, int to) {
+    int expected = -1;
+    if (!__atomic_compare_exchange_n(&victim->migrate_to, &expected, to, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return false;
+
+    worker_wake(victim);
+    return true;
+}
+
+// An idle worker (no peers, or no traffic last pass) steals a connection
+// from the busiest worker that can spare one
+static void worker_try_steal(WorkerThread *w) {
+    if (w->peer_count > 0 && __atomic_load_n(&w->rate_bps, __ATOMIC_RELAXED) > 0)
+        return;
+
+    WorkerThread *victim = NULL;
+    long victim_rate = -1;
+    for (int i = 0; i < NUM_WORKER_THREADS; i++) {
+        WorkerThread *v = &workers[i];
+        if (v == w || __atomic_load_n(&v->peer_count, __ATOMIC_RELAXED) < 2)
+            continue;
+
+        long rate = __atomic_load_n(&v->rate_bps, __ATOMIC_RELAXED);
+        if (rate > victim_rate) {
+            victim = v;
+            victim_rate = rate;
+        }
+    }
+
+    if (victim && request_migration(victim, w->thread_id))
+        __atomic_fetch_add(&w->steals, 1, __ATOMIC_RELAXED);
+}
+
+// Main thread: turn the workers' counters into rates, then move one peer
+// from the busiest worker to the idlest if the gap is large enough
+static void scheduler_pass(double dt) {
+    WorkerThread *busiest = NULL, *idlest = NULL;
+
+    for (int i = 0; i < NUM_WORKER_THREADS; i++) {
+        WorkerThread *w = &workers[i];
+
+        long bytes = __atomic_load_n(&w->bytes_in, __ATOMIC_RELAXED);
+        long msgs = __atomic_load_n(&w->msgs_in, __ATOMIC_RELAXED);
+        long busy = __atomic_load_n(&w->busy_usec, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&w->rate_bps, (long)((bytes - w->last_bytes) / dt),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&w->msg_rate, (long)((msgs - w->last_msgs) / dt),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&w->util_pct,
+                         (int)((busy - w->last_busy_usec) / (dt * 10000.0)),
+                         __ATOMIC_RELAXED);
+
+        w->last_bytes = bytes;
+        w->last_msgs = msgs;
+        w->last_busy_usec = busy;
+
+        // rates right after a move still reflect the old peer set
+        if (w->cooldown > 0) {
+            w->cooldown--;
+            continue;
+        }
+
+        if (!idlest || w->rate_bps < idlest->rate_bps)
+            idlest = w;
+        if (w->peer_count >= 2 && (!busiest || w->rate_bps > busiest->rate_bps))
+            busiest = w;
+    }
+
+    if (!busiest || busiest == idlest)
+        return;
+
+    // only move if shifting an average peer actually narrows the gap,
+    // otherwise two evenly loaded workers just trade peers back and forth
+    long gap = busiest->rate_bps - idlest->rate_bps;
+    long avg_peer_rate = busiest->rate_bps / busiest->peer_count;
+
+    bool rate_skew = busiest->rate_bps > REBALANCE_RATIO * idlest->rate_bps &&
+                     gap > REBALANCE_MIN_RATE &&
+                     gap > avg_peer_rate + avg_peer_rate / 2;
+    bool count_skew = busiest->peer_count - idlest->peer_count >= 2;
+
+    if ((rate_skew || count_skew) &&
+        request_migration(busiest, idlest->thread_id)) {
+        busiest->cooldown = 2;
+        idlest->cooldown = 2;
+    }
+}
+
+static void print_worker_stats(void) {
+    long tx_frames, tx_writes, tx_bytes;
+    peer_output_stats(&tx_frames, &tx_writes, &tx_bytes);
+    printf("[TX] %ld frames in %ld writes (%.2f MiB)\n",
+           tx_frames, tx_writes, tx_bytes / (1024.0 * 1024.0));
+
+    long rx_in_place, rx_copied;
+    store_block_stats(&rx_in_place, &rx_copied);
+    printf("[RX] %ld blocks received in place, %ld copied\n",
+           rx_in_place, rx_copied);
+
+    long rx_reads, rx_frames, rx_buffered;
+    peer_rx_stats(&rx_reads, &rx_frames, &rx_buffered);
+    printf("[RX] %ld frames in %ld reads, %.2f MiB of blocks via receive buffer\n",
+           rx_frames, rx_reads, rx_buffered / (1024.0 * 1024.0));
+
+    conn_manager_print_stats(&conn_mgr);
+    pipeline_print_stats();
+    interest_print_stats();
+
+    printf("[LOCKS] waited %ld times for the picker lock\n",
+           __atomic_load_n(&state_waits, __ATOMIC_RELAXED));
+    hash_pool_print_stats(&hash_pool);
+
+    for (int i = 0; i < NUM_WORKER_THREADS; i++) {
+        WorkerThread *w = &workers[i];
+        printf("[WORKER %d] peers=%d rate=%.1f KiB/s msgs=%ld/s util=%d%% "
+               "total=%.1f MiB moved in/out=%ld/%ld steals=%ld\n",
+               w->thread_id,
+               __atomic_load_n(&w->peer_count, __ATOMIC_RELAXED),
+               __atomic_load_n(&w->rate_bps, __ATOMIC_RELAXED) / 1024.0,
+               __atomic_load_n(&w->msg_rate, __ATOMIC_RELAXED),
+               __atomic_load_n(&w->util_pct, __ATOMIC_RELAXED),
+               __atomic_load_n(&w->bytes_in, __ATOMIC_RELAXED) / (1024.0 * 1024.0),
+               __atomic_load_n(&w->migrated_in, __ATOMIC_RELAXED),
+               __atomic_load_n(&w->migrated_out, __ATOMIC_RELAXED),
+               __atomic_load_n(&w->steals, __ATOMIC_RELAXED));
+    }
+}
+
+// ============================================================================
+// Worker thread function
+// ============================================================================
+static void on_worker_sweep(void *ctx) {
+    WorkerThread *w = ctx;
+    double now = get_time_seconds();
+
+    // Take back requests from snubbing peers and missed deadlines first,
+    // so that peers that are delivering can pick them up; snubs are
+    // logged once the lock is released
+    for (int i = 0; i < w->peer_count; i++) {
+        Peer *p = w->peers[i];
+        bool was_snubbed = p->snubbed;
+
+        state_lock();
+        int released = pipeline_expire(p, w->ts, now);
+        state_unlock();
+
+        pipeline_print_snub(p, was_snubbed, released, now);
+    }
+
+    // Request more blocks from our own peers, and hand upload slots freed
+    // on any worker to peers that asked for one while all were taken
+    for (int i = 0; i < w->peer_count; i++) {
+        Peer *p = w->peers[i];
+        peer_sample_rate(p, now);
+        if (p->state != PEER_ACTIVE || p->socket_fd < 0)
+            continue;
+        try_unchoke(p);
+        if (!p->is_choked)
+            maybe_request_more(p, w->ts);
+    }
+
+    worker_reap_peers(w);
+
+    __atomic_store_n(&w->busy_usec, (long)(w->loop->dispatch_time * 1e6),
+                     __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&w->migrate_to, __ATOMIC_ACQUIRE) >= 0)
+        worker_migrate_peer(w, now);
+
+    event_loop_arm(w->loop, &w->sweep_timer, SWEEP_INTERVAL);
+}
+
+static void on_worker_steal(void *ctx) {
+    WorkerThread *w = ctx;
+
+    worker_try_steal(w);
+    event_loop_arm(w->loop, &w->steal_timer, STEAL_INTERVAL);
+}
+
+void* worker_thread_func(void* arg) {
+    WorkerThread *w = (WorkerThread*)arg;
+    TorrentState *ts = w->ts;
+
+    // the main thread is 0 to the picker
+    picker_set_thread(w->thread_id + 1);
+
+    timer_init(&w->sweep_timer, on_worker_sweep, w);
+    timer_init(&w->steal_timer, on_worker_steal, w);
+    event_loop_arm(w->loop, &w->sweep_timer, SWEEP_INTERVAL);
+    event_loop_arm(w->loop, &w->steal_timer, STEAL_INTERVAL);
+
+    // sleeps until I/O, a wakeup on wake_fd or the next timer
+    while (!__atomic_load_n(&shutdown_flag, __ATOMIC_ACQUIRE))
+        event_loop_poll(w->loop, -1);
+
+    timer_cancel(&w->sweep_timer);
+    timer_cancel(&w->steal_timer);
+
+    // Hand surviving peers back to the shared list for the seeding phase
+    worker_drain_inbox(w);
+    worker_reap_peers(w);
+
+    state_lock();
+    for (int i = 0; i < w->peer_count; i++) {
+        Peer *p = w->peers[i];
+        peer_unwatch(p);
+        attach_peer(ts, p);
+    }
+    state_unlock();
+    __atomic_store_n(&w->peer_count, 0, __ATOMIC_RELAXED);
+
+    io_backend_thread_exit();
     return NULL;
 }
 
+static int worker_init(WorkerThread *w, int id, TorrentState *ts) {
+    memset(w, 0, sizeof(*w));
+    w->thread_id = id;
+    w->ts = ts;
+    w->migrate_to = -1;
+    pthread_mutex_init(&w->inbox_lock, NULL);
+
+    w->interest_done = interest_map_new(ts);
+    if (!w->interest_done) return -1;
+
+    w->loop = event_loop_create(w);
+    if (!w->loop) {
+        free(w->interest_done);
+        return -1;
+    }
+
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->wake_fd < 0) {
+        perror("eventfd");
+        event_loop_destroy(w->loop);
+        return -1;
+    }
+
+    w->wake_ev.fn = on_worker_wake;
+    w->wake_ev.ctx = NULL;
+    event_loop_add(w->loop, &w->wake_ev, w->wake_fd, EPOLLIN);
+    return 0;
+}
+
+static void worker_destroy(WorkerThread *w) {
+    close(w->wake_fd);
+    event_loop_destroy(w->loop);
+    free(w->peers);
+    free(w->inbox_peers);
+    free(w->inbox_haves);
+    free(w->inbox_cancels);
+    free(w->interest_done);
+    pthread_mutex_destroy(&w->inbox_lock);
+}
+
+// ============================================================================
+// Main thread: listen socket and tracker, hands new peers to workers
+// ============================================================================
+
+static void on_main_listen_event(EventLoop *loop, void *ctx, uint32_t events) {
+    TorrentState *ts = loop->user;
+    (void)ctx;
+    (void)events;
+
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+
+        int fd = accept4(ts->listen_fd, (struct sockaddr *)&addr, &addr_len,
+                         SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
+        }
+
+        char ip_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip_str, sizeof(ip_str));
+
+        if (total_peer_count() >= MAX_PEER_CONNECTIONS) {
+            close(fd);
+            continue;
+        }
+
+        Peer *p = peer_create(ip_str, ntohs(addr.sin_port));
+        if (!p) {
+            close(fd);
+            continue;
+        }
+
+        p->socket_fd = fd;
+        p->state = PEER_WAIT_HANDSHAKE_OUT;
+        peer_expect_handshake(p);
+        printf("[LISTEN] Accepted inbound peer %s:%d\n", p->ip, p->port);
+
+        if (worker_handoff_peer(pick_worker(), p) < 0)
+            peer_free(p);
+    }
+}
+
+// main thread timers, ctx is the main loop
+static Timer tracker_timer;
+static Timer scheduler_timer;
+static Timer stats_timer;
+static double last_rebalance;
+
+static void on_tracker_timer(void *ctx) {
+    EventLoop *loop = ctx;
+    TorrentState *ts = loop->user;
+
+    printf("\n[TRACKER] Contacting tracker...\n");
+    TrackerResponse tr;
+    if (contact_tracker(ts->meta, &tr) == 0) {
+        printf("[TRACKER] Received %d peers\n", tr.num_peers);
+
+        for (int i = 0; i < tr.num_peers; i++)
+            conn_manager_add_candidate(&conn_mgr, tr.peers[i].ip,
+                                       tr.peers[i].port);
+
+        tracker_response_free(&tr);
+    }
+
+    event_loop_arm(loop, &tracker_timer, TRACKER_RECONTACT_INTERVAL);
+}
+
+static void on_scheduler_timer(void *ctx) {
+    EventLoop *loop = ctx;
+    double t = get_time_seconds();
+
+    scheduler_pass(t - last_rebalance);
+    last_rebalance = t;
+    event_loop_arm(loop, &scheduler_timer, REBALANCE_INTERVAL);
+}
+
+static void on_stats_timer(void *ctx) {
+    EventLoop *loop = ctx;
+
+    print_worker_stats();
+    event_loop_arm(loop, &stats_timer, STATS_INTERVAL);
+}
+
+// Verdicts from the hash pool. A verified piece is announced by every
+// worker to its peers; a failed one is emptied before the picker hands
+// out its blocks again. The main loop checks for completion right after
+// this wakeup.
+static void on_hash_results(EventLoop *loop, void *ctx, uint32_t events) {
+    TorrentState *ts = ctx;
+    HashResult res[HASH_RESULT_BATCH];
+    (void)loop;
+    (void)events;
+
+    int n = hash_pool_collect(&hash_pool, res, HASH_RESULT_BATCH);
+    for (int k = 0; k < n; k++) {
+        int index = res[k].piece;
+
+        if (!res[k].ok) {
+            // the state lock spans both resets, so a block the emptied
+            // buffer takes is only counted once the counts are reset
+            state_lock();
+            reset_piece(ts, index);
+            picker_piece_failed(ts, index);
+            state_unlock();
+
+            printf("[STORE] Piece %d FAILED verification. Resetting.\n", index);
+            continue;
+        }
+
+        mark_piece_complete(ts, index);
+        broadcast_have_safe(index);
+        print_progress_if_needed(ts);
+
+        state_lock();
+        endgame_piece_done(ts, get_time_seconds());
+        state_unlock();
+
+        printf(" [PIECE] Completed piece %d\n", index);
+    }
+}
+
+// Stop and join the first started worker threads, then tear down the
+// first initialised workers. None is torn down before all have stopped:
+// a worker finishing its last piece still posts to the others' inboxes.
+static void stop_workers(int started, int initialised) {
+    __atomic_store_n(&shutdown_flag, true, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < started; i++) {
+        worker_wake(&workers[i]);
+        pthread_join(workers[i].pthread, NULL);
+    }
+
+    for (int i = 0; i < initialised; i++)
+        worker_destroy(&workers[i]);
+}
+
 // ============================================================================
 // Main download function with multithreading
 // ============================================================================
 int download_torrent_multithreaded(TorrentState *ts) {
-    time_t last_tracker_contact = 0;
-    
+    __atomic_store_n(&shutdown_flag, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&unchoked_slots, 0, __ATOMIC_RELAXED);
+
+    EventLoop *main_loop = event_loop_create(ts);
+    if (!main_loop) return -1;
+
+    if (conn_manager_init(&conn_mgr) < 0) {
+        event_loop_destroy(main_loop);
+        return -1;
+    }
+    EventHandler dial_ev = { .fn = on_dial_slot_free, .ctx = NULL };
+    event_loop_add(main_loop, &dial_ev, conn_mgr.notify_fd, EPOLLIN);
+
+    if (hash_pool_init(&hash_pool, ts) < 0) {
+        conn_manager_destroy(&conn_mgr);
+        event_loop_destroy(main_loop);
+        return -1;
+    }
+    EventHandler hash_ev = { .fn = on_hash_results, .ctx = ts };
+    event_loop_add(main_loop, &hash_ev, hash_pool.notify_fd, EPOLLIN);
+
     ts->listen_fd = setup_listen_socket(ts->listen_port);
     if (ts->listen_fd >= 0) {
         printf("[LISTEN] Accepting peers on port %d (fd=%d)\n",
                ts->listen_port, ts->listen_fd);
+        ts->listen_ev.fn = on_main_listen_event;
+        ts->listen_ev.ctx = NULL;
+        event_loop_add(main_loop, &ts->listen_ev, ts->listen_fd, EPOLLIN);
     }
 
-   
-
-    // Create worker threads
-    WorkerThread workers[NUM_WORKER_THREADS];
+    // Create worker threads, each with its own reactor
     for (int i = 0; i < NUM_WORKER_THREADS; i++) {
-        workers[i].thread_id = i;
-        workers[i].ts = ts;
-        pthread_create(&workers[i].pthread, NULL, worker_thread_func, &workers[i]);
+        if (worker_init(&workers[i], i, ts) < 0) {
+            fprintf(stderr, "[WORKER] Failed to set up worker %d\n", i);
+            stop_workers(i, i);
+            hash_pool_destroy(&hash_pool);
+            conn_manager_destroy(&conn_mgr);
+            event_loop_destroy(main_loop);
+            return -1;
+        }
+        if (pthread_create(&workers[i].pthread, NULL, worker_thread_func, &workers[i]) != 0) {
+            fprintf(stderr, "[WORKER] Could not start worker %d\n", i);
+            stop_workers(i, i + 1);
+            hash_pool_destroy(&hash_pool);
+            conn_manager_destroy(&conn_mgr);
+            event_loop_destroy(main_loop);
+            return -1;
+        }
     }
 
-    // Main thread handles tracker and progress
-    while (1) {
-        time_t now = time(NULL);
+    // peers added before the download started (e.g. by the caller)
+    for (int i = 0; i < ts->peer_count; i++) {
+        peer_unwatch(ts->peers[i]);
+        worker_handoff_peer(pick_worker(), ts->peers[i]);
+    }
+    ts->peer_count = 0;
+
+    timer_init(&tracker_timer, on_tracker_timer, main_loop);
+    timer_init(&scheduler_timer, on_scheduler_timer, main_loop);
+    timer_init(&stats_timer, on_stats_timer, main_loop);
 
+    if (!ts->skip_tracker)
+        on_tracker_timer(main_loop);
+    last_rebalance = get_time_seconds();
+    event_loop_arm(main_loop, &scheduler_timer, REBALANCE_INTERVAL);
+    event_loop_arm(main_loop, &stats_timer, STATS_INTERVAL);
+
+    // Main thread handles tracker, inbound connections and progress
+    while (1) {
         // Check completion
         if (all_pieces_downloaded1(ts)) {
             double elapsed = get_time_seconds() - ts->download_start_time;
@@ -542,40 +1252,33 @@ int download_torrent_multithreaded(TorrentState *ts) {
             printf("║     DOWNLOAD COMPLETE!                 ║\n");
             printf("║     Time: %.2f seconds                 ║\n", elapsed);
             printf("╚════════════════════════════════════════╝\n\n");
-            
-            shutdown_flag = true;
+            print_worker_stats();
+
+            __atomic_store_n(&shutdown_flag, true, __ATOMIC_RELEASE);
             break;
         }
 
-        // Contact tracker
-        if (now - last_tracker_contact > TRACKER_RECONTACT_INTERVAL ||
-            last_tracker_contact == 0) {
-            
-            if (!ts->skip_tracker) {
-                printf("\n[TRACKER] Contacting tracker...\n");
-                TrackerResponse tr;
-                if (contact_tracker(ts->meta, &tr) == 0) {
-                    printf("[TRACKER] Received %d peers\n", tr.num_peers);
-                    
-                    pthread_mutex_lock(&state_mutex);
-                    for (int i = 0; i < tr.num_peers && ts->peer_count < MAX_PEER_CONNECTIONS; i++) {
-                        try_connect_peer(ts, tr.peers[i].ip, tr.peers[i].port);
-                    }
-                    pthread_mutex_unlock(&state_mutex);
-                    
-                    tracker_response_free(&tr);
-                }
-            }
-            last_tracker_contact = now;
-        }
+        // replace closed and failed connections from the pool
+        dial_candidates();
 
-        sleep(1);
+        // sleeps until a connection, a hash verdict, a free dial slot or
+        // the next timer
+        event_loop_poll(main_loop, -1);
     }
 
-    // Wait for threads to finish
-    for (int i = 0; i < NUM_WORKER_THREADS; i++) {
-        pthread_join(workers[i].pthread, NULL);
+    stop_workers(NUM_WORKER_THREADS, NUM_WORKER_THREADS);
+
+    // the seeding phase keeps the peers but not their pool slots
+    for (int i = 0; i < ts->peer_count; i++) {
+        ts->peers[i]->conn_cand = -1;
+        pipeline_print_peer(ts->peers[i]);
     }
+    picker_print_stats(ts);
+    endgame_print_stats(ts);
+    file_writer_print_stats(ts);
+    conn_manager_destroy(&conn_mgr);
 
+    hash_pool_destroy(&hash_pool);
+    event_loop_destroy(main_loop);
     return 0;
-}
\ No newline at end of file
+}
@@ -8,13 +8,32 @@
 #include "torrent_parser.h"
 #include "store_pieces.h"
 #include "outgoingMessages.h"
+#include "io_backend.h"
+#include "peer_output.h"
+#include "file_writer.h"
 
-static long total_uploaded_bytes = 0;
+static UploadMode upload_mode = UPLOAD_COPY;
+
+void set_upload_mode(UploadMode mode) {
+    upload_mode = mode;
+}
+
+UploadMode get_upload_mode(void) {
+    return upload_mode;
+}
+
+const char *upload_mode_name(void) {
+    switch (upload_mode) {
+        case UPLOAD_SENDFILE: return "sendfile";
+        case UPLOAD_ZEROCOPY: return "zerocopy";
+        default:              return "copy";
+    }
+}
 
 // KEEP-ALIVE (length = 0)
 int send_keep_alive(Peer *peer) {
     uint32_t zero = 0;
-    return send(peer->socket_fd, &zero, 4, 0) == 4 ? 0 : -1;
+    return peer_queue(peer, &zero, 4);
 }
 
 // CHOKE (id = 0)
@@ -25,7 +44,7 @@ int send_choke(Peer *peer) {
     memcpy(msg, &len, 4);
     msg[4] = 0;
 
-    return send(peer->socket_fd, msg, 5, 0) == 5 ? 0 : -1;
+    return peer_queue(peer, msg, 5);
 }
 
 // UNCHOKE (id = 1)
@@ -36,7 +55,7 @@ int send_unchoke(Peer *peer) {
     memcpy(msg, &len, 4);
     msg[4] = 1;
 
-    return send(peer->socket_fd, msg, 5, 0) == 5 ? 0 : -1;
+    return peer_queue(peer, msg, 5);
 }
 
 // INTERESTED (id = 2)
@@ -47,7 +66,7 @@ int send_interested(Peer *peer) {
     memcpy(msg, &len, 4);
     msg[4] = 2;
 
-    return send(peer->socket_fd, msg, 5, 0) == 5 ? 0 : -1;
+    return peer_queue(peer, msg, 5);
 }
 
 // NOT INTERESTED (id = 3)
@@ -58,7 +77,7 @@ int send_not_interested(Peer *peer) {
     memcpy(msg, &len, 4);
     msg[4] = 3;
 
-    return send(peer->socket_fd, msg, 5, 0) == 5 ? 0 : -1;
+    return peer_queue(peer, msg, 5);
 }
 
 // HAVE (id = 4)
@@ -71,7 +90,24 @@ int send_have(Peer *peer, uint32_t piece_index) {
     msg[4] = 4; 
     memcpy(msg + 5, &net_index, 4);
 
-    return send(peer->socket_fd, msg, 9, 0) == 9 ? 0 : -1;
+    return peer_queue(peer, msg, 9);
+}
+
+// CANCEL (id = 8)
+int send_cancel(Peer *peer, uint32_t index, uint32_t begin, uint32_t length) {
+    uint32_t len = htonl(13);
+    uint32_t net_index = htonl(index);
+    uint32_t net_begin = htonl(begin);
+    uint32_t net_length = htonl(length);
+
+    unsigned char msg[17];
+    memcpy(msg, &len, 4);
+    msg[4] = 8;
+    memcpy(msg + 5, &net_index, 4);
+    memcpy(msg + 9, &net_begin, 4);
+    memcpy(msg + 13, &net_length, 4);
+
+    return peer_queue(peer, msg, 17);
 }
 
 // BITFIELD (id = 5)
@@ -86,7 +122,7 @@ int send_bitfield(Peer *peer, TorrentState *ts) {
     int bf_len = ts->my_bitfield_len;
     uint32_t len = htonl(1 + bf_len);
 
-    unsigned char *msg = malloc(4 + 1 + bf_len);
+    unsigned char *msg = peer_queue_reserve(peer, 4 + 1 + bf_len);
     if (!msg) {
         fprintf(stderr, " malloc failed\n");
         return -1;
@@ -94,30 +130,47 @@ int send_bitfield(Peer *peer, TorrentState *ts) {
     
     memcpy(msg, &len, 4);
     msg[4] = 5; 
-    memcpy(msg + 5, ts->my_bitfield, bf_len);
-
-    int sent = send(peer->socket_fd, msg, 5 + bf_len, 0);
-    free(msg);
+    // other threads may be setting bits as we copy
+    for (int i = 0; i < bf_len; i++)
+        msg[5 + i] = __atomic_load_n(&ts->my_bitfield[i], __ATOMIC_RELAXED);
 
-    return (sent == 5 + bf_len) ? 0 : -1;
+    return peer_queue_commit(peer);
 }
 
 // tell peers what we have
-int broadcast_have(TorrentState *ts, int piece_index) {
-    if (!ts) return -1;
-    
-    for (int i = 0; i < ts->peer_count; i++) {
-        Peer *p = ts->peers[i];
-        if (!p || p->socket_fd < 0) continue;
-        
-        printf(" Broadcasting HAVE %d to %s:%d\n",
-               piece_index, p->ip, p->port);
-        
-        send_have(p, (uint32_t)piece_index);
+// the HAVE is queued for every peer, then all queues are flushed together
+int broadcast_have_to(Peer **peers, int count, int piece_index) {
+    if (!peers || count <= 0) return 0;
+
+    uint32_t len = htonl(5);
+    uint32_t net_index = htonl((uint32_t)piece_index);
+    unsigned char msg[9];
+    memcpy(msg, &len, 4);
+    msg[4] = 4;
+    memcpy(msg + 5, &net_index, 4);
+
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        Peer *p = peers[i];
+        if (!p || p->socket_fd < 0 || p->state != PEER_ACTIVE) continue;
+
+        if (peer_queue_deferred(p, msg, 9) == 0)
+            n++;
+    }
+
+    if (n > 0) {
+        printf(" Broadcasting HAVE %d to %d peers\n", piece_index, n);
+        peer_flush_many(peers, count);
     }
+
     return 0;
 }
 
+int broadcast_have(TorrentState *ts, int piece_index) {
+    if (!ts) return -1;
+    return broadcast_have_to(ts->peers, ts->peer_count, piece_index);
+}
+
 // BITFIELD (id = 7)
 int send_piece(Peer *peer, TorrentState *ts, int index, int begin, int length)
 {
@@ -138,11 +191,6 @@ int send_piece(Peer *peer, TorrentState *ts, int index, int begin, int length)
 
     PieceBuffer *pb = &ts->pieces[index];
     
-    if (!pb->data) {
-        fprintf(stderr, "[PIECE] Piece %d data is NULL\n", index);
-        return -1;
-    }
-    
     if (!pb->verified) {
         fprintf(stderr, "[PIECE] Piece %d not verified\n", index);
         return -1;
@@ -154,42 +202,87 @@ int send_piece(Peer *peer, TorrentState *ts, int index, int begin, int length)
         return -1;
     }
 
-    
-    uint32_t msg_len = htonl(9 + length);
-    unsigned char *msg = malloc(4 + 9 + length);
-    if (!msg) {
-        fprintf(stderr, "[PIECE] malloc failed for %d bytes\n", 4 + 9 + length);
+    // a peer that is not reading gets no more blocks until it catches up
+    if (peer->tx_queued + 13 + length > PEER_TX_MAX_QUEUED) {
+        fprintf(stderr, "[PIECE] Output queue full for %s:%d\n", peer->ip, peer->port);
         return -1;
     }
 
-    // Construct message
-    memcpy(msg, &msg_len, 4);                   
-    msg[4] = 7;                                  
-
+    unsigned char header[13];
+    uint32_t msg_len = htonl(9 + length);
     uint32_t index_be = htonl(index);
     uint32_t begin_be = htonl(begin);
 
-    memcpy(msg+5, &index_be, 4);               
-    memcpy(msg+9, &begin_be, 4);               
-    memcpy(msg+13, pb->data + begin, length);  
-
-    // Send message
-    int sent = send(peer->socket_fd, msg, 4 + 9 + length, 0);
-    free(msg);
-
-    if (sent <= 0) {
-        fprintf(stderr, " Failed to send to %s:%d\n", peer->ip, peer->port);
-        return -1;
+    memcpy(header, &msg_len, 4);
+    header[4] = 7;
+    memcpy(header+5, &index_be, 4);
+    memcpy(header+9, &begin_be, 4);
+
+    int rc;
+    bool on_disk = __atomic_load_n(&pb->written, __ATOMIC_ACQUIRE) && ts->writer;
+
+    if (upload_mode == UPLOAD_SENDFILE || !pb->data) {
+        // the RAM copy may be released at any time in this mode, so
+        // never touch pb->data; wait until the piece is on disk
+        if (!on_disk) {
+            fprintf(stderr, "[PIECE] Piece %d not on disk yet\n", index);
+            return -1;
+        }
+
+        // header in the queue, block straight from the page cache
+        off_t offset;
+        int fd = file_writer_block_fd(ts, index, begin, length, &offset);
+        if (fd >= 0) {
+            if (peer_queue_deferred(peer, header, sizeof(header)) < 0)
+                return -1;
+            rc = peer_queue_file(peer, fd, offset, length);
+        } else {
+            // the block spans files (or the descriptor could be closed
+            // before it is sent): copy it out of the files instead, read
+            // first so a failed read leaves nothing half-queued
+            unsigned char *block = malloc(length);
+            if (!block || file_writer_read(ts, index, begin, block, length) != 0) {
+                fprintf(stderr, "[PIECE] Failed to read block %d:%d from disk\n",
+                        index, begin);
+                free(block);
+                return -1;
+            }
+
+            unsigned char *msg = peer_queue_reserve(peer, sizeof(header) + length);
+            if (msg) {
+                memcpy(msg, header, sizeof(header));
+                memcpy(msg+13, block, length);
+            }
+            free(block);
+            if (!msg)
+                return -1;
+            rc = peer_queue_commit(peer);
+        }
+
+    } else if (upload_mode == UPLOAD_ZEROCOPY) {
+        // verified pieces never change, so the kernel can send from them
+        if (peer_queue_deferred(peer, header, sizeof(header)) < 0)
+            return -1;
+        rc = peer_queue_ref(peer, pb->data + begin, length);
+
+    } else {
+        unsigned char *msg = peer_queue_reserve(peer, sizeof(header) + length);
+        if (!msg) {
+            fprintf(stderr, "[PIECE] malloc failed for %d bytes\n", 4 + 9 + length);
+            return -1;
+        }
+
+        // Construct message in place in the output queue
+        memcpy(msg, header, sizeof(header));
+        memcpy(msg+13, pb->data + begin, length);
+        rc = peer_queue_commit(peer);
     }
 
-    if (sent != 4 + 9 + length) {
-        fprintf(stderr, " Partial send: %d/%d bytes\n", sent, 4 + 9 + length);
+    // a short write leaves the rest queued; only a socket error fails
+    if (rc < 0) {
+        fprintf(stderr, " Failed to send to %s:%d\n", peer->ip, peer->port);
         return -1;
     }
 
-    total_uploaded_bytes += length;
-    printf("  Sent piece=%d begin=%d length=%d to %s:%d (total: %ld bytes)\n",
-           index, begin, length, peer->ip, peer->port, total_uploaded_bytes);
-
     return 0;
 }
\ No newline at end of file
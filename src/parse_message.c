@@ -10,6 +10,7 @@
 #include "store_pieces.h"
 #include "torrent_parser.h"
 #include "outgoingMessages.h"
+#include "piece_picker.h"
 
 /* parse a full BitTorrent message frame into ParsedMessage  
    returns 0 on success, -1 on error */
@@ -132,10 +133,8 @@ void handle_peer_communication(Peer *peer, TorrentState *ts)
                 uint32_t idx = ntohl(*(uint32_t*)msg.payload);
                 printf("[PEER] Peer HAS piece %u\n", idx);
 
-                /* update peer bitfield */
-                if (peer->bitfield && idx < peer->bitfield_len * 8) {
-                    peer->bitfield[idx/8] |= (1 << (7 - (idx % 8)));
-                }
+                /* update peer bitfield and availability */
+                picker_peer_have(ts, peer, idx);
                 break;
             }
 
@@ -144,19 +143,10 @@ void handle_peer_communication(Peer *peer, TorrentState *ts)
 
                 if (msg.payload_len == 0) break;
 
-                if (peer->bitfield) {
-                    free(peer->bitfield);
-                    peer->bitfield = NULL;
-                }
-
-                peer->bitfield_len = msg.payload_len;
-                peer->bitfield = malloc(peer->bitfield_len);
-                if (!peer->bitfield) {
+                if (picker_peer_bitfield(ts, peer, msg.payload, msg.payload_len) < 0) {
                     fprintf(stderr, "malloc failed for bitfield\n");
                     exit(1);
                 }
-
-                memcpy(peer->bitfield, msg.payload, peer->bitfield_len);
                 break;
 
             case MSG_PIECE: {
@@ -180,7 +170,7 @@ void handle_peer_communication(Peer *peer, TorrentState *ts)
                            req.index, req.begin, req.length);
 
                     /* only serve pieces we have */
-                    if (ts->piece_complete[req.index]) {
+                    if (is_piece_complete(ts, req.index)) {
                         send_piece(peer, ts, req.index, req.begin, req.length);
                     } else {
                         printf("[UPLOAD] Cannot send; we do NOT have piece %u.\n",
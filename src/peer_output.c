@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+#include "peer_output.h"
+#include "io_backend.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+static long stat_frames = 0;
+static long stat_writes = 0;
+static long stat_bytes = 0;
+
+static long stat_copied = 0;
+static long stat_sendfile = 0;
+static long stat_zerocopy = 0;
+static long stat_zerocopy_copied = 0;
+
+static OutChunk *new_chunk(Peer *p, OutChunkKind kind, size_t cap) {
+    OutChunk *c = malloc(sizeof(OutChunk) + cap);
+    if (!c) return NULL;
+
+    memset(c, 0, sizeof(OutChunk));
+    c->kind = kind;
+    c->cap = cap;
+    c->file_fd = -1;
+
+    if (p->tx_tail) p->tx_tail->next = c;
+    else            p->tx_head = c;
+    p->tx_tail = c;
+    return c;
+}
+
+// Make sure the tail chunk has room for len more bytes
+static OutChunk *tail_with_room(Peer *p, size_t len) {
+    OutChunk *t = p->tx_tail;
+    if (t && t->kind == OUT_DATA && t->cap - t->len >= len)
+        return t;
+
+    size_t cap = len > PEER_TX_CHUNK_SIZE ? len : PEER_TX_CHUNK_SIZE;
+    return new_chunk(p, OUT_DATA, cap);
+}
+
+// Drop n written bytes from the front of the queue
+static void consume(Peer *p, size_t n) {
+    p->tx_queued -= n;
+
+    while (n > 0 && p->tx_head) {
+        OutChunk *c = p->tx_head;
+        size_t left = c->len - c->off;
+
+        if (n < left) {
+            c->off += n;
+            return;
+        }
+
+        n -= left;
+        p->tx_head = c->next;
+        if (!p->tx_head) p->tx_tail = NULL;
+        free(c);
+    }
+}
+
+unsigned char *peer_queue_reserve(Peer *p, size_t len) {
+    if (!p || p->socket_fd < 0) return NULL;
+
+    OutChunk *c = tail_with_room(p, len);
+    if (!c) return NULL;
+
+    unsigned char *dst = c->data + c->len;
+    c->len += len;
+    p->tx_queued += len;
+    __atomic_fetch_add(&stat_copied, (long)len, __ATOMIC_RELAXED);
+    return dst;
+}
+
+int peer_queue_commit(Peer *p) {
+    __atomic_fetch_add(&stat_frames, 1, __ATOMIC_RELAXED);
+
+    if (p->tx_cork > 0)
+        return 0;
+    return peer_flush(p) < 0 ? -1 : 0;
+}
+
+int peer_queue_deferred(Peer *p, const void *frame, size_t len) {
+    unsigned char *dst = peer_queue_reserve(p, len);
+    if (!dst) return -1;
+
+    memcpy(dst, frame, len);
+    __atomic_fetch_add(&stat_frames, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int peer_queue(Peer *p, const void *frame, size_t len) {
+    unsigned char *dst = peer_queue_reserve(p, len);
+    if (!dst) return -1;
+
+    memcpy(dst, frame, len);
+    return peer_queue_commit(p);
+}
+
+int peer_queue_file(Peer *p, int fd, off_t offset, size_t len) {
+    if (!p || p->socket_fd < 0 || fd < 0) return -1;
+
+    OutChunk *c = new_chunk(p, OUT_FILE, 0);
+    if (!c) return -1;
+
+    c->file_fd = fd;
+    c->file_off = offset;
+    c->len = len;
+    p->tx_queued += len;
+    return peer_queue_commit(p);
+}
+
+// Turn on SO_ZEROCOPY the first time a peer needs it
+static bool zerocopy_ready(Peer *p) {
+    if (p->tx_zc_state == 0) {
+        int one = 1;
+        if (setsockopt(p->socket_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+            p->tx_zc_state = 1;
+        } else {
+            p->tx_zc_state = -1;
+        }
+    }
+    return p->tx_zc_state > 0;
+}
+
+int peer_queue_ref(Peer *p, const unsigned char *buf, size_t len) {
+    if (!p || p->socket_fd < 0) return -1;
+
+    if (!zerocopy_ready(p)) {
+        unsigned char *dst = peer_queue_reserve(p, len);
+        if (!dst) return -1;
+        memcpy(dst, buf, len);
+        return peer_queue_commit(p);
+    }
+
+    OutChunk *c = new_chunk(p, OUT_REF, 0);
+    if (!c) return -1;
+
+    c->ref = buf;
+    c->len = len;
+    p->tx_queued += len;
+    return peer_queue_commit(p);
+}
+
+// Read MSG_ZEROCOPY completions off the socket error queue. They have to
+// be drained or they pile up against the socket's option memory.
+static void reap_zerocopy(Peer *p) {
+    char control[128];
+
+    while (p->tx_zc_inflight > 0) {
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+
+        if (recvmsg(p->socket_fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            long n = (long)(ee->ee_data - ee->ee_info) + 1;
+            p->tx_zc_inflight = n > p->tx_zc_inflight ? 0 : p->tx_zc_inflight - n;
+
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                __atomic_fetch_add(&stat_zerocopy_copied, n, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// sendfile() the head chunk. Returns bytes written or -1 with errno set.
+static ssize_t write_file_chunk(Peer *p, OutChunk *c) {
+    off_t off = c->file_off + (off_t)c->off;
+    ssize_t w = sendfile(p->socket_fd, c->file_fd, &off, c->len - c->off);
+    __atomic_fetch_add(&stat_writes, 1, __ATOMIC_RELAXED);
+
+    // file shorter than expected: treat like a broken socket
+    if (w == 0) {
+        errno = EIO;
+        return -1;
+    }
+    if (w > 0)
+        __atomic_fetch_add(&stat_sendfile, (long)w, __ATOMIC_RELAXED);
+    return w;
+}
+
+// Gather memory chunks up to the next file chunk into one sendmsg()
+static ssize_t write_memory_chunks(Peer *p) {
+    struct iovec iov[PEER_TX_MAX_IOV];
+    int n = 0;
+    size_t ref_bytes = 0;
+    bool file_next = false;
+
+    for (OutChunk *c = p->tx_head; c && n < PEER_TX_MAX_IOV; c = c->next) {
+        if (c->kind == OUT_FILE) {
+            file_next = true;
+            break;
+        }
+        if (c->len == c->off) continue;
+
+        const unsigned char *base = c->kind == OUT_REF ? c->ref : c->data;
+        iov[n].iov_base = (void *)(base + c->off);
+        iov[n].iov_len = c->len - c->off;
+        if (c->kind == OUT_REF) ref_bytes += iov[n].iov_len;
+        n++;
+    }
+
+    // sendmsg() is writev() that takes MSG_NOSIGNAL
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = n;
+
+    int flags = MSG_NOSIGNAL;
+    if (ref_bytes > 0) flags |= MSG_ZEROCOPY;
+    if (file_next) flags |= MSG_MORE;   // PIECE header rides with the sendfile() data
+
+    ssize_t w = sendmsg(p->socket_fd, &mh, flags);
+    __atomic_fetch_add(&stat_writes, 1, __ATOMIC_RELAXED);
+
+    if (w > 0 && ref_bytes > 0) {
+        p->tx_zc_inflight++;
+        __atomic_fetch_add(&stat_zerocopy, (long)((size_t)w < ref_bytes ? (size_t)w : ref_bytes),
+                           __ATOMIC_RELAXED);
+    }
+    return w;
+}
+
+int peer_flush(Peer *p) {
+    if (!p) return -1;
+    if (p->socket_fd < 0) {
+        peer_output_reset(p);
+        return -1;
+    }
+
+    int rc = 0;
+    while (p->tx_queued > 0) {
+        ssize_t w = p->tx_head->kind == OUT_FILE ? write_file_chunk(p, p->tx_head)
+                                                 : write_memory_chunks(p);
+
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                rc = 1;     // rest goes out on the next EPOLLOUT edge
+                break;
+            }
+
+            // a frame may be half written, the stream is unusable; the
+            // owner sees EOF on its next read and disconnects as usual
+            perror("peer_flush");
+            shutdown(p->socket_fd, SHUT_RDWR);
+            peer_output_reset(p);
+            return -1;
+        }
+
+        __atomic_fetch_add(&stat_bytes, (long)w, __ATOMIC_RELAXED);
+        consume(p, (size_t)w);
+    }
+
+    if (p->tx_zc_inflight > 0)
+        reap_zerocopy(p);
+    return rc;
+}
+
+void peer_flush_many(Peer **peers, int count) {
+    if (!peers || count <= 0) return;
+
+    if (io_backend_kind() == IO_BACKEND_URING) {
+        IoOp *ops = calloc(count, sizeof(IoOp));
+        Peer **owners = calloc(count, sizeof(Peer *));
+        int n = 0;
+
+        if (ops && owners) {
+            // one op per peer: the unwritten part of its first chunk
+            for (int i = 0; i < count; i++) {
+                Peer *p = peers[i];
+                if (!p || p->socket_fd < 0 || p->tx_cork > 0 || !p->tx_head)
+                    continue;
+                if (p->tx_head->kind != OUT_DATA)
+                    continue;
+
+                OutChunk *c = p->tx_head;
+                ops[n].kind = IO_OP_SEND;
+                ops[n].fd = p->socket_fd;
+                ops[n].buf = c->data + c->off;
+                ops[n].len = c->len - c->off;
+                owners[n] = p;
+                n++;
+            }
+
+            if (n > 0 && io_backend_submit(ops, n) >= 0) {
+                for (int i = 0; i < n; i++) {
+                    if (ops[i].result > 0) {
+                        __atomic_fetch_add(&stat_bytes, (long)ops[i].result,
+                                           __ATOMIC_RELAXED);
+                        consume(owners[i], (size_t)ops[i].result);
+                    } else if (ops[i].result < 0 && ops[i].result != -EAGAIN) {
+                        peer_output_reset(owners[i]);
+                    }
+                }
+            }
+        }
+
+        free(ops);
+        free(owners);
+    }
+
+    // anything left must be written until EAGAIN, or no EPOLLOUT edge
+    // would ever come to finish it
+    for (int i = 0; i < count; i++) {
+        Peer *p = peers[i];
+        if (p && p->socket_fd >= 0 && p->tx_cork == 0 && p->tx_queued > 0)
+            peer_flush(p);
+    }
+}
+
+void peer_cork(Peer *p) {
+    p->tx_cork++;
+}
+
+int peer_uncork(Peer *p) {
+    if (p->tx_cork > 0)
+        p->tx_cork--;
+    if (p->tx_cork > 0)
+        return 0;
+
+    if (p->tx_queued == 0) {
+        // completions arrive as EPOLLERR edges and land here
+        if (p->tx_zc_inflight > 0 && p->socket_fd >= 0)
+            reap_zerocopy(p);
+        return 0;
+    }
+    return peer_flush(p);
+}
+
+void peer_output_reset(Peer *p) {
+    OutChunk *c = p->tx_head;
+    while (c) {
+        OutChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    p->tx_head = NULL;
+    p->tx_tail = NULL;
+    p->tx_queued = 0;
+    p->tx_zc_inflight = 0;
+}
+
+void peer_output_stats(long *frames, long *writes, long *bytes) {
+    if (frames) *frames = __atomic_load_n(&stat_frames, __ATOMIC_RELAXED);
+    if (writes) *writes = __atomic_load_n(&stat_writes, __ATOMIC_RELAXED);
+    if (bytes)  *bytes  = __atomic_load_n(&stat_bytes, __ATOMIC_RELAXED);
+}
+
+void peer_output_copy_stats(long *copied, long *sendfile, long *zerocopy,
+                            long *zerocopy_copied) {
+    if (copied)   *copied   = __atomic_load_n(&stat_copied, __ATOMIC_RELAXED);
+    if (sendfile) *sendfile = __atomic_load_n(&stat_sendfile, __ATOMIC_RELAXED);
+    if (zerocopy) *zerocopy = __atomic_load_n(&stat_zerocopy, __ATOMIC_RELAXED);
+    if (zerocopy_copied)
+        *zerocopy_copied = __atomic_load_n(&stat_zerocopy_copied, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,952 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include "piece_picker.h"
+#include "store_pieces.h"
+#include "sendRequest.h"
+#include "request_pipeline.h"
+#include "init_torrent_state.h"
+
+// piece i in a bitmap laid out like the wire bitfield (first piece in
+// the top bit), so a bitmap word and 8 bitfield bytes line up
+#define PIECE_WORD(i) ((i) / 64)
+#define PIECE_BIT(i) (1ULL << (63 - (i) % 64))
+
+static unsigned int picker_seed;
+
+static int stream_window = 0;
+static double stream_piece_time = STREAM_PIECE_TIME;
+
+// the calling thread's id and the started pieces it claims from first
+static __thread int picker_thread;
+static __thread int reserved[PICKER_RESERVED];
+static __thread int reserved_count;
+static __thread int reserved_next;   // slot to replace when full
+
+void picker_set_thread(int id) {
+    picker_thread = id;
+    reserved_count = 0;
+    reserved_next = 0;
+}
+
+void set_stream_mode(int window, double piece_time) {
+    if (window >= 0)
+        stream_window = window;
+    else if (stream_window == 0)
+        stream_window = STREAM_WINDOW_DEFAULT;
+
+    if (piece_time > 0)
+        stream_piece_time = piece_time;
+}
+
+// 8 bytes of the peer's bitfield as one word, zero past its end
+static uint64_t peer_word(const Peer *p, int w) {
+    unsigned char buf[8] = {0};
+    int n = p->bitfield_len - w * 8;
+
+    if (n <= 0)
+        return 0;
+    if (n > 8)
+        n = 8;
+    memcpy(buf, p->bitfield + w * 8, n);
+
+    uint64_t v;
+    memcpy(&v, buf, sizeof(v));
+    return be64toh(v);
+}
+
+static uint64_t *piece_free_words(PiecePicker *pk, int i) {
+    return pk->free_blocks + (size_t)i * pk->block_words;
+}
+
+// Tiers in picking order: the highest priority first
+static int tier_of(TorrentState *ts, int i) {
+    int prio = ts->piece_priority ? ts->piece_priority[i] : FILE_PRIO_NORMAL;
+    return FILE_PRIO_HIGH - prio;
+}
+
+int picker_init(TorrentState *ts) {
+    int n = ts->total_pieces;
+    PiecePicker *pk = calloc(1, sizeof(PiecePicker));
+    if (!pk)
+        return -1;
+    ts->picker = pk;
+
+    int max_blocks = (ts->piece_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t slots = n > 0 ? n : 1;
+
+    pk->words = (n + 63) / 64;
+    pk->block_words = (max_blocks + 63) / 64;
+    if (pk->block_words < 1)
+        pk->block_words = 1;
+
+    ts->availability = calloc(slots, sizeof(int));
+    pk->fresh = calloc(pk->words + 1, sizeof(uint64_t));
+    pk->order = malloc(slots * sizeof(int));
+    pk->pos = malloc(slots * sizeof(int));
+    pk->partial = malloc(slots * sizeof(int));
+    pk->partial_pos = malloc(slots * sizeof(int));
+    pk->free_blocks = calloc(slots * pk->block_words, sizeof(uint64_t));
+    pk->free_count = malloc(slots * sizeof(int));
+    pk->owner = malloc(slots);
+
+    if (!ts->availability || !pk->fresh || !pk->order ||
+        !pk->pos || !pk->partial || !pk->partial_pos || !pk->free_blocks ||
+        !pk->free_count || !pk->owner) {
+        picker_free(ts);
+        return -1;
+    }
+
+    picker_seed = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+    pk->streaming = stream_window > 0;
+
+    int tier_size[PICKER_TIERS] = {0};
+
+    for (int i = 0; i < n; i++) {
+        pk->partial_pos[i] = -1;
+        pk->pos[i] = -1;
+        pk->free_count[i] = 0;
+        pk->owner[i] = -1;
+        if (!piece_wanted(ts, i))
+            continue;
+
+        int nb = ts->pieces[i].num_blocks;
+        uint64_t *fw = piece_free_words(pk, i);
+
+        for (int b = 0; b < nb; b++)
+            fw[b / 64] |= 1ULL << (b % 64);
+
+        pk->free_count[i] = nb;
+        pk->free_total += nb;
+        pk->fresh[PIECE_WORD(i)] |= PIECE_BIT(i);
+        tier_size[tier_of(ts, i)]++;
+    }
+
+    // everything starts with availability 0, in the first bucket of its
+    // tier
+    int tier_start[PICKER_TIERS + 1];
+    tier_start[0] = 0;
+    for (int t = 0; t < PICKER_TIERS; t++) {
+        tier_start[t + 1] = tier_start[t] + tier_size[t];
+        pk->bucket[t * PICKER_LEVELS] = tier_start[t];
+        for (int a = 1; a < PICKER_LEVELS; a++)
+            pk->bucket[t * PICKER_LEVELS + a] = tier_start[t + 1];
+    }
+    pk->bucket[PICKER_BUCKETS] = tier_start[PICKER_TIERS];
+
+    // and nothing is started: every bucket is all fresh
+    for (int l = 0; l < PICKER_BUCKETS; l++)
+        pk->fresh_end[l] = pk->bucket[l + 1];
+
+    int fill[PICKER_TIERS];
+    memcpy(fill, tier_start, sizeof(fill));
+    for (int i = 0; i < n; i++) {
+        if (piece_wanted(ts, i))
+            pk->order[fill[tier_of(ts, i)]++] = i;
+    }
+
+    // each tier shuffled once; ties within a bucket then come out in
+    // random order
+    for (int t = 0; t < PICKER_TIERS; t++) {
+        int *o = pk->order + tier_start[t];
+        for (int i = tier_size[t] - 1; i > 0; i--) {
+            int j = rand_r(&picker_seed) % (i + 1);
+            int tmp = o[i];
+            o[i] = o[j];
+            o[j] = tmp;
+        }
+    }
+    for (int k = 0; k < pk->bucket[PICKER_BUCKETS]; k++)
+        pk->pos[pk->order[k]] = k;
+
+    return 0;
+}
+
+void picker_free(TorrentState *ts) {
+    PiecePicker *pk = ts->picker;
+
+    free(ts->availability);
+    ts->availability = NULL;
+
+    if (!pk)
+        return;
+
+    free(pk->fresh);
+    free(pk->order);
+    free(pk->pos);
+    free(pk->partial);
+    free(pk->partial_pos);
+    free(pk->free_blocks);
+    free(pk->free_count);
+    free(pk->owner);
+    free(pk);
+    ts->picker = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Availability order
+// ---------------------------------------------------------------------------
+
+static int level_of(TorrentState *ts, int i) {
+    int a = ts->availability[i];
+    return tier_of(ts, i) * PICKER_LEVELS + (a < PICKER_LEVELS ? a : PICKER_LEVELS - 1);
+}
+
+static void swap_order(PiecePicker *pk, int x, int y) {
+    int px = pk->order[x];
+    int py = pk->order[y];
+
+    pk->order[x] = py;
+    pk->order[y] = px;
+    pk->pos[py] = x;
+    pk->pos[px] = y;
+}
+
+static bool is_fresh(PiecePicker *pk, int i) {
+    return pk->fresh[PIECE_WORD(i)] & PIECE_BIT(i);
+}
+
+// The fresh pieces of a bucket come first: order[bucket[l] ..
+// fresh_end[l]-1]. These move a piece of bucket l across that line.
+static void fresh_leave(PiecePicker *pk, int i, int l) {
+    swap_order(pk, pk->pos[i], --pk->fresh_end[l]);
+}
+
+static void fresh_enter(PiecePicker *pk, int i, int l) {
+    swap_order(pk, pk->pos[i], pk->fresh_end[l]++);
+}
+
+// Last place of its bucket, then make that place the next bucket's
+// first; a fresh piece goes through the end of the fresh ones, a started
+// one through the start of the next bucket's
+static void move_up(PiecePicker *pk, int i, int level) {
+    bool fresh = is_fresh(pk, i);
+
+    if (fresh)
+        fresh_leave(pk, i, level);
+    swap_order(pk, pk->pos[i], pk->bucket[level + 1] - 1);
+    pk->bucket[level + 1]--;
+
+    if (fresh || level + 1 == PICKER_BUCKETS)
+        return;
+    fresh_leave(pk, i, level + 1);
+}
+
+static void move_down(PiecePicker *pk, int i, int level) {
+    bool fresh = is_fresh(pk, i);
+
+    if (!fresh) {
+        swap_order(pk, pk->pos[i], pk->fresh_end[level]);
+        pk->fresh_end[level]++;
+    }
+    swap_order(pk, pk->pos[i], pk->bucket[level]);
+    pk->bucket[level]++;
+
+    if (fresh)
+        fresh_enter(pk, i, level - 1);
+}
+
+static void availability_add(TorrentState *ts, int i) {
+    PiecePicker *pk = ts->picker;
+
+    if (pk->pos[i] >= 0 && ts->availability[i] < PICKER_LEVELS - 1)
+        move_up(pk, i, level_of(ts, i));
+    ts->availability[i]++;
+}
+
+static void availability_remove(TorrentState *ts, int i) {
+    PiecePicker *pk = ts->picker;
+
+    if (ts->availability[i] <= 0)
+        return;
+    if (pk->pos[i] >= 0 && ts->availability[i] <= PICKER_LEVELS - 1)
+        move_down(pk, i, level_of(ts, i));
+    ts->availability[i]--;
+}
+
+// Move the piece past every bucket and out of the order
+static void order_remove(TorrentState *ts, int i) {
+    PiecePicker *pk = ts->picker;
+
+    for (int l = level_of(ts, i); l < PICKER_BUCKETS; l++)
+        move_up(pk, i, l);
+    pk->pos[i] = -1;
+}
+
+// ---------------------------------------------------------------------------
+// Peers
+// ---------------------------------------------------------------------------
+
+// Add (+1) or remove (-1) every piece in the peer's bitfield
+static void count_bitfield(TorrentState *ts, const Peer *p, int delta) {
+    if (!ts->picker || !p->bitfield)
+        return;
+
+    int n = p->bitfield_len * 8;
+    if (n > ts->total_pieces)
+        n = ts->total_pieces;
+
+    for (int i = 0; i < n; i++) {
+        if (!(p->bitfield[i / 8] & (1 << (7 - (i % 8)))))
+            continue;
+        if (delta > 0)
+            availability_add(ts, i);
+        else
+            availability_remove(ts, i);
+    }
+}
+
+int picker_peer_bitfield(TorrentState *ts, Peer *p,
+                         const unsigned char *bits, uint32_t len) {
+    count_bitfield(ts, p, -1);
+    free(p->bitfield);
+    p->bitfield = NULL;
+    p->bitfield_len = 0;
+
+    p->bitfield = malloc(len ? len : 1);
+    if (!p->bitfield)
+        return -1;
+
+    memcpy(p->bitfield, bits, len);
+    p->bitfield_len = len;
+
+    count_bitfield(ts, p, +1);
+    return 0;
+}
+
+bool picker_peer_have(TorrentState *ts, Peer *p, uint32_t index) {
+    if (index >= (uint32_t)ts->total_pieces)
+        return false;
+
+    // a peer that started with nothing may skip the BITFIELD
+    if (!p->bitfield) {
+        p->bitfield = calloc(ts->my_bitfield_len, 1);
+        if (!p->bitfield)
+            return false;
+        p->bitfield_len = ts->my_bitfield_len;
+    }
+
+    if (index >= (uint32_t)p->bitfield_len * 8 || peer_has_piece(p, index))
+        return false;
+
+    p->bitfield[index / 8] |= (1 << (7 - (index % 8)));
+    if (ts->picker)
+        availability_add(ts, index);
+    return true;
+}
+
+void picker_peer_gone(TorrentState *ts, Peer *p) {
+    count_bitfield(ts, p, -1);
+    free(p->bitfield);
+    p->bitfield = NULL;
+    p->bitfield_len = 0;
+}
+
+// ---------------------------------------------------------------------------
+// Streaming
+// ---------------------------------------------------------------------------
+
+// Move the cursor past complete pieces and give the pieces that entered
+// the window their deadlines
+static void stream_advance(TorrentState *ts, double now) {
+    PiecePicker *pk = ts->picker;
+    int n = ts->total_pieces;
+
+    while (pk->cursor < n && pk->pos[pk->cursor] < 0)
+        pk->cursor++;
+
+    if (pk->first_time <= 0 &&
+        ((long)pk->cursor * ts->piece_length >= (long)STREAM_FIRST_MIB << 20 ||
+         pk->cursor == n))
+        pk->first_time = now;
+
+    if (!pk->streaming)
+        return;
+
+    int end = pk->cursor + stream_window;
+    if (end > n)
+        end = n;
+
+    int i = pk->window_end > pk->cursor ? pk->window_end : pk->cursor;
+    for (; i < end; i++) {
+        if (pk->pos[i] >= 0)
+            ts->piece_states[i].deadline = now + (i - pk->cursor + 1) * stream_piece_time;
+    }
+
+    if (end > pk->window_end)
+        pk->window_end = end;
+}
+
+// Would a block asked of this peer now arrive before the piece's
+// deadline? Peers without a rate estimate yet get the benefit of the
+// doubt, and a piece already late goes to whoever can take it.
+static bool in_time(const Peer *p, const PieceState *ps, double now) {
+    if (p->dlv_rate <= 0 || ps->deadline <= now)
+        return true;
+
+    double eta = now + (p->outstanding_requests + 1) * (double)BLOCK_SIZE / p->dlv_rate;
+    return eta <= ps->deadline;
+}
+
+// A window piece this peer is too slow for
+static bool stream_skip(TorrentState *ts, const Peer *p, int i, double now) {
+    const PieceState *ps = &ts->piece_states[i];
+    return ts->picker->streaming && ps->deadline > 0 && !in_time(p, ps, now);
+}
+
+// First window piece, in order, the peer has and can deliver in time
+static int pick_window(TorrentState *ts, Peer *p, double now) {
+    PiecePicker *pk = ts->picker;
+
+    for (int i = pk->cursor; i < pk->window_end; i++) {
+        pk->examined++;
+
+        if (pk->pos[i] < 0 || __atomic_load_n(&pk->free_count[i], __ATOMIC_RELAXED) == 0 ||
+            !peer_has_piece(p, i))
+            continue;
+        if (in_time(p, &ts->piece_states[i], now))
+            return i;
+    }
+    return -1;
+}
+
+// A block in flight elsewhere of a piece due within one piece time
+static bool pick_urgent(TorrentState *ts, Peer *p, double now,
+                        int *piece, int *block) {
+    PiecePicker *pk = ts->picker;
+
+    for (int i = pk->cursor; i < pk->window_end; i++) {
+        PieceState *ps = &ts->piece_states[i];
+
+        if (pk->pos[i] < 0 || ps->deadline <= 0 ||
+            ps->deadline - now > stream_piece_time)
+            continue;
+        if (!peer_has_piece(p, i) || !in_time(p, ps, now))
+            continue;
+
+        PieceBuffer *pb = &ts->pieces[i];
+        for (int b = 0; b < pb->num_blocks; b++) {
+            if (block_stored(pb, b) ||
+                !__atomic_load_n(&pb->block_requested[b], __ATOMIC_RELAXED))
+                continue;
+            if (pipeline_has_request(p, i, b * BLOCK_SIZE))
+                continue;
+
+            ps->raced = true;
+            pk->raced_blocks++;
+            *piece = i;
+            *block = b;
+            return true;
+        }
+    }
+    return false;
+}
+
+// ---------------------------------------------------------------------------
+// Block states
+// ---------------------------------------------------------------------------
+
+// Keep the fresh bitmap and the partial list in step with the piece.
+// Lock-free claims do not come here, so a piece they use up stays in the
+// partial list until its next update under the lock.
+static void update_lists(TorrentState *ts, int i) {
+    PiecePicker *pk = ts->picker;
+    int free_count = __atomic_load_n(&pk->free_count[i], __ATOMIC_RELAXED);
+    bool wanted = pk->pos[i] >= 0;
+    bool started = free_count < ts->pieces[i].num_blocks;
+    bool fresh = wanted && !started;
+
+    if (wanted && fresh != is_fresh(pk, i)) {
+        if (fresh)
+            fresh_enter(pk, i, level_of(ts, i));
+        else
+            fresh_leave(pk, i, level_of(ts, i));
+    }
+
+    if (fresh)
+        pk->fresh[PIECE_WORD(i)] |= PIECE_BIT(i);
+    else
+        pk->fresh[PIECE_WORD(i)] &= ~PIECE_BIT(i);
+
+    if (wanted && started && free_count > 0) {
+        if (pk->partial_pos[i] < 0) {
+            pk->partial_pos[i] = pk->partial_count;
+            pk->partial[pk->partial_count++] = i;
+        }
+    } else if (pk->partial_pos[i] >= 0) {
+        int last = pk->partial[--pk->partial_count];
+        pk->partial[pk->partial_pos[i]] = last;
+        pk->partial_pos[last] = pk->partial_pos[i];
+        pk->partial_pos[i] = -1;
+    }
+}
+
+static void count_taken(PiecePicker *pk, int i, int n) {
+    __atomic_fetch_sub(&pk->free_count[i], n, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&pk->free_total, n, __ATOMIC_RELAXED);
+}
+
+// Clear the block's free bit; false if it was not free
+static bool take_block(PiecePicker *pk, int i, int b) {
+    uint64_t bit = 1ULL << (b % 64);
+    uint64_t old = __atomic_fetch_and(&piece_free_words(pk, i)[b / 64], ~bit,
+                                      __ATOMIC_ACQ_REL);
+
+    if (!(old & bit))
+        return false;
+
+    count_taken(pk, i, 1);
+    return true;
+}
+
+// Claim the first free block of the piece: a CAS on the word holding it,
+// retried while other threads take blocks of the same word
+static int claim_first(PiecePicker *pk, int i) {
+    uint64_t *fw = piece_free_words(pk, i);
+
+    for (int w = 0; w < pk->block_words; w++) {
+        uint64_t old = __atomic_load_n(&fw[w], __ATOMIC_ACQUIRE);
+
+        while (old) {
+            uint64_t bit = old & -old;
+
+            if (__atomic_compare_exchange_n(&fw[w], &old, old & ~bit, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                count_taken(pk, i, 1);
+                return w * 64 + __builtin_ctzll(bit);
+            }
+            __atomic_fetch_add(&pk->claim_retries, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return -1;
+}
+
+// The claimed block is requested now; it cannot have been before
+static void note_claim(TorrentState *ts, int piece, int block) {
+    PiecePicker *pk = ts->picker;
+
+    if (__atomic_exchange_n(&ts->pieces[piece].block_requested[block], true,
+                            __ATOMIC_RELAXED))
+        __atomic_fetch_add(&pk->duplicate_claims, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pk->claims, 1, __ATOMIC_RELAXED);
+}
+
+// Remember a piece this thread works on, replacing the oldest once full
+static void reserve(int piece) {
+    for (int k = 0; k < reserved_count; k++) {
+        if (reserved[k] == piece)
+            return;
+    }
+
+    if (reserved_count < PICKER_RESERVED) {
+        reserved[reserved_count++] = piece;
+    } else {
+        reserved[reserved_next] = piece;
+        reserved_next = (reserved_next + 1) % PICKER_RESERVED;
+    }
+}
+
+// Give a block back: set its free bit unless it is free already
+static bool return_block(PiecePicker *pk, int piece, int block) {
+    uint64_t bit = 1ULL << (block % 64);
+    uint64_t old = __atomic_fetch_or(&piece_free_words(pk, piece)[block / 64], bit,
+                                     __ATOMIC_ACQ_REL);
+
+    if (old & bit)
+        return false;
+
+    __atomic_fetch_add(&pk->free_count[piece], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pk->free_total, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void picker_unmark(TorrentState *ts, int piece, int block) {
+    if (piece < 0 || piece >= ts->total_pieces)
+        return;
+
+    PieceBuffer *pb = &ts->pieces[piece];
+    if (!pb->block_requested || block < 0 || block >= pb->num_blocks)
+        return;
+    if (block_stored(pb, block))
+        return;
+
+    __atomic_store_n(&pb->block_requested[block], false, __ATOMIC_RELAXED);
+
+    PiecePicker *pk = ts->picker;
+    if (!pk || pk->pos[piece] < 0)
+        return;
+
+    if (return_block(pk, piece, block))
+        update_lists(ts, piece);
+}
+
+void picker_return_claim(TorrentState *ts, int piece, int block) {
+    PiecePicker *pk = ts->picker;
+
+    __atomic_store_n(&ts->pieces[piece].block_requested[block], false, __ATOMIC_RELAXED);
+
+    // the piece may have left the partial list: our own reservation
+    // still finds it, and the next update under the lock (a block of it
+    // arriving) lists it again
+    if (pk)
+        return_block(pk, piece, block);
+}
+
+void picker_block_received(TorrentState *ts, int piece, int block) {
+    if (!ts->picker || piece < 0 || piece >= ts->total_pieces)
+        return;
+    if (block < 0 || block >= ts->pieces[piece].num_blocks)
+        return;
+
+    // normally taken when it was requested already
+    take_block(ts->picker, piece, block);
+    update_lists(ts, piece);
+}
+
+void picker_piece_done(TorrentState *ts, int piece) {
+    PiecePicker *pk = ts->picker;
+    if (!pk || piece < 0 || piece >= ts->total_pieces || pk->pos[piece] < 0)
+        return;
+
+    double now = get_time_seconds();
+    double deadline = ts->piece_states[piece].deadline;
+    if (deadline > 0) {
+        if (now <= deadline)
+            pk->deadlines_met++;
+        else
+            pk->deadlines_missed++;
+    }
+
+    order_remove(ts, piece);
+    stream_advance(ts, now);
+
+    // whatever is still free is taken at once, so a lock-free claim
+    // racing with this finds nothing
+    uint64_t *fw = piece_free_words(pk, piece);
+    int left = 0;
+    for (int w = 0; w < pk->block_words; w++)
+        left += __builtin_popcountll(__atomic_exchange_n(&fw[w], 0, __ATOMIC_ACQ_REL));
+    count_taken(pk, piece, left);
+    update_lists(ts, piece);
+}
+
+// Back into the order, in the bucket of its availability: the reverse
+// of order_remove()
+static void order_insert(TorrentState *ts, int i) {
+    PiecePicker *pk = ts->picker;
+    int last = pk->bucket[PICKER_BUCKETS]++;
+
+    pk->order[last] = i;
+    pk->pos[i] = last;
+    if (is_fresh(pk, i))
+        fresh_enter(pk, i, PICKER_BUCKETS - 1);
+    for (int l = PICKER_BUCKETS - 1; l > level_of(ts, i); l--)
+        move_down(pk, i, l);
+}
+
+void picker_piece_failed(TorrentState *ts, int piece) {
+    PiecePicker *pk = ts->picker;
+    if (!pk || piece < 0 || piece >= ts->total_pieces || pk->pos[piece] >= 0 ||
+        !piece_wanted(ts, piece))
+        return;
+
+    PieceState *ps = &ts->piece_states[piece];
+    memset(ps->have_block, 0, ps->total_blocks);
+    memset(ps->requested_block, 0, ps->total_blocks);
+    ps->received_blocks = 0;
+    ps->raced = false;
+
+    order_insert(ts, piece);
+    pk->owner[piece] = -1;
+
+    // the reader waits on it again
+    if (piece < pk->cursor) {
+        pk->cursor = piece;
+        if (pk->streaming)
+            ps->deadline = get_time_seconds() + stream_piece_time;
+    }
+
+    int nb = ts->pieces[piece].num_blocks;
+    uint64_t *fw = piece_free_words(pk, piece);
+    for (int b = 0; b < nb; b++)
+        __atomic_fetch_or(&fw[b / 64], 1ULL << (b % 64), __ATOMIC_RELEASE);
+    __atomic_store_n(&pk->free_count[piece], nb, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pk->free_total, nb, __ATOMIC_RELAXED);
+    update_lists(ts, piece);
+}
+
+int picker_wanted_pieces(TorrentState *ts, const int **pieces) {
+    PiecePicker *pk = ts->picker;
+    if (!pk) {
+        *pieces = NULL;
+        return 0;
+    }
+
+    *pieces = pk->order;
+    return pk->bucket[PICKER_BUCKETS];
+}
+
+long picker_free_blocks(TorrentState *ts) {
+    return ts->picker ? __atomic_load_n(&ts->picker->free_total, __ATOMIC_RELAXED) : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Picking
+// ---------------------------------------------------------------------------
+
+// Most important, then rarest started piece the peer has, this thread's
+// own before others', random among equals
+static int pick_partial(TorrentState *ts, Peer *p, double now) {
+    PiecePicker *pk = ts->picker;
+    int best = -1;
+    int best_level = 0;
+    int ties = 0;
+
+    for (int k = 0; k < pk->partial_count; k++) {
+        int i = pk->partial[k];
+        pk->examined++;
+
+        // used up by lock-free claims since it was listed
+        if (__atomic_load_n(&pk->free_count[i], __ATOMIC_RELAXED) == 0)
+            continue;
+        if (!peer_has_piece(p, i) || stream_skip(ts, p, i, now))
+            continue;
+
+        int level = 2 * level_of(ts, i) + (pk->owner[i] != picker_thread);
+        if (best >= 0 && level > best_level)
+            continue;
+        if (best < 0 || level < best_level)
+            ties = 0;
+
+        // reservoir sampling: each equal candidate is kept with
+        // probability 1/ties
+        if (rand_r(&picker_seed) % ++ties == 0) {
+            best = i;
+            best_level = level;
+        }
+    }
+    return best;
+}
+
+// Warmup: any unstarted piece of the most important tier still wanted
+// that the peer has, from a random word on
+static int pick_random(TorrentState *ts, Peer *p, double now) {
+    PiecePicker *pk = ts->picker;
+    if (pk->words == 0)
+        return -1;
+
+    int top = 0;
+    while (top < PICKER_TIERS - 1 &&
+           pk->bucket[top * PICKER_LEVELS] == pk->bucket[(top + 1) * PICKER_LEVELS])
+        top++;
+
+    int start = rand_r(&picker_seed) % pk->words;
+
+    for (int k = 0; k < pk->words; k++) {
+        int w = (start + k) % pk->words;
+        uint64_t bits = pk->fresh[w] & peer_word(p, w);
+        pk->examined++;
+
+        while (bits) {
+            int lead = __builtin_clzll(bits);
+            int i = w * 64 + lead;
+
+            if (tier_of(ts, i) == top && !stream_skip(ts, p, i, now))
+                return i;
+            bits &= ~(1ULL << (63 - lead));
+        }
+    }
+    return -1;
+}
+
+// Rarest unstarted piece of the highest tier the peer has, from the
+// fresh bitmap ANDed with the peer's bitfield a word at a time; the
+// first of the rarest from a random word on
+static int rarest_fresh(TorrentState *ts, Peer *p, double now) {
+    PiecePicker *pk = ts->picker;
+    int best = -1;
+    int best_level = 0;
+
+    if (pk->words == 0)
+        return -1;
+
+    int start = rand_r(&picker_seed) % pk->words;
+
+    for (int k = 0; k < pk->words; k++) {
+        int w = (start + k) % pk->words;
+        uint64_t bits = pk->fresh[w] & peer_word(p, w);
+        pk->examined++;
+
+        while (bits) {
+            int lead = __builtin_clzll(bits);
+            int i = w * 64 + lead;
+            bits &= ~(1ULL << (63 - lead));
+
+            int level = level_of(ts, i);
+            if ((best < 0 || level < best_level) && !stream_skip(ts, p, i, now)) {
+                best = i;
+                best_level = level;
+            }
+        }
+    }
+    return best;
+}
+
+// Rarest unstarted piece of the highest tier the peer has (started ones
+// are pick_partial()'s). The fresh pieces of each bucket are walked from
+// a random place, but only for as many as the fresh bitmap has words (at
+// least PICKER_SCAN_MIN): past that the peer has few of the pieces in
+// front, and the bitmap is as quick.
+static int pick_rarest(TorrentState *ts, Peer *p, double now) {
+    PiecePicker *pk = ts->picker;
+    int budget = pk->words > PICKER_SCAN_MIN ? pk->words : PICKER_SCAN_MIN;
+
+    for (int l = 0; l < PICKER_BUCKETS; l++) {
+        // nobody has the pieces in the first bucket of a tier
+        if (l % PICKER_LEVELS == 0)
+            continue;
+
+        int first = pk->bucket[l];
+        int len = pk->fresh_end[l] - first;
+        if (len <= 0)
+            continue;
+
+        int start = rand_r(&picker_seed) % len;
+        for (int k = 0; k < len; k++) {
+            int i = pk->order[first + (start + k) % len];
+            pk->examined++;
+
+            if (peer_has_piece(p, i) && !stream_skip(ts, p, i, now))
+                return i;
+            if (--budget == 0)
+                return rarest_fresh(ts, p, now);
+        }
+    }
+    return -1;
+}
+
+// The piece to take the next block from, -1 if none
+static int pick_piece(TorrentState *ts, Peer *p, double now, int best) {
+    if (best < 0)
+        best = pick_partial(ts, p, now);
+    if (best < 0 && __atomic_load_n(&ts->pieces_complete, __ATOMIC_RELAXED) < PICKER_RANDOM_FIRST)
+        best = pick_random(ts, p, now);
+    if (best < 0)
+        best = pick_rarest(ts, p, now);
+    return best;
+}
+
+bool picker_pick_block(TorrentState *ts, Peer *p, int *piece, int *block,
+                       bool *duplicate) {
+    PiecePicker *pk = ts->picker;
+    double now = 0;
+    int best = -1;
+
+    *duplicate = false;
+    if (!pk || !p->bitfield)
+        return false;
+
+    pk->picks++;
+
+    // the reader's window first, in order; then race what is late
+    if (pk->streaming) {
+        now = get_time_seconds();
+        if (pk->window_end == 0)
+            stream_advance(ts, now);
+
+        best = pick_window(ts, p, now);
+        if (best < 0 && pick_urgent(ts, p, now, piece, block)) {
+            *duplicate = true;
+            return true;
+        }
+    }
+
+    // a lock-free claim may empty the chosen piece first; then look again
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (__atomic_load_n(&pk->free_total, __ATOMIC_RELAXED) == 0)
+            return false;
+
+        best = pick_piece(ts, p, now, attempt == 0 ? best : -1);
+        if (best < 0)
+            return false;
+
+        int b = claim_first(pk, best);
+        if (b < 0)
+            continue;
+
+        if (pk->owner[best] < 0)
+            pk->owner[best] = (signed char)picker_thread;
+        if (pk->owner[best] == picker_thread)
+            reserve(best);
+
+        note_claim(ts, best, b);
+        update_lists(ts, best);
+        *piece = best;
+        *block = b;
+        return true;
+    }
+    return false;
+}
+
+bool picker_claim_reserved(TorrentState *ts, Peer *p, int *piece, int *block) {
+    PiecePicker *pk = ts->picker;
+
+    if (!pk || pk->streaming || !p->bitfield)
+        return false;
+
+    for (int k = 0; k < reserved_count; ) {
+        int i = reserved[k];
+
+        // kept for the thread's other peers
+        if (i < ts->total_pieces && !peer_has_piece(p, i)) {
+            k++;
+            continue;
+        }
+
+        int b = i < ts->total_pieces ? claim_first(pk, i) : -1;
+        if (b >= 0) {
+            note_claim(ts, i, b);
+            __atomic_fetch_add(&pk->claims_unlocked, 1, __ATOMIC_RELAXED);
+            *piece = i;
+            *block = b;
+            return true;
+        }
+
+        // nothing left to claim: if blocks are returned later, the
+        // locked picker hands the piece back to us
+        reserved[k] = reserved[--reserved_count];
+    }
+    return false;
+}
+
+void picker_print_stats(TorrentState *ts) {
+    PiecePicker *pk = ts->picker;
+    if (!pk)
+        return;
+
+    printf("[PICKER] %ld picks, %.1f candidates examined per pick, "
+           "%d pieces wanted, %d partial\n",
+           pk->picks, pk->picks ? (double)pk->examined / pk->picks : 0.0,
+           pk->bucket[PICKER_BUCKETS], pk->partial_count);
+
+    printf("[PICKER] %ld blocks claimed, %ld of them without the lock, "
+           "%ld CAS retries, %ld claimed twice\n",
+           __atomic_load_n(&pk->claims, __ATOMIC_RELAXED),
+           __atomic_load_n(&pk->claims_unlocked, __ATOMIC_RELAXED),
+           __atomic_load_n(&pk->claim_retries, __ATOMIC_RELAXED),
+           __atomic_load_n(&pk->duplicate_claims, __ATOMIC_RELAXED));
+
+    if (pk->first_time > 0)
+        printf("[STREAM] First %d MiB readable after %.2f s\n",
+               STREAM_FIRST_MIB, pk->first_time - ts->download_start_time);
+
+    if (pk->streaming)
+        printf("[STREAM] %d-piece window: %ld deadlines met, %ld missed, "
+               "%ld blocks raced near the cursor\n",
+               stream_window, pk->deadlines_met, pk->deadlines_missed,
+               pk->raced_blocks);
+}
@@ -8,8 +8,12 @@
 #include <stdlib.h>     
 #include <string.h>     
 #include <sys/socket.h> 
+#include <sys/uio.h>
 #include <arpa/inet.h>  
+#include <errno.h>
 #include "receive_message.h"
+#include "contact_tracker.h"
+#include "store_pieces.h"
 
 void print_hex(const unsigned char *buf, size_t len) {
     for (size_t i = 0; i < len; i++)
@@ -91,3 +95,249 @@ unsigned char* receive_message(int sock_fd) {
 
     return buf;
 }
+
+static long rx_reads;        // recv()/recvmsg() calls that returned data
+static long rx_frames;       // frames and blocks decoded
+static long rx_copied;       // PIECE payload bytes moved from rx_buf into place
+
+void peer_rx_stats(long *reads, long *frames, long *copied_bytes) {
+    if (reads) *reads = __atomic_load_n(&rx_reads, __ATOMIC_RELAXED);
+    if (frames) *frames = __atomic_load_n(&rx_frames, __ATOMIC_RELAXED);
+    if (copied_bytes) *copied_bytes = __atomic_load_n(&rx_copied, __ATOMIC_RELAXED);
+}
+
+// read without blocking: first into dst (the rest of a block or big frame,
+// if any), then whatever else the socket has into the free end of rx_buf.
+// returns bytes read into dst and rx_buf together (>0), or WIRE_AGAIN /
+// WIRE_ERROR
+static int recv_some(struct Peer *peer, unsigned char *dst, size_t dst_len) {
+    struct iovec iov[2];
+    struct msghdr mh;
+    int iovcnt = 0;
+
+    if (dst_len > 0) {
+        iov[iovcnt].iov_base = dst;
+        iov[iovcnt].iov_len = dst_len;
+        iovcnt++;
+    }
+    if (peer->rx_end < PEER_RX_BUF_SIZE) {
+        uint32_t room = PEER_RX_BUF_SIZE - peer->rx_end;
+        uint32_t buffered = peer->rx_end - peer->rx_start;
+
+        // while blocks are streaming in, stop after the next PIECE header
+        // so its payload can be read into place instead of through rx_buf
+        if (peer->rx_in_blocks && buffered < 13 && 13 - buffered < room)
+            room = 13 - buffered;
+
+        iov[iovcnt].iov_base = peer->rx_buf + peer->rx_end;
+        iov[iovcnt].iov_len = room;
+        iovcnt++;
+    }
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+
+    while (1) {
+        ssize_t n = recvmsg(peer->socket_fd, &mh, 0);
+        if (n > 0) {
+            __atomic_fetch_add(&rx_reads, 1, __ATOMIC_RELAXED);
+            if ((size_t)n > dst_len)
+                peer->rx_end += n - dst_len;
+            return (int)n;
+        }
+        if (n == 0) return WIRE_ERROR;          // peer closed
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return WIRE_AGAIN;
+        return WIRE_ERROR;
+    }
+}
+
+// move undecoded bytes to the front so the next read gets the most room
+static void compact_rx_buf(struct Peer *peer) {
+    if (peer->rx_start == 0)
+        return;
+    memmove(peer->rx_buf, peer->rx_buf + peer->rx_start,
+            peer->rx_end - peer->rx_start);
+    peer->rx_end -= peer->rx_start;
+    peer->rx_start = 0;
+}
+
+// hand len buffered bytes over to dst (rest of a block or big frame)
+static uint32_t take_buffered(struct Peer *peer, unsigned char *dst, uint32_t len) {
+    uint32_t avail = peer->rx_end - peer->rx_start;
+    if (len > avail) len = avail;
+    memcpy(dst, peer->rx_buf + peer->rx_start, len);
+    peer->rx_start += len;
+    return len;
+}
+
+// give back a block we stopped receiving in place
+static void release_claim(struct Peer *peer) {
+    if (peer->rx_claim) {
+        release_block_claim(peer->rx_claim);
+        peer->rx_claim = NULL;
+    }
+    peer->rx_dst = NULL;
+}
+
+static void end_frame(struct Peer *peer, uint32_t len) {
+    peer->bytes_received += 4 + len;
+    peer->msgs_received++;
+    __atomic_fetch_add(&rx_frames, 1, __ATOMIC_RELAXED);
+}
+
+int peer_read_message_direct(struct Peer *peer, struct TorrentState *ts,
+                             unsigned char **out) {
+    *out = NULL;
+
+    // the big frame handed out last time has been used by now
+    free(peer->rx_done);
+    peer->rx_done = NULL;
+
+    if (!peer->rx_buf) {
+        peer->rx_buf = malloc(PEER_RX_BUF_SIZE);
+        if (!peer->rx_buf) {
+            perror("malloc");
+            return WIRE_ERROR;
+        }
+        peer->rx_start = peer->rx_end = 0;
+    }
+
+    while (1) {
+        // 1. block payload straight into the piece buffer
+        if (peer->rx_dst) {
+            uint32_t off = peer->rx_got - 9;
+            uint32_t n = take_buffered(peer, peer->rx_dst + off,
+                                       peer->rx_len - peer->rx_got);
+            __atomic_fetch_add(&rx_copied, n, __ATOMIC_RELAXED);
+            peer->rx_got += n;
+
+            if (peer->rx_got < peer->rx_len) {
+                uint32_t need = peer->rx_len - peer->rx_got;
+                peer->rx_start = peer->rx_end = 0;
+                int r = recv_some(peer, peer->rx_dst + (peer->rx_got - 9), need);
+                if (r <= 0) return r;
+                peer->rx_got += (uint32_t)r < need ? (uint32_t)r : need;
+                continue;
+            }
+
+            // the claim goes with the block: store_block() ends it
+            peer->rx_block = peer->rx_dst;
+            peer->rx_dst = NULL;
+            peer->rx_claim = NULL;
+            peer->rx_in_blocks = true;
+            end_frame(peer, peer->rx_len);
+            return WIRE_BLOCK;
+        }
+
+        // 2. frame larger than rx_buf, assembled in its own allocation
+        if (peer->rx_msg) {
+            peer->rx_got += take_buffered(peer, peer->rx_msg + 4 + peer->rx_got,
+                                          peer->rx_len - peer->rx_got);
+
+            if (peer->rx_got < peer->rx_len) {
+                uint32_t need = peer->rx_len - peer->rx_got;
+                peer->rx_start = peer->rx_end = 0;
+                int r = recv_some(peer, peer->rx_msg + 4 + peer->rx_got, need);
+                if (r <= 0) return r;
+                peer->rx_got += (uint32_t)r < need ? (uint32_t)r : need;
+                continue;
+            }
+
+            *out = peer->rx_done = peer->rx_msg;
+            peer->rx_msg = NULL;
+            peer->rx_in_blocks = false;
+            end_frame(peer, peer->rx_len);
+            return WIRE_DONE;
+        }
+
+        // 3. decode the next frame from rx_buf
+        unsigned char *p = peer->rx_buf + peer->rx_start;
+        uint32_t avail = peer->rx_end - peer->rx_start;
+
+        if (avail >= 4) {
+            uint32_t len_net;
+            memcpy(&len_net, p, 4);
+            uint32_t len = ntohl(len_net);
+
+            if (len > (1 << 20)) { // 1 MB max frame
+                fprintf(stderr, "Peer sent invalid length: %u\n", len);
+                return WIRE_ERROR;
+            }
+
+            // PIECE with a block we still need: payload goes into place
+            if (ts && len > 9 && avail >= 13 && p[4] == 7) {
+                uint32_t index, begin;
+                memcpy(&index, p + 5, 4);
+                memcpy(&begin, p + 9, 4);
+                index = ntohl(index);
+                begin = ntohl(begin);
+
+                peer->rx_dst = claim_block_buffer(ts, index, begin, len - 9,
+                                                  &peer->rx_claim);
+                if (peer->rx_dst) {
+                    peer->rx_block_index = index;
+                    peer->rx_block_begin = begin;
+                    peer->rx_block_len = len - 9;
+                    peer->rx_len = len;
+                    peer->rx_got = 9;
+                    peer->rx_start += 13;
+                    continue;
+                }
+            }
+
+            // complete frame: handed out where it lies, valid until the
+            // next call for this peer
+            if (avail >= 4 + len) {
+                *out = p;
+                peer->rx_start += 4 + len;
+                peer->rx_in_blocks = false;
+                end_frame(peer, len);
+                return WIRE_DONE;
+            }
+
+            if (4 + len > PEER_RX_BUF_SIZE) {
+                peer->rx_msg = malloc(4 + len);
+                if (!peer->rx_msg) {
+                    perror("malloc");
+                    return WIRE_ERROR;
+                }
+                memcpy(peer->rx_msg, p, 4);
+                peer->rx_len = len;
+                peer->rx_got = 0;
+                peer->rx_start += 4;
+                continue;
+            }
+        }
+
+        // 4. need more bytes: one large read for as many frames as are queued
+        if (peer->rx_start == peer->rx_end)
+            peer->rx_start = peer->rx_end = 0;
+        else
+            compact_rx_buf(peer);
+
+        int r = recv_some(peer, NULL, 0);
+        if (r <= 0) return r;
+    }
+}
+
+int peer_read_message(struct Peer *peer, unsigned char **out) {
+    return peer_read_message_direct(peer, NULL, out);
+}
+
+void peer_rx_reset(struct Peer *peer) {
+    release_claim(peer);
+    free(peer->rx_msg);
+    free(peer->rx_done);
+    free(peer->rx_buf);
+    peer->rx_msg = NULL;
+    peer->rx_done = NULL;
+    peer->rx_buf = NULL;
+    peer->rx_start = 0;
+    peer->rx_end = 0;
+    peer->rx_in_blocks = false;
+    peer->rx_len = 0;
+    peer->rx_got = 0;
+    peer->hs_got = 0;
+}
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "request_pipeline.h"
+#include "store_pieces.h"
+#include "outgoingMessages.h"
+#include "piece_picker.h"
+
+static int min_depth = PIPELINE_MIN_DEPTH;
+static int max_depth = PIPELINE_MAX_DEPTH;
+
+static long rtt_samples;
+static long window_grows;
+static long window_shrinks;
+static long requests_timed_out;
+static long requests_released;
+static long peers_snubbed;
+
+void set_pipeline_bounds(int lo, int hi) {
+    if (hi > PIPELINE_MAX_DEPTH)
+        hi = PIPELINE_MAX_DEPTH;
+    if (hi >= 1)
+        max_depth = hi;
+    if (lo >= 1)
+        min_depth = lo;
+    if (min_depth > max_depth)
+        min_depth = max_depth;
+}
+
+void get_pipeline_bounds(int *lo, int *hi) {
+    if (lo) *lo = min_depth;
+    if (hi) *hi = max_depth;
+}
+
+static int clamp_depth(int depth) {
+    if (depth < min_depth) return min_depth;
+    if (depth > max_depth) return max_depth;
+    return depth;
+}
+
+void pipeline_init(Peer *p) {
+    p->max_pipeline = clamp_depth(PIPELINE_INITIAL_DEPTH);
+    p->outstanding_requests = 0;
+    p->snubbed = false;
+    p->snubbed_at = 0;
+    p->last_delivery = 0;
+    p->srtt = 0;
+    p->min_rtt = 0;
+    p->dlv_rate = 0;
+    p->dlv_bytes = 0;
+    p->dlv_mark = 0;
+    p->dlv_mark_time = 0;
+}
+
+int pipeline_on_request(Peer *p, uint32_t index, uint32_t begin,
+                        uint32_t len, double now) {
+    if (!p->reqs) {
+        p->reqs = malloc(PIPELINE_MAX_DEPTH * sizeof(PeerRequest));
+        if (!p->reqs)
+            return -1;
+    }
+    if (p->outstanding_requests >= PIPELINE_MAX_DEPTH)
+        return -1;
+
+    // a quiet spell with nothing asked for is not a snub
+    if (p->outstanding_requests == 0 && p->last_delivery < now)
+        p->last_delivery = now;
+
+    PeerRequest *r = &p->reqs[p->outstanding_requests++];
+    r->index = index;
+    r->begin = begin;
+    r->length = len;
+    r->sent = now;
+    return 0;
+}
+
+static void rtt_sample(Peer *p, double rtt) {
+    if (rtt < 0)
+        rtt = 0;
+
+    p->srtt = p->srtt > 0 ? 0.875 * p->srtt + 0.125 * rtt : rtt;
+
+    // the minimum never ages out: with a full window every later sample
+    // includes the queue we built at the peer, and taking that as the
+    // path delay would grow the window without bound
+    if (p->min_rtt <= 0 || rtt < p->min_rtt)
+        p->min_rtt = rtt;
+
+    __atomic_fetch_add(&rtt_samples, 1, __ATOMIC_RELAXED);
+}
+
+// Window from the current estimates; unchanged until both exist
+static void resize_window(Peer *p) {
+    if (p->snubbed || p->min_rtt <= 0 || p->dlv_rate <= 0)
+        return;
+
+    double rtt = p->min_rtt > PIPELINE_RTT_FLOOR ? p->min_rtt : PIPELINE_RTT_FLOOR;
+    double bdp = p->dlv_rate * rtt / BLOCK_SIZE;
+    int depth = clamp_depth((int)(PIPELINE_GAIN * bdp) + 1);
+
+    if (depth > p->max_pipeline)
+        __atomic_fetch_add(&window_grows, 1, __ATOMIC_RELAXED);
+    else if (depth < p->max_pipeline)
+        __atomic_fetch_add(&window_shrinks, 1, __ATOMIC_RELAXED);
+
+    p->max_pipeline = depth;
+}
+
+// Unordered table: the last entry fills the hole
+static void remove_request(Peer *p, int i) {
+    p->reqs[i] = p->reqs[--p->outstanding_requests];
+}
+
+static int find_request(const Peer *p, uint32_t index, uint32_t begin) {
+    for (int i = 0; i < p->outstanding_requests; i++) {
+        if (p->reqs[i].index == index && p->reqs[i].begin == begin)
+            return i;
+    }
+    return -1;
+}
+
+bool pipeline_on_block(Peer *p, uint32_t index, uint32_t begin,
+                       uint32_t len, double now) {
+    int i = find_request(p, index, begin);
+    bool found = i >= 0;
+
+    if (found) {
+        rtt_sample(p, now - p->reqs[i].sent);
+        remove_request(p, i);
+    }
+
+    p->last_delivery = now;
+
+    p->dlv_bytes += len;
+    if (p->dlv_mark_time <= 0) {
+        p->dlv_mark = p->dlv_bytes - len;
+        p->dlv_mark_time = now;
+        return found;
+    }
+
+    // sample over at least one round trip so that a burst of blocks
+    // read in one go does not look like line rate
+    double dt = now - p->dlv_mark_time;
+    if (dt < PIPELINE_RATE_INTERVAL || dt < p->srtt)
+        return found;
+
+    // rises at once, decays slowly: the window must not collapse because
+    // of a single sample taken while the peer was briefly idle
+    double rate = (p->dlv_bytes - p->dlv_mark) / dt;
+    p->dlv_rate = rate > p->dlv_rate ? rate : 0.75 * p->dlv_rate + 0.25 * rate;
+    p->dlv_mark = p->dlv_bytes;
+    p->dlv_mark_time = now;
+
+    resize_window(p);
+    return found;
+}
+
+bool pipeline_has_request(const Peer *p, uint32_t index, uint32_t begin) {
+    return find_request(p, index, begin) >= 0;
+}
+
+bool pipeline_cancel(Peer *p, uint32_t index, uint32_t begin) {
+    int i = find_request(p, index, begin);
+    if (i < 0)
+        return false;
+
+    if (p->socket_fd >= 0)
+        send_cancel(p, index, begin, p->reqs[i].length);
+    remove_request(p, i);
+    return true;
+}
+
+// Make a block available to the picker again, unless it arrived meanwhile
+static void unmark_block(TorrentState *ts, const PeerRequest *r) {
+    if (r->index >= (uint32_t)ts->total_pieces)
+        return;
+
+    picker_unmark(ts, r->index, r->begin / BLOCK_SIZE);
+}
+
+int pipeline_release(Peer *p, TorrentState *ts) {
+    int n = p->outstanding_requests;
+
+    for (int i = 0; i < n; i++)
+        unmark_block(ts, &p->reqs[i]);
+
+    p->outstanding_requests = 0;
+
+    // the gap until the next unchoke is not delivery time
+    p->dlv_mark_time = 0;
+
+    if (n > 0)
+        __atomic_fetch_add(&requests_released, n, __ATOMIC_RELAXED);
+    return n;
+}
+
+void pipeline_print_snub(const Peer *p, bool was_snubbed, int released, double now) {
+    if (p->snubbed && !was_snubbed)
+        printf("[PIPE] %s:%d snubbed us (nothing for %.0f s), "
+               "reassigning %d requests\n",
+               p->ip, p->port, now - p->last_delivery, released);
+    else if (!p->snubbed && was_snubbed)
+        printf("[PIPE] %s:%d snub lifted, requesting again\n", p->ip, p->port);
+}
+
+int pipeline_expire(Peer *p, TorrentState *ts, double now) {
+    if (p->snubbed && now - p->snubbed_at > PEER_SNUB_PENALTY) {
+        p->snubbed = false;
+        p->max_pipeline = min_depth;
+    }
+
+    if (p->outstanding_requests == 0)
+        return 0;
+
+    if (now - p->last_delivery > PEER_SNUB_TIMEOUT) {
+        // a window of 0 keeps the picker away from this peer
+        p->snubbed = true;
+        p->snubbed_at = now;
+        p->max_pipeline = 0;
+        __atomic_fetch_add(&peers_snubbed, 1, __ATOMIC_RELAXED);
+        return pipeline_release(p, ts);
+    }
+
+    double timeout = REQUEST_TIMEOUT_RTTS * p->srtt;
+    if (timeout < REQUEST_TIMEOUT)
+        timeout = REQUEST_TIMEOUT;
+
+    int n = 0;
+    for (int i = p->outstanding_requests - 1; i >= 0; i--) {
+        if (now - p->reqs[i].sent < timeout)
+            continue;
+
+        unmark_block(ts, &p->reqs[i]);
+        remove_request(p, i);
+        n++;
+    }
+
+    if (n > 0) {
+        __atomic_fetch_add(&requests_timed_out, n, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&requests_released, n, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+void pipeline_print_stats(void) {
+    printf("[PIPE] %ld RTT samples, window grew %ld times, shrank %ld times "
+           "(bounds %d..%d blocks)\n",
+           __atomic_load_n(&rtt_samples, __ATOMIC_RELAXED),
+           __atomic_load_n(&window_grows, __ATOMIC_RELAXED),
+           __atomic_load_n(&window_shrinks, __ATOMIC_RELAXED),
+           min_depth, max_depth);
+    printf("[PIPE] %ld requests returned to the pool (%ld timed out), "
+           "%ld peers snubbed\n",
+           __atomic_load_n(&requests_released, __ATOMIC_RELAXED),
+           __atomic_load_n(&requests_timed_out, __ATOMIC_RELAXED),
+           __atomic_load_n(&peers_snubbed, __ATOMIC_RELAXED));
+}
+
+void pipeline_print_peer(const Peer *p) {
+    printf("[PIPE] %s:%d window=%d srtt=%.1f ms min_rtt=%.1f ms rate=%.1f KiB/s%s\n",
+           p->ip, p->port, p->max_pipeline, p->srtt * 1000.0,
+           p->min_rtt * 1000.0, p->dlv_rate / 1024.0,
+           p->snubbed ? " (snubbed)" : "");
+}
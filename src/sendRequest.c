@@ -5,9 +5,19 @@
 #include <sys/socket.h>
 #include <stdio.h>
 #include "torrent_parser.h"
+#include "peer_output.h"
+#include "request_pipeline.h"
+#include "init_torrent_state.h"
+#include "piece_picker.h"
 
 static inline bool we_have_piece(TorrentState *ts, int index) {
-    return ts->piece_complete[index];
+    return is_piece_complete(ts, index);
+}
+
+static bool endgame_enabled = true;
+
+void set_endgame(bool on) {
+    endgame_enabled = on;
 }
 
 bool peer_has_piece(Peer *peer, int index) {
@@ -34,8 +44,58 @@ int send_request(Peer *peer, int index, int begin, int length) {
     memcpy(msg + 9,  &net_begin, 4);
     memcpy(msg + 13, &net_length, 4);
 
-    int sent = send(peer->socket_fd, msg, sizeof(msg), 0);
-    return (sent == (int)sizeof(msg)) ? 0 : -1;
+    return peer_queue(peer, msg, sizeof(msg));
+}
+
+/* true once no missing block is left unrequested */
+static bool all_blocks_in_flight(TorrentState *ts, int *missing) {
+    const int *wanted;
+    int count = picker_wanted_pieces(ts, &wanted);
+    int n = 0;
+
+    if (picker_free_blocks(ts) > 0)
+        return false;
+
+    for (int k = 0; k < count; k++) {
+        PieceBuffer *pb = &ts->pieces[wanted[k]];
+
+        for (int b = 0; b < pb->num_blocks; b++) {
+            if (!block_stored(pb, b))
+                n++;
+        }
+    }
+
+    *missing = n;
+    return n > 0;
+}
+
+/* endgame: a block in flight elsewhere that this peer was not asked for */
+static bool pick_duplicate(Peer *peer, TorrentState *ts, int *piece, int *block) {
+    const int *wanted;
+    int count = picker_wanted_pieces(ts, &wanted);
+
+    for (int k = 0; k < count; k++) {
+        int p = wanted[k];
+        if (we_have_piece(ts, p) || !peer_has_piece(peer, p))
+            continue;
+
+        PieceBuffer *pb = &ts->pieces[p];
+        if (!pb->data || !pb->block_requested)
+            continue;
+
+        for (int b = 0; b < pb->num_blocks; b++) {
+            if (block_stored(pb, b) ||
+                !__atomic_load_n(&pb->block_requested[b], __ATOMIC_RELAXED))
+                continue;
+            if (pipeline_has_request(peer, p, b * BLOCK_SIZE))
+                continue;
+
+            *piece = p;
+            *block = b;
+            return true;
+        }
+    }
+    return false;
 }
 
 int request_multiple_blocks(Peer *peer, TorrentState *ts) {
@@ -43,44 +103,40 @@ int request_multiple_blocks(Peer *peer, TorrentState *ts) {
     if (peer->is_choked) return -1;
 
     int requests_sent = 0;
+    double now = get_time_seconds();
 
-    /* issue requests until pipeline is full */
+    /* queue the whole batch, it goes out in one write on uncork */
+    peer_cork(peer);
+
+    /* issue requests until the window is full */
     while (peer->outstanding_requests < peer->max_pipeline) {
 
         int selected_piece = -1;
         int selected_block = -1;
-
-        /* search all pieces for something useful to request */
-        for (int p = 0; p < ts->total_pieces; p++) {
-
-            if (ts->piece_complete[p])
-                continue;
-            if (!peer_has_piece(peer, p))
-                continue;
-
-            PieceBuffer *pb = &ts->pieces[p];
-            if (!pb || !pb->data || !pb->block_received)
-                continue;
-
-            /* allocate block_requested array if needed */
-            if (!pb->block_requested) {
-                pb->block_requested = calloc(pb->num_blocks, 1);
-                if (!pb->block_requested) continue;
+        bool duplicate = false;
+
+        /* rarest-first or streaming, see piece_picker.h */
+        if (!picker_pick_block(ts, peer, &selected_piece, &selected_block,
+                               &duplicate)) {
+            int missing;
+
+            /* nothing unrequested left: go endgame once every missing
+               block is in flight, then ask more than one peer for them */
+            if (!ts->endgame) {
+                if (!endgame_enabled || !all_blocks_in_flight(ts, &missing))
+                    break;  /* nothing available */
+
+                ts->endgame = true;
+                ts->endgame_start = now;
+                ts->endgame_blocks = missing;
             }
 
-            /* find the first block this peer can help with */
-            for (int b = 0; b < pb->num_blocks; b++) {
-                if (!pb->block_received[b] && !pb->block_requested[b]) {
-                    selected_piece = p;
-                    selected_block = b;
-                    goto GOT_BLOCK;
-                }
-            }
-        }
+            if (!pick_duplicate(peer, ts, &selected_piece, &selected_block))
+                break;
 
-GOT_BLOCK:
-        if (selected_piece == -1)
-            break;  /* nothing available */
+            duplicate = true;
+            ts->endgame_requests++;
+        }
 
         PieceBuffer *pb = &ts->pieces[selected_piece];
 
@@ -91,21 +147,99 @@ GOT_BLOCK:
 
         int request_len = (remaining >= BLOCK_SIZE) ? BLOCK_SIZE : remaining;
 
-        /* mark block as requested before sending */
-        pb->block_requested[selected_block] = true;
+        /* the picker claimed the block (a duplicate is requested from
+           another peer already) */
+        if (pipeline_on_request(peer, selected_piece, offset, request_len, now) < 0) {
+            if (!duplicate)
+                picker_unmark(ts, selected_piece, selected_block);
+            break;
+        }
 
         if (send_request(peer, selected_piece, offset, request_len) < 0) {
-            pb->block_requested[selected_block] = false;
-            return requests_sent;
+            pipeline_release(peer, ts);
+            break;
         }
 
-        peer->outstanding_requests++;
         requests_sent++;
     }
 
+    peer_uncork(peer);
     return requests_sent;
 }
 
+int request_reserved_blocks(Peer *peer, TorrentState *ts) {
+    if (!peer || peer->socket_fd < 0 || peer->is_choked) return 0;
+
+    int requests_sent = 0;
+    double now = get_time_seconds();
+
+    peer_cork(peer);
+
+    while (peer->outstanding_requests < peer->max_pipeline) {
+        int piece, block;
+
+        if (!picker_claim_reserved(ts, peer, &piece, &block))
+            break;
+
+        PieceBuffer *pb = &ts->pieces[piece];
+        int offset = block * BLOCK_SIZE;
+        int request_len = pb->length - offset;
+        if (request_len > BLOCK_SIZE)
+            request_len = BLOCK_SIZE;
+
+        if (pipeline_on_request(peer, piece, offset, request_len, now) < 0) {
+            picker_return_claim(ts, piece, block);
+            break;
+        }
+
+        /* on a write error the peer is dropped, which returns its
+           requests under the picker's lock */
+        if (send_request(peer, piece, offset, request_len) < 0)
+            break;
+
+        requests_sent++;
+    }
+
+    peer_uncork(peer);
+    return requests_sent;
+}
+
+void endgame_piece_done(TorrentState *ts, double now) {
+    int tail = ts->pieces_wanted / 100;
+    if (tail < 1)
+        tail = 1;
+
+    // pieces_complete is the only completion count: a piece that fails
+    // its hash is never in it
+    int done = __atomic_load_n(&ts->pieces_complete, __ATOMIC_ACQUIRE);
+
+    if (ts->tail_start <= 0) {
+        if (ts->pieces_wanted - tail <= 0)
+            ts->tail_start = ts->download_start_time;
+        else if (done >= ts->pieces_wanted - tail)
+            ts->tail_start = now;
+    }
+    if (done >= ts->pieces_wanted && ts->tail_time <= 0)
+        ts->tail_time = now - ts->tail_start;
+}
+
+void endgame_print_stats(TorrentState *ts) {
+    if (ts->endgame)
+        printf("[ENDGAME] Entered %.2f s in with %d blocks in flight, "
+               "%ld duplicate requests\n",
+               ts->endgame_start - ts->download_start_time,
+               ts->endgame_blocks, ts->endgame_requests);
+    else
+        printf("[ENDGAME] Not entered\n");
+
+    printf("[ENDGAME] %ld CANCELs sent, %.1f KiB of duplicate blocks wasted\n",
+           ts->cancels_sent, ts->wasted_bytes / 1024.0);
+
+    int tail = ts->pieces_wanted / 100;
+    printf("[ENDGAME] Last %d pieces (1%%) took %.3f s\n",
+           tail < 1 ? 1 : tail, ts->tail_time);
+}
+
 int request_next_block(Peer *peer, TorrentState *ts) {
     return request_multiple_blocks(peer, ts);
 }
@@ -0,0 +1,415 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/sha.h>
+
+#include "sha1.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHA1_X86 1
+#endif
+
+// state words of every lane: st[word][lane]
+typedef void (*lanes_fn)(uint32_t st[5][SHA1_MAX_LANES], const uint8_t *const *data,
+                         size_t blocks);
+
+typedef struct {
+    const char *name;
+    int lanes;                  // 1: one buffer at a time with one()
+    lanes_fn blocks;            // lanes > 1: compress blocks of every lane
+    void (*one)(const uint8_t *data, size_t len, uint8_t *digest);
+} Sha1Backend;
+
+#define CALIBRATE_LEN (128 * 1024)  // bytes per buffer timed on first use
+#define CALIBRATE_RUNS 3
+
+static const uint32_t sha1_init[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static uint32_t load_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void store_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// The last len % 64 bytes, the 0x80 marker and the bit length, padded
+// to whole blocks in tail
+// @return blocks in tail (1 or 2)
+static size_t pad_tail(const uint8_t *data, size_t len, uint8_t tail[128]) {
+    size_t rest = len % 64;
+    size_t blocks = rest + 9 <= 64 ? 1 : 2;
+    uint64_t bits = (uint64_t)len * 8;
+
+    memset(tail, 0, 128);
+    memcpy(tail, data + len - rest, rest);
+    tail[rest] = 0x80;
+    store_be32(tail + blocks * 64 - 8, bits >> 32);
+    store_be32(tail + blocks * 64 - 4, (uint32_t)bits);
+    return blocks;
+}
+
+static void sha1_openssl(const uint8_t *data, size_t len, uint8_t *digest) {
+    SHA1(data, len, digest);
+}
+
+#ifdef SHA1_X86
+
+// ---------------------------------------------------------------------------
+// SHA extensions: four rounds per sha1rnds4, the schedule in sha1msg1/2
+// ---------------------------------------------------------------------------
+
+// Four rounds with message words m; e takes them, e_next saves ABCD for
+// the next four
+#define SHANI_ROUNDS(e, e_next, m, f)                 \
+    do {                                              \
+        e = _mm_sha1nexte_epu32(e, m);                \
+        e_next = abcd;                                \
+        abcd = _mm_sha1rnds4_epu32(abcd, e, f);       \
+    } while (0)
+
+// Schedule steps that take the words of the group just used (m0 for the
+// group, m1..m3 the ones after it)
+#define SHANI_MSG1(m3, m0) m3 = _mm_sha1msg1_epu32(m3, m0)
+#define SHANI_XOR(m2, m0)  m2 = _mm_xor_si128(m2, m0)
+#define SHANI_MSG2(m1, m0) m1 = _mm_sha1msg2_epu32(m1, m0)
+
+__attribute__((target("sha,sse4.1")))
+static void shani_blocks(uint32_t state[5], const uint8_t *data, size_t blocks) {
+    const __m128i swap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+    __m128i e1, m0, m1, m2, m3;
+
+    for (size_t n = 0; n < blocks; n++, data += 64) {
+        __m128i abcd_save = abcd;
+        __m128i e_save = e0;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), swap);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), swap);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), swap);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), swap);
+
+        // rounds 0-3 add the first words to E directly
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        SHANI_ROUNDS(e1, e0, m1, 0); SHANI_MSG1(m0, m1);
+        SHANI_ROUNDS(e0, e1, m2, 0); SHANI_MSG1(m1, m2); SHANI_XOR(m0, m2);
+        SHANI_ROUNDS(e1, e0, m3, 0); SHANI_MSG1(m2, m3); SHANI_XOR(m1, m3); SHANI_MSG2(m0, m3);
+        SHANI_ROUNDS(e0, e1, m0, 0); SHANI_MSG1(m3, m0); SHANI_XOR(m2, m0); SHANI_MSG2(m1, m0);
+        SHANI_ROUNDS(e1, e0, m1, 1); SHANI_MSG1(m0, m1); SHANI_XOR(m3, m1); SHANI_MSG2(m2, m1);
+        SHANI_ROUNDS(e0, e1, m2, 1); SHANI_MSG1(m1, m2); SHANI_XOR(m0, m2); SHANI_MSG2(m3, m2);
+        SHANI_ROUNDS(e1, e0, m3, 1); SHANI_MSG1(m2, m3); SHANI_XOR(m1, m3); SHANI_MSG2(m0, m3);
+        SHANI_ROUNDS(e0, e1, m0, 1); SHANI_MSG1(m3, m0); SHANI_XOR(m2, m0); SHANI_MSG2(m1, m0);
+        SHANI_ROUNDS(e1, e0, m1, 1); SHANI_MSG1(m0, m1); SHANI_XOR(m3, m1); SHANI_MSG2(m2, m1);
+        SHANI_ROUNDS(e0, e1, m2, 2); SHANI_MSG1(m1, m2); SHANI_XOR(m0, m2); SHANI_MSG2(m3, m2);
+        SHANI_ROUNDS(e1, e0, m3, 2); SHANI_MSG1(m2, m3); SHANI_XOR(m1, m3); SHANI_MSG2(m0, m3);
+        SHANI_ROUNDS(e0, e1, m0, 2); SHANI_MSG1(m3, m0); SHANI_XOR(m2, m0); SHANI_MSG2(m1, m0);
+        SHANI_ROUNDS(e1, e0, m1, 2); SHANI_MSG1(m0, m1); SHANI_XOR(m3, m1); SHANI_MSG2(m2, m1);
+        SHANI_ROUNDS(e0, e1, m2, 2); SHANI_MSG1(m1, m2); SHANI_XOR(m0, m2); SHANI_MSG2(m3, m2);
+        SHANI_ROUNDS(e1, e0, m3, 3); SHANI_MSG1(m2, m3); SHANI_XOR(m1, m3); SHANI_MSG2(m0, m3);
+        SHANI_ROUNDS(e0, e1, m0, 3); SHANI_MSG1(m3, m0); SHANI_XOR(m2, m0); SHANI_MSG2(m1, m0);
+        SHANI_ROUNDS(e1, e0, m1, 3); SHANI_XOR(m3, m1); SHANI_MSG2(m2, m1);
+        SHANI_ROUNDS(e0, e1, m2, 3); SHANI_MSG2(m3, m2);
+        SHANI_ROUNDS(e1, e0, m3, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static void sha1_shani(const uint8_t *data, size_t len, uint8_t *digest) {
+    uint32_t st[5];
+    uint8_t tail[128];
+
+    memcpy(st, sha1_init, sizeof(st));
+    shani_blocks(st, data, len / 64);
+    shani_blocks(st, tail, pad_tail(data, len, tail));
+
+    for (int i = 0; i < 5; i++)
+        store_be32(digest + 4 * i, st[i]);
+}
+
+// ---------------------------------------------------------------------------
+// Multi-buffer: lane l of every vector belongs to buffer l
+// ---------------------------------------------------------------------------
+
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+typedef uint32_t u32x8 __attribute__((vector_size(32)));
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// W[t] in a ring of 16, computed in place from t = 16 on
+#define LANES_W(w, t) \
+    ((t) < 16 ? w[t] : (w[(t) & 15] = ROTL(w[((t) + 13) & 15] ^ w[((t) + 8) & 15] ^ \
+                                           w[((t) + 2) & 15] ^ w[(t) & 15], 1)))
+
+#define F_CHOOSE(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define F_PARITY(b, c, d) ((b) ^ (c) ^ (d))
+#define F_MAJORITY(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+
+#define LANES_ROUND(a, b, c, d, e, f, k, t)                  \
+    do {                                                     \
+        e += ROTL(a, 5) + f(b, c, d) + (k) + LANES_W(w, t);  \
+        b = ROTL(b, 30);                                     \
+    } while (0)
+
+// Five rounds, after which the variables are back in their places
+#define LANES_FIVE(f, k, t)                                  \
+    do {                                                     \
+        LANES_ROUND(a, b, c, d, e, f, k, t);                 \
+        LANES_ROUND(e, a, b, c, d, f, k, (t) + 1);           \
+        LANES_ROUND(d, e, a, b, c, f, k, (t) + 2);           \
+        LANES_ROUND(c, d, e, a, b, f, k, (t) + 3);           \
+        LANES_ROUND(b, c, d, e, a, f, k, (t) + 4);           \
+    } while (0)
+
+// The compression function on vectors of type V with lanes lanes; the
+// same code for every width, the target decides the instructions
+#define DEFINE_LANES_BLOCKS(name, V, lanes, target_isa)                          \
+__attribute__((target(target_isa)))                                              \
+static void name(uint32_t st[5][SHA1_MAX_LANES], const uint8_t *const *data,     \
+                 size_t blocks) {                                                \
+    V s[5], w[16];                                                               \
+                                                                                 \
+    for (int i = 0; i < 5; i++)                                                  \
+        memcpy(&s[i], st[i], sizeof(V));                                         \
+                                                                                 \
+    for (size_t n = 0; n < blocks; n++) {                                        \
+        for (int t = 0; t < 16; t++) {                                           \
+            for (int l = 0; l < (lanes); l++)                                    \
+                w[t][l] = load_be32(data[l] + n * 64 + t * 4);                   \
+        }                                                                        \
+                                                                                 \
+        V a = s[0], b = s[1], c = s[2], d = s[3], e = s[4];                      \
+        for (int t = 0; t < 20; t += 5)                                          \
+            LANES_FIVE(F_CHOOSE, 0x5a827999, t);                                 \
+        for (int t = 20; t < 40; t += 5)                                         \
+            LANES_FIVE(F_PARITY, 0x6ed9eba1, t);                                 \
+        for (int t = 40; t < 60; t += 5)                                         \
+            LANES_FIVE(F_MAJORITY, 0x8f1bbcdc, t);                               \
+        for (int t = 60; t < 80; t += 5)                                         \
+            LANES_FIVE(F_PARITY, 0xca62c1d6, t);                                 \
+                                                                                 \
+        s[0] += a;                                                               \
+        s[1] += b;                                                               \
+        s[2] += c;                                                               \
+        s[3] += d;                                                               \
+        s[4] += e;                                                               \
+    }                                                                            \
+                                                                                 \
+    for (int i = 0; i < 5; i++)                                                  \
+        memcpy(st[i], &s[i], sizeof(V));                                         \
+}
+
+DEFINE_LANES_BLOCKS(sse2_blocks, u32x4, 4, "sse2")
+DEFINE_LANES_BLOCKS(avx2_blocks, u32x8, 8, "avx2")
+
+#endif
+
+static const Sha1Backend backend_openssl = { "openssl", 1, NULL, sha1_openssl };
+#ifdef SHA1_X86
+static const Sha1Backend backend_shani = { "sha-ni", 1, NULL, sha1_shani };
+static const Sha1Backend backend_avx2 = { "avx2", 8, avx2_blocks, NULL };
+static const Sha1Backend backend_sse2 = { "sse2", 4, sse2_blocks, NULL };
+#endif
+
+static const Sha1Backend *all_backends[] = {
+#ifdef SHA1_X86
+    &backend_shani, &backend_avx2, &backend_sse2,
+#endif
+    &backend_openssl,
+};
+#define NUM_BACKENDS (int)(sizeof(all_backends) / sizeof(all_backends[0]))
+
+static const Sha1Backend *backend;
+static double rates[NUM_BACKENDS];   // GB/s per core, 0 = not measured
+
+static bool supported(const Sha1Backend *b) {
+#ifdef SHA1_X86
+    __builtin_cpu_init();
+    if (b == &backend_shani)
+        return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+    if (b == &backend_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (b == &backend_sse2)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return b == &backend_openssl;
+}
+
+static double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void hash_batch(const Sha1Backend *b, const uint8_t *const *data, const size_t *len,
+                       int n, uint8_t (*digest)[SHA1_DIGEST_LEN]);
+
+// Time a full batch with every backend the CPU has and keep the fastest:
+// the SHA extensions are not faster than 8 AVX2 lanes on every CPU.
+// Racing first callers may both measure; either result will do.
+static const Sha1Backend *pick_backend(void) {
+    const Sha1Backend *b = __atomic_load_n(&backend, __ATOMIC_ACQUIRE);
+    if (b)
+        return b;
+
+    b = &backend_openssl;
+    uint8_t *buf = calloc(SHA1_MAX_LANES, CALIBRATE_LEN);
+    if (buf) {
+        const uint8_t *data[SHA1_MAX_LANES];
+        size_t len[SHA1_MAX_LANES];
+        uint8_t digest[SHA1_MAX_LANES][SHA1_DIGEST_LEN];
+        double best = 0;
+
+        for (int l = 0; l < SHA1_MAX_LANES; l++) {
+            data[l] = buf + (size_t)l * CALIBRATE_LEN;
+            len[l] = CALIBRATE_LEN;
+        }
+
+        for (int i = 0; i < NUM_BACKENDS; i++) {
+            if (!supported(all_backends[i]))
+                continue;
+
+            // best of a few, the first pays for page faults
+            double fastest = 0;
+            for (int run = 0; run < CALIBRATE_RUNS; run++) {
+                double t0 = now_seconds();
+                hash_batch(all_backends[i], data, len, SHA1_MAX_LANES, digest);
+                double t = now_seconds() - t0;
+                if (run == 0 || t < fastest)
+                    fastest = t;
+            }
+
+            rates[i] = fastest > 0 ? SHA1_MAX_LANES * (double)CALIBRATE_LEN / fastest / 1e9 : 0;
+            if (rates[i] > best) {
+                best = rates[i];
+                b = all_backends[i];
+            }
+        }
+        free(buf);
+    }
+
+    __atomic_store_n(&backend, b, __ATOMIC_RELEASE);
+    return b;
+}
+
+int sha1_set_backend(const char *name) {
+    for (int i = 0; i < NUM_BACKENDS; i++) {
+        if (strcmp(all_backends[i]->name, name) == 0 && supported(all_backends[i])) {
+            __atomic_store_n(&backend, all_backends[i], __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void sha1_print_stats(void) {
+    const Sha1Backend *b = pick_backend();
+    char line[256];
+    int pos = 0;
+
+    for (int i = 0; i < NUM_BACKENDS && pos < (int)sizeof(line); i++) {
+        if (rates[i] > 0)
+            pos += snprintf(line + pos, sizeof(line) - pos, "%s%s %.2f GB/s",
+                            pos ? ", " : "", all_backends[i]->name, rates[i]);
+    }
+
+    if (pos > 0)
+        printf("[SHA1] Using %s; per core on %d x %d KiB: %s\n", b->name,
+               SHA1_MAX_LANES, CALIBRATE_LEN / 1024, line);
+    else
+        printf("[SHA1] Using %s (chosen, not measured)\n", b->name);
+}
+
+const char *sha1_backend_name(void) {
+    return pick_backend()->name;
+}
+
+int sha1_lanes(void) {
+    return pick_backend()->lanes;
+}
+
+void sha1(const uint8_t *data, size_t len, uint8_t *digest) {
+    const Sha1Backend *b = pick_backend();
+
+    if (b->one)
+        b->one(data, len, digest);
+    else
+        sha1_openssl(data, len, digest);
+}
+
+// The first count buffers, all len long, in the lanes; spare lanes hash
+// the first buffer again and are thrown away
+static void hash_lanes(const Sha1Backend *b, const uint8_t *const *data, int count,
+                       size_t len, uint8_t (*digest)[SHA1_DIGEST_LEN]) {
+    uint32_t st[5][SHA1_MAX_LANES];
+    const uint8_t *in[SHA1_MAX_LANES];
+    uint8_t tail[SHA1_MAX_LANES][128];
+    size_t tail_blocks = 0;
+
+    for (int l = 0; l < b->lanes; l++) {
+        in[l] = data[l < count ? l : 0];
+        for (int i = 0; i < 5; i++)
+            st[i][l] = sha1_init[i];
+    }
+
+    b->blocks(st, in, len / 64);
+
+    for (int l = 0; l < b->lanes; l++) {
+        tail_blocks = pad_tail(in[l], len, tail[l]);
+        in[l] = tail[l];
+    }
+    b->blocks(st, in, tail_blocks);
+
+    for (int l = 0; l < count; l++) {
+        for (int i = 0; i < 5; i++)
+            store_be32(digest[l] + 4 * i, st[i][l]);
+    }
+}
+
+static void hash_batch(const Sha1Backend *b, const uint8_t *const *data, const size_t *len,
+                       int n, uint8_t (*digest)[SHA1_DIGEST_LEN]) {
+    int i = 0;
+
+    if (b->lanes == 1) {
+        for (; i < n; i++)
+            b->one(data[i], len[i], digest[i]);
+        return;
+    }
+
+    // runs of equal length go through the lanes, as long as they fill at
+    // least half of them; a half-empty pass is slower than OpenSSL
+    while (i < n) {
+        int run = 1;
+        while (run < b->lanes && i + run < n && len[i + run] == len[i])
+            run++;
+
+        if (run * 2 >= b->lanes) {
+            hash_lanes(b, data + i, run, len[i], digest + i);
+        } else {
+            for (int k = 0; k < run; k++)
+                sha1_openssl(data[i + k], len[i + k], digest[i + k]);
+        }
+        i += run;
+    }
+}
+
+void sha1_many(const uint8_t *const *data, const size_t *len, int n,
+               uint8_t (*digest)[SHA1_DIGEST_LEN]) {
+    hash_batch(pick_backend(), data, len, n, digest);
+}
@@ -12,27 +12,51 @@
 #include "verify_pieces.h"
 #include "outgoingMessages.h"
 #include "file_writer.h"
+#include "init_torrent_state.h"
+
+static long blocks_in_place = 0;
+static long blocks_copied = 0;
+
+void store_block_stats(long *in_place, long *copied) {
+    if (in_place) *in_place = __atomic_load_n(&blocks_in_place, __ATOMIC_RELAXED);
+    if (copied)   *copied   = __atomic_load_n(&blocks_copied, __ATOMIC_RELAXED);
+}
 
 void print_progress_if_needed(TorrentState *ts) {
-    int total = ts->total_pieces;
+    int total = ts->pieces_wanted;
 
     if (total <= 0) return;
 
-    int completed = 0;
-    for (int i = 0; i < total; i++) {
-        if (ts->piece_complete[i]) {
-            completed++;
-        }
+    int completed = __atomic_load_n(&ts->pieces_complete, __ATOMIC_RELAXED);
+    int percent = (int)((long)completed * 100 / total);
+
+    /* print only when crossing a new 10% point; pieces can finish on
+       several threads at once, one of them prints */
+    int shown = __atomic_load_n(&ts->last_progress_shown, __ATOMIC_RELAXED);
+    int step = (percent / 10) * 10;
+
+    if (percent >= shown + 10 &&
+        __atomic_compare_exchange_n(&ts->last_progress_shown, &shown, step, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        printf("[PROGRESS] %d%% complete (%d/%d pieces, %.1f MiB)\n",
+               step, completed, total,
+               __atomic_load_n(&ts->bytes_complete, __ATOMIC_RELAXED) / 1048576.0);
     }
+}
+
+bool mark_piece_complete(TorrentState *ts, int index) {
+    uint8_t bit = 0x80 >> (index % 8);
 
-    int percent = (completed * 100) / total;
+    /* release: whoever sees the bit also sees the verified piece */
+    if (__atomic_fetch_or(&ts->my_bitfield[index / 8], bit, __ATOMIC_ACQ_REL) & bit)
+        return false;
 
-    /* print only when crossing a new 10% point */
-    if (percent >= ts->last_progress_shown + 10) {
-        ts->last_progress_shown = (percent / 10) * 10;
-        printf("[PROGRESS] %d%% complete (%d/%d pieces)\n",
-               ts->last_progress_shown, completed, total);
+    if (piece_wanted(ts, index)) {
+        __atomic_fetch_add(&ts->bytes_complete, (long)ts->pieces[index].length,
+                           __ATOMIC_RELAXED);
+        __atomic_fetch_add(&ts->pieces_complete, 1, __ATOMIC_RELEASE);
     }
+    return true;
 }
 
 int init_piece_storage(TorrentState *ts) {
@@ -63,9 +87,10 @@ int init_piece_storage(TorrentState *ts) {
         pb->blocks_done = 0;
         pb->verified = false;
 
-        /* allocate data buffer */
-        pb->data = calloc(pb->length, 1);
-        if (!pb->data) {
+        /* allocate data buffer; none for a piece nobody wants, whose
+           blocks are then refused */
+        pb->data = piece_wanted(ts, i) ? calloc(pb->length, 1) : NULL;
+        if (!pb->data && piece_wanted(ts, i)) {
             free_piece_storage(ts);
             return -1;
         }
@@ -78,9 +103,9 @@ int init_piece_storage(TorrentState *ts) {
             return -1;
         }
 
-        /* track received blocks */
-        pb->block_received = calloc(pb->num_blocks, sizeof(bool));
-        if (!pb->block_received) {
+        /* state of each block, all BLOCK_FREE */
+        pb->block_state = calloc(pb->num_blocks, 1);
+        if (!pb->block_state) {
             free_piece_storage(ts);
             return -1;
         }
@@ -97,8 +122,8 @@ void free_piece_storage(TorrentState *ts) {
         if (ts->pieces[i].data) {
             free(ts->pieces[i].data);
         }
-        if (ts->pieces[i].block_received) {
-            free(ts->pieces[i].block_received);
+        if (ts->pieces[i].block_state) {
+            free(ts->pieces[i].block_state);
         }
         if (ts->pieces[i].block_requested) {
             free(ts->pieces[i].block_requested);
@@ -109,68 +134,163 @@ void free_piece_storage(TorrentState *ts) {
     ts->pieces = NULL;
 }
 
-int store_received_block(TorrentState *ts, int index, int begin, unsigned char *data, int len) {
+// Length of the block at begin, exactly as we request it: BLOCK_SIZE,
+// or what is left of the piece for its last block
+static int block_length(const PieceBuffer *pb, int begin) {
+    int left = pb->length - begin;
+    return left < BLOCK_SIZE ? left : BLOCK_SIZE;
+}
+
+// Give back an in-place claim on a block that is not stored after all
+static void end_claim(unsigned char *state) {
+    unsigned char landing = BLOCK_LANDING;
+    __atomic_compare_exchange_n(state, &landing, BLOCK_FREE, false,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+int store_block(TorrentState *ts, int index, int begin, unsigned char *data, int len) {
 
     if (!ts || !ts->pieces) return -1;
     if (index < 0 || index >= ts->total_pieces) return -1;
 
     PieceBuffer *pb = &ts->pieces[index];
-
-    if (!pb->data || !pb->block_received) return -1;
-    if (begin < 0 || len <= 0 || begin + len > pb->length) return -1;
+    if (!pb->block_state || begin < 0 || begin >= pb->length) return -1;
 
     int block_idx = begin / BLOCK_SIZE;
-    if (block_idx < 0 || block_idx >= pb->num_blocks) return -1;
+    unsigned char *state = &pb->block_state[block_idx];
+
+    /* payload already received in place by peer_read_message_direct(),
+       under a claim that ends here whatever happens. A claimed piece
+       has its buffer: it is only freed once every block is STORED */
+    unsigned char *buf = pb->data;
+    bool in_place = buf && data == buf + begin;
+
+    /* a full piece is being verified (or was, and its buffer may be
+       gone): late duplicates are dropped before the buffer is used.
+       Only whole blocks, exactly as we request them, are stored */
+    if (__atomic_load_n(&pb->blocks_done, __ATOMIC_ACQUIRE) == pb->num_blocks ||
+        !buf || begin % BLOCK_SIZE != 0 || len != block_length(pb, begin)) {
+        if (in_place)
+            end_claim(state);
+        return -1;
+    }
+
+    if (in_place) {
+        unsigned char landing = BLOCK_LANDING;
+        if (!__atomic_compare_exchange_n(state, &landing, BLOCK_STORED, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return -1;
+        __atomic_fetch_add(&blocks_in_place, 1, __ATOMIC_RELAXED);
+    } else {
+        /* own the block for the copy: a duplicate, or one a reader is
+           still receiving in place, is dropped */
+        unsigned char free_state = BLOCK_FREE;
+        if (!__atomic_compare_exchange_n(state, &free_state, BLOCK_LANDING, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return -1;
+        memcpy(buf + begin, data, len);
+        __atomic_store_n(state, BLOCK_STORED, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&blocks_copied, 1, __ATOMIC_RELAXED);
+    }
 
-    /* avoid counting the same block twice */
-    bool first_time = !pb->block_received[block_idx];
+    /* the caller that fills the piece gets to finish it */
+    return __atomic_add_fetch(&pb->blocks_done, 1, __ATOMIC_ACQ_REL) == pb->num_blocks;
+}
 
-    memcpy(pb->data + begin, data, len);
+void write_verified_piece(TorrentState *ts, int index) {
+    PieceBuffer *pb = &ts->pieces[index];
 
-    pb->block_received[block_idx] = true;
-    if (pb->block_requested)
-        pb->block_requested[block_idx] = false;
+    if (file_writer_write_piece(ts, index, pb->data, pb->length) == 0) {
+        printf("[STORE] Piece %d written to disk\n", index);
+        __atomic_store_n(&pb->written, true, __ATOMIC_RELEASE);
 
-    if (first_time)
-        pb->blocks_done++;
+        // uploads come from the file now, the RAM copy can go
+        if (get_upload_mode() == UPLOAD_SENDFILE) {
+            free(pb->data);
+            pb->data = NULL;
+        }
+    }
+}
 
-    /* piece completed? */
-    if (pb->blocks_done == pb->num_blocks) {
+void reset_piece(TorrentState *ts, int index) {
+    PieceBuffer *pb = &ts->pieces[index];
 
-        printf("[STORE] All blocks received for piece %d. Verifying...\n", index);
+    /* first: a block claimed once its state is FREE must find a piece
+       that is not full, or store_block() would drop it */
+    pb->verified = false;
+    __atomic_store_n(&pb->blocks_done, 0, __ATOMIC_RELEASE);
 
-        if (verify_piece(ts, index, pb->data, pb->length)) {
+    /* every block is still STORED, so nobody is writing into the piece */
+    memset(pb->data, 0, pb->length);
+    if (pb->block_requested)
+        memset(pb->block_requested, 0, pb->num_blocks);
 
-            ts->piece_complete[index] = true;
-            pb->verified = true;
+    /* last: the piece takes blocks again */
+    for (int b = 0; b < pb->num_blocks; b++)
+        __atomic_store_n(&pb->block_state[b], BLOCK_FREE, __ATOMIC_RELEASE);
+}
 
-            if (file_writer_write_piece(ts, index, pb->data, pb->length) == 0)
-                printf("[STORE] Piece %d written to disk\n", index);
+int finish_piece(TorrentState *ts, int index) {
+    PieceBuffer *pb = &ts->pieces[index];
 
-            broadcast_have(ts, index);
-            print_progress_if_needed(ts);
+    printf("[STORE] All blocks received for piece %d. Verifying...\n", index);
 
-            /* update local bitfield */
-            if (ts->my_bitfield) {
-                int byte = index / 8;
-                int bit  = 7 - (index % 8);
-                ts->my_bitfield[byte] |= (1 << bit);
-            }
+    if (verify_piece(ts, index, pb->data, pb->length)) {
+        write_verified_piece(ts, index);
+        mark_piece_complete(ts, index);
+        broadcast_have(ts, index);
+        print_progress_if_needed(ts);
+        return 0;
+    }
 
-        } else {
-            printf("[STORE] Piece %d FAILED verification. Resetting.\n", index);
+    printf("[STORE] Piece %d FAILED verification. Resetting.\n", index);
+    reset_piece(ts, index);
+    return -1;
+}
 
-            memset(pb->data, 0, pb->length);
-            memset(pb->block_received, 0, pb->num_blocks);
-            if (pb->block_requested)
-                memset(pb->block_requested, 0, pb->num_blocks);
+int store_received_block(TorrentState *ts, int index, int begin, unsigned char *data, int len) {
+    int rc = store_block(ts, index, begin, data, len);
 
-            pb->blocks_done = 0;
-            pb->verified = false;
-        }
+    if (rc == 1)
+        finish_piece(ts, index);
+    return rc < 0 ? -1 : 0;
+}
+
+unsigned char *claim_block_buffer(TorrentState *ts, uint32_t index, uint32_t begin,
+                                  uint32_t len, unsigned char **claim) {
+    if (!ts || !ts->pieces || index >= (uint32_t)ts->total_pieces)
+        return NULL;
+
+    PieceBuffer *pb = &ts->pieces[index];
+    if (!pb->block_state || begin % BLOCK_SIZE != 0 || begin >= (uint32_t)pb->length)
+        return NULL;
+
+    /* only whole blocks, exactly as we request them */
+    if (len != (uint32_t)block_length(pb, begin))
+        return NULL;
+
+    /* a full piece is never handed out, its buffer may be freed once
+       written; one being reset is full until its blocks are FREE */
+    if (__atomic_load_n(&pb->blocks_done, __ATOMIC_ACQUIRE) == pb->num_blocks)
+        return NULL;
+
+    unsigned char *state = &pb->block_state[begin / BLOCK_SIZE];
+    unsigned char free_state = BLOCK_FREE;
+    if (!__atomic_compare_exchange_n(state, &free_state, BLOCK_LANDING, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    if (!pb->data) {
+        release_block_claim(state);
+        return NULL;
     }
 
-    return 0;
+    *claim = state;
+    return pb->data + begin;
+}
+
+void release_block_claim(unsigned char *claim) {
+    __atomic_store_n(claim, BLOCK_FREE, __ATOMIC_RELEASE);
 }
 
 int get_piece_block(TorrentState *ts, int index, int begin, int length, unsigned char *out) {
@@ -182,13 +302,13 @@ int get_piece_block(TorrentState *ts, int index, int begin, int length, unsigned
         return -1;
     }
 
-    if (!ts->piece_complete[index]) {
+    if (!is_piece_complete(ts, index)) {
         return -1;
     }
 
     PieceBuffer *pb = &ts->pieces[index];
 
-    if (begin < 0 || length < 0 || begin + length > pb->length) {
+    if (!pb->data || begin < 0 || length < 0 || begin + length > pb->length) {
         return -1;
     }
 
@@ -197,7 +317,7 @@ int get_piece_block(TorrentState *ts, int index, int begin, int length, unsigned
 }
 
 bool is_piece_complete(TorrentState *ts, int index) {
-    if (!ts || !ts->piece_complete) {
+    if (!ts || !ts->my_bitfield) {
         return false;
     }
 
@@ -205,5 +325,6 @@ bool is_piece_complete(TorrentState *ts, int index) {
         return false;
     }
 
-    return ts->piece_complete[index];
+    return __atomic_load_n(&ts->my_bitfield[index / 8], __ATOMIC_ACQUIRE) &
+           (0x80 >> (index % 8));
 }
@@ -0,0 +1,209 @@
+#include <string.h>
+
+#include "timer_wheel.h"
+#include "init_torrent_state.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// ticks covered by levels 0..l
+#define LEVEL_SPAN(l) ((uint64_t)1 << (TIMER_WHEEL_BITS * ((l) + 1)))
+
+static uint64_t tick_floor(const TimerWheel *tw, double t) {
+    double ticks = (t - tw->base_time) * 1000.0 / TIMER_TICK_MS;
+    return ticks > 0 ? (uint64_t)ticks : 0;
+}
+
+static uint64_t tick_ceil(const TimerWheel *tw, double t) {
+    double ticks = (t - tw->base_time) * 1000.0 / TIMER_TICK_MS;
+    if (ticks <= 0)
+        return 0;
+    uint64_t n = (uint64_t)ticks;
+    return n < ticks ? n + 1 : n;
+}
+
+// Put t in the slot for its expiry relative to now_tick
+static void link_timer(TimerWheel *tw, Timer *t) {
+    uint64_t e = t->expires;
+    int level = 0;
+    int slot;
+
+    if (e <= tw->now_tick) {
+        // due now (moved down by a cascade): the slot about to run
+        slot = tw->now_tick & SLOT_MASK;
+    } else {
+        uint64_t delta = e - tw->now_tick;
+
+        if (delta >= LEVEL_SPAN(TIMER_WHEEL_LEVELS - 1)) {
+            e = tw->now_tick + LEVEL_SPAN(TIMER_WHEEL_LEVELS - 1) - 1;
+            t->expires = e;
+            delta = e - tw->now_tick;
+        }
+        while (delta >= LEVEL_SPAN(level))
+            level++;
+        slot = (e >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    }
+
+    t->level = level;
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = tw->slots[level][slot];
+    if (t->next)
+        t->next->prev = t;
+    tw->slots[level][slot] = t;
+    tw->occupied[level] |= (uint64_t)1 << slot;
+    t->wheel = tw;
+}
+
+static void unlink_timer(TimerWheel *tw, Timer *t) {
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        tw->slots[t->level][t->slot] = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+
+    if (!tw->slots[t->level][t->slot])
+        tw->occupied[t->level] &= ~((uint64_t)1 << t->slot);
+
+    t->next = NULL;
+    t->prev = NULL;
+    t->wheel = NULL;
+}
+
+void timer_wheel_init(TimerWheel *tw, double now) {
+    memset(tw, 0, sizeof(*tw));
+    tw->base_time = now;
+}
+
+void timer_wheel_clear(TimerWheel *tw) {
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        for (int s = 0; s < TIMER_WHEEL_SLOTS; s++) {
+            Timer *t = tw->slots[l][s];
+            while (t) {
+                Timer *next = t->next;
+                t->next = NULL;
+                t->prev = NULL;
+                t->wheel = NULL;
+                t = next;
+            }
+            tw->slots[l][s] = NULL;
+        }
+        tw->occupied[l] = 0;
+    }
+    tw->armed = 0;
+}
+
+void timer_init(Timer *t, timer_fn fn, void *ctx) {
+    memset(t, 0, sizeof(*t));
+    t->fn = fn;
+    t->ctx = ctx;
+}
+
+void timer_arm(TimerWheel *tw, Timer *t, double delay) {
+    if (t->wheel)
+        timer_cancel(t);
+
+    // from the clock, not now_tick: the wheel only catches up after a poll
+    uint64_t e = tick_ceil(tw, get_time_seconds() + delay);
+    if (e <= tw->now_tick)
+        e = tw->now_tick + 1;
+
+    t->expires = e;
+    link_timer(tw, t);
+    tw->armed++;
+}
+
+void timer_cancel(Timer *t) {
+    TimerWheel *tw = t->wheel;
+    if (!tw)
+        return;
+
+    unlink_timer(tw, t);
+    tw->armed--;
+}
+
+// First tick after now_tick at which a slot needs work: a level 0 slot
+// expires, or a higher level slot is moved down
+static uint64_t next_event_tick(const TimerWheel *tw) {
+    uint64_t best = UINT64_MAX;
+
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        uint64_t bits = tw->occupied[l];
+        if (!bits)
+            continue;
+
+        int shift = TIMER_WHEEL_BITS * l;
+        uint64_t base = tw->now_tick >> shift;
+        int n = (int)((base + 1) & SLOT_MASK);
+
+        // bit k of r = slot base + 1 + k
+        uint64_t r = n ? (bits >> n) | (bits << (64 - n)) : bits;
+        uint64_t tick = (base + 1 + __builtin_ctzll(r)) << shift;
+
+        if (tick < best)
+            best = tick;
+    }
+    return best;
+}
+
+// Move the timers of one higher level slot down the wheel
+static void cascade(TimerWheel *tw, int level, int slot) {
+    Timer *t = tw->slots[level][slot];
+
+    tw->slots[level][slot] = NULL;
+    tw->occupied[level] &= ~((uint64_t)1 << slot);
+
+    while (t) {
+        Timer *next = t->next;
+        link_timer(tw, t);
+        t = next;
+    }
+}
+
+int timer_wheel_run(TimerWheel *tw, double now) {
+    uint64_t target = tick_floor(tw, now);
+    int fired = 0;
+
+    while (tw->now_tick < target) {
+        // skip the ticks where nothing happens
+        uint64_t next = next_event_tick(tw);
+        if (next > target) {
+            tw->now_tick = target;
+            break;
+        }
+        tw->now_tick = next;
+
+        for (int l = 1; l < TIMER_WHEEL_LEVELS; l++) {
+            if (tw->now_tick & (((uint64_t)1 << (TIMER_WHEEL_BITS * l)) - 1))
+                break;
+            cascade(tw, l, (tw->now_tick >> (TIMER_WHEEL_BITS * l)) & SLOT_MASK);
+        }
+
+        // pop one at a time: a callback may cancel others in this slot
+        int slot = tw->now_tick & SLOT_MASK;
+        Timer *t;
+        while ((t = tw->slots[0][slot]) != NULL) {
+            unlink_timer(tw, t);
+            tw->armed--;
+            tw->fired++;
+            fired++;
+            t->fn(t->ctx);
+        }
+    }
+
+    return fired;
+}
+
+int timer_wheel_timeout_ms(const TimerWheel *tw, double now, int max_ms) {
+    uint64_t next = next_event_tick(tw);
+    if (next == UINT64_MAX)
+        return max_ms;
+
+    double at = tw->base_time + next * (TIMER_TICK_MS / 1000.0);
+    double ms = (at - now) * 1000.0;
+    if (ms <= 0)
+        return 0;
+    if (max_ms >= 0 && ms > max_ms)
+        return max_ms;
+    return (int)ms + 1;         // round up: waking early just polls again
+}
@@ -18,6 +18,118 @@ static char *safe_strndup(const char *s, size_t n) {
     return p;
 }
 
+// a path component from the torrent must stay inside the download directory
+static bool safe_component(const char *s, int len) {
+    if (len <= 0 || memchr(s, '/', len) || memchr(s, '\0', len))
+        return false;
+    if ((len == 1 && s[0] == '.') || (len == 2 && s[0] == '.' && s[1] == '.'))
+        return false;
+    return true;
+}
+
+// Parse the "files" list of a multi-file torrent. Paths are stored
+// relative to the torrent's directory until the name is known.
+static int parse_files(bencode_t *list, TorrentInfo *ti) {
+    bencode_t files, entry;
+    bencode_clone(list, &files);
+
+    while (bencode_list_has_next(&files)) {
+        bencode_list_get_next(&files, &entry);
+        if (!bencode_is_dict(&entry))
+            return -1;
+
+        long length = -1;
+        char *path = NULL;
+        size_t path_len = 0;
+
+        while (bencode_dict_has_next(&entry)) {
+            bencode_t v;
+            const char *k;
+            int kl;
+
+            if (!bencode_dict_get_next(&entry, &v, &k, &kl))
+                break;
+
+            if (kl == 6 && memcmp(k, "length", 6) == 0) {
+                bencode_int_value(&v, &length);
+            } else if (kl == 4 && memcmp(k, "path", 4) == 0) {
+                bencode_t comp;
+                while (bencode_list_has_next(&v)) {
+                    const char *c;
+                    int cl;
+
+                    bencode_list_get_next(&v, &comp);
+                    if (!bencode_string_value(&comp, &c, &cl) || !safe_component(c, cl)) {
+                        free(path);
+                        return -1;
+                    }
+
+                    char *tmp = realloc(path, path_len + cl + 2);
+                    if (!tmp) {
+                        free(path);
+                        return -1;
+                    }
+                    path = tmp;
+                    if (path_len > 0)
+                        path[path_len++] = '/';
+                    memcpy(path + path_len, c, cl);
+                    path_len += cl;
+                    path[path_len] = '\0';
+                }
+            }
+        }
+
+        if (!path || length < 0) {
+            free(path);
+            return -1;
+        }
+
+        TorrentFile *tmp = realloc(ti->files, sizeof(TorrentFile) * (ti->num_files + 1));
+        if (!tmp) {
+            free(path);
+            return -1;
+        }
+        ti->files = tmp;
+        ti->files[ti->num_files].path = path;
+        ti->files[ti->num_files].length = length;
+        ti->files[ti->num_files].offset = ti->file_length;
+        ti->num_files++;
+        ti->file_length += length;
+    }
+
+    return ti->num_files > 0 ? 0 : -1;
+}
+
+// Turn the parsed files into paths under the torrent's name; a
+// single-file torrent becomes one file called name
+static int finish_files(TorrentInfo *ti) {
+    if (!ti->name || !safe_component(ti->name, strlen(ti->name))) {
+        fprintf(stderr, "Torrent has no usable name.\n");
+        return -1;
+    }
+
+    if (ti->num_files == 0) {
+        ti->files = calloc(1, sizeof(TorrentFile));
+        if (!ti->files)
+            return -1;
+        ti->files[0].path = safe_strndup(ti->name, strlen(ti->name));
+        ti->files[0].length = ti->file_length;
+        ti->num_files = 1;
+        return ti->files[0].path ? 0 : -1;
+    }
+
+    for (int i = 0; i < ti->num_files; i++) {
+        size_t len = strlen(ti->name) + strlen(ti->files[i].path) + 2;
+        char *full = malloc(len);
+        if (!full)
+            return -1;
+        snprintf(full, len, "%s/%s", ti->name, ti->files[i].path);
+        free(ti->files[i].path);
+        ti->files[i].path = full;
+    }
+    return 0;
+}
+
 // frees all heap-allocated memory within the TorrentInfo structure.
 void torrent_info_free(TorrentInfo *ti) {
     if (!ti) return;
@@ -39,6 +151,11 @@ void torrent_info_free(TorrentInfo *ti) {
     if (ti->name) {
         free(ti->name); 
     }
+
+    // 4. Free the file list
+    for (int i = 0; i < ti->num_files; i++)
+        free(ti->files[i].path);
+    free(ti->files);
     
     // Set members to NULL/0 after freeing
     memset(ti, 0, sizeof(*ti));
@@ -206,6 +323,11 @@ int torrentparser(const char *path, TorrentInfo *ti) {
                         ti->file_length = file_length;
                         // printf("  File Length: %ld\n", ti->file_length);
                     }
+                } else if (info_klen == 5 && memcmp(info_key, "files", 5) == 0) {
+                    if (parse_files(&info_val, ti) != 0) {
+                        fprintf(stderr, "Invalid or unsafe file list in torrent.\n");
+                        goto error_cleanup;
+                    }
                 }
             }
             
@@ -213,6 +335,9 @@ int torrentparser(const char *path, TorrentInfo *ti) {
             SHA1((unsigned char*)info_start, val.str - info_start+1, ti->info_hash);
         }
     }
+    if (finish_files(ti) != 0)
+        goto error_cleanup;
+
     free(data);
     return 0; // Success
 
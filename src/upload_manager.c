@@ -1,11 +1,13 @@
 // upload_manager.c
 // Handles seeding/upload behavior for peers.
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <time.h>
 #include <errno.h>
 #include <sys/socket.h>
@@ -21,10 +23,14 @@
 #include "receive_message.h"
 #include "outgoingMessages.h"
 #include "requestPayload.h"
+#include "event_loop.h"
+#include "peer_output.h"
+#include "handshake_with_peer.h"
+#include "interest.h"
 
 #define TRACKER_RECONTACT_INTERVAL 1800  // re-announce every 30 mins
-#define KEEP_ALIVE_INTERVAL 120          // keep-alives every 2 mins
 #define STATUS_PRINT_INTERVAL 60         // periodic status prints
+#define CLEANUP_INTERVAL 1.0             // reap closed peers
 
 static unsigned char CLIENT_ID[20] = "-TC0001-123456789012";
 
@@ -40,16 +46,11 @@ int parse_request_payload(const unsigned char *msg, piece_request *req) {
     if (!msg || !req)
         return -1;
 
-    printf("Bytes as received %u %u %u\n", msg[1], msg[5], msg[9]);
-
     // NOTE: The offsets here assume msg[0] is index[0]
     req->index  = read_u32_be(msg);
     req->begin  = read_u32_be(msg + 4);
     req->length = read_u32_be(msg + 8);
 
-    printf("Parsed values: index=%u, begin=%u, length=%u\n",
-           req->index, req->begin, req->length);
-
     return 0;
 }
 
@@ -78,21 +79,13 @@ static void manage_upload_slots(TorrentState *ts) {
     }
 }
 
-// Handle any message from a peer while seeding
-static void handle_seed_message(TorrentState *ts, Peer *peer) {
-    unsigned char *raw_buf = receive_message(peer->socket_fd);
-    if (!raw_buf) {
-        printf("[SEED %s:%d]  Connection closed\n", peer->ip, peer->port);
-        peer->socket_fd = -1;
-        return;
-    }
-
+// Handle one complete message frame from a peer while seeding
+static void handle_seed_message(TorrentState *ts, Peer *peer, unsigned char *raw_buf) {
     ParsedMessage msg;
     if (parse_message(raw_buf, &msg) < 0) {
         fprintf(stderr, "[SEED %s:%d]  Failed to parse message\n",
                 peer->ip, peer->port);
-        free(raw_buf);
-        peer->socket_fd = -1;
+        peer_disconnect(peer);
         return;
     }
 
@@ -126,11 +119,8 @@ static void handle_seed_message(TorrentState *ts, Peer *peer) {
             break;
 
         case MSG_HAVE: {
-            if (msg.payload_len == 4) {
-                uint32_t idx = ntohl(*(uint32_t*)msg.payload);
-                printf("[SEED %s:%d] >>> RECEIVED: HAVE piece=%u\n",
-                       peer->ip, peer->port, idx);
-            }
+            if (msg.payload_len == 4)
+                interest_have_received();
             break;
         }
 
@@ -140,21 +130,12 @@ static void handle_seed_message(TorrentState *ts, Peer *peer) {
             break;
 
         case MSG_REQUEST: {
-            printf("Received piece request\n");
             piece_request req;
 
-            // quick dump of raw request bytes
-            for (int i = 0; i < 12; i++)
-                printf("%02X ", ((unsigned char*)msg.payload)[i]);
-            printf("\n");
-
-            int res = parse_request_payload((unsigned char*) msg.payload, &req);
-            printf("Parse result: %d\n", res);
-
-            if (res == 0) {
-                printf("[SEED %s:%d] >>> REQUEST piece=%u begin=%u len=%u\n",
-                       peer->ip, peer->port, req.index, req.begin, req.length);
-
+            // nothing is printed per block: it would cost more than
+            // sending it
+            if (msg.payload_len == 12 &&
+                parse_request_payload((unsigned char*) msg.payload, &req) == 0) {
                 // basic safety checks
                 if (peer->am_choking)
                     break;
@@ -165,9 +146,6 @@ static void handle_seed_message(TorrentState *ts, Peer *peer) {
                 if (req.length > 16384)
                     break;
 
-                printf("[SEED %s:%d] <<< SENDING: PIECE %u %u %u\n",
-                       peer->ip, peer->port, req.index, req.begin, req.length);
-
                 send_piece(peer, ts, req.index, req.begin, req.length);
                 ts->bytes_uploaded += req.length;
             }
@@ -190,20 +168,22 @@ static void handle_seed_message(TorrentState *ts, Peer *peer) {
                    peer->ip, peer->port, msg.id);
             break;
     }
-
-    free(raw_buf);
 }
 
+static void on_seed_peer_event(EventLoop *loop, void *ctx, uint32_t events);
+
 // Accept a new inbound peer connection
-static void accept_incoming_peer(TorrentState *ts) {
+// returns 0 if a peer was accepted, -1 when the backlog is empty
+static int accept_incoming_peer(TorrentState *ts) {
     struct sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
 
-    int new_fd = accept(ts->listen_fd, (struct sockaddr *)&addr, &addr_len);
+    int new_fd = accept4(ts->listen_fd, (struct sockaddr *)&addr, &addr_len,
+                         SOCK_NONBLOCK);
     if (new_fd < 0) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
             perror("accept");
-        return;
+        return -1;
     }
 
     char ip_str[INET_ADDRSTRLEN];
@@ -218,70 +198,31 @@ static void accept_incoming_peer(TorrentState *ts) {
     if (!p) {
         printf("[SEED]  Failed to allocate peer\n");
         close(new_fd);
-        return;
+        return 0;
     }
 
     p->socket_fd = new_fd;
     p->state = PEER_WAIT_HANDSHAKE_OUT;  // expect their handshake first
     p->am_choking = true;
 
-    // set blocking mode for the handshake
-    int flags = fcntl(new_fd, F_GETFL, 0);
-    if (flags != -1)
-        fcntl(new_fd, F_SETFL, flags & ~O_NONBLOCK);
+    peer_watch(ts->loop, p, on_seed_peer_event);
 
     printf("[SEED %s:%d]  Waiting for handshake...\n", ip_str, port);
+    return 0;
 }
 
-// Handle inbound handshake from a peer
+// Handle inbound handshake from a peer (called once all 68 bytes are in)
 static void handle_inbound_handshake(TorrentState *ts, Peer *peer) {
-    unsigned char hs[68];
-    int got = recv(peer->socket_fd, hs, 68, 0);
-
-    printf("[SEED %s:%d] >>> Handshake (%d bytes)\n",
-           peer->ip, peer->port, got);
-
-    if (got != 68) {
-        printf("[SEED %s:%d]  Bad handshake length\n",
-               peer->ip, peer->port);
-        close(peer->socket_fd);
-        peer->socket_fd = -1;
-        peer->state = PEER_DISCONNECTED;
-        return;
-    }
-
-    // basic protocol validation
-    if (hs[0] != 19 ||
-        memcmp(hs + 1, "BitTorrent protocol", 19) != 0 ||
-        memcmp(hs + 28, ts->meta->info_hash, 20) != 0) {
-
-        printf("[SEED %s:%d]  Invalid handshake\n",
-               peer->ip, peer->port);
-        close(peer->socket_fd);
-        peer->socket_fd = -1;
-        peer->state = PEER_DISCONNECTED;
-        return;
-    }
-
     printf("[SEED %s:%d]  Valid handshake\n",
            peer->ip, peer->port);
 
-    // reply handshake
-    unsigned char reply[68] = {0};
-    reply[0] = 19;
-    memcpy(reply + 1, "BitTorrent protocol", 19);
-    memcpy(reply + 28, ts->meta->info_hash, 20);
-    memcpy(reply + 48, CLIENT_ID, 20);
-
     printf("[SEED %s:%d] <<< Sending handshake response\n",
            peer->ip, peer->port);
 
-    if (send(peer->socket_fd, reply, 68, 0) != 68) {
+    if (peer_send_handshake(peer, ts->meta->info_hash, CLIENT_ID) < 0) {
         printf("[SEED %s:%d]  Handshake send error\n",
                peer->ip, peer->port);
-        close(peer->socket_fd);
-        peer->socket_fd = -1;
-        peer->state = PEER_DISCONNECTED;
+        peer_disconnect(peer);
         return;
     }
 
@@ -296,15 +237,124 @@ static void handle_inbound_handshake(TorrentState *ts, Peer *peer) {
            peer->ip, peer->port);
 }
 
-// Send keep-alives to active peers
-static void send_keep_alives(TorrentState *ts) {
+// Per-peer readiness handler while seeding. Reads never block; partial
+// handshakes and frames wait in the Peer for the next event.
+static void on_seed_peer_event(EventLoop *loop, void *ctx, uint32_t events) {
+    TorrentState *ts = loop->user;
+    Peer *peer = ctx;
+    (void)events;
+
+    // PIECE replies for a burst of REQUESTs are flushed together
+    peer_cork(peer);
+
+    while (peer->socket_fd >= 0) {
+        int r;
+
+        if (peer->state == PEER_WAIT_HANDSHAKE_OUT) {
+            r = peer_read_handshake(peer, ts->meta->info_hash);
+            if (r == WIRE_AGAIN) break;
+            if (r == WIRE_ERROR) {
+                printf("[SEED %s:%d]  Invalid handshake\n",
+                       peer->ip, peer->port);
+                peer_disconnect(peer);
+                break;
+            }
+            handle_inbound_handshake(ts, peer);
+
+        } else if (peer->state == PEER_ACTIVE) {
+            unsigned char *raw_buf;
+            r = peer_read_message(peer, &raw_buf);
+            if (r == WIRE_AGAIN) break;
+            if (r == WIRE_ERROR) {
+                printf("[SEED %s:%d]  Connection closed\n", peer->ip, peer->port);
+                peer_disconnect(peer);
+                break;
+            }
+            handle_seed_message(ts, peer, raw_buf);
+
+        } else {
+            break;
+        }
+    }
+
+    peer_uncork(peer);
+}
+
+static void on_seed_listen_event(EventLoop *loop, void *ctx, uint32_t events) {
+    (void)ctx;
+    (void)events;
+    while (accept_incoming_peer(loop->user) == 0)
+        ;
+}
+
+// Seeding timers, ctx is the TorrentState. Keep-alives are per peer
+// (see peer_watch()).
+static Timer announce_timer;
+static Timer status_timer;
+static Timer cleanup_timer;
+static time_t seed_start_time;
+
+static void on_announce_timer(void *ctx) {
+    TorrentState *ts = ctx;
+
+    printf("[SEED] Re-announcing to tracker...\n");
+    TrackerResponse tr;
+    if (contact_tracker(ts->meta, &tr) == 0) {
+        printf("[SEED] Tracker updated\n");
+        tracker_response_free(&tr);
+    }
+    event_loop_arm(ts->loop, &announce_timer, TRACKER_RECONTACT_INTERVAL);
+}
+
+static void on_status_timer(void *ctx) {
+    TorrentState *ts = ctx;
+
+    int active_peers = 0;
+    int unchoked_peers = 0;
+
     for (int i = 0; i < ts->peer_count; i++) {
-        Peer *p = ts->peers[i];
-        if (p->state == PEER_ACTIVE && p->socket_fd >= 0) {
-            unsigned char keep_alive[4] = {0, 0, 0, 0};
-            send(p->socket_fd, keep_alive, 4, 0);
+        if (ts->peers[i]->state == PEER_ACTIVE &&
+            ts->peers[i]->socket_fd >= 0) {
+
+            active_peers++;
+            if (!ts->peers[i]->am_choking)
+                unchoked_peers++;
         }
     }
+
+    int uptime = time(NULL) - seed_start_time;
+    double mb_uploaded = ts->bytes_uploaded / (1024.0 * 1024.0);
+
+    printf("\n[SEED] Uptime: %d:%02d:%02d\n",
+           uptime / 3600, (uptime % 3600) / 60, uptime % 60);
+    printf("[SEED] Active peers: %d (%d unchoked)\n",
+           active_peers, unchoked_peers);
+    printf("[SEED] Uploaded: %.2f MB\n", mb_uploaded);
+    printf("[SEED] Event loop: %ld wakeups, %ld events\n",
+           ts->loop->wakeups, ts->loop->events_dispatched);
+
+    long copied, via_sendfile, via_zerocopy, zc_copied;
+    peer_output_copy_stats(&copied, &via_sendfile, &via_zerocopy, &zc_copied);
+    printf("[SEED] Upload path %s: %.2f MB copied, %.2f MB sendfile, "
+           "%.2f MB zerocopy (%ld sends copied by kernel)\n",
+           upload_mode_name(), copied / (1024.0 * 1024.0),
+           via_sendfile / (1024.0 * 1024.0),
+           via_zerocopy / (1024.0 * 1024.0), zc_copied);
+
+    long rx_reads, rx_frames;
+    peer_rx_stats(&rx_reads, &rx_frames, NULL);
+    printf("[SEED] Received %ld frames in %ld reads\n", rx_frames, rx_reads);
+    interest_print_stats();
+    printf("\n");
+
+    event_loop_arm(ts->loop, &status_timer, STATUS_PRINT_INTERVAL);
+}
+
+static void on_cleanup_timer(void *ctx) {
+    TorrentState *ts = ctx;
+
+    cleanup_dead_peers(ts);
+    event_loop_arm(ts->loop, &cleanup_timer, CLEANUP_INTERVAL);
 }
 
 // Main seeding loop
@@ -313,10 +363,7 @@ int start_seeding(TorrentState *ts) {
     printf("Listening on port %d\n", ts->listen_port);
 
     ts->is_seeding = true;
-    time_t last_tracker_contact = 0;
-    time_t last_keep_alive = time(NULL);
-    time_t last_status_print = time(NULL);
-    time_t start_time = time(NULL);
+    seed_start_time = time(NULL);
 
     // initial tracker announce (completed download)
     printf("[SEED] Announcing completion to tracker...\n");
@@ -325,120 +372,55 @@ int start_seeding(TorrentState *ts) {
         printf("[SEED] Tracker ok. Waiting for peers...\n");
         tracker_response_free(&tr);
     }
-    last_tracker_contact = time(NULL);
 
     if (ts->listen_fd < 0) {
         fprintf(stderr, "[SEED] ERROR: listen socket not set\n");
         return -1;
     }
 
-    printf("[SEED] Ready. Accepting connections\n");
-
-    while (1) {
-        time_t now = time(NULL);
-
-        // periodic tracker announce
-        if (now - last_tracker_contact > TRACKER_RECONTACT_INTERVAL) {
-            printf("[SEED] Re-announcing to tracker...\n");
-            TrackerResponse tr2;
-            if (contact_tracker(ts->meta, &tr2) == 0) {
-                printf("[SEED] Tracker updated\n");
-                tracker_response_free(&tr2);
-            }
-            last_tracker_contact = now;
+    // reuse the download loop if there is one, otherwise start fresh
+    if (!ts->loop) {
+        ts->loop = event_loop_create(ts);
+        if (!ts->loop) {
+            fprintf(stderr, "[SEED] ERROR: failed to create event loop\n");
+            return -1;
         }
+    }
 
-        // keep-alives
-        if (now - last_keep_alive > KEEP_ALIVE_INTERVAL) {
-            send_keep_alives(ts);
-            last_keep_alive = now;
-        }
-
-        // periodic status print
-        if (now - last_status_print > STATUS_PRINT_INTERVAL) {
-            int active_peers = 0;
-            int unchoked_peers = 0;
-
-            for (int i = 0; i < ts->peer_count; i++) {
-                if (ts->peers[i]->state == PEER_ACTIVE &&
-                    ts->peers[i]->socket_fd >= 0) {
-
-                    active_peers++;
-                    if (!ts->peers[i]->am_choking)
-                        unchoked_peers++;
-                }
-            }
-
-            int uptime = now - start_time;
-            double mb_uploaded = ts->bytes_uploaded / (1024.0 * 1024.0);
-
-            printf("\n[SEED] Uptime: %d:%02d:%02d\n",
-                   uptime / 3600, (uptime % 3600) / 60, uptime % 60);
-            printf("[SEED] Active peers: %d (%d unchoked)\n",
-                   active_peers, unchoked_peers);
-            printf("[SEED] Uploaded: %.2f MB\n\n", mb_uploaded);
-
-            last_status_print = now;
-        }
-
-        // build fd_set for select()
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-
-        int max_fd = -1;
-
-        if (ts->listen_fd >= 0) {
-            FD_SET(ts->listen_fd, &read_fds);
-            max_fd = ts->listen_fd;
-        }
-
-        for (int i = 0; i < ts->peer_count; i++) {
-            Peer *p = ts->peers[i];
-            if (p->socket_fd < 0) continue;
-
-            FD_SET(p->socket_fd, &read_fds);
-            if (p->socket_fd > max_fd)
-                max_fd = p->socket_fd;
-        }
-
-        if (max_fd < 0) {
-            sleep(5);
-            cleanup_dead_peers(ts);
-            continue;
-        }
-
-        struct timeval tv;
-        tv.tv_sec = 5;
-        tv.tv_usec = 0;
-
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, &tv);
-
-        if (activity < 0) {
-            if (errno == EINTR) continue;
-            perror("select");
-            continue;
-        }
+    int flags = fcntl(ts->listen_fd, F_GETFL, 0);
+    if (flags != -1)
+        fcntl(ts->listen_fd, F_SETFL, flags | O_NONBLOCK);
 
-        if (activity == 0)
-            continue;
+    ts->listen_ev.fn = on_seed_listen_event;
+    ts->listen_ev.ctx = NULL;
+    event_loop_add(ts->loop, &ts->listen_ev, ts->listen_fd, EPOLLIN);
 
-        if (ts->listen_fd >= 0 && FD_ISSET(ts->listen_fd, &read_fds))
-            accept_incoming_peer(ts);
+    // hand peers left over from the download phase to the seed handler
+    for (int i = 0; i < ts->peer_count; i++) {
+        Peer *p = ts->peers[i];
+        if (p->socket_fd < 0) continue;
+        if (p->loop == ts->loop)
+            p->ev.fn = on_seed_peer_event;
+        else
+            peer_watch(ts->loop, p, on_seed_peer_event);
+    }
 
-        for (int i = 0; i < ts->peer_count; i++) {
-            Peer *peer = ts->peers[i];
-            if (peer->socket_fd < 0) continue;
+    printf("[SEED] Ready. Accepting connections\n");
 
-            if (!FD_ISSET(peer->socket_fd, &read_fds))
-                continue;
+    timer_init(&announce_timer, on_announce_timer, ts);
+    timer_init(&status_timer, on_status_timer, ts);
+    timer_init(&cleanup_timer, on_cleanup_timer, ts);
+    event_loop_arm(ts->loop, &announce_timer, TRACKER_RECONTACT_INTERVAL);
+    event_loop_arm(ts->loop, &status_timer, STATUS_PRINT_INTERVAL);
+    event_loop_arm(ts->loop, &cleanup_timer, CLEANUP_INTERVAL);
 
-            if (peer->state == PEER_WAIT_HANDSHAKE_OUT)
-                handle_inbound_handshake(ts, peer);
-            else if (peer->state == PEER_ACTIVE)
-                handle_seed_message(ts, peer);
-        }
+    while (1) {
+        // dispatch readiness and timers; handlers accept peers and serve
+        // requests, timers announce, print status and reap closed peers
+        int activity = event_loop_poll(ts->loop, -1);
 
-        cleanup_dead_peers(ts);
+        if (activity < 0)
+            sleep(1);
     }
 
     return 0;
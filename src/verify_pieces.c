@@ -1,36 +1,65 @@
-#include <openssl/sha.h>
 #include <string.h>
 #include <stdio.h>
 #include "verify_pieces.h"
 #include "store_pieces.h"
 #include "torrent_parser.h"
+#include "sha1.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 /*
  * Check if a piece matches the SHA1 hash from the torrent file.
- * Marks the piece as complete on success.
+ * The caller marks it complete (mark_piece_complete()) on success.
  */
 bool verify_piece(TorrentState *ts, int index, unsigned char *data, int length)
 {
-    PieceBuffer *pb = &ts->pieces[index];
+    bool ok;
 
-    unsigned char digest[20];
-    SHA1(pb->data, pb->length, digest);   // compute hash of stored piece
+    verify_pieces(ts, &index, 1, &ok);
+    return ok;
+}
+
+/*
+ * Same for several pieces; the SHA1 backend hashes them side by side.
+ */
+int verify_pieces(TorrentState *ts, const int *index, int n, bool *ok)
+{
+    int passed = 0;
+
+    for (int first = 0; first < n; first += SHA1_MAX_LANES) {
+        const uint8_t *data[SHA1_MAX_LANES];
+        size_t len[SHA1_MAX_LANES];
+        uint8_t digest[SHA1_MAX_LANES][SHA1_DIGEST_LEN];
+        int count = n - first < SHA1_MAX_LANES ? n - first : SHA1_MAX_LANES;
+
+        for (int i = 0; i < count; i++) {
+            PieceBuffer *pb = &ts->pieces[index[first + i]];
+            data[i] = pb->data;
+            len[i] = pb->length;
+        }
+
+        sha1_many(data, len, count, digest);   // compute hash of stored pieces
 
-    unsigned char *expected = ts->meta->pieces + (index * 20);  // expected hash
+        for (int i = 0; i < count; i++) {
+            int piece = index[first + i];
+            PieceBuffer *pb = &ts->pieces[piece];
+            unsigned char *expected = ts->meta->pieces + (piece * 20);  // expected hash
 
-    // compare hashes
-    if (memcmp(digest, expected, 20) == 0) {
-        printf("[VERIFY] Piece %d verified successfully.\n", index);
-        ts->piece_complete[index] = true;
-        pb->verified = true;
-        return 1;
+            // compare hashes
+            if (memcmp(digest[i], expected, 20) == 0) {
+                printf("[VERIFY] Piece %d verified successfully.\n", piece);
+                pb->verified = true;
+                ok[first + i] = true;
+                passed++;
+            } else {
+                // hash mismatch
+                printf("[VERIFY] Piece %d FAILED SHA1 check. Redownloading.\n", piece);
+                pb->verified = false;
+                ok[first + i] = false;
+            }
+        }
     }
 
-    // hash mismatch
-    printf("[VERIFY] Piece %d FAILED SHA1 check. Redownloading.\n", index);
-    pb->verified = false;
-    return 0;
+    return passed;
 }